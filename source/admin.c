@@ -245,6 +245,32 @@ static void generate_key(int argc, char **argv) {
     am_free(encoded);
 }
 
+static void show_stats(int argc, char **argv) {
+    int id = argc > 2 ? atoi(argv[2]) : AM_DEFAULT_AGENT_ID;
+    int format = AM_STATS_FORMAT_TEXT;
+    char *report = NULL;
+    int status;
+    if (argc > 3 && strcasecmp(argv[3], "--json") == 0) {
+        format = AM_STATS_FORMAT_JSON;
+    } else if (argc > 3 && strcasecmp(argv[3], "--prometheus") == 0) {
+        format = AM_STATS_FORMAT_PROMETHEUS;
+    }
+    status = am_stats_init(id);
+    if (status == AM_SUCCESS) {
+        report = am_stats_report(format);
+    }
+    if (report != NULL && format != AM_STATS_FORMAT_TEXT) {
+        fprintf(stdout, "%s%s", report, format == AM_STATS_FORMAT_JSON ? "\n" : "");
+    } else if (report != NULL) {
+        fprintf(stdout, "\nAgent statistics (agent id %d):\n\n%s\n", id, report);
+    } else {
+        fprintf(stdout, "\nError reading agent statistics: %s.\n\n",
+                am_strerror(status == AM_SUCCESS ? AM_ENOMEM : status));
+    }
+    am_free(report);
+    am_stats_shutdown();
+}
+
 static am_bool_t validate_os_version() {
 #ifdef _WIN32
     OSVERSIONINFOEXA osvi = {
@@ -2249,6 +2275,7 @@ int main(int argc, char **argv) {
         { "--p", password_encrypt },
         { "--d", password_decrypt },
         { "--a", archive_files },
+        { "--stats", show_stats },
         { NULL }
     };
     
@@ -2402,6 +2429,8 @@ int main(int argc, char **argv) {
             " agentadmin --p \"key\" \"password\"\n\n"
             "Archive directories/files:\n"
             " agentadmin --a archive.zip directory_or_file [directory_or_file]\n\n"
+            "Show agent statistics (cache, shared memory, log, OpenAM calls and request latency):\n"
+            " agentadmin --stats [agent id] [--json|--prometheus]\n\n"
             "Build and version information:\n"
             " agentadmin --v\n\n", DESCRIPTION);
 
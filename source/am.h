@@ -68,6 +68,18 @@ typedef enum {
 #define AM_SHARED_MAX_SIZE_VAR      "AM_MAX_SHARED_POOL_SIZE" /* env var used to limit pool size */
 #endif
 
+#ifndef AM_SHARED_HUGEPAGES_VAR
+#define AM_SHARED_HUGEPAGES_VAR     "AM_SHARED_HUGEPAGES" /* env var: "thp" (transparent huge pages) or hugetlbfs mount directory */
+#endif
+
+#ifndef AM_SHARED_PREFAULT_VAR
+#define AM_SHARED_PREFAULT_VAR      "AM_SHARED_PREFAULT" /* env var: "1" - prefault shared memory pages at creation */
+#endif
+
+#ifndef AM_SHARED_NUMA_VAR
+#define AM_SHARED_NUMA_VAR          "AM_SHARED_NUMA" /* env var: "interleave" - spread shared memory pages over all NUMA nodes */
+#endif
+
 #ifndef AM_MAX_INSTANCES
 #define AM_MAX_INSTANCES            32 /* max number of agent configuration instances */
 #endif
@@ -80,8 +92,108 @@ typedef enum {
 #define AM_MAX_THREADS_POOL         AM_MAX_INSTANCES
 #endif
 
-#ifndef AM_LOG_QUEUE_SIZE
-#define AM_LOG_QUEUE_SIZE           2048 /* must be a power of two */
+#ifndef AM_WORKER_QUEUES
+#define AM_WORKER_QUEUES            8 /* number of worker pool task queues (worker threads share them round-robin) */
+#endif
+
+#ifndef AM_WORKER_TASKS
+#define AM_WORKER_TASKS             1024 /* number of preallocated worker pool task nodes */
+#endif
+
+#ifndef AM_NOTIFICATION_BATCH
+#define AM_NOTIFICATION_BATCH       1024 /* max number of notification messages processed at once */
+#endif
+
+#ifndef AM_POST_DATA_CHUNK_SIZE
+#define AM_POST_DATA_CHUNK_SIZE     65536 /* post data preservation file write buffer size */
+#endif
+
+#ifndef AM_CACHE_SKETCH_WIDTH
+#define AM_CACHE_SKETCH_WIDTH       8192 /* cache admission frequency sketch counters per row (power of two, 16 or more) */
+#endif
+
+#ifndef AM_CACHE_EVICTION_SAMPLES
+#define AM_CACHE_EVICTION_SAMPLES   8 /* number of instance cache entries sampled for an eviction victim */
+#endif
+
+#ifndef AM_PDP_SEGMENTS
+#define AM_PDP_SEGMENTS             256 /* max number of post data preservation segment files */
+#endif
+
+#ifndef AM_PDP_SEGMENT_SIZE
+#define AM_PDP_SEGMENT_SIZE         67108864 /* post data preservation segment file is sealed at this size */
+#endif
+
+#ifndef AM_PDP_INDEX_SIZE
+#define AM_PDP_INDEX_SIZE           16384 /* max number of preserved post requests (power of two) */
+#endif
+
+#ifndef AM_PDP_COMPACT_INTERVAL
+#define AM_PDP_COMPACT_INTERVAL     60 /* post data preservation segment compaction interval (seconds) */
+#endif
+
+#ifndef AM_CONFIG_REFRESH_TIMEOUT
+#define AM_CONFIG_REFRESH_TIMEOUT   60 /* seconds after which a background configuration refresh is considered lost */
+#endif
+
+#ifndef AM_CACHE_REMOVE_BATCH
+#define AM_CACHE_REMOVE_BATCH       256 /* max number of cache entries removed within one cache lock */
+#endif
+
+#ifndef AM_COOKIE_TABLE_SIZE
+#define AM_COOKIE_TABLE_SIZE        64 /* number of cookies parsed w/o a heap allocation */
+#endif
+
+#ifndef AM_ARENA_BLOCK_SIZE
+#define AM_ARENA_BLOCK_SIZE         16384 /* request arena block size */
+#endif
+
+#ifndef AM_SESSION_DECODE_CACHE_SIZE
+#define AM_SESSION_DECODE_CACHE_SIZE 32 /* number of decoded session tokens cached per thread */
+#endif
+
+#ifndef AM_PREFILTER_RULES
+#define AM_PREFILTER_RULES          32 /* max number of static asset pre-filter rules (per instance) */
+#endif
+
+#ifndef AM_PREFILTER_RULE_SIZE
+#define AM_PREFILTER_RULE_SIZE      64
+#endif
+
+#ifndef AM_PREFILTER_TTL
+#define AM_PREFILTER_TTL            10 /* sec; static asset pre-filter is rebuilt (or expires) after */
+#endif
+
+#ifndef AM_LOG_RING_SIZE
+#define AM_LOG_RING_SIZE            (4 * 1024 * 1024) /* log ring capacity (bytes) */
+#endif
+
+#ifndef AM_LOG_RING_SIZE_VAR
+#define AM_LOG_RING_SIZE_VAR        "AM_LOG_RING_SIZE" /* env var used to change log ring capacity (the ring is set up before configuration is read) */
+#endif
+
+#ifndef AM_LOG_MAINTENANCE_INTERVAL
+#define AM_LOG_MAINTENANCE_INTERVAL 1 /* log file rotation/compression task interval (seconds) */
+#endif
+
+#ifndef AM_LOG_BATCH_SIZE
+#define AM_LOG_BATCH_SIZE           64 /* max number of log messages written (and synced) at once */
+#endif
+
+#ifndef AM_AUDIT_PENDING_MAX
+#define AM_AUDIT_PENDING_MAX        2048 /* max number of remote audit entries waiting in shared memory */
+#endif
+
+#ifndef AM_AUDIT_SPOOL_SEGMENT_SIZE
+#define AM_AUDIT_SPOOL_SEGMENT_SIZE 1048576 /* remote audit spool segment file size */
+#endif
+
+#ifndef AM_AUDIT_SPOOL_SEGMENTS
+#define AM_AUDIT_SPOOL_SEGMENTS     64 /* max number of remote audit spool segment files */
+#endif
+
+#ifndef AM_STATS_PROCESSES
+#define AM_STATS_PROCESSES          32 /* max number of processes with their own request latency statistics */
 #endif
 
 #ifndef AM_LOG_MESSAGE_SIZE
@@ -152,6 +264,8 @@ typedef enum {
 #define AM_AUDIT_SHM_NAME       "am_shared_audit"
 #define AM_CACHE_SHM_NAME       "am_shared_cache"
 #define AM_CONFIG_SHM_NAME      "am_shared_conf"
+#define AM_STATS_SHM_NAME       "am_shared_stats"
+#define AM_PDP_SHM_NAME         "am_shared_pdp"
 
 
 typedef enum {
@@ -230,6 +344,39 @@ struct url {
     char query[AM_URI_SIZE + 1];
 };
 
+typedef struct {
+    unsigned int off;
+    unsigned int len;
+} am_span_t;
+
+typedef struct {
+    am_span_t pair; /* name=value (leading whitespace removed) */
+    am_span_t name;
+    am_span_t value; /* whitespace and double-quotes removed */
+} am_cookie_span_t;
+
+typedef struct {
+    const char *header; /* cookie header value the table is built from */
+    unsigned int count;
+    unsigned int size;
+    am_cookie_span_t *list; /* points to entries or, for larger headers, to heap */
+    am_cookie_span_t entries[AM_COOKIE_TABLE_SIZE];
+} am_cookie_table_t;
+
+typedef struct am_arena am_arena_t;
+
+typedef struct {
+    int sync; /* 0 - fsync after each batch, >0 - at most every N seconds, -1 - never */
+    int rate; /* max number of messages per second, per call site and level (0 - no limit) */
+    int overflow_drop; /* drop messages (instead of blocking the writer) when the log ring is full */
+    int deferred; /* format log messages in the log worker */
+    int json; /* write records as JSON objects (implies deferred) */
+    int segment_size; /* roll log files over into segments of this size (0 - disabled) */
+    int compress_disable; /* keep rotated log files uncompressed */
+    int retain_files; /* max number of rotated files kept per log file (0 - no limit) */
+    int retain_size; /* max size (bytes) of rotated files kept per log file (0 - no limit) */
+} am_log_options_t;
+
 typedef struct am_request {
     am_status_t status;
     unsigned int retry;
@@ -248,6 +395,7 @@ typedef struct am_request {
     char *normalized_url_pathinfo;
     char *overridden_url_pathinfo;
     const char *cookies;
+    am_cookie_table_t cookie_table; /* parsed cookies (offsets into cookies) */
     const char *content_type;
     char method;
 
@@ -256,6 +404,7 @@ typedef struct am_request {
 
     char *client_ip;
     char *client_host;
+    const char *peer_ip; /* connection peer address as reported by the web container (never taken from a header) */
 
     const char *user;
     const char *user_temp;
@@ -272,16 +421,24 @@ typedef struct am_request {
     char *post_data;
     size_t post_data_sz;
     const char *post_data_url;
+    const char *post_data_fn; /* post data preservation file to replay (see am_read_post_data_f) */
+    uint64_t post_data_offset; /* post data offset in post_data_fn */
 
     unsigned long instance_id;
     am_config_t *conf; /*agent configuration*/
 
+    am_arena_t *arena; /*request lifetime allocations, see am_request_arena*/
+
     void *ctx; /*web container/request context*/
 #ifdef _WIN32
     void *ctx_class;
 #endif
     am_status_t(*am_get_request_url_f)(struct am_request *);
     am_status_t(*am_get_post_data_f)(struct am_request *);
+    /* optional: read the next request body chunk (returns the number of bytes read, 0 at the end
+     * of data or a negative value on error). Container modules which set it get post data
+     * preservation files streamed to and replayed from post_data_fn in am_set_post_data_f */
+    ssize_t(*am_read_post_data_f)(struct am_request *, char *, size_t);
     am_status_t(*am_set_post_data_f)(struct am_request *);
     am_status_t(*am_set_user_f)(struct am_request *, const char *);
     am_status_t(*am_set_method_f)(struct am_request *);
@@ -298,6 +455,9 @@ unsigned long am_instance_id(const char *);
 void am_process_request(am_request_t *r);
 void am_request_free(am_request_t *r);
 
+void am_prefilter_update(am_config_t *conf);
+int am_prefilter_request(unsigned long instance_id, int method, const char *uri);
+
 const char *am_method_num_to_str(int method);
 int am_method_str_to_num(const char *method_str);
 
@@ -321,17 +481,21 @@ void am_log_init(int id, int s);
 void am_log_init_worker(int id, int s);
 void am_log_shutdown(int id);
 void am_log_register_instance(unsigned long instance_id, const char *debug_log, int log_level, int log_size,
-        const char *audit_log, int audit_level, int audit_size, const char *config_file);
+        const char *audit_log, int audit_level, int audit_size, const am_log_options_t *options, const char *config_file);
 
 void am_config_free(am_config_t **c);
+void am_config_log_options(const am_config_t *c, am_log_options_t *options);
 am_config_t *am_get_config_file(unsigned long instance_id, const char *filename);
 int am_get_agent_config(unsigned long instance_id, const char *config_file, am_config_t **cnf);
 
 char *base64_decode(const char *in, size_t *length);
 char *base64_encode(const void *in, size_t *length);
+char *load_file(const char *filepath, size_t *data_sz);
+char *load_file_range(const char *filepath, uint64_t offset, size_t size);
 void am_free(void *ptr);
 int am_asprintf(char **buffer, const char *fmt, ...);
 char *am_json_escape(const char *str, size_t *escaped_sz);
+size_t am_json_escape_to(char *buf, size_t size, const char *str, size_t len);
 
 char *am_normalize_pattern(const char *url);
 
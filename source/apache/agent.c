@@ -61,6 +61,7 @@ typedef struct {
     int audit_level;
     int debug_size;
     int audit_size;
+    am_log_options_t log_options;
     int error;
     int agent_id;
     unsigned long config_id;
@@ -86,6 +87,7 @@ static const char *am_set_opt(cmd_parms *c, void *cfg, const char *arg) {
             conf->audit_level = ac->audit_level;
             conf->debug_size = ac->debug;
             conf->audit_size = ac->audit;
+            am_config_log_options(ac, &conf->log_options);
             conf->error = AM_SUCCESS;
             am_config_free(&ac);
         } else {
@@ -383,6 +385,9 @@ static am_status_t set_custom_response(am_request_t *rq, const char *text, const
 
                 inputs = apr_pstrcat(r->pool, "", NULL);
 
+                if (rq->post_data == NULL && ISVALID(rq->post_data_fn)) {
+                    rq->post_data = load_file_range(rq->post_data_fn, rq->post_data_offset, rq->post_data_sz);
+                }
                 if (ISVALID(rq->post_data)) {
                     /* recreate x-www-form-urlencoded HTML Form data */
                     a = apr_pstrdup(r->pool, rq->post_data);
@@ -407,6 +412,7 @@ static am_status_t set_custom_response(am_request_t *rq, const char *text, const
                 r->clength = 0;
                 apr_table_unset(r->headers_in, "Content-Length");
                 apr_table_unset(r->notes, amagent_post_filter_name);
+                apr_pool_userdata_setn(NULL, amagent_post_filter_name, NULL, r->pool);
                 ap_set_content_type(r, "text/html");
                 ap_rprintf(r, "<html><head></head><body onload=\"document.postform.submit()\">"
                         "<form name=\"postform\" method=\"POST\" action=\"%s\">"
@@ -523,6 +529,30 @@ static am_status_t set_request_body(am_request_t *rq) {
     }
 
     apr_table_unset(r->notes, amagent_post_filter_name);
+    apr_pool_userdata_setn(NULL, amagent_post_filter_name, NULL, r->pool);
+
+    if (ISVALID(rq->post_data_fn) && rq->post_data_sz > 0 && rq->post_data == NULL) {
+        apr_file_t *file = NULL;
+        if (rq->is_json_url) {
+            /* json response carries the (encoded) post data itself */
+            rq->post_data = load_file_range(rq->post_data_fn, rq->post_data_offset, rq->post_data_sz);
+        } else if (apr_file_open(&file, rq->post_data_fn, APR_READ | APR_BINARY,
+                APR_OS_DEFAULT, r->pool) == APR_SUCCESS) {
+            apr_off_t offset = (apr_off_t) rq->post_data_offset;
+            /* the file is opened here, it will be removed before the agent filter replays it;
+             * file position is where the post data starts (preservation store segment file) */
+            apr_file_seek(file, APR_SET, &offset);
+            apr_pool_userdata_setn(file, amagent_post_filter_name, NULL, r->pool);
+            AM_LOG_DEBUG(rq->instance_id, "%s preserved %ld bytes (%s)", thisfunc,
+                    rq->post_data_sz, rq->post_data_fn);
+            r->clength = rq->post_data_sz;
+            apr_table_set(r->headers_in, "Content-Length",
+                    apr_psprintf(r->pool, "%ld", rq->post_data_sz));
+            return AM_SUCCESS;
+        } else {
+            AM_LOG_ERROR(rq->instance_id, "%s unable to open %s", thisfunc, rq->post_data_fn);
+        }
+    }
 
     if (ISVALID(rq->post_data) && rq->post_data_sz > 0) {
         size_t data_sz = rq->post_data_sz;
@@ -544,6 +574,35 @@ static am_status_t set_request_body(am_request_t *rq) {
     return AM_SUCCESS;
 }
 
+static ssize_t read_request_body(am_request_t *rq, char *buf, size_t size) {
+    request_rec *r;
+    apr_bucket_brigade *bb;
+    apr_size_t read_bytes = size;
+    apr_status_t read_status;
+
+    if (rq == NULL || rq->ctx == NULL || buf == NULL) {
+        return -1;
+    }
+
+    r = (request_rec *) rq->ctx;
+    bb = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+    read_status = ap_get_brigade(r->input_filters, bb, AP_MODE_READBYTES,
+            APR_BLOCK_READ, size);
+    if (read_status == APR_SUCCESS) {
+        read_status = apr_brigade_flatten(bb, buf, &read_bytes);
+    }
+    apr_brigade_destroy(bb);
+    if (read_status != APR_SUCCESS) {
+        return -1;
+    }
+    if (read_bytes == 0) {
+        /* remove the content length since the body has been read */
+        r->clength = 0;
+        apr_table_unset(r->headers_in, "Content-Length");
+    }
+    return (ssize_t) read_bytes;
+}
+
 static am_status_t get_request_body(am_request_t *rq) {
     static const char *thisfunc = "get_request_body():";
     request_rec *r;
@@ -628,6 +687,7 @@ static am_status_t get_request_body(am_request_t *rq) {
 static int amagent_auth_handler(request_rec *req) {
     static const char *thisfunc = "amagent_auth_handler():";
     int result;
+    char method;
     am_request_t am_request;
     am_config_t *boot = NULL;
 
@@ -647,13 +707,19 @@ static int amagent_auth_handler(request_rec *req) {
         return HTTP_FORBIDDEN;
     }
 
+    /* static asset pre-filter: not enforced requests skip the rest of the processing */
+    method = get_method_num(req, config->config_id);
+    if (am_prefilter_request(config->config_id, method, req->unparsed_uri)) {
+        return am_status_value(AM_SUCCESS);
+    }
+
     LOG_R(APLOG_DEBUG, req, "amagent_auth_handler(): [%s] [%ld]", config->config, config->config_id);
 
     /* register and update instance logger configuration (for already registered
      * instances - update logging level only 
      */
     am_log_register_instance(config->config_id, config->debug_file, config->debug_level, config->debug_size,
-            config->audit_file, config->audit_level, config->audit_size, config->config);
+            config->audit_file, config->audit_level, config->audit_size, &config->log_options, config->config);
 
     AM_LOG_DEBUG(config->config_id, "%s begin", thisfunc);
 
@@ -675,20 +741,22 @@ static int amagent_auth_handler(request_rec *req) {
     am_request.status = AM_ERROR;
     am_request.instance_id = config->config_id;
     am_request.ctx = req;
-    am_request.method = get_method_num(req, config->config_id);
+    am_request.method = method;
     am_request.content_type = apr_table_get(req->headers_in, "Content-Type");
     am_request.cookies = apr_table_get(req->headers_in, "Cookie");
 
+#ifdef APACHE24
+    am_request.peer_ip = req->connection->client_ip;
+#else
+    am_request.peer_ip = req->connection->remote_ip;
+#endif
+
     if (ISVALID(am_request.conf->client_ip_header)) {
         am_request.client_ip = (char *) apr_table_get(req->headers_in, am_request.conf->client_ip_header);
     }
 
     if (!ISVALID(am_request.client_ip)) {
-#ifdef APACHE24
-        am_request.client_ip = (char *) req->connection->client_ip;
-#else
-        am_request.client_ip = (char *) req->connection->remote_ip;
-#endif
+        am_request.client_ip = (char *) am_request.peer_ip;
     }
 
     if (ISVALID(am_request.conf->client_hostname_header)) {
@@ -697,6 +765,7 @@ static int amagent_auth_handler(request_rec *req) {
 
     am_request.am_get_request_url_f = get_request_url;
     am_request.am_get_post_data_f = get_request_body;
+    am_request.am_read_post_data_f = read_request_body;
     am_request.am_set_post_data_f = set_request_body;
     am_request.am_set_user_f = set_user;
     am_request.am_set_header_in_request_f = set_header_in_request;
@@ -739,6 +808,39 @@ static apr_status_t amagent_post_filter(ap_filter_t *f, apr_bucket_brigade *buck
     apr_size_t sz;
     char *clean;
     const char *data = apr_table_get(r->notes, amagent_post_filter_name);
+    request_rec *m = r;
+    void *file = NULL;
+
+    /* post data file is set up with the main request (this might be a sub-request) */
+    while (m->main != NULL) {
+        m = m->main;
+    }
+    apr_pool_userdata_get(&file, amagent_post_filter_name, m->pool);
+
+    if (file != NULL) {
+        apr_off_t offset = 0;
+        /* replay preserved post data straight from the file (no copy) */
+        apr_file_seek((apr_file_t *) file, APR_CUR, &offset);
+        apr_pool_userdata_setn(NULL, amagent_post_filter_name, NULL, m->pool);
+        apr_table_unset(r->notes, amagent_post_filter_name);
+
+        LOG_R(APLOG_DEBUG, r, "amagent_post_filter(): reposting %ld bytes from a file", (long) m->clength);
+
+        bucket = apr_bucket_file_create((apr_file_t *) file, offset, (apr_size_t) m->clength,
+                m->pool, c->bucket_alloc);
+        if (bucket == NULL) {
+            return APR_EGENERAL;
+        }
+        APR_BRIGADE_INSERT_TAIL(bucket_out, bucket);
+
+        bucket = apr_bucket_eos_create(c->bucket_alloc);
+        if (bucket == NULL) {
+            return APR_EGENERAL;
+        }
+        APR_BRIGADE_INSERT_TAIL(bucket_out, bucket);
+        ap_remove_input_filter(f);
+        return APR_SUCCESS;
+    }
 
     do {
         if (data == NULL) break;
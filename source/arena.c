@@ -0,0 +1,221 @@
+/**
+ * The contents of this file are subject to the terms of the Common Development and
+ * Distribution License (the License). You may not use this file except in compliance with the
+ * License.
+ *
+ * You can obtain a copy of the License at legal/CDDLv1.0.txt. See the License for the
+ * specific language governing permission and limitations under the License.
+ *
+ * When distributing Covered Software, include this CDDL Header Notice in each file and include
+ * the License file at legal/CDDLv1.0.txt. If applicable, add the following below the CDDL
+ * Header, with the fields enclosed by brackets [] replaced by your own identifying
+ * information: "Portions copyright [year] [name of copyright owner]".
+ *
+ * Copyright 2015 ForgeRock AS.
+ */
+
+#include "platform.h"
+#include "am.h"
+#include "utility.h"
+#include "thread.h"
+
+/*
+ * Request scoped bump allocator. Memory is handed out from a list of blocks and
+ * is released all at once with am_arena_reset. The first block is allocated together
+ * with the arena itself and is kept on reset, so that a recycled arena serves
+ * a typical request without any heap calls.
+ */
+
+#define AM_ARENA_ALIGN(s)   (((s) + 15) & ~((size_t) 15))
+
+struct am_arena_block {
+    struct am_arena_block *next;
+    size_t size;
+    size_t used;
+};
+
+#define AM_ARENA_BLOCK_DATA(b) ((char *) (b) + AM_ARENA_ALIGN(sizeof (struct am_arena_block)))
+
+struct am_arena {
+    struct am_arena_block *first;
+    struct am_arena_block *blocks; /* current block is the head of the list */
+};
+
+static AM_THREAD_LOCAL am_arena_t *thread_arena = NULL;
+
+static struct am_arena_block *arena_block_create(size_t size) {
+    struct am_arena_block *b = (struct am_arena_block *) malloc(AM_ARENA_ALIGN(sizeof (struct am_arena_block)) + size);
+    if (b != NULL) {
+        b->next = NULL;
+        b->size = size;
+        b->used = 0;
+    }
+    return b;
+}
+
+am_arena_t *am_arena_create() {
+    am_arena_t *a = (am_arena_t *) malloc(AM_ARENA_ALIGN(sizeof (am_arena_t)) +
+            AM_ARENA_ALIGN(sizeof (struct am_arena_block)) + AM_ARENA_BLOCK_SIZE);
+    if (a != NULL) {
+        a->first = (struct am_arena_block *) ((char *) a + AM_ARENA_ALIGN(sizeof (am_arena_t)));
+        a->first->next = NULL;
+        a->first->size = AM_ARENA_BLOCK_SIZE;
+        a->first->used = 0;
+        a->blocks = a->first;
+    }
+    return a;
+}
+
+void am_arena_reset(am_arena_t *a) {
+    struct am_arena_block *b, *n;
+    if (a == NULL) return;
+    for (b = a->blocks; b != NULL; b = n) {
+        n = b->next;
+        if (b != a->first) {
+            free(b);
+        }
+    }
+    a->first->next = NULL;
+    a->first->used = 0;
+    a->blocks = a->first;
+}
+
+void am_arena_destroy(am_arena_t *a) {
+    if (a == NULL) return;
+    am_arena_reset(a);
+    free(a);
+}
+
+void *am_arena_alloc(am_arena_t *a, size_t size) {
+    struct am_arena_block *b;
+    void *p;
+
+    if (a == NULL) return NULL;
+    size = AM_ARENA_ALIGN(size == 0 ? 1 : size);
+
+    b = a->blocks;
+    if (b->size - b->used < size) {
+        if (size > AM_ARENA_BLOCK_SIZE / 4) {
+            /* large allocation - give it a block of its own, but keep allocating from the current one */
+            struct am_arena_block *l = arena_block_create(size);
+            if (l == NULL) return NULL;
+            l->used = size;
+            l->next = b->next;
+            b->next = l;
+            return AM_ARENA_BLOCK_DATA(l);
+        }
+        b = arena_block_create(AM_ARENA_BLOCK_SIZE);
+        if (b == NULL) return NULL;
+        b->next = a->blocks;
+        a->blocks = b;
+    }
+    p = AM_ARENA_BLOCK_DATA(b) + b->used;
+    b->used += size;
+    return p;
+}
+
+char *am_arena_strndup(am_arena_t *a, const char *s, size_t n) {
+    char *p;
+    if (s == NULL) return NULL;
+    n = strnlen(s, n);
+    p = (char *) am_arena_alloc(a, n + 1);
+    if (p != NULL) {
+        memcpy(p, s, n);
+        p[n] = '\0';
+    }
+    return p;
+}
+
+char *am_arena_strdup(am_arena_t *a, const char *s) {
+    return s != NULL ? am_arena_strndup(a, s, strlen(s)) : NULL;
+}
+
+/**
+ * Same as am_asprintf, only the result is allocated from the arena (the previous
+ * value of *buffer is not freed, it can safely be used as one of the arguments).
+ * The string is formatted directly into the free space of the current block
+ * whenever it fits.
+ */
+int am_arena_asprintf(am_arena_t *a, char **buffer, const char *fmt, ...) {
+    struct am_arena_block *b;
+    size_t avail;
+    char *p;
+    int size;
+    va_list ap;
+
+    if (a == NULL || buffer == NULL) return -1;
+
+    b = a->blocks;
+    avail = b->size - b->used;
+    p = AM_ARENA_BLOCK_DATA(b) + b->used;
+
+    va_start(ap, fmt);
+    size = vsnprintf(p, avail, fmt, ap);
+    va_end(ap);
+    if (size < 0) {
+        *buffer = NULL;
+        return size;
+    }
+    if ((size_t) size < avail) {
+        b->used += AM_ARENA_ALIGN((size_t) size + 1);
+        if (b->used > b->size) {
+            b->used = b->size;
+        }
+        *buffer = p;
+        return size;
+    }
+
+    p = (char *) am_arena_alloc(a, (size_t) size + 1);
+    if (p == NULL) {
+        *buffer = NULL;
+        return -1;
+    }
+    va_start(ap, fmt);
+    size = vsnprintf(p, (size_t) size + 1, fmt, ap);
+    va_end(ap);
+    *buffer = p;
+    return size;
+}
+
+static void arena_thread_cleanup() {
+    am_arena_destroy(thread_arena);
+    thread_arena = NULL;
+}
+
+/**
+ * Get an arena for the calling thread, reusing the one released by a previous request if any.
+ */
+am_arena_t *am_arena_get() {
+    am_arena_t *a = thread_arena;
+    if (a != NULL) {
+        thread_arena = NULL;
+        return a;
+    }
+    return am_arena_create();
+}
+
+/**
+ * Release all memory allocated from the arena and keep the arena for the next request
+ * running in this thread.
+ */
+void am_arena_release(am_arena_t *a) {
+    if (a == NULL) return;
+    am_arena_reset(a);
+    if (thread_arena == NULL) {
+        thread_arena = a;
+        am_thread_cleanup_register(arena_thread_cleanup);
+    } else {
+        am_arena_destroy(a);
+    }
+}
+
+/**
+ * Request arena - created on the first use and released by am_request_free.
+ */
+am_arena_t *am_request_arena(am_request_t *r) {
+    if (r == NULL) return NULL;
+    if (r->arena == NULL) {
+        r->arena = am_arena_get();
+    }
+    return r->arena;
+}
@@ -36,23 +36,6 @@
     (hdr)->last = offset;\
 } while (0)
 
-#define OFFSET_LIST_UNLINK(hdr, links, offset) do {\
-    if (links(offset)->next) {\
-        links(links(offset)->next)->prev = links(offset)->prev;\
-    } else {\
-        (hdr)->last = links(offset)->prev;\
-    }\
-    if (links(offset)->prev) {\
-        links(links(offset)->prev)->next = links(offset)->next;\
-    } else {\
-        (hdr)->first = links(offset)->next;\
-    }\
-} while (0)
-
-#define AM_OFFSET_LIST_FOR_EACH_OFFSET(base, header, e, offset) \
-    for (offset = (header)->first; (e = AM_GET_POINTER((base), offset), offset); \
-        offset = e->lh.next)
-
 struct offset_list_hdr {
     unsigned int first, last;
 };
@@ -62,8 +45,11 @@ struct am_audit {
         unsigned long instance_id;
         int interval;
         int last;
+        unsigned int generation; /* changes every time the instance configuration values change */
+        unsigned int pending; /* number of entries in list_hdr */
         struct offset_list_hdr list_hdr;
         char config_file[AM_PATH_SIZE];
+        char spool[AM_PATH_SIZE]; /* on-disk spool file name prefix (empty if there is no spool) */
         char openam[AM_URI_SIZE];
     } config[AM_MAX_INSTANCES];
 };
@@ -71,23 +57,56 @@ struct am_audit {
 struct am_audit_entry {
     unsigned long instance_id;
     struct offset_list lh;
+    unsigned int size;
     char server_id[12];
     char value[1];
 };
 
-struct am_audit_transfer {
+/* list of audit entries detached from the shared memory for shipping */
+struct audit_source {
     unsigned long instance_id;
-    char *message;
-    char *server_id;
-    char *config_file;
+    unsigned int generation;
+    unsigned int first, last;
+    unsigned int count;
+    char config_file[AM_PATH_SIZE];
+    char spool[AM_PATH_SIZE];
+    char openam[AM_URI_SIZE];
+};
+
+struct audit_buffer {
+    char *data;
+    size_t size;
+    size_t capacity;
+};
+
+/* net options and spool handles, private to the process running the audit timer */
+static struct audit_instance {
+    unsigned long instance_id;
+    unsigned int generation;
+    am_net_options_t options;
+    am_spool_t *spool;
+    char spool_name[AM_PATH_SIZE];
+} audit_instances[AM_MAX_INSTANCES];
+
+struct audit_upload {
+    unsigned long instance_id;
+    const char *openam;
+    am_net_options_t *options;
+};
+
+struct audit_spool_read {
+    struct audit_buffer *buffer;
+    int count;
 };
 
 static am_timer_event_t *audit_timer = NULL;
 static am_shm_t *audit_shm = NULL;
 
-static const char *AUDIT_REQ_MSG = "<Request><![CDATA[<logRecWrite reqid=\"%%d\"><log logName=\"%s\" sid=\"%s\">"
+/* audit entries are stored without the request prefix - reqid is assigned when a batch is serialized */
+static const char *AUDIT_REQ_PREFIX = "<Request><![CDATA[<logRecWrite reqid=\"";
+static const char *AUDIT_REQ_MSG = "\"><log logName=\"%s\" sid=\"%s\">"
         "</log><logRecord><level>800</level><recMsg>%s</recMsg><logInfoMap><logInfo><infoKey>LoginIDSid</infoKey>"
-        "<infoValue>%s</infoValue></logInfo></logInfoMap></logRecord></logRecWrite>]]></Request>%%s";
+        "<infoValue>%s</infoValue></logInfo></logInfoMap></logRecord></logRecWrite>]]></Request>";
 
 int am_audit_init(int id) {
     if (audit_shm != NULL) return AM_SUCCESS;
@@ -155,12 +174,14 @@ static am_status_t add_audit_entry(struct am_audit_config *config, unsigned long
     }
     memcpy(audit_entry->value, message, size);
     audit_entry->value[size] = '\0';
+    audit_entry->size = (unsigned int) size;
     audit_entry->instance_id = instance_id;
 
     audit_entry->lh.next = audit_entry->lh.prev = 0;
 
     offset = AM_GET_OFFSET(audit_shm->pool, audit_entry);
     OFFSET_LIST_APPEND(&config->list_hdr, AUDIT_ENTRY_LINKS, offset);
+    config->pending++;
     return AM_SUCCESS;
 }
 
@@ -211,6 +232,9 @@ int am_add_remote_audit_entry(unsigned long instance_id, const char *agent_token
     config = get_audit_config(instance_id);
     if (config == NULL) {
         status = AM_EINVAL;
+    } else if (config->pending >= AM_AUDIT_PENDING_MAX) {
+        /* shipping is behind (remote logging service is not available or the spool is full) */
+        status = AM_EAGAIN;
     } else {
         status = add_audit_entry(config, instance_id, agent_token_server_id, message, size);
     }
@@ -219,115 +243,281 @@ int am_add_remote_audit_entry(unsigned long instance_id, const char *agent_token
     return status;
 }
 
-static am_status_t extract_audit_entries(unsigned long instance_id,
-        am_status_t(*callback)(const char *openam, int count, struct am_audit_transfer *batch)) {
-    static const char *thisfunc = "extract_audit_entries():";
-    am_status_t status;
-    struct am_audit_entry *e;
-    int offset;
+static int audit_buffer_append(struct audit_buffer *b, const char *data, size_t size) {
+    if (b->size + size + 1 > b->capacity) {
+        size_t capacity = b->capacity > 0 ? b->capacity : 4096;
+        char *tmp;
+        while (b->size + size + 1 > capacity) {
+            capacity *= 2;
+        }
+        tmp = realloc(b->data, capacity);
+        if (tmp == NULL) {
+            return AM_ENOMEM;
+        }
+        b->data = tmp;
+        b->capacity = capacity;
+    }
+    memcpy(b->data + b->size, data, size);
+    b->size += size;
+    b->data[b->size] = '\0';
+    return AM_SUCCESS;
+}
+
+/**
+ * Detach all pending entries of the instance in slot 'index' (when 'check_due' is set, only
+ * if it is due to run). The list is unlinked from the shared memory in O(1) - entries are then
+ * owned by the caller. src->instance_id is set to 0 if there is nothing to do.
+ */
+static am_status_t detach_audit_entries(int index, struct audit_source *src, int check_due) {
+    struct am_audit *audit_data;
     struct am_audit_config *config;
-    int i, c = 0;
-    struct am_audit_transfer *batch;
+    am_status_t status;
 
-    batch = malloc(BATCH_SIZE * sizeof (struct am_audit_transfer));
-    if (batch == NULL) {
-        return AM_ENOMEM;
-    }
+    src->instance_id = 0;
+    src->first = src->last = src->count = 0;
 
     status = am_shm_lock(audit_shm);
     if (status != AM_SUCCESS) {
-        AM_FREE(batch);
         return status;
     }
 
-    config = get_audit_config(instance_id);
-    if (config == NULL) {
-        AM_FREE(batch);
+    audit_data = get_audit_data();
+    if (audit_data == NULL) {
         am_shm_unlock(audit_shm);
-        return AM_EINVAL;
+        return AM_ENOMEM;
     }
 
-    AM_OFFSET_LIST_FOR_EACH_OFFSET(audit_shm->pool, &config->list_hdr, e, offset) {
-        batch[c].message = strdup(e->value);
-        batch[c].instance_id = e->instance_id;
-        batch[c].server_id = strdup(e->server_id);
-        batch[c].config_file = strdup(config->config_file);
+    config = &audit_data->config[index];
+    if (config->instance_id > 0 && (!check_due ||
+            config->interval == 1 || config->interval == ++(config->last))) {
+        if (check_due) {
+            /* reset run-count for this instance */
+            config->last = 0;
+        }
 
-        c++;
+        src->instance_id = config->instance_id;
+        src->generation = config->generation;
+        src->first = config->list_hdr.first;
+        src->last = config->list_hdr.last;
+        src->count = config->pending;
+        strncpy(src->config_file, config->config_file, sizeof (src->config_file) - 1);
+        src->config_file[sizeof (src->config_file) - 1] = '\0';
+        strncpy(src->spool, config->spool, sizeof (src->spool) - 1);
+        src->spool[sizeof (src->spool) - 1] = '\0';
+        strncpy(src->openam, config->openam, sizeof (src->openam) - 1);
+        src->openam[sizeof (src->openam) - 1] = '\0';
+        config->list_hdr.first = config->list_hdr.last = 0;
+        config->pending = 0;
+    }
 
-        if (c == BATCH_SIZE) {
-            AM_LOG_DEBUG(instance_id, "%s sending %d audit log messages to %s", thisfunc, c, config->openam);
-            callback(config->openam, c, batch);
-            for (i = 0; i < c; i++) {
-                AM_FREE(batch[i].message, batch[i].server_id, batch[i].config_file);
-            }
-            c = 0;
+    am_shm_unlock(audit_shm);
+    return AM_SUCCESS;
+}
+
+/**
+ * Put detached entries not shipped yet back in front of the instance list (O(1)).
+ */
+static void reattach_audit_entries(int index, struct audit_source *src) {
+    struct am_audit *audit_data;
+    struct am_audit_config *config;
+
+    if (src->first == 0 || am_shm_lock(audit_shm) != AM_SUCCESS) {
+        return;
+    }
+
+    audit_data = get_audit_data();
+    if (audit_data != NULL && audit_data->config[index].instance_id == src->instance_id) {
+        config = &audit_data->config[index];
+        AUDIT_ENTRY_LINKS(src->first)->prev = 0;
+        if (config->list_hdr.first) {
+            AUDIT_ENTRY_LINKS(src->last)->next = config->list_hdr.first;
+            AUDIT_ENTRY_LINKS(config->list_hdr.first)->prev = src->last;
+        } else {
+            config->list_hdr.last = src->last;
         }
+        config->list_hdr.first = src->first;
+        config->pending += src->count;
+        src->first = src->last = src->count = 0;
+    }
 
-        OFFSET_LIST_UNLINK(&config->list_hdr, AUDIT_ENTRY_LINKS, offset);
-        am_shm_free(audit_shm, e);
+    am_shm_unlock(audit_shm);
+}
+
+/**
+ * Copy (and release) up to BATCH_SIZE detached entries into the spool buffer, as a sequence of
+ * nul terminated server-id and record pairs. Shared memory can be re-mapped by any other thread
+ * once the lock is released, so records are copied out (one memcpy each) rather than referenced.
+ */
+static int read_audit_entries(struct audit_source *src, struct audit_buffer *spool) {
+    struct am_audit_entry *e;
+    int count = 0;
+
+    spool->size = 0;
+    if (am_shm_lock(audit_shm) != AM_SUCCESS) {
+        return -1;
     }
 
-    if (c) {
-        AM_LOG_DEBUG(instance_id, "%s sending %d audit log messages to %s", thisfunc, c, config->openam);
-        callback(config->openam, c, batch);
-        for (i = 0; i < c; i++) {
-            AM_FREE(batch[i].message, batch[i].server_id, batch[i].config_file);
+    while (src->first && count < BATCH_SIZE) {
+        e = (struct am_audit_entry *) AM_GET_POINTER(audit_shm->pool, src->first);
+        src->first = e->lh.next;
+        src->count--;
+        if (audit_buffer_append(spool, e->server_id, strnlen(e->server_id, sizeof (e->server_id)) + 1) == AM_SUCCESS &&
+                audit_buffer_append(spool, e->value, e->size + 1) == AM_SUCCESS) {
+            count++;
         }
+        am_shm_free(audit_shm, e);
     }
 
     am_shm_unlock(audit_shm);
+    return count;
+}
+
+/**
+ * Move detached entries (in batches of BATCH_SIZE) into the on-disk spool. A batch is copied out
+ * under the shared memory lock and spooled after it is released (spool appends can mean disk I/O,
+ * when a segment fills up); the entries which made it into the spool are released after that.
+ *
+ * @return AM_SUCCESS, or AM_EAGAIN if the spool is full - entries left are still detached
+ */
+static am_status_t spool_audit_entries(struct audit_source *src, am_spool_t *spool, struct audit_buffer *record) {
+    static const char *thisfunc = "spool_audit_entries():";
+    struct am_audit_entry *e;
+    am_status_t status = AM_SUCCESS;
+    size_t sizes[BATCH_SIZE], offset;
+    unsigned int next;
+    int count, done;
+
+    while (src->first && status == AM_SUCCESS) {
+        if (am_shm_lock(audit_shm) != AM_SUCCESS) {
+            return AM_ERROR;
+        }
+        record->size = 0;
+        for (count = 0, next = src->first; next && count < BATCH_SIZE; count++) {
+            e = (struct am_audit_entry *) AM_GET_POINTER(audit_shm->pool, next);
+            offset = record->size;
+            if (audit_buffer_append(record, e->server_id, strnlen(e->server_id, sizeof (e->server_id)) + 1) != AM_SUCCESS ||
+                    audit_buffer_append(record, e->value, e->size + 1) != AM_SUCCESS) {
+                record->size = offset;
+            }
+            sizes[count] = record->size - offset; /* 0 - out of memory, the entry is dropped */
+            next = e->lh.next;
+        }
+        am_shm_unlock(audit_shm);
 
-    AM_FREE(batch);
+        for (done = 0, offset = 0; done < count; done++) {
+            status = sizes[done] == 0 ? AM_ENOMEM : am_spool_append(spool, record->data + offset, sizes[done]);
+            if (status == AM_EAGAIN) {
+                break;
+            }
+            if (status != AM_SUCCESS) {
+                AM_LOG_WARNING(src->instance_id, "%s dropping audit entry (%s)", thisfunc, am_strerror(status));
+                status = AM_SUCCESS;
+            }
+            offset += sizes[done];
+        }
+
+        if (am_shm_lock(audit_shm) != AM_SUCCESS) {
+            return AM_ERROR;
+        }
+        for (; done > 0; done--) {
+            e = (struct am_audit_entry *) AM_GET_POINTER(audit_shm->pool, src->first);
+            src->first = e->lh.next;
+            src->count--;
+            am_shm_free(audit_shm, e);
+        }
+        am_shm_unlock(audit_shm);
+    }
     return status;
 }
 
-static am_status_t write_entries_to_server(const char *openam, int count, struct am_audit_transfer *batch) {
-    static const char *thisfunc = "write_entries_to_server():";
-    int i, msg_size;
-    struct audit_worker_data *wd;
-    char *server_id = NULL, *msg = NULL, *config_file = NULL;
-    unsigned long instance_id;
+/**
+ * Get net options and spool for the instance, fetching agent configuration only when the
+ * instance has been (re)configured since the options were cached.
+ */
+static struct audit_instance *get_audit_instance(struct audit_source *src) {
+    static const char *thisfunc = "get_audit_instance():";
+    int i, slot = -1;
+    struct audit_instance *inst;
+    am_config_t *conf = NULL;
 
-    if (count == 0 || batch == NULL || ISINVALID(openam)) {
-        return AM_EINVAL;
+    for (i = 0; i < AM_MAX_INSTANCES; i++) {
+        if (audit_instances[i].instance_id == src->instance_id) {
+            slot = i;
+            break;
+        }
+        if (slot == -1 && audit_instances[i].instance_id == 0) {
+            slot = i;
+        }
     }
-
-    wd = malloc(sizeof (struct audit_worker_data));
-    if (wd == NULL) {
-        return AM_ENOMEM;
+    if (slot == -1) {
+        return NULL;
     }
+    inst = &audit_instances[slot];
 
-    for (i = 0; i < count; i++) {
-        if (msg == NULL) {
-            server_id = batch[i].server_id;
-            instance_id = batch[i].instance_id;
-            config_file = batch[i].config_file;
-            msg_size = am_asprintf(&msg, batch[i].message, i + 1, "");
-        } else {
-            msg_size = am_asprintf(&msg, batch[i].message, i + 1, msg);
+    if (inst->instance_id != src->instance_id || inst->generation != src->generation) {
+        if (am_get_agent_config(src->instance_id, src->config_file, &conf) != AM_SUCCESS) {
+            return NULL;
         }
-        if (msg_size <= 0 || msg == NULL) {
-            AM_FREE(wd, msg);
-            return AM_ENOMEM;
+        if (inst->instance_id != 0) {
+            am_net_options_delete(&inst->options);
         }
+        memset(&inst->options, 0, sizeof (am_net_options_t));
+        am_net_options_create(conf, &inst->options, NULL);
+        inst->instance_id = src->instance_id;
+        inst->generation = src->generation;
+        am_config_free(&conf);
+    }
+
+    if (strcmp(inst->spool_name, src->spool) != 0) {
+        am_spool_close(inst->spool);
+        inst->spool = NULL;
+        strncpy(inst->spool_name, src->spool, sizeof (inst->spool_name) - 1);
+        if (ISVALID(src->spool)) {
+            /* opening the spool replays records left by the previous run */
+            inst->spool = am_spool_open(src->spool, AM_AUDIT_SPOOL_SEGMENT_SIZE, AM_AUDIT_SPOOL_SEGMENTS);
+            if (inst->spool == NULL) {
+                AM_LOG_WARNING(src->instance_id, "%s unable to open audit spool %s, sending audit entries directly",
+                        thisfunc, src->spool);
+            } else if (am_spool_pending(inst->spool) > 0) {
+                AM_LOG_INFO(src->instance_id, "%s %u audit entries found in spool %s",
+                        thisfunc, am_spool_pending(inst->spool), src->spool);
+            }
+        }
+    }
+    return inst;
+}
+
+static am_status_t write_entries_to_server(void *arg, const char *server_id, struct audit_buffer *msg) {
+    static const char *thisfunc = "write_entries_to_server():";
+    struct audit_source *src = (struct audit_source *) arg;
+    struct audit_instance *inst;
+    struct audit_worker_data *wd;
+
+    wd = malloc(sizeof (struct audit_worker_data));
+    if (wd == NULL) {
+        return AM_ENOMEM;
     }
 
-    wd->instance_id = instance_id;
-    wd->openam = strdup(openam);
-    wd->logdata = msg;
+    wd->instance_id = src->instance_id;
+    wd->openam = strdup(src->openam);
+    wd->logdata = msg->data;
     wd->options = malloc(sizeof (am_net_options_t));
     if (wd->options != NULL) {
-        am_config_t *conf = NULL;
-        if (am_get_agent_config(instance_id, config_file, &conf) == AM_SUCCESS) {
-            am_net_options_create(conf, wd->options, NULL);
+        inst = get_audit_instance(src);
+        if (inst != NULL) {
+            am_net_options_copy(wd->options, &inst->options);
+        } else {
+            memset(wd->options, 0, sizeof (am_net_options_t));
         }
-        wd->options->server_id = strdup(server_id);
-        am_config_free(&conf);
+        wd->options->server_id = ISVALID(server_id) ? strdup(server_id) : NULL;
     }
 
-    if (am_worker_dispatch(remote_audit_worker, wd) != 0) {
-        AM_LOG_WARNING(instance_id, "%s failed to dispatch remote audit_shm log worker", thisfunc);
+    /* the worker owns the serialized batch now */
+    msg->data = NULL;
+    msg->size = msg->capacity = 0;
+
+    if (am_worker_dispatch_class(AM_WORKER_LOW, remote_audit_worker, wd) != 0) {
+        AM_LOG_WARNING(src->instance_id, "%s failed to dispatch remote audit_shm log worker", thisfunc);
         am_net_options_delete(wd->options);
         AM_FREE(wd->openam, wd->logdata, wd->options, wd);
         return AM_ERROR;
@@ -335,39 +525,184 @@ static am_status_t write_entries_to_server(const char *openam, int count, struct
     return AM_SUCCESS;
 }
 
-static void am_audit_tick(void *arg) {
-    static const char *thisfunc = "am_audit_tick():";
-    int i;
-    struct am_audit *audit_data;
-    int lock_status, status;
+static am_status_t upload_entries_to_server(void *arg, const char *server_id, struct audit_buffer *msg) {
+    struct audit_upload *u = (struct audit_upload *) arg;
+    char *options_server_id = u->options->server_id;
+    am_status_t status;
 
-    lock_status = am_shm_lock(audit_shm);
-    if (lock_status != AM_SUCCESS) {
-        return;
+    u->options->server_id = ISVALID(server_id) ? (char *) server_id : NULL;
+    status = am_agent_audit_request(u->instance_id, u->openam, msg->data, u->options);
+    u->options->server_id = options_server_id;
+    msg->size = 0;
+    return status;
+}
+
+/**
+ * Serialize spooled records into logRecWrite requests (in a single pass, appending to the batch buffer)
+ * and send them, one request set per each run of records with the same server-id. The number
+ * of records sent successfully is returned in 'sent'.
+ */
+static am_status_t send_audit_entries(unsigned long instance_id, const char *openam, struct audit_buffer *spool, int count,
+        am_status_t(*send)(void *arg, const char *server_id, struct audit_buffer *msg), void *arg, int *sent) {
+    static const char *thisfunc = "send_audit_entries():";
+    struct audit_buffer msg;
+    const char *p = spool->data, *server_id = NULL, *record;
+    size_t prefix_sz = strlen(AUDIT_REQ_PREFIX), record_sz;
+    char reqid[16];
+    int i, n = 0, reqid_sz;
+    am_status_t status = AM_SUCCESS;
+
+    memset(&msg, 0, sizeof (struct audit_buffer));
+    *sent = 0;
+
+    for (i = 0; i < count; i++) {
+        const char *sid = p;
+        record = sid + strlen(sid) + 1;
+        record_sz = strlen(record);
+        p = record + record_sz + 1;
+
+        if (n > 0 && strcmp(sid, server_id) != 0) {
+            AM_LOG_DEBUG(instance_id, "%s sending %d audit log messages to %s", thisfunc, n, openam);
+            status = send(arg, server_id, &msg);
+            if (status != AM_SUCCESS) break;
+            *sent += n;
+            n = 0;
+        }
+
+        server_id = sid;
+        reqid_sz = snprintf(reqid, sizeof (reqid), "%d", ++n);
+        if (audit_buffer_append(&msg, AUDIT_REQ_PREFIX, prefix_sz) != AM_SUCCESS ||
+                audit_buffer_append(&msg, reqid, reqid_sz) != AM_SUCCESS ||
+                audit_buffer_append(&msg, record, record_sz) != AM_SUCCESS) {
+            status = AM_ENOMEM;
+            break;
+        }
     }
 
-    audit_data = get_audit_data();
-    if (audit_data == NULL) {
-        am_shm_unlock(audit_shm);
-        return;
+    if (status == AM_SUCCESS && n > 0) {
+        AM_LOG_DEBUG(instance_id, "%s sending %d audit log messages to %s", thisfunc, n, openam);
+        status = send(arg, server_id, &msg);
+        if (status == AM_SUCCESS) {
+            *sent += n;
+        }
+    }
+    am_free(msg.data);
+    return status;
+}
+
+static void spool_read_callback(void *arg, const char *data, size_t size) {
+    struct audit_spool_read *r = (struct audit_spool_read *) arg;
+    if (r->count >= 0) {
+        r->count = audit_buffer_append(r->buffer, data, size) == AM_SUCCESS ? r->count + 1 : -1;
+    }
+}
+
+/**
+ * Upload spooled audit records to the remote logging service in batches of BATCH_SIZE.
+ * Records are acknowledged (and released from the spool) once the service has accepted them;
+ * the upload stops at the first failure, leaving the rest in the spool for the next run.
+ *
+ * @return AM_SUCCESS if the spool has been emptied, error status otherwise
+ */
+int am_audit_spool_upload(unsigned long instance_id, const char *openam, am_net_options_t *options, am_spool_t *spool) {
+    am_net_options_t no_options;
+    struct audit_buffer records;
+    struct audit_spool_read r;
+    struct audit_upload u;
+    am_status_t status = AM_SUCCESS;
+    int sent;
+
+    if (spool == NULL || ISINVALID(openam)) {
+        return AM_EINVAL;
     }
+    if (options == NULL) {
+        memset(&no_options, 0, sizeof (am_net_options_t));
+        options = &no_options;
+    }
+
+    memset(&records, 0, sizeof (struct audit_buffer));
+    u.instance_id = instance_id;
+    u.openam = openam;
+    u.options = options;
+
+    while (am_spool_pending(spool) > 0) {
+        records.size = 0;
+        r.buffer = &records;
+        r.count = 0;
+        if (am_spool_read(spool, BATCH_SIZE, spool_read_callback, &r) == 0) {
+            break;
+        }
+        if (r.count < 0) {
+            status = AM_ENOMEM;
+            break;
+        }
+        status = send_audit_entries(instance_id, openam, &records, r.count, upload_entries_to_server, &u, &sent);
+        am_spool_ack(spool, sent);
+        if (status != AM_SUCCESS) {
+            break;
+        }
+    }
+
+    am_free(records.data);
+    return status;
+}
+
+static void am_audit_tick(void *arg) {
+    static const char *thisfunc = "am_audit_tick():";
+    int i, count, sent;
+    am_status_t status, spool_status;
+    struct audit_source src;
+    struct audit_buffer spool;
+    struct audit_instance *inst;
+
+    memset(&spool, 0, sizeof (struct audit_buffer));
+    memset(&src, 0, sizeof (struct audit_source));
 
     for (i = 0; i < AM_MAX_INSTANCES; i++) {
-        if (audit_data->config[i].instance_id > 0 &&
-                (audit_data->config[i].interval == 1 ||
-                audit_data->config[i].interval == ++(audit_data->config[i].last))) {
-            /* reset run-count for this instance */
-            audit_data->config[i].last = 0;
+        if (detach_audit_entries(i, &src, AM_TRUE) != AM_SUCCESS) {
+            break;
+        }
+        if (src.instance_id == 0) {
+            continue;
+        }
 
-            status = extract_audit_entries(audit_data->config[i].instance_id, write_entries_to_server);
-            if (status != AM_SUCCESS) {
-                AM_LOG_WARNING(audit_data->config[i].instance_id,
-                        "%s failed to extract audit entries (%s)", thisfunc, am_strerror(status));
+        inst = get_audit_instance(&src);
+        if (inst != NULL && inst->spool != NULL) {
+            /* spool detached entries and upload from the spool; when the spool fills up, entries
+             * are put back into the shared memory (and new ones are refused once there are
+             * AM_AUDIT_PENDING_MAX of them) until the remote logging service catches up */
+            do {
+                spool_status = spool_audit_entries(&src, inst->spool, &spool);
+                reattach_audit_entries(i, &src);
+                status = am_audit_spool_upload(src.instance_id, src.openam, &inst->options, inst->spool);
+                if (status != AM_SUCCESS) {
+                    AM_LOG_WARNING(src.instance_id, "%s failed to upload audit entries to %s (%s), %u entries left in spool",
+                            thisfunc, src.openam, am_strerror(status), am_spool_pending(inst->spool));
+                    break;
+                }
+            } while (spool_status == AM_EAGAIN &&
+                    detach_audit_entries(i, &src, AM_FALSE) == AM_SUCCESS && src.first != 0);
+            continue;
+        }
+
+        /* no spool: stream detached entries out in batches; each batch is serialized and sent outside the lock */
+        while (src.first) {
+            count = read_audit_entries(&src, &spool);
+            if (count < 0) {
+                /* unable to lock - entries detached so far are lost */
+                break;
+            }
+            if (count > 0) {
+                status = send_audit_entries(src.instance_id, src.openam, &spool, count, write_entries_to_server, &src, &sent);
+                if (status != AM_SUCCESS) {
+                    AM_LOG_WARNING(src.instance_id, "%s failed to send audit entries (%s)",
+                            thisfunc, am_strerror(status));
+                }
             }
         }
     }
 
-    am_shm_unlock(audit_shm);
+    am_free(spool.data);
 }
 
 int am_audit_processor_init() {
@@ -386,8 +721,39 @@ int am_audit_processor_init() {
 }
 
 void am_audit_processor_shutdown() {
+    int i;
     am_close_timer_event(audit_timer);
     audit_timer = NULL;
+    for (i = 0; i < AM_MAX_INSTANCES; i++) {
+        if (audit_instances[i].instance_id != 0) {
+            am_net_options_delete(&audit_instances[i].options);
+            audit_instances[i].instance_id = 0;
+        }
+        am_spool_close(audit_instances[i].spool);
+        audit_instances[i].spool = NULL;
+        audit_instances[i].spool_name[0] = '\0';
+    }
+}
+
+/**
+ * Remote audit spool files are kept next to the local audit log file.
+ */
+static void set_audit_spool_name(am_config_t *conf, char *name, size_t size) {
+    const char *sep = NULL;
+    if (ISVALID(conf->audit_file)) {
+        sep = strrchr(conf->audit_file, '/');
+#ifdef _WIN32
+        if (strrchr(conf->audit_file, '\\') > sep) {
+            sep = strrchr(conf->audit_file, '\\');
+        }
+#endif
+    }
+    if (sep == NULL) {
+        name[0] = '\0';
+        return;
+    }
+    snprintf(name, size, "%.*sremote_audit_%lu", (int) (sep - conf->audit_file + 1), conf->audit_file,
+            conf->instance_id);
 }
 
 int am_audit_register_instance(am_config_t *conf) {
@@ -413,13 +779,24 @@ int am_audit_register_instance(am_config_t *conf) {
     req.conf = conf;
     openam = get_valid_openam_url(&req);
 
-    /* update existing instance configuration */
+    /* update existing instance configuration; called with every configuration fetch, so the
+     * generation (which makes the audit timer rebuild its net options) changes only along with
+     * the values */
     for (i = 0; i < AM_MAX_INSTANCES; i++) {
         if (audit_data->config[i].instance_id == conf->instance_id) {
-            audit_data->config[i].interval = conf->audit_remote_interval <= 0 ?
-                    DEFAULT_RUN_INTERVAL : conf->audit_remote_interval;
-            strncpy(audit_data->config[i].config_file, conf->config, sizeof (audit_data->config[i].config_file) - 1);
-            strncpy(audit_data->config[i].openam, openam, sizeof (audit_data->config[i].openam) - 1);
+            struct am_audit_config *c = &audit_data->config[i];
+            int interval = conf->audit_remote_interval <= 0 ? DEFAULT_RUN_INTERVAL : conf->audit_remote_interval;
+            char spool[sizeof (c->spool)];
+
+            set_audit_spool_name(conf, spool, sizeof (spool));
+            if (c->interval != interval || strncmp(c->config_file, NOTNULL(conf->config), sizeof (c->config_file) - 1) != 0 ||
+                    strncmp(c->openam, NOTNULL(openam), sizeof (c->openam) - 1) != 0 || strcmp(c->spool, spool) != 0) {
+                c->interval = interval;
+                strncpy(c->config_file, NOTNULL(conf->config), sizeof (c->config_file) - 1);
+                strncpy(c->openam, NOTNULL(openam), sizeof (c->openam) - 1);
+                strcpy(c->spool, spool);
+                c->generation++;
+            }
             am_shm_unlock(audit_shm);
             return AM_SUCCESS;
         }
@@ -431,8 +808,10 @@ int am_audit_register_instance(am_config_t *conf) {
             audit_data->config[i].interval = conf->audit_remote_interval <= 0 ?
                     DEFAULT_RUN_INTERVAL : conf->audit_remote_interval;
             audit_data->config[i].last = 0;
+            audit_data->config[i].generation++;
             strncpy(audit_data->config[i].config_file, conf->config, sizeof (audit_data->config[i].config_file) - 1);
             strncpy(audit_data->config[i].openam, openam, sizeof (audit_data->config[i].openam) - 1);
+            set_audit_spool_name(conf, audit_data->config[i].spool, sizeof (audit_data->config[i].spool));
             break;
         }
     }
@@ -440,3 +819,23 @@ int am_audit_register_instance(am_config_t *conf) {
     am_shm_unlock(audit_shm);
     return AM_SUCCESS;
 }
+
+/**
+ * Returns the configuration generation of an audit instance (0 if it is not registered).
+ * This is used to check the instance registration in tests.
+ *
+ * @param instance_id the agent instance
+ */
+unsigned int am_test_get_audit_generation(unsigned long instance_id) {
+    struct am_audit_config *c;
+    unsigned int generation = 0;
+    if (am_shm_lock(audit_shm) != AM_SUCCESS) {
+        return 0;
+    }
+    c = get_audit_config(instance_id);
+    if (c != NULL) {
+        generation = c->generation;
+    }
+    am_shm_unlock(audit_shm);
+    return generation;
+}
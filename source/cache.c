@@ -32,6 +32,15 @@
  * ===============================================================
  * key: 'uuid value'
  * 
+ * Cache memory is accounted per agent instance. Once an instance grows over its quota
+ * (org.forgerock.agents.cache.quota), a new session entry has to evict one of the instance's
+ * own entries first - the least frequently used one out of AM_CACHE_EVICTION_SAMPLES sampled.
+ * With admission enabled (org.forgerock.agents.cache.admission) the new entry is only cached
+ * if its key was looked up more often than the victim's (TinyLFU), so that tokens seen once
+ * (bots, scanners) don't push out the working set. Key lookup frequencies are kept in
+ * a count-min sketch with 4 bit counters (16 to a 64 bit word) which are halved every
+ * 10 * AM_CACHE_SKETCH_WIDTH lookups - one row per lookup, so that no single request pays
+ * for aging the whole sketch.
  */
 
 enum {
@@ -84,13 +93,29 @@ struct am_cache_entry {
     struct offset_list lh; /* collisions */
 };
 
+#define AM_CACHE_SKETCH_ROWS 4
+#define AM_CACHE_SKETCH_MAX 15
+#define AM_CACHE_SKETCH_WORDS (AM_CACHE_SKETCH_WIDTH / 16) /* 4 bit counters, 16 to a word */
+
+struct am_cache_instance {
+    int used;
+    int admission;
+    am_cache_stats_t stats;
+};
+
 struct am_cache {
     size_t count;
     struct offset_list table[AM_HASH_TABLE_SIZE]; /* first,last */
+    struct am_cache_instance instance[AM_MAX_INSTANCES];
+    uint32_t sketch_additions;
+    uint32_t sketch_aging; /* number of rows still to be halved */
+    uint64_t sketch[AM_CACHE_SKETCH_ROWS][AM_CACHE_SKETCH_WORDS];
 };
 
 static am_shm_t *cache = NULL;
 
+int am_purge_caches_to_now(unsigned long instance_id);
+
 /**
  * Get a copy of the shared memory area handle pointed to by "cache".
  */
@@ -123,7 +148,7 @@ int am_cache_init(int id) {
             return AM_ENOMEM;
         }
         am_shm_lock(cache);
-        cache_data->count = 0;
+        memset(cache_data, 0, sizeof(struct am_cache));
         /* initialize head nodes */
         for (i = 0; i < AM_HASH_TABLE_SIZE; i++) {
             cache_data->table[i].next = cache_data->table[i].prev = 0;
@@ -163,6 +188,117 @@ static unsigned int index_for(unsigned int tablelength, unsigned int hashvalue)
     return (hashvalue % tablelength);
 }
 
+/**
+ * Get instance memory accounting slot. The function must be called while holding the mutex (am_shm_lock).
+ */
+static struct am_cache_instance *get_cache_instance(struct am_cache *cache_data, unsigned long instance_id) {
+    struct am_cache_instance *free_slot = NULL;
+    int i;
+    if (cache_data == NULL) {
+        return NULL;
+    }
+    for (i = 0; i < AM_MAX_INSTANCES; i++) {
+        struct am_cache_instance *c = &cache_data->instance[i];
+        if (c->used && c->stats.instance_id == instance_id) {
+            return c;
+        }
+        if (!c->used && free_slot == NULL) {
+            free_slot = c;
+        }
+    }
+    if (free_slot != NULL) {
+        memset(free_slot, 0, sizeof(struct am_cache_instance));
+        free_slot->used = AM_TRUE;
+        free_slot->stats.instance_id = instance_id;
+    }
+    return free_slot;
+}
+
+static void cache_charge(unsigned long instance_id, size_t size, int add) {
+    struct am_cache_instance *c = get_cache_instance(get_cache_header_data(), instance_id);
+    if (c == NULL) {
+        return;
+    }
+    if (add) {
+        c->stats.size += size;
+    } else {
+        c->stats.size -= size < c->stats.size ? size : c->stats.size;
+    }
+}
+
+/**
+ * Allocate cache memory, charged to the instance. The function must be called while holding the mutex (am_shm_lock).
+ */
+static void *cache_alloc(unsigned long instance_id, size_t size) {
+    void *ptr = am_shm_alloc_with_gc(cache, size, am_purge_caches_to_now, instance_id);
+    if (ptr != NULL) {
+        cache_charge(instance_id, am_shm_size(ptr), AM_TRUE);
+    }
+    return ptr;
+}
+
+static void cache_free(unsigned long instance_id, void *ptr) {
+    if (ptr != NULL) {
+        cache_charge(instance_id, am_shm_size(ptr), AM_FALSE);
+        am_shm_free(cache, ptr);
+    }
+}
+
+/**
+ * Release cache entry key and the entry itself (once it is unlinked with delete_cache_entry).
+ */
+static void free_cache_entry(struct am_cache_entry *element) {
+    unsigned long instance_id = element->instance_id;
+    cache_free(instance_id, AM_GET_POINTER(cache->pool, element->key_offset));
+    cache_free(instance_id, element);
+}
+
+static uint32_t sketch_index(uint32_t *x) {
+    *x = *x * 0x9E3779B1U + 0x7F4A7C15U;
+    return (*x ^ (*x >> 16)) & (AM_CACHE_SKETCH_WIDTH - 1);
+}
+
+#define SKETCH_COUNTER(w, j) ((int) (((w) >> (((j) & 15) * 4)) & 0xF))
+
+/**
+ * Record a key lookup in the frequency sketch. The function must be called while holding the mutex (am_shm_lock).
+ */
+static void sketch_increment(struct am_cache *cache_data, unsigned int key_hash) {
+    uint32_t x = key_hash;
+    int i, j;
+    for (i = 0; i < AM_CACHE_SKETCH_ROWS; i++) {
+        uint32_t c = sketch_index(&x);
+        uint64_t *w = &cache_data->sketch[i][c >> 4];
+        if (SKETCH_COUNTER(*w, c) < AM_CACHE_SKETCH_MAX) {
+            *w += (uint64_t) 1 << ((c & 15) * 4);
+        }
+    }
+    if (cache_data->sketch_aging > 0) {
+        /* age the counters so that old popularity fades out, a row at a time */
+        uint64_t *row = cache_data->sketch[--cache_data->sketch_aging];
+        for (j = 0; j < AM_CACHE_SKETCH_WORDS; j++) {
+            row[j] = (row[j] >> 1) & 0x7777777777777777ULL;
+        }
+    }
+    if (++cache_data->sketch_additions >= 10 * AM_CACHE_SKETCH_WIDTH) {
+        cache_data->sketch_additions >>= 1;
+        cache_data->sketch_aging = AM_CACHE_SKETCH_ROWS;
+    }
+}
+
+static int sketch_estimate(struct am_cache *cache_data, unsigned int key_hash) {
+    uint32_t x = key_hash;
+    int i, min = AM_CACHE_SKETCH_MAX;
+    for (i = 0; i < AM_CACHE_SKETCH_ROWS; i++) {
+        uint32_t c = sketch_index(&x);
+        int v = SKETCH_COUNTER(cache_data->sketch[i][c >> 4], c);
+        if (v < min) {
+            min = v;
+        }
+    }
+    return min;
+}
+
 /**
  * Get cache entry. The function must be called while holding the mutex (am_shm_lock).
  */
@@ -213,7 +349,7 @@ static int delete_cache_entry(int entry_index, struct am_cache_entry *element) {
     head = (struct am_cache_entry_data *) AM_GET_POINTER(cache->pool, element->data.prev);
 
     AM_OFFSET_LIST_FOR_EACH(cache->pool, head, i, tmp, struct am_cache_entry_data) {
-        am_shm_free(cache, i);
+        cache_free(element->instance_id, i);
     }
 
     /* remove a node from a doubly linked list */
@@ -259,55 +395,67 @@ static int delete_cache_entry_element_by_index(struct am_cache_entry *entry, int
             } else {
                 ((struct am_cache_entry_data *) AM_GET_POINTER(cache->pool, i->lh.next))->lh.prev = i->lh.prev;
             }
-            am_shm_free(cache, i);
+            cache_free(entry->instance_id, i);
         }
     }
 
     return AM_SUCCESS;
 }
 
-/*
- * Remove cache entries that that have expired as of the expiry_time, which would be set
- * to the current time.
- * 
- * Note: this will be called in the memory allocator (shared.c) when memory is low, and it will be
- * enclosed in lock/unlock blocks, so they are not required here.
- *
- * Returns the number of cache entries removed.
+/**
+ * Remove cache entries (of all instances or of one instance only) that have expired as of
+ * the expiry_time. The function must be called while holding the mutex (am_shm_lock).
  */
-int am_purge_caches(unsigned long instance_id, time_t expiry_time) {
+static int purge_cache_entries(struct am_cache *cache_data, const unsigned long *instance_id, time_t expiry_time) {
     struct am_cache_entry *cache_entry, *tmp, *head;
-    struct am_cache *cache_data;
-    
-    int delete_count;
+    int delete_count = 0;
     int i;
 
-    cache_data = get_cache_header_data();
-    if (cache_data == NULL) {
-        return 0;
-    }
-    
-    delete_count = 0;
-    
     for (i = 0; i < AM_HASH_TABLE_SIZE; i++) {
         // NOTE: prev is first, and so is head
         head = (struct am_cache_entry *) AM_GET_POINTER(cache->pool, cache_data->table[i].prev);
         AM_OFFSET_LIST_FOR_EACH(cache->pool, head, cache_entry, tmp, struct am_cache_entry) {
+            if (instance_id != NULL && cache_entry->instance_id != *instance_id) {
+                continue;
+            }
             if (difftime(cache_entry->ts + cache_entry->valid, expiry_time) < 0) {
                 // remove the data list from this element
                 if (delete_cache_entry(i, cache_entry) == 0) {
-                    am_shm_free(cache, AM_GET_POINTER(cache->pool, cache_entry->key_offset));
-                    am_shm_free(cache, cache_entry);
+                    free_cache_entry(cache_entry);
                     delete_count++;
                 }
             }
         }
     }
-    AM_LOG_INFO(instance_id, "evicted %d sessions out of %lu\n", delete_count, (unsigned long)cache_data->count);
     cache_data->count -= delete_count;
     return delete_count;
 }
 
+/*
+ * Remove cache entries that that have expired as of the expiry_time, which would be set
+ * to the current time.
+ * 
+ * Note: this will be called in the memory allocator (shared.c) when memory is low, and it will be
+ * enclosed in lock/unlock blocks, so they are not required here.
+ *
+ * Returns the number of cache entries removed.
+ */
+int am_purge_caches(unsigned long instance_id, time_t expiry_time) {
+    struct am_cache *cache_data;
+    size_t count;
+    int delete_count;
+
+    cache_data = get_cache_header_data();
+    if (cache_data == NULL) {
+        return 0;
+    }
+
+    count = cache_data->count;
+    delete_count = purge_cache_entries(cache_data, NULL, expiry_time);
+    AM_LOG_INFO(instance_id, "evicted %d sessions out of %lu\n", delete_count, (unsigned long) count);
+    return delete_count;
+}
+
 /*
  * Purge caches to the current time
  */
@@ -380,8 +528,7 @@ int am_get_pdp_cache_entry(am_request_t *request, const char *key, char **data,
             }
 
             if (!delete_cache_entry(entry_index, cache_entry)) {
-                am_shm_free(cache, AM_GET_POINTER(cache->pool, cache_entry->key_offset));
-                am_shm_free(cache, cache_entry);
+                free_cache_entry(cache_entry);
                 cache_data->count--;
             }
             am_shm_unlock(cache);
@@ -461,8 +608,7 @@ int am_add_pdp_cache_entry(am_request_t *request, const char *key, const char *u
     cache_entry = get_cache_entry(key, NULL);
     if (cache_entry != NULL) {
         if (!delete_cache_entry(entry_index, cache_entry)) {
-            am_shm_free(cache, AM_GET_POINTER(cache->pool, cache_entry->key_offset));
-            am_shm_free(cache, cache_entry);
+            free_cache_entry(cache_entry);
             cache_data->count--;
             cache_entry = NULL;
         } else {
@@ -473,7 +619,7 @@ int am_add_pdp_cache_entry(am_request_t *request, const char *key, const char *u
         }
     }
 
-    cache_entry = am_shm_alloc_with_gc(cache, sizeof(struct am_cache_entry), am_purge_caches_to_now, request->instance_id);
+    cache_entry = cache_alloc(request->instance_id, sizeof(struct am_cache_entry));
     if (cache_entry == NULL) {
         AM_LOG_DEBUG(request->instance_id, "%s failed to allocate %ld bytes",
                 thisfunc, sizeof(struct am_cache_entry));
@@ -487,12 +633,12 @@ int am_add_pdp_cache_entry(am_request_t *request, const char *key, const char *u
     cache_entry->instance_id = request->instance_id;
     
     key_sz = strlen(key);
-    cache_entry_key = am_shm_alloc_with_gc(cache, key_sz + 1, am_purge_caches_to_now, request->instance_id);
+    cache_entry_key = cache_alloc(request->instance_id, key_sz + 1);
     if (cache_entry_key == NULL) {
         AM_LOG_DEBUG(request->instance_id, "%s failed to allocate %ld bytes",
                      thisfunc, key_sz + 1);
+        cache_free(request->instance_id, cache_entry);
         am_shm_unlock(cache);
-        am_shm_free(cache, cache_entry);
         return AM_ENOMEM;
     }
     cache_entry = AM_GET_POINTER(cache->pool, cache_entry_offset);
@@ -504,16 +650,16 @@ int am_add_pdp_cache_entry(am_request_t *request, const char *key, const char *u
     
     cache_data = get_cache_header_data();
     if (cache_data == NULL) {
+        cache_free(request->instance_id, cache_entry_key);
+        cache_free(request->instance_id, cache_entry);
         am_shm_unlock(cache);
-        am_shm_free(cache, cache_entry_key);
-        am_shm_free(cache, cache_entry);
         return AM_ENOMEM;
     }
     
     AM_OFFSET_LIST_INSERT(cache->pool, cache_entry, &(cache_data->table[entry_index]), struct am_cache_entry);
 
     entry_data_len = sizeof(struct am_cache_entry_data) +url_length + file_length + content_type_length + 3;
-    cache_entry_data = am_shm_alloc_with_gc(cache, entry_data_len, am_purge_caches_to_now, request->instance_id);
+    cache_entry_data = cache_alloc(request->instance_id, entry_data_len);
     
     if (cache_entry_data == NULL) {
         AM_LOG_DEBUG(request->instance_id, "%s failed to allocate %ld bytes",
@@ -580,8 +726,7 @@ int am_remove_cache_entry(unsigned long instance_id, const char *key) {
     if (result != 0) {
         AM_LOG_ERROR(instance_id, "%s failed to remove cache entry (%s)", thisfunc, key);
     } else {
-        am_shm_free(cache, AM_GET_POINTER(cache->pool, cache_entry->key_offset));
-        am_shm_free(cache, cache_entry);
+        free_cache_entry(cache_entry);
         cache_data->count--;
         AM_LOG_DEBUG(instance_id, "%s cache entry removed (%s)", thisfunc, key);
     }
@@ -589,6 +734,126 @@ int am_remove_cache_entry(unsigned long instance_id, const char *key) {
     return result;
 }
 
+/*
+ * Delete all session and policy cache entries of an agent instance. Post data preservation
+ * entries and the policy change event entry are kept.
+ * Returns the number of cache entries removed.
+ */
+int am_remove_instance_cache_entries(unsigned long instance_id) {
+    static const char *thisfunc = "am_remove_instance_cache_entries():";
+    struct am_cache_entry *cache_entry, *tmp, *head;
+    struct am_cache_entry_data *data;
+    struct am_cache *cache_data;
+    int i, removed = 0;
+
+    if (am_shm_lock(cache) != AM_SUCCESS) {
+        return 0;
+    }
+
+    cache_data = get_cache_header_data();
+    if (cache_data == NULL) {
+        am_shm_unlock(cache);
+        return 0;
+    }
+
+    for (i = 0; i < AM_HASH_TABLE_SIZE; i++) {
+        head = (struct am_cache_entry *) AM_GET_POINTER(cache->pool, cache_data->table[i].prev);
+        AM_OFFSET_LIST_FOR_EACH(cache->pool, head, cache_entry, tmp, struct am_cache_entry) {
+            char *key = AM_GET_POINTER(cache->pool, cache_entry->key_offset);
+            if (cache_entry->instance_id != instance_id || strcmp(key, AM_POLICY_CHANGE_KEY) == 0) {
+                continue;
+            }
+            data = cache_entry->data.prev != 0 ?
+                    (struct am_cache_entry_data *) AM_GET_POINTER(cache->pool, cache_entry->data.prev) : NULL;
+            if (data != NULL && data->type == AM_CACHE_PDP) {
+                continue;
+            }
+            if (delete_cache_entry(i, cache_entry) == AM_SUCCESS) {
+                free_cache_entry(cache_entry);
+                removed++;
+            }
+        }
+    }
+    cache_data->count -= removed;
+    am_shm_unlock(cache);
+
+    AM_LOG_DEBUG(instance_id, "%s %d cache entries removed", thisfunc, removed);
+    return removed;
+}
+
+struct cache_key_index {
+    int index;
+    const char *key;
+};
+
+static int compare_cache_key_index(const void *a, const void *b) {
+    const struct cache_key_index *x = (const struct cache_key_index *) a;
+    const struct cache_key_index *y = (const struct cache_key_index *) b;
+    return x->index != y->index ? (x->index < y->index ? -1 : 1) : strcmp(x->key, y->key);
+}
+
+/*
+ * Delete a number of shared cache entries (key: any). Keys are sorted by hash table bucket
+ * and removed in groups of AM_CACHE_REMOVE_BATCH with one lock acquisition each; duplicate
+ * keys are skipped. Returns the number of entries removed.
+ */
+int am_remove_cache_entries(unsigned long instance_id, const char **keys, int count) {
+    static const char *thisfunc = "am_remove_cache_entries():";
+    struct cache_key_index *list;
+    struct am_cache *cache_data;
+    int i, j, n = 0, removed = 0;
+
+    if (keys == NULL || count <= 0) {
+        return 0;
+    }
+
+    list = (struct cache_key_index *) malloc(count * sizeof (struct cache_key_index));
+    if (list == NULL) {
+        /* no memory to sort the keys in - remove them one by one */
+        for (i = 0; i < count; i++) {
+            if (ISVALID(keys[i]) && am_remove_cache_entry(instance_id, keys[i]) == AM_SUCCESS) {
+                removed++;
+            }
+        }
+        AM_LOG_DEBUG(instance_id, "%s %d cache entries removed (%d keys)", thisfunc, removed, count);
+        return removed;
+    }
+    for (i = 0; i < count; i++) {
+        if (ISVALID(keys[i])) {
+            list[n].key = keys[i];
+            list[n].index = index_for(AM_HASH_TABLE_SIZE, am_hash(keys[i]));
+            n++;
+        }
+    }
+    qsort(list, n, sizeof (struct cache_key_index), compare_cache_key_index);
+
+    for (i = 0; i < n; i = j) {
+        if (am_shm_lock(cache) != AM_SUCCESS) {
+            break;
+        }
+        cache_data = get_cache_header_data();
+        for (j = i; j < n && j - i < AM_CACHE_REMOVE_BATCH; j++) {
+            struct am_cache_entry *cache_entry;
+            int entry_index = 0;
+
+            if (cache_data == NULL || (j > 0 && strcmp(list[j].key, list[j - 1].key) == 0)) {
+                continue;
+            }
+            cache_entry = get_cache_entry(list[j].key, &entry_index);
+            if (cache_entry != NULL && delete_cache_entry(entry_index, cache_entry) == AM_SUCCESS) {
+                free_cache_entry(cache_entry);
+                cache_data->count--;
+                removed++;
+            }
+        }
+        am_shm_unlock(cache);
+    }
+
+    AM_LOG_DEBUG(instance_id, "%s %d cache entries removed (%d keys)", thisfunc, removed, count);
+    free(list);
+    return removed;
+}
+
 /* 
  * Find session/policy response cache entry (key: session token).
  */
@@ -601,6 +866,7 @@ int am_get_session_policy_cache_entry(am_request_t *request, const char *key,
     struct am_cache_entry_data *a, *tmp, *head;
 
     struct am_cache *cache_data;
+    struct am_cache_instance *instance;
     struct am_namevalue *sesion_attrs = NULL;
     struct am_policy_result *pol_attrs = NULL, *pol_curr = NULL;
     struct am_action_decision *action_curr = NULL;
@@ -621,9 +887,14 @@ int am_get_session_policy_cache_entry(am_request_t *request, const char *key,
         return AM_ENOMEM;
     }
     
+    instance = get_cache_instance(cache_data, request->instance_id);
+    sketch_increment(cache_data, am_hash(key));
+
     cache_entry = get_cache_entry(key, &entry_index);
     if (cache_entry == NULL) {
         AM_LOG_WARNING(request->instance_id, "%s failed to locate data for a key (%s)", thisfunc, key);
+        if (instance != NULL) instance->stats.misses++;
+        am_stats_add(AM_STATS_CACHE_MISSES, 1);
         am_shm_unlock(cache);
         return AM_NOT_FOUND;
     }
@@ -641,10 +912,11 @@ int am_get_session_policy_cache_entry(am_request_t *request, const char *key,
             AM_LOG_WARNING(request->instance_id, "%s data for a key (%s) is obsolete (created: %s, valid until: %s)",
                     thisfunc, key, tsc, tsu);
             if (!delete_cache_entry(entry_index, cache_entry)) {
-                am_shm_free(cache, AM_GET_POINTER(cache->pool, cache_entry->key_offset));
-                am_shm_free(cache, cache_entry);
+                free_cache_entry(cache_entry);
                 cache_data->count--;
             }
+            if (instance != NULL) instance->stats.misses++;
+            am_stats_add(AM_STATS_CACHE_MISSES, 1);
             am_shm_unlock(cache);
             return AM_ETIMEDOUT;
 
@@ -725,6 +997,14 @@ int am_get_session_policy_cache_entry(am_request_t *request, const char *key,
     if (sesion_attrs != NULL || pol_attrs != NULL) {
         status = AM_SUCCESS;
     }
+    if (instance != NULL) {
+        if (status == AM_SUCCESS) {
+            instance->stats.hits++;
+        } else {
+            instance->stats.misses++;
+        }
+    }
+    am_stats_add(status == AM_SUCCESS ? AM_STATS_CACHE_HITS : AM_STATS_CACHE_MISSES, 1);
 
     am_shm_unlock(cache);
     return status;
@@ -743,7 +1023,7 @@ static int am_store_policy_result_element(am_request_t *request, struct am_polic
     
     size_t resource_len = strlen(element->resource);
     size_t policy_len = sizeof(struct am_cache_entry_data) + resource_len + 1;
-    struct am_cache_entry_data *policy = am_shm_alloc_with_gc(cache, policy_len, am_purge_caches_to_now, request->instance_id);
+    struct am_cache_entry_data *policy = cache_alloc(request->instance_id, policy_len);
     cache_entry = AM_GET_POINTER(cache->pool, cache_entry_offset);
     
     if (policy == NULL) {
@@ -765,7 +1045,7 @@ static int am_store_policy_result_element(am_request_t *request, struct am_polic
     /* add response attributes */
     AM_LIST_FOR_EACH(element->response_attributes, rae, rat) {
         size_t attr_len = sizeof(struct am_cache_entry_data) + rae->ns + rae->vs + 2;
-        struct am_cache_entry_data *attr = am_shm_alloc_with_gc(cache, attr_len, am_purge_caches_to_now, request->instance_id);
+        struct am_cache_entry_data *attr = cache_alloc(request->instance_id, attr_len);
         cache_entry = AM_GET_POINTER(cache->pool, cache_entry_offset);
         
         if (attr == NULL) {
@@ -790,7 +1070,7 @@ static int am_store_policy_result_element(am_request_t *request, struct am_polic
         {
             /* add action decision */
             size_t action_decision_len = sizeof(struct am_cache_entry_data);
-            struct am_cache_entry_data *action_decision = am_shm_alloc_with_gc(cache, action_decision_len, am_purge_caches_to_now, request->instance_id);
+            struct am_cache_entry_data *action_decision = cache_alloc(request->instance_id, action_decision_len);
             cache_entry = AM_GET_POINTER(cache->pool, cache_entry_offset);
             
             if (action_decision == NULL) {
@@ -815,7 +1095,7 @@ static int am_store_policy_result_element(am_request_t *request, struct am_polic
         AM_LIST_FOR_EACH(ae->advices, aee, att) {
             /* add advices */
             size_t advice_len = sizeof(struct am_cache_entry_data) + aee->ns + aee->vs + 2;
-            struct am_cache_entry_data *advice = am_shm_alloc_with_gc(cache, advice_len, am_purge_caches_to_now, request->instance_id);
+            struct am_cache_entry_data *advice = cache_alloc(request->instance_id, advice_len);
             cache_entry = AM_GET_POINTER(cache->pool, cache_entry_offset);
             
             if (advice == NULL) {
@@ -839,7 +1119,7 @@ static int am_store_policy_result_element(am_request_t *request, struct am_polic
     /* add response decisions (profile attributes) */
     AM_LIST_FOR_EACH(element->response_decisions, rde, rdt) {
         size_t profile_attr_len = sizeof(struct am_cache_entry_data) + rde->ns + rde->vs + 2;
-        struct am_cache_entry_data *profile_attr = am_shm_alloc_with_gc(cache, profile_attr_len, am_purge_caches_to_now, request->instance_id);
+        struct am_cache_entry_data *profile_attr = cache_alloc(request->instance_id, profile_attr_len);
         cache_entry = AM_GET_POINTER(cache->pool, cache_entry_offset);
 
         if (profile_attr == NULL) {
@@ -926,6 +1206,115 @@ static int am_merge_session_policy_cache_entry(am_request_t *request, const char
     return status;
 }
 
+/**
+ * Pick an eviction victim out of AM_CACHE_EVICTION_SAMPLES session entries of the instance:
+ * the least frequently used one (the one to expire first on a tie). Post data preservation and
+ * policy change entries are never evicted. The function must be called while holding the mutex (am_shm_lock).
+ */
+static struct am_cache_entry *find_cache_victim(struct am_cache *cache_data, unsigned long instance_id,
+        unsigned int start, int *victim_index, int *victim_frequency) {
+    struct am_cache_entry *cache_entry, *tmp, *head, *victim = NULL;
+    unsigned int i, n = 0;
+
+    for (i = 0; i < AM_HASH_TABLE_SIZE && n < AM_CACHE_EVICTION_SAMPLES; i++) {
+        int entry_index = (start + i) % AM_HASH_TABLE_SIZE;
+        head = (struct am_cache_entry *) AM_GET_POINTER(cache->pool, cache_data->table[entry_index].prev);
+        AM_OFFSET_LIST_FOR_EACH(cache->pool, head, cache_entry, tmp, struct am_cache_entry) {
+            char *key = AM_GET_POINTER(cache->pool, cache_entry->key_offset);
+            struct am_cache_entry_data *data = cache_entry->data.prev != 0 ?
+                    (struct am_cache_entry_data *) AM_GET_POINTER(cache->pool, cache_entry->data.prev) : NULL;
+            int frequency;
+
+            if (cache_entry->instance_id != instance_id || strcmp(key, AM_POLICY_CHANGE_KEY) == 0
+                    || (data != NULL && data->type == AM_CACHE_PDP)) {
+                continue;
+            }
+            frequency = sketch_estimate(cache_data, am_hash(key));
+            if (victim == NULL || frequency < *victim_frequency || (frequency == *victim_frequency
+                    && cache_entry->ts + cache_entry->valid < victim->ts + victim->valid)) {
+                victim = cache_entry;
+                *victim_index = entry_index;
+                *victim_frequency = frequency;
+            }
+            n++;
+        }
+    }
+    return victim;
+}
+
+/**
+ * Make room for a new session entry within the instance cache quota. Expired entries of the instance
+ * are removed first, then the least frequently used ones - unless (with admission enabled) the new
+ * key is not used more often than the eviction victim.
+ * The function must be called while holding the mutex (am_shm_lock).
+ *
+ * @return AM_TRUE if the entry is to be cached
+ */
+static int admit_cache_entry(am_request_t *request, unsigned int key_hash) {
+    struct am_cache *cache_data = get_cache_header_data();
+    struct am_cache_instance *c = get_cache_instance(cache_data, request->instance_id);
+    int purged = AM_FALSE, evicted = 0;
+
+    if (c == NULL) {
+        return AM_TRUE;
+    }
+    c->stats.quota = request->conf->cache_quota > 0 ? (uint64_t) request->conf->cache_quota * 1024 : 0;
+    c->admission = request->conf->cache_admission;
+
+    while (c->stats.quota > 0 && c->stats.size >= c->stats.quota) {
+        struct am_cache_entry *victim;
+        int victim_index = 0, victim_frequency = 0;
+
+        if (!purged) {
+            purge_cache_entries(cache_data, &request->instance_id, time(NULL));
+            purged = AM_TRUE;
+            continue;
+        }
+        victim = evicted < AM_CACHE_EVICTION_SAMPLES ? find_cache_victim(cache_data, request->instance_id,
+                key_hash, &victim_index, &victim_frequency) : NULL;
+        if (victim == NULL || (c->admission && sketch_estimate(cache_data, key_hash) <= victim_frequency)) {
+            c->stats.rejected++;
+            am_stats_add(AM_STATS_CACHE_REJECTED, 1);
+            return AM_FALSE;
+        }
+        if (delete_cache_entry(victim_index, victim) != AM_SUCCESS) {
+            c->stats.rejected++;
+            am_stats_add(AM_STATS_CACHE_REJECTED, 1);
+            return AM_FALSE;
+        }
+        free_cache_entry(victim);
+        cache_data->count--;
+        c->stats.evicted++;
+        am_stats_add(AM_STATS_CACHE_EVICTED, 1);
+        evicted++;
+    }
+    c->stats.admitted++;
+    am_stats_add(AM_STATS_CACHE_ADMITTED, 1);
+    return AM_TRUE;
+}
+
+/**
+ * Get per instance cache counters.
+ *
+ * @return number of instances reported
+ */
+int am_cache_stats(am_cache_stats_t *out, int size) {
+    struct am_cache *cache_data;
+    int i, n = 0;
+
+    if (out == NULL || size <= 0 || am_shm_lock(cache) != AM_SUCCESS) {
+        return 0;
+    }
+    cache_data = get_cache_header_data();
+    for (i = 0; cache_data != NULL && i < AM_MAX_INSTANCES && n < size; i++) {
+        if (cache_data->instance[i].used) {
+            out[n++] = cache_data->instance[i].stats;
+        }
+    }
+    am_shm_unlock(cache);
+    return n;
+}
+
 /* 
  * Add session/policy response cache entry (key: session token).
  */
@@ -967,7 +1356,14 @@ int am_add_session_policy_cache_entry(am_request_t *request, const char *key,
         return status;
     }
 
-    cache_entry = am_shm_alloc_with_gc(cache, sizeof(struct am_cache_entry), am_purge_caches_to_now, request->instance_id);
+    if (!admit_cache_entry(request, key_hash)) {
+        AM_LOG_DEBUG(request->instance_id, "%s cache entry (%s) is not admitted, instance cache quota is %d KB",
+                thisfunc, key, request->conf->cache_quota);
+        am_shm_unlock(cache);
+        return AM_ENOMEM;
+    }
+
+    cache_entry = cache_alloc(request->instance_id, sizeof(struct am_cache_entry));
     if (cache_entry == NULL) {
         AM_LOG_DEBUG(request->instance_id, "%s failed to allocate %ld bytes",
                 thisfunc, sizeof(struct am_cache_entry));
@@ -987,12 +1383,12 @@ int am_add_session_policy_cache_entry(am_request_t *request, const char *key,
     cache_entry->instance_id = request->instance_id;
     
     key_sz = strlen(key);
-    cache_entry_key = am_shm_alloc_with_gc(cache, key_sz + 1, am_purge_caches_to_now, request->instance_id);
+    cache_entry_key = cache_alloc(request->instance_id, key_sz + 1);
     if (cache_entry_key == NULL) {
         AM_LOG_DEBUG(request->instance_id, "%s failed to allocate %ld bytes",
                      thisfunc, key_sz + 1);
+        cache_free(request->instance_id, cache_entry);
         am_shm_unlock(cache);
-        am_shm_free(cache, cache_entry);
         return AM_ENOMEM;
     }
     cache_entry = AM_GET_POINTER(cache->pool, cache_entry_offset);
@@ -1004,9 +1400,9 @@ int am_add_session_policy_cache_entry(am_request_t *request, const char *key,
 
     cache_data = get_cache_header_data();
     if (cache_data == NULL) {
+        cache_free(request->instance_id, cache_entry_key);
+        cache_free(request->instance_id, cache_entry);
         am_shm_unlock(cache);
-        am_shm_free(cache, cache_entry_key);
-        am_shm_free(cache, cache_entry);
         return AM_ENOMEM;
     }
     
@@ -1018,7 +1414,7 @@ int am_add_session_policy_cache_entry(am_request_t *request, const char *key,
         
         AM_LIST_FOR_EACH(session, element, tmp) {
             size_t session_attr_len = sizeof(struct am_cache_entry_data) +element->ns + element->vs + 2;
-            struct am_cache_entry_data *session_attr = am_shm_alloc_with_gc(cache, session_attr_len, am_purge_caches_to_now, request->instance_id);
+            struct am_cache_entry_data *session_attr = cache_alloc(request->instance_id, session_attr_len);
             cache_entry = AM_GET_POINTER(cache->pool, cache_entry_offset);
             if (session_attr == NULL) {
                 AM_LOG_DEBUG(request->instance_id, "%s failed to allocate %ld bytes", thisfunc, session_attr_len);
@@ -1110,8 +1506,7 @@ int am_get_policy_cache_entry(am_request_t *request, const char *key, time_t ref
             AM_LOG_WARNING(request->instance_id, "%s data for a key (%s) is obsolete (created: %s, valid until: %s)",
                     thisfunc, key, tsc, tsu);
             if (!delete_cache_entry(entry_index, cache_entry)) {
-                am_shm_free(cache, AM_GET_POINTER(cache->pool, cache_entry->key_offset));
-                am_shm_free(cache, cache_entry);
+                free_cache_entry(cache_entry);
                 cache_data->count--;
             }
             am_shm_unlock(cache);
@@ -1165,6 +1560,9 @@ int am_add_policy_cache_entry(am_request_t *r, const char *key, int valid) {
     cache_entry = get_cache_entry(key, NULL);
     if (cache_entry != NULL) {
         /* policy-change cache entry exists - update timestamp data */
+        size_t size = am_shm_size(cache_entry) + am_shm_size(AM_GET_POINTER(cache->pool, cache_entry->key_offset));
+        cache_charge(cache_entry->instance_id, size, AM_FALSE);
+        cache_charge(r->instance_id, size, AM_TRUE);
         cache_entry->ts = time(NULL);
         cache_entry->valid = 0;
         cache_entry->instance_id = r->instance_id;
@@ -1172,7 +1570,7 @@ int am_add_policy_cache_entry(am_request_t *r, const char *key, int valid) {
         return AM_SUCCESS;
     }
 
-    cache_entry = am_shm_alloc_with_gc(cache, sizeof(struct am_cache_entry), am_purge_caches_to_now, r->instance_id);
+    cache_entry = cache_alloc(r->instance_id, sizeof(struct am_cache_entry));
     if (cache_entry == NULL) {
         AM_LOG_DEBUG(r->instance_id, "%s failed to allocate %ld bytes",
                 thisfunc, sizeof(struct am_cache_entry));
@@ -1186,12 +1584,12 @@ int am_add_policy_cache_entry(am_request_t *r, const char *key, int valid) {
     cache_entry->instance_id = r->instance_id;
     
     key_sz = strlen(key);
-    cache_entry_key = am_shm_alloc_with_gc(cache, key_sz + 1, am_purge_caches_to_now, r->instance_id);
+    cache_entry_key = cache_alloc(r->instance_id, key_sz + 1);
     if (cache_entry_key == NULL) {
         AM_LOG_DEBUG(r->instance_id, "%s failed to allocate %ld bytes",
                      thisfunc, key_sz + 1);
+        cache_free(r->instance_id, cache_entry);
         am_shm_unlock(cache);
-        am_shm_free(cache, cache_entry);
         return AM_ENOMEM;
     }
     cache_entry = AM_GET_POINTER(cache->pool, cache_entry_offset);
@@ -1203,9 +1601,9 @@ int am_add_policy_cache_entry(am_request_t *r, const char *key, int valid) {
     
     cache_data = get_cache_header_data();
     if (cache_data == NULL) {
+        cache_free(r->instance_id, cache_entry_key);
+        cache_free(r->instance_id, cache_entry);
         am_shm_unlock(cache);
-        am_shm_free(cache, cache_entry_key);
-        am_shm_free(cache, cache_entry);
         return AM_ENOMEM;
     }
     
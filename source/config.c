@@ -19,132 +19,13 @@
 #include "utility.h"
 #include "list.h"
 #include "net_client.h"
-
-#define MAKE_TYPE(t,s) (s << 16 | t)
-#define GET_TYPE(r)    (r & 0xFFFF)
-#define GET_SIZE(r)    (r >> 16)
+#include "thread.h"
 
 enum {
-    AM_CONF_ALL = 0,
-    AM_CONF_BOOT,
+    AM_CONF_BOOT = 1,
     AM_CONF_REMOTE
 };
 
-enum {
-    AM_CONF_LOCAL = 1,
-    AM_CONF_PDP_DIR,
-    AM_CONF_NAMING_URL,
-    AM_CONF_REALM,
-    AM_CONF_USER,
-    AM_CONF_PASSWORD,
-    AM_CONF_KEY,
-    AM_CONF_DEBUG,
-    AM_CONF_DEBUG_LEVEL,
-    AM_CONF_DEBUG_FILE,
-    AM_CONF_AUDIT,
-    AM_CONF_AUDIT_LEVEL,
-    AM_CONF_AUDIT_FILE,
-    AM_CONF_CERT_KEY_FILE,
-    AM_CONF_CERT_KEY_PASS,
-    AM_CONF_CERT_FILE,
-    AM_CONF_CERT_CA_FILE,
-    AM_CONF_CIPHERS,
-    AM_CONF_TLS_OPTIONS,
-    AM_CONF_CERT_TRUST,
-    AM_CONF_NET_TIMEOUT,
-    AM_CONF_VALID_LEVEL,
-    AM_CONF_VALID_PING,
-    AM_CONF_VALID_PING_MISS,
-    AM_CONF_VALID_PING_OK,
-    AM_CONF_VALID_DEFAULT_IDX,
-    AM_CONF_HOST_MAP,
-    AM_CONF_RETRY_MAX,
-    AM_CONF_RETRY_WAIT,
-    AM_CONF_AGENT_URI,
-    AM_CONF_COOKIE,
-    AM_CONF_LOGIN_URL,
-    AM_CONF_COOKIE_SECURE,
-    AM_CONF_NOTIF_ENABLE,
-    AM_CONF_NOTIF_URL,
-    AM_CONF_EVAL_CASE,
-    AM_CONF_POLICY_CACHE_VALID,
-    AM_CONF_TOKEN_CACHE_VALID,
-    AM_CONF_UID_PARAM,
-    AM_CONF_UID_PARAM_TYPE,
-    AM_CONF_PROF_ATTR,
-    AM_CONF_PROF_ATTR_MAP,
-    AM_CONF_SESS_ATTR,
-    AM_CONF_SESS_ATTR_MAP,
-    AM_CONF_RESP_ATTR,
-    AM_CONF_RESP_ATTR_MAP,
-    AM_CONF_LB_ENABLE,
-    AM_CONF_SSO_ONLY,
-    AM_CONF_ACC_DENIED,
-    AM_CONF_FQDN_CHECK,
-    AM_CONF_FQDN_DEFAULT,
-    AM_CONF_FQDN_MAP,
-    AM_CONF_COOKIE_RESET,
-    AM_CONF_COOKIE_RESET_MAP,
-    AM_CONF_NEF_INVERT,
-    AM_CONF_NEF_ATTR,
-    AM_CONF_NEF_MAP,
-    AM_CONF_NEF_IP_MAP,
-    AM_CONF_NEF_EXT_MAP,
-    AM_CONF_PDP,
-    AM_CONF_PDP_LBCOOKIE,
-    AM_CONF_PDP_CACHE,
-    AM_CONF_PDP_JS,
-    AM_CONF_PDP_SMODE,
-    AM_CONF_PDP_SVALUE,
-    AM_CONF_PDP_PREFIX,
-    AM_CONF_IP_VALIDATE,
-    AM_CONF_COOKIE_PREFIX,
-    AM_CONF_COOKIE_MAXAGE,
-    AM_CONF_CDSSO,
-    AM_CONF_CDSSO_LOGIN_MAP,
-    AM_CONF_CDSSO_COOKIE_MAP,
-    AM_CONF_LOGOUT_COOKIE_MAP,
-    AM_CONF_LOGOUT_REDIRECT,
-    AM_CONF_LOGOUT_MAP,
-    AM_CONF_AMLOGOUT_MAP,
-    AM_CONF_SCOPE,
-    AM_CONF_CRESOLVE,
-    AM_CONF_PE_ENC_CHARS,
-    AM_CONF_CK_ENC_CHARS,
-    AM_CONF_OV_PROTO,
-    AM_CONF_OV_HOST,
-    AM_CONF_OV_PORT,
-    AM_CONF_OV_NURL,
-    AM_CONF_VALID,
-    AM_CONF_PASS_REPLY_KEY,
-    AM_CONF_POL_CSKEW,
-    AM_CONF_URL_REDIR_PARAM,
-    AM_CONF_CACHE_HEADERS,
-    AM_CONF_REDIRECT_ADVICE,
-    AM_CONF_CLIENT_IP_HEADER,
-    AM_CONF_CLIENT_HOST_HEADER,
-    AM_CONF_URL_CHECK,
-    AM_CONF_CONDLOGIN_MAP,
-    AM_CONF_HTTP_ONLY_COOKIE,
-    AM_CONF_ATTR_SEP,
-    AM_CONF_WIN_LOGON,
-    AM_CONF_WIN_PASS_HEADER,
-    AM_CONF_JSON_URL_MAP,
-    AM_CONF_NEF_REGEX_ENABLE,
-    AM_CONF_NEF_EXT_REGEX_ENABLE,
-    AM_CONF_LOGOUT_REGEX_ENABLE,
-    AM_CONF_LOGOUT_URL_REGEX,
-    AM_CONF_LOGOUT_REDIR_DISABLE,
-    AM_CONF_AUDIT_REMOTE_FILE,
-    AM_CONF_AUDIT_REMOTE_INTERVAL,
-    AM_CONF_AUDIT_FILE_DISPOSITION,
-    AM_CONF_ANON_USER_ENABLE,
-    AM_CONF_ANON_USER_ID,
-    AM_CONF_PATHINFO_IGNORE,
-    AM_CONF_PATHINFO_IGNORE_NOTENFORCED,
-    AM_CONF_KEEPALIVE_DISABLE
-};
-
 struct am_instance {
     struct offset_list list; /* list of instance configurations */
 };
@@ -155,18 +36,12 @@ struct am_instance_entry {
     char token[AM_MAX_TOKEN_LENGTH];
     char name[AM_HASH_TABLE_KEY_SIZE]; /* agent id */
     char config[AM_PATH_SIZE]; /* config file name */
-    struct offset_list data; /* agent configuration data */
+    unsigned int image; /* agent configuration image offset */
+    size_t image_size;
+    time_t refresh; /* background configuration refresh start time (0: not running) */
     struct offset_list lh;
 };
 
-struct am_instance_entry_data {
-    long type; /* low byte: type; high byte: optional map/list size */
-    int num_value;
-    size_t size[2];
-    struct offset_list lh;
-    char value[1]; /* format: key\0value\0 */
-};
-
 static am_shm_t *conf = NULL;
 
 int am_configuration_init(int id) {
@@ -225,16 +100,14 @@ static struct am_instance_entry *get_instance_entry(unsigned long instance_id) {
 
 static int delete_instance_entry(struct am_instance_entry *e) {
     int rv = 0;
-    struct am_instance_entry_data *i, *t, *h;
     struct am_instance *instance_data = get_instance_data();
 
     if (e == NULL || instance_data == NULL) return AM_EINVAL;
 
     /* cleanup instance entry data */
-    h = (struct am_instance_entry_data *) AM_GET_POINTER(conf->pool, e->data.prev);
-
-    AM_OFFSET_LIST_FOR_EACH(conf->pool, h, i, t, struct am_instance_entry_data) {
-        am_shm_free(conf, i);
+    if (e->image != 0) {
+        am_shm_free(conf, AM_GET_POINTER(conf->pool, e->image));
+        e->image = 0;
     }
 
     /* remove a node from a doubly linked list */
@@ -252,6 +125,18 @@ static int delete_instance_entry(struct am_instance_entry *e) {
     return rv;
 }
 
+/**
+ * Remove instance entry and its agent session. Must be called with the configuration
+ * shared memory locked.
+ */
+static void remove_instance_entry(struct am_instance_entry *e) {
+    am_remove_cache_entry(e->instance_id, e->token); /* delete cached agent session data */
+    am_agent_init_set_value(e->instance_id, AM_TRUE, AM_FALSE); /* set this instance to 'unconfigured' */
+    if (delete_instance_entry(e) == AM_SUCCESS) { /* remove cached configuration data */
+        am_shm_free(conf, e);
+    }
+}
+
 void remove_agent_instance_byname(const char *name) {
     struct am_instance_entry *e, *t, *h;
     struct am_instance *instance_data;
@@ -272,993 +157,633 @@ void remove_agent_instance_byname(const char *name) {
 
     AM_OFFSET_LIST_FOR_EACH(conf->pool, h, e, t, struct am_instance_entry) {
         if (strcasecmp(e->name, name) == 0) {
-            am_remove_cache_entry(e->instance_id, e->token); /* delete cached agent session data */
-            am_agent_init_set_value(e->instance_id, AM_TRUE, AM_FALSE); /* set this instance to 'unconfigured' */
-            if (delete_instance_entry(e) == AM_SUCCESS) { /* remove cached configuration data */
-                am_shm_free(conf, e);
-            }
+            remove_instance_entry(e);
         }
     }
     am_shm_unlock(conf);
 }
 
-#define HEADER_FROM_OFFSET(shm, offset) ((struct offset_list *)AM_GET_POINTER((shm)->pool, offset))
-
-#define SAVE_NUM_VALUE(shm, hdr_offset, t, v) \
-    do {\
-        struct am_instance_entry_data *x = am_shm_alloc(shm, sizeof (struct am_instance_entry_data));\
-        if (x == NULL) return AM_ENOMEM;\
-        x->type = t;\
-        x->num_value = v;\
-        x->size[0] = x->size[1] = 0;\
-        x->lh.next = x->lh.prev = 0;\
-        AM_OFFSET_LIST_INSERT(shm->pool, x, HEADER_FROM_OFFSET(shm, hdr_offset), struct am_instance_entry_data);\
-    } while(0)
-
-#define SAVE_CHAR_VALUE(shm, hdr_offset, t, v) \
-    do {\
-        size_t sz = strlen(v);\
-        struct am_instance_entry_data *x = am_shm_alloc(shm, sizeof (struct am_instance_entry_data) + sz + 1);\
-        if (x == NULL) return AM_ENOMEM;\
-        x->type = t;\
-        x->num_value = 0;\
-        x->size[0] = sz; x->size[1] = 0;\
-        memcpy(x->value, v, x->size[0]);\
-        x->value[x->size[0]] = 0;\
-        x->lh.next = x->lh.prev = 0;\
-        AM_OFFSET_LIST_INSERT(shm->pool, x, HEADER_FROM_OFFSET(shm, hdr_offset), struct am_instance_entry_data);\
-    } while(0)
-
-#define SAVE_CHAR2_VALUE(shm, hdr_offset, t, v, k) \
-    do {\
-        size_t sz = strlen(v);\
-        size_t kz = strlen(k);\
-        struct am_instance_entry_data *x = am_shm_alloc(shm, sizeof (struct am_instance_entry_data) + sz + kz + 2);\
-        if (x == NULL) return AM_ENOMEM;\
-        x->type = t;\
-        x->num_value = 0;\
-        x->size[0] = sz; x->size[1] = kz;\
-        memcpy(x->value, v, x->size[0]);\
-        x->value[x->size[0]] = 0;\
-        memcpy(x->value + x->size[0] + 1, k, x->size[1]);\
-        x->value[x->size[0] + x->size[1] + 1] = 0;\
-        x->lh.next = x->lh.prev = 0;\
-        AM_OFFSET_LIST_INSERT(shm->pool, x, HEADER_FROM_OFFSET(shm, hdr_offset), struct am_instance_entry_data);\
-    } while(0)
-
-static int am_create_instance_entry_data(int h, am_config_t *c, char all) {
-    int i;
+/*
+ * Agent configuration image.
+ *
+ * Configuration of an agent instance is stored in shared memory as one contiguous,
+ * position independent block:
+ *
+ *   header | field table | item arrays | string pool
+ *
+ * The field table has one entry per config_fields[] descriptor (in table order) and holds
+ * either a number or an image offset of a string or of an item array (string offsets for
+ * string lists, values for number lists and name/value string offset pairs for maps).
+ * Offset 0 stands for "not set". Any change in config_fields[] or in the layout itself
+ * requires AM_CONFIG_IMAGE_VERSION to be bumped.
+ */
 
-    if (all == AM_CONF_ALL || all == AM_CONF_BOOT) {
+#define AM_CONFIG_IMAGE_MAGIC 0x49434D41 /* AMCI */
+#define AM_CONFIG_IMAGE_VERSION 4
 
-        if (c->local > 0) {
-            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_LOCAL, 0), c->local);
-        }
-        if (ISVALID(c->pdp_dir)) {
-            SAVE_CHAR_VALUE(conf, h, MAKE_TYPE(AM_CONF_PDP_DIR, 0), c->pdp_dir);
-        }
-        if (c->naming_url_sz > 0 && c->naming_url != NULL) {
-            for (i = 0; i < c->naming_url_sz; i++) {
-                SAVE_CHAR_VALUE(conf, h, MAKE_TYPE(AM_CONF_NAMING_URL, c->naming_url_sz), c->naming_url[i]);
-            }
-        }
-        if (ISVALID(c->realm)) {
-            SAVE_CHAR_VALUE(conf, h, MAKE_TYPE(AM_CONF_REALM, 0), c->realm);
-        }
-        if (ISVALID(c->user)) {
-            SAVE_CHAR_VALUE(conf, h, MAKE_TYPE(AM_CONF_USER, 0), c->user);
-        }
-        if (ISVALID(c->pass)) {
-            SAVE_CHAR_VALUE(conf, h, MAKE_TYPE(AM_CONF_PASSWORD, 0), c->pass);
-        }
-        if (ISVALID(c->key)) {
-            SAVE_CHAR_VALUE(conf, h, MAKE_TYPE(AM_CONF_KEY, 0), c->key);
-        }
-        if (c->debug > 0) {
-            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_DEBUG, 0), c->debug);
-        }
-        if (c->debug_level > 0) {
-            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_DEBUG_LEVEL, 0), c->debug_level);
-        }
-        if (ISVALID(c->debug_file)) {
-            SAVE_CHAR_VALUE(conf, h, MAKE_TYPE(AM_CONF_DEBUG_FILE, 0), c->debug_file);
-        }
-        if (c->audit > 0) {
-            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_AUDIT, 0), c->audit);
-        }
-        if (ISVALID(c->audit_file)) {
-            SAVE_CHAR_VALUE(conf, h, MAKE_TYPE(AM_CONF_AUDIT_FILE, 0), c->audit_file);
-        }
-        if (ISVALID(c->cert_key_file)) {
-            SAVE_CHAR_VALUE(conf, h, MAKE_TYPE(AM_CONF_CERT_KEY_FILE, 0), c->cert_key_file);
-        }
-        if (ISVALID(c->cert_key_pass)) {
-            SAVE_CHAR_VALUE(conf, h, MAKE_TYPE(AM_CONF_CERT_KEY_PASS, 0), c->cert_key_pass);
-        }
-        if (ISVALID(c->cert_file)) {
-            SAVE_CHAR_VALUE(conf, h, MAKE_TYPE(AM_CONF_CERT_FILE, 0), c->cert_file);
-        }
-        if (ISVALID(c->cert_ca_file)) {
-            SAVE_CHAR_VALUE(conf, h, MAKE_TYPE(AM_CONF_CERT_CA_FILE, 0), c->cert_ca_file);
-        }
-        if (ISVALID(c->ciphers)) {
-            SAVE_CHAR_VALUE(conf, h, MAKE_TYPE(AM_CONF_CIPHERS, 0), c->ciphers);
-        }
-        if (ISVALID(c->tls_opts)) {
-            SAVE_CHAR_VALUE(conf, h, MAKE_TYPE(AM_CONF_TLS_OPTIONS, 0), c->tls_opts);
-        }
-        if (c->cert_trust > 0) {
-            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_CERT_TRUST, 0), c->cert_trust);
-        }
-        if (c->net_timeout > 0) {
-            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_NET_TIMEOUT, 0), c->net_timeout);
-        }
-        if (c->valid_level > 0) {
-            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_VALID_LEVEL, 0), c->valid_level);
-        }
-        if (c->valid_ping > 0) {
-            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_VALID_PING, 0), c->valid_ping);
-        }
-        if (c->valid_ping_miss > 0) {
-            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_VALID_PING_MISS, 0), c->valid_ping_miss);
-        }
-        if (c->valid_ping_ok > 0) {
-            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_VALID_PING_OK, 0), c->valid_ping_ok);
-        }
-        if (c->valid_default_url_sz > 0 && c->valid_default_url != NULL) {
-            for (i = 0; i < c->valid_default_url_sz; i++) {
-                SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_VALID_DEFAULT_IDX, c->valid_default_url_sz), c->valid_default_url[i]);
-            }
-        }
-        if (c->hostmap_sz > 0 && c->hostmap != NULL) {
-            for (i = 0; i < c->hostmap_sz; i++) {
-                SAVE_CHAR_VALUE(conf, h, MAKE_TYPE(AM_CONF_HOST_MAP, c->hostmap_sz), c->hostmap[i]);
-            }
-        }
-        if (c->retry_max > 0) {
-            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_RETRY_MAX, 0), c->retry_max);
-        }
-        if (c->retry_wait > 0) {
-            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_RETRY_WAIT, 0), c->retry_wait);
-        }
-    }
+enum {
+    AM_CONF_IMAGE_NUM = 0,
+    AM_CONF_IMAGE_STR,
+    AM_CONF_IMAGE_STR_LIST,
+    AM_CONF_IMAGE_NUM_LIST,
+    AM_CONF_IMAGE_MAP
+};
 
-    if (all == AM_CONF_ALL || all == AM_CONF_REMOTE) {
+struct config_field {
+    int source; /* AM_CONF_BOOT: bootstrap or AM_CONF_REMOTE: agent profile value */
+    int type;
+    size_t offset;
+    size_t size_offset; /* list and map item count */
+};
 
-        if (ISVALID(c->agenturi)) {
-            SAVE_CHAR_VALUE(conf, h, MAKE_TYPE(AM_CONF_AGENT_URI, 0), c->agenturi);
-        }
-        if (ISVALID(c->cookie_name)) {
-            SAVE_CHAR_VALUE(conf, h, MAKE_TYPE(AM_CONF_COOKIE, 0), c->cookie_name);
-        }
-        if (c->login_url_sz > 0 && c->login_url != NULL) {
-            for (i = 0; i < c->login_url_sz; i++) {
-                am_config_map_t *v = &c->login_url[i];
-                if (ISVALID(v->name) && ISVALID(v->value)) {
-                    SAVE_CHAR2_VALUE(conf, h, MAKE_TYPE(AM_CONF_LOGIN_URL, c->login_url_sz), v->name, v->value);
-                }
-            }
-        }
-        if (c->cookie_secure > 0) {
-            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_COOKIE_SECURE, 0), c->cookie_secure);
-        }
-        if (c->notif_enable > 0) {
-            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_NOTIF_ENABLE, 0), c->notif_enable);
-        }
-        if (ISVALID(c->notif_url)) {
-            SAVE_CHAR_VALUE(conf, h, MAKE_TYPE(AM_CONF_NOTIF_URL, 0), c->notif_url);
-        }
-        if (c->url_eval_case_ignore > 0) {
-            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_EVAL_CASE, 0), c->url_eval_case_ignore);
-        }
-        if (c->policy_cache_valid > 0) {
-            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_POLICY_CACHE_VALID, 0), c->policy_cache_valid);
-        }
-        if (c->token_cache_valid > 0) {
-            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_TOKEN_CACHE_VALID, 0), c->token_cache_valid);
-        }
-        if (ISVALID(c->userid_param)) {
-            SAVE_CHAR_VALUE(conf, h, MAKE_TYPE(AM_CONF_UID_PARAM, 0), c->userid_param);
-        }
-        if (ISVALID(c->userid_param_type)) {
-            SAVE_CHAR_VALUE(conf, h, MAKE_TYPE(AM_CONF_UID_PARAM_TYPE, 0), c->userid_param_type);
-        }
-        if (c->profile_attr_fetch > 0) {
-            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_PROF_ATTR, 0), c->profile_attr_fetch);
-        }
-        if (c->profile_attr_map_sz > 0 && c->profile_attr_map != NULL) {
-            for (i = 0; i < c->profile_attr_map_sz; i++) {
-                am_config_map_t *v = &c->profile_attr_map[i];
-                if (ISVALID(v->name) && ISVALID(v->value)) {
-                    SAVE_CHAR2_VALUE(conf, h, MAKE_TYPE(AM_CONF_PROF_ATTR_MAP, c->profile_attr_map_sz), v->name, v->value);
-                }
-            }
-        }
-        if (c->session_attr_fetch > 0) {
-            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_SESS_ATTR, 0), c->session_attr_fetch);
-        }
-        if (c->session_attr_map_sz > 0 && c->session_attr_map != NULL) {
-            for (i = 0; i < c->session_attr_map_sz; i++) {
-                am_config_map_t *v = &c->session_attr_map[i];
-                if (ISVALID(v->name) && ISVALID(v->value)) {
-                    SAVE_CHAR2_VALUE(conf, h, MAKE_TYPE(AM_CONF_SESS_ATTR_MAP, c->session_attr_map_sz), v->name, v->value);
-                }
-            }
-        }
-        if (c->response_attr_fetch > 0) {
-            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_RESP_ATTR, 0), c->response_attr_fetch);
-        }
-        if (c->response_attr_map_sz > 0 && c->response_attr_map != NULL) {
-            for (i = 0; i < c->response_attr_map_sz; i++) {
-                am_config_map_t *v = &c->response_attr_map[i];
-                if (ISVALID(v->name) && ISVALID(v->value)) {
-                    SAVE_CHAR2_VALUE(conf, h, MAKE_TYPE(AM_CONF_RESP_ATTR_MAP, c->response_attr_map_sz), v->name, v->value);
-                }
-            }
-        }
-        if (c->lb_enable > 0) {
-            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_LB_ENABLE, 0), c->lb_enable);
-        }
-        if (c->keepalive_disable > 0) {
-            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_KEEPALIVE_DISABLE, 0), c->keepalive_disable);
-        }
-        if (c->sso_only > 0) {
-            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_SSO_ONLY, 0), c->sso_only);
-        }
-        if (ISVALID(c->access_denied_url)) {
-            SAVE_CHAR_VALUE(conf, h, MAKE_TYPE(AM_CONF_ACC_DENIED, 0), c->access_denied_url);
-        }
-        if (c->fqdn_check_enable > 0) {
-            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_FQDN_CHECK, 0), c->fqdn_check_enable);
-        }
-        if (ISVALID(c->fqdn_default)) {
-            SAVE_CHAR_VALUE(conf, h, MAKE_TYPE(AM_CONF_FQDN_DEFAULT, 0), c->fqdn_default);
-        }
-        if (c->fqdn_map_sz > 0 && c->fqdn_map != NULL) {
-            for (i = 0; i < c->fqdn_map_sz; i++) {
-                am_config_map_t *v = &c->fqdn_map[i];
-                if (ISVALID(v->name) && ISVALID(v->value)) {
-                    SAVE_CHAR2_VALUE(conf, h, MAKE_TYPE(AM_CONF_FQDN_MAP, c->fqdn_map_sz), v->name, v->value);
-                }
-            }
-        }
-        if (c->cookie_reset_enable > 0) {
-            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_COOKIE_RESET, 0), c->cookie_reset_enable);
-        }
-        if (c->cookie_reset_map_sz > 0 && c->cookie_reset_map != NULL) {
-            for (i = 0; i < c->cookie_reset_map_sz; i++) {
-                am_config_map_t *v = &c->cookie_reset_map[i];
-                if (ISVALID(v->name) && ISVALID(v->value)) {
-                    SAVE_CHAR2_VALUE(conf, h, MAKE_TYPE(AM_CONF_COOKIE_RESET_MAP, c->cookie_reset_map_sz), v->name, v->value);
-                }
-            }
-        }
-        if (c->not_enforced_invert > 0) {
-            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_NEF_INVERT, 0), c->not_enforced_invert);
-        }
-        if (c->not_enforced_fetch_attr > 0) {
-            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_NEF_ATTR, 0), c->not_enforced_fetch_attr);
-        }
-        if (c->not_enforced_map_sz > 0 && c->not_enforced_map != NULL) {
-            for (i = 0; i < c->not_enforced_map_sz; i++) {
-                am_config_map_t *v = &c->not_enforced_map[i];
-                if (ISVALID(v->name) && ISVALID(v->value)) {
-                    SAVE_CHAR2_VALUE(conf, h, MAKE_TYPE(AM_CONF_NEF_MAP, c->not_enforced_map_sz), v->name, v->value);
-                }
-            }
-        }
-        if (c->not_enforced_ext_map_sz > 0 && c->not_enforced_ext_map != NULL) {
-            for (i = 0; i < c->not_enforced_ext_map_sz; i++) {
-                am_config_map_t *v = &c->not_enforced_ext_map[i];
-                if (ISVALID(v->name) && ISVALID(v->value)) {
-                    SAVE_CHAR2_VALUE(conf, h, MAKE_TYPE(AM_CONF_NEF_EXT_MAP, c->not_enforced_ext_map_sz), v->name, v->value);
-                }
-            }
-        }
-        if (c->not_enforced_ip_map_sz > 0 && c->not_enforced_ip_map != NULL) {
-            for (i = 0; i < c->not_enforced_ip_map_sz; i++) {
-                am_config_map_t *v = &c->not_enforced_ip_map[i];
-                if (ISVALID(v->name) && ISVALID(v->value)) {
-                    SAVE_CHAR2_VALUE(conf, h, MAKE_TYPE(AM_CONF_NEF_IP_MAP, c->not_enforced_ip_map_sz), v->name, v->value);
-                }
-            }
-        }
-        if (c->not_enforced_regex_enable > 0) {
-            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_NEF_REGEX_ENABLE, 0), c->not_enforced_regex_enable);
-        }
-        if (c->not_enforced_ext_regex_enable > 0) {
-            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_NEF_EXT_REGEX_ENABLE, 0), c->not_enforced_ext_regex_enable);
-        }
-        if (c->logout_regex_enable > 0) {
-            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_LOGOUT_REGEX_ENABLE, 0), c->logout_regex_enable);
-        }
-        if (c->pdp_enable > 0) {
-            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_PDP, 0), c->pdp_enable);
-        }
-        if (ISVALID(c->pdp_lb_cookie)) {
-            SAVE_CHAR_VALUE(conf, h, MAKE_TYPE(AM_CONF_PDP_LBCOOKIE, 0), c->pdp_lb_cookie);
-        }
-        if (ISVALID(c->pdp_sess_mode)) {
-            SAVE_CHAR_VALUE(conf, h, MAKE_TYPE(AM_CONF_PDP_SMODE, 0), c->pdp_sess_mode);
-        }
-        if (ISVALID(c->pdp_sess_value)) {
-            SAVE_CHAR_VALUE(conf, h, MAKE_TYPE(AM_CONF_PDP_SVALUE, 0), c->pdp_sess_value);
-        }
-        if (ISVALID(c->pdp_uri_prefix)) {
-            SAVE_CHAR_VALUE(conf, h, MAKE_TYPE(AM_CONF_PDP_PREFIX, 0), c->pdp_uri_prefix);
-        }
-        if (c->pdp_cache_valid > 0) {
-            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_PDP_CACHE, 0), c->pdp_cache_valid);
-        }
-        if (c->pdp_js_repost > 0) {
-            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_PDP_JS, 0), c->pdp_js_repost);
-        }
-        if (c->client_ip_validate > 0) {
-            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_IP_VALIDATE, 0), c->client_ip_validate);
-        }
-        if (ISVALID(c->cookie_prefix)) {
-            SAVE_CHAR_VALUE(conf, h, MAKE_TYPE(AM_CONF_COOKIE_PREFIX, 0), c->cookie_prefix);
-        }
-        if (c->cookie_maxage > 0) {
-            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_COOKIE_MAXAGE, 0), c->cookie_maxage);
-        }
-        if (c->cdsso_enable > 0) {
-            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_CDSSO, 0), c->cdsso_enable);
-        }
-        if (c->cdsso_login_map_sz > 0 && c->cdsso_login_map != NULL) {
-            for (i = 0; i < c->cdsso_login_map_sz; i++) {
-                am_config_map_t *v = &c->cdsso_login_map[i];
-                if (ISVALID(v->name) && ISVALID(v->value)) {
-                    SAVE_CHAR2_VALUE(conf, h, MAKE_TYPE(AM_CONF_CDSSO_LOGIN_MAP, c->cdsso_login_map_sz), v->name, v->value);
-                }
-            }
-        }
-        if (c->cdsso_cookie_domain_map_sz > 0 && c->cdsso_cookie_domain_map != NULL) {
-            for (i = 0; i < c->cdsso_cookie_domain_map_sz; i++) {
-                am_config_map_t *v = &c->cdsso_cookie_domain_map[i];
-                if (ISVALID(v->name) && ISVALID(v->value)) {
-                    SAVE_CHAR2_VALUE(conf, h, MAKE_TYPE(AM_CONF_CDSSO_COOKIE_MAP, c->cdsso_cookie_domain_map_sz), v->name, v->value);
-                }
-            }
-        }
-        if (c->logout_cookie_reset_map_sz > 0 && c->logout_cookie_reset_map != NULL) {
-            for (i = 0; i < c->logout_cookie_reset_map_sz; i++) {
-                am_config_map_t *v = &c->logout_cookie_reset_map[i];
-                if (ISVALID(v->name) && ISVALID(v->value)) {
-                    SAVE_CHAR2_VALUE(conf, h, MAKE_TYPE(AM_CONF_LOGOUT_COOKIE_MAP, c->logout_cookie_reset_map_sz), v->name, v->value);
-                }
-            }
-        }
-        if (ISVALID(c->logout_redirect_url)) {
-            SAVE_CHAR_VALUE(conf, h, MAKE_TYPE(AM_CONF_LOGOUT_REDIRECT, 0), c->logout_redirect_url);
-        }
-        if (ISVALID(c->logout_url_regex)) {
-            SAVE_CHAR_VALUE(conf, h, MAKE_TYPE(AM_CONF_LOGOUT_URL_REGEX, 0), c->logout_url_regex);
-        }
-        if (c->logout_redirect_disable > 0) {
-            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_LOGOUT_REDIR_DISABLE, 0), c->logout_redirect_disable);
-        }
-        if (c->logout_map_sz > 0 && c->logout_map != NULL) {
-            for (i = 0; i < c->logout_map_sz; i++) {
-                am_config_map_t *v = &c->logout_map[i];
-                if (ISVALID(v->name) && ISVALID(v->value)) {
-                    SAVE_CHAR2_VALUE(conf, h, MAKE_TYPE(AM_CONF_LOGOUT_MAP, c->logout_map_sz), v->name, v->value);
+#define AM_CONF_FIELD(s, t, f) {s, t, offsetof(am_config_t, f), 0}
+#define AM_CONF_FIELD_LIST(s, t, f, n) {s, t, offsetof(am_config_t, f), offsetof(am_config_t, n)}
+
+static const struct config_field config_fields[] = {
+    AM_CONF_FIELD(AM_CONF_BOOT, AM_CONF_IMAGE_NUM, local),
+    AM_CONF_FIELD(AM_CONF_BOOT, AM_CONF_IMAGE_STR, pdp_dir),
+    AM_CONF_FIELD_LIST(AM_CONF_BOOT, AM_CONF_IMAGE_STR_LIST, naming_url, naming_url_sz),
+    AM_CONF_FIELD(AM_CONF_BOOT, AM_CONF_IMAGE_STR, realm),
+    AM_CONF_FIELD(AM_CONF_BOOT, AM_CONF_IMAGE_STR, user),
+    AM_CONF_FIELD(AM_CONF_BOOT, AM_CONF_IMAGE_STR, pass),
+    AM_CONF_FIELD(AM_CONF_BOOT, AM_CONF_IMAGE_STR, key),
+    AM_CONF_FIELD(AM_CONF_BOOT, AM_CONF_IMAGE_NUM, debug),
+    AM_CONF_FIELD(AM_CONF_BOOT, AM_CONF_IMAGE_NUM, debug_level),
+    AM_CONF_FIELD(AM_CONF_BOOT, AM_CONF_IMAGE_STR, debug_file),
+    AM_CONF_FIELD(AM_CONF_BOOT, AM_CONF_IMAGE_NUM, audit),
+    AM_CONF_FIELD(AM_CONF_BOOT, AM_CONF_IMAGE_STR, audit_file),
+    AM_CONF_FIELD(AM_CONF_BOOT, AM_CONF_IMAGE_STR, cert_key_file),
+    AM_CONF_FIELD(AM_CONF_BOOT, AM_CONF_IMAGE_STR, cert_key_pass),
+    AM_CONF_FIELD(AM_CONF_BOOT, AM_CONF_IMAGE_STR, cert_file),
+    AM_CONF_FIELD(AM_CONF_BOOT, AM_CONF_IMAGE_STR, cert_ca_file),
+    AM_CONF_FIELD(AM_CONF_BOOT, AM_CONF_IMAGE_STR, ciphers),
+    AM_CONF_FIELD(AM_CONF_BOOT, AM_CONF_IMAGE_STR, tls_opts),
+    AM_CONF_FIELD(AM_CONF_BOOT, AM_CONF_IMAGE_NUM, cert_trust),
+    AM_CONF_FIELD(AM_CONF_BOOT, AM_CONF_IMAGE_NUM, net_timeout),
+    AM_CONF_FIELD(AM_CONF_BOOT, AM_CONF_IMAGE_NUM, valid_level),
+    AM_CONF_FIELD(AM_CONF_BOOT, AM_CONF_IMAGE_NUM, valid_ping),
+    AM_CONF_FIELD(AM_CONF_BOOT, AM_CONF_IMAGE_NUM, valid_ping_miss),
+    AM_CONF_FIELD(AM_CONF_BOOT, AM_CONF_IMAGE_NUM, valid_ping_ok),
+    AM_CONF_FIELD_LIST(AM_CONF_BOOT, AM_CONF_IMAGE_NUM_LIST, valid_default_url, valid_default_url_sz),
+    AM_CONF_FIELD_LIST(AM_CONF_BOOT, AM_CONF_IMAGE_STR_LIST, hostmap, hostmap_sz),
+    AM_CONF_FIELD(AM_CONF_BOOT, AM_CONF_IMAGE_NUM, retry_max),
+    AM_CONF_FIELD(AM_CONF_BOOT, AM_CONF_IMAGE_NUM, retry_wait),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_STR, agenturi),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_STR, cookie_name),
+    AM_CONF_FIELD_LIST(AM_CONF_REMOTE, AM_CONF_IMAGE_MAP, login_url, login_url_sz),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_NUM, cookie_secure),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_NUM, notif_enable),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_STR, notif_url),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_NUM, url_eval_case_ignore),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_NUM, policy_cache_valid),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_NUM, token_cache_valid),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_STR, userid_param),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_STR, userid_param_type),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_NUM, profile_attr_fetch),
+    AM_CONF_FIELD_LIST(AM_CONF_REMOTE, AM_CONF_IMAGE_MAP, profile_attr_map, profile_attr_map_sz),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_NUM, session_attr_fetch),
+    AM_CONF_FIELD_LIST(AM_CONF_REMOTE, AM_CONF_IMAGE_MAP, session_attr_map, session_attr_map_sz),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_NUM, response_attr_fetch),
+    AM_CONF_FIELD_LIST(AM_CONF_REMOTE, AM_CONF_IMAGE_MAP, response_attr_map, response_attr_map_sz),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_NUM, lb_enable),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_NUM, keepalive_disable),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_NUM, log_sync),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_NUM, log_rate),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_NUM, log_overflow_drop),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_NUM, log_deferred),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_STR, log_format),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_NUM, log_segment_size),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_NUM, log_compress_disable),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_NUM, log_retain_files),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_NUM, log_retain_size),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_STR, status_url),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_NUM, sso_only),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_STR, access_denied_url),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_NUM, fqdn_check_enable),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_STR, fqdn_default),
+    AM_CONF_FIELD_LIST(AM_CONF_REMOTE, AM_CONF_IMAGE_MAP, fqdn_map, fqdn_map_sz),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_NUM, cookie_reset_enable),
+    AM_CONF_FIELD_LIST(AM_CONF_REMOTE, AM_CONF_IMAGE_MAP, cookie_reset_map, cookie_reset_map_sz),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_NUM, not_enforced_invert),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_NUM, not_enforced_fetch_attr),
+    AM_CONF_FIELD_LIST(AM_CONF_REMOTE, AM_CONF_IMAGE_MAP, not_enforced_map, not_enforced_map_sz),
+    AM_CONF_FIELD_LIST(AM_CONF_REMOTE, AM_CONF_IMAGE_MAP, not_enforced_ext_map, not_enforced_ext_map_sz),
+    AM_CONF_FIELD_LIST(AM_CONF_REMOTE, AM_CONF_IMAGE_MAP, not_enforced_ip_map, not_enforced_ip_map_sz),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_NUM, not_enforced_regex_enable),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_NUM, not_enforced_ext_regex_enable),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_NUM, logout_regex_enable),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_NUM, pdp_enable),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_STR, pdp_lb_cookie),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_STR, pdp_sess_mode),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_STR, pdp_sess_value),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_STR, pdp_uri_prefix),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_NUM, pdp_cache_valid),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_NUM, pdp_js_repost),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_NUM, pdp_max_size),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_NUM, cache_quota),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_NUM, cache_admission),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_NUM, client_ip_validate),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_STR, cookie_prefix),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_NUM, cookie_maxage),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_NUM, cdsso_enable),
+    AM_CONF_FIELD_LIST(AM_CONF_REMOTE, AM_CONF_IMAGE_MAP, cdsso_login_map, cdsso_login_map_sz),
+    AM_CONF_FIELD_LIST(AM_CONF_REMOTE, AM_CONF_IMAGE_MAP, cdsso_cookie_domain_map, cdsso_cookie_domain_map_sz),
+    AM_CONF_FIELD_LIST(AM_CONF_REMOTE, AM_CONF_IMAGE_MAP, logout_cookie_reset_map, logout_cookie_reset_map_sz),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_STR, logout_redirect_url),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_STR, logout_url_regex),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_NUM, logout_redirect_disable),
+    AM_CONF_FIELD_LIST(AM_CONF_REMOTE, AM_CONF_IMAGE_MAP, logout_map, logout_map_sz),
+    AM_CONF_FIELD_LIST(AM_CONF_REMOTE, AM_CONF_IMAGE_MAP, openam_logout_map, openam_logout_map_sz),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_NUM, policy_scope_subtree),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_NUM, resolve_client_host),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_NUM, policy_eval_encode_chars),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_NUM, cookie_encode_chars),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_NUM, override_protocol),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_NUM, override_host),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_NUM, override_port),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_NUM, override_notif_url),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_NUM, config_valid),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_STR, password_replay_key),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_NUM, policy_clock_skew),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_STR, url_redirect_param),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_NUM, cache_control_enable),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_NUM, use_redirect_for_advice),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_STR, client_ip_header),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_STR, client_hostname_header),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_STR, url_check_regex),
+    AM_CONF_FIELD_LIST(AM_CONF_REMOTE, AM_CONF_IMAGE_MAP, cond_login_url, cond_login_url_sz),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_NUM, cookie_http_only),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_STR, multi_attr_separator),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_NUM, logon_user_enable),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_NUM, password_header_enable),
+    AM_CONF_FIELD_LIST(AM_CONF_REMOTE, AM_CONF_IMAGE_MAP, json_url_map, json_url_map_sz),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_NUM, audit_level),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_NUM, audit_remote_interval),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_STR, audit_file_remote),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_STR, audit_file_disposition),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_NUM, anon_remote_user_enable),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_STR, unauthenticated_user),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_NUM, path_info_ignore),
+    AM_CONF_FIELD(AM_CONF_REMOTE, AM_CONF_IMAGE_NUM, path_info_ignore_not_enforced),
+};
+
+#define AM_CONF_FIELDS (sizeof (config_fields) / sizeof (config_fields[0]))
+
+struct config_image_field {
+    uint32_t value; /* number or image offset */
+    uint32_t count; /* number of list/map items */
+};
+
+struct config_image {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size; /* total image size */
+    uint32_t fields;
+    uint64_t hash; /* of everything following the header */
+    struct config_image_field field[1];
+};
+
+#define AM_CONFIG_IMAGE_HEADER offsetof(struct config_image, field)
+
+struct config_image_writer {
+    char *base; /* NULL while the image size is calculated */
+    uint32_t items;
+    uint32_t pool;
+};
+
+static uint32_t image_items(struct config_image_writer *w, size_t size) {
+    uint32_t offset = w->items;
+    w->items += (uint32_t) size;
+    return offset;
+}
+
+static uint32_t image_string(struct config_image_writer *w, const char *value) {
+    size_t size = strlen(value) + 1;
+    uint32_t offset = w->pool;
+    if (w->base != NULL) {
+        memcpy(w->base + offset, value, size);
+    }
+    w->pool += (uint32_t) size;
+    return offset;
+}
+
+static void image_write_fields(struct config_image_writer *w, const am_config_t *boot, const am_config_t *remote) {
+    struct config_image *image = (struct config_image *) w->base;
+    unsigned int i;
+    int j;
+
+    for (i = 0; i < AM_CONF_FIELDS; i++) {
+        const struct config_field *f = &config_fields[i];
+        const char *c = (const char *) (f->source == AM_CONF_BOOT ? boot : remote);
+        const void *p = c + f->offset;
+        int count = f->size_offset != 0 ? *(const int *) (c + f->size_offset) : 0;
+        struct config_image_field v = {0, 0};
+
+        switch (f->type) {
+            case AM_CONF_IMAGE_NUM:
+                v.value = (uint32_t) *(const int *) p;
+                break;
+            case AM_CONF_IMAGE_STR:
+            {
+                const char *s = *(char * const *) p;
+                if (ISVALID(s)) {
+                    v.value = image_string(w, s);
                 }
             }
-        }
-        if (c->openam_logout_map_sz > 0 && c->openam_logout_map != NULL) {
-            for (i = 0; i < c->openam_logout_map_sz; i++) {
-                am_config_map_t *v = &c->openam_logout_map[i];
-                if (ISVALID(v->name) && ISVALID(v->value)) {
-                    SAVE_CHAR2_VALUE(conf, h, MAKE_TYPE(AM_CONF_AMLOGOUT_MAP, c->openam_logout_map_sz), v->name, v->value);
+                break;
+            case AM_CONF_IMAGE_STR_LIST:
+            {
+                char * const *l = *(char ** const *) p;
+                if (l == NULL || count <= 0) break;
+                v.value = image_items(w, count * sizeof (uint32_t));
+                for (j = 0; j < count; j++) {
+                    if (!ISVALID(l[j])) continue;
+                    if (w->base != NULL) {
+                        ((uint32_t *) (w->base + v.value))[v.count] = image_string(w, l[j]);
+                    } else {
+                        image_string(w, l[j]);
+                    }
+                    v.count++;
                 }
             }
-        }
-        if (c->policy_scope_subtree > 0) {
-            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_SCOPE, 0), c->policy_scope_subtree);
-        }
-        if (c->resolve_client_host > 0) {
-            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_CRESOLVE, 0), c->resolve_client_host);
-        }
-        if (c->policy_eval_encode_chars > 0) {
-            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_PE_ENC_CHARS, 0), c->policy_eval_encode_chars);
-        }
-        if (c->cookie_encode_chars > 0) {
-            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_CK_ENC_CHARS, 0), c->cookie_encode_chars);
-        }
-        if (c->override_protocol > 0) {
-            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_OV_PROTO, 0), c->override_protocol);
-        }
-        if (c->override_host > 0) {
-            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_OV_HOST, 0), c->override_host);
-        }
-        if (c->override_port > 0) {
-            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_OV_PORT, 0), c->override_port);
-        }
-        if (c->override_notif_url > 0) {
-            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_OV_NURL, 0), c->override_notif_url);
-        }
-        if (c->config_valid > 0) {
-            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_VALID, 0), c->config_valid);
-        }
-        if (ISVALID(c->password_replay_key)) {
-            SAVE_CHAR_VALUE(conf, h, MAKE_TYPE(AM_CONF_PASS_REPLY_KEY, 0), c->password_replay_key);
-        }
-        if (c->policy_clock_skew > 0) {
-            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_POL_CSKEW, 0), c->policy_clock_skew);
-        }
-        if (ISVALID(c->url_redirect_param)) {
-            SAVE_CHAR_VALUE(conf, h, MAKE_TYPE(AM_CONF_URL_REDIR_PARAM, 0), c->url_redirect_param);
-        }
-        if (c->cache_control_enable > 0) {
-            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_CACHE_HEADERS, 0), c->cache_control_enable);
-        }
-        if (c->use_redirect_for_advice > 0) {
-            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_REDIRECT_ADVICE, 0), c->use_redirect_for_advice);
-        }
-        if (ISVALID(c->client_ip_header)) {
-            SAVE_CHAR_VALUE(conf, h, MAKE_TYPE(AM_CONF_CLIENT_IP_HEADER, 0), c->client_ip_header);
-        }
-        if (ISVALID(c->client_hostname_header)) {
-            SAVE_CHAR_VALUE(conf, h, MAKE_TYPE(AM_CONF_CLIENT_HOST_HEADER, 0), c->client_hostname_header);
-        }
-        if (ISVALID(c->url_check_regex)) {
-            SAVE_CHAR_VALUE(conf, h, MAKE_TYPE(AM_CONF_URL_CHECK, 0), c->url_check_regex);
-        }
-        if (c->cond_login_url_sz > 0 && c->cond_login_url != NULL) {
-            for (i = 0; i < c->cond_login_url_sz; i++) {
-                am_config_map_t *v = &c->cond_login_url[i];
-                if (ISVALID(v->name) && ISVALID(v->value)) {
-                    SAVE_CHAR2_VALUE(conf, h, MAKE_TYPE(AM_CONF_CONDLOGIN_MAP, c->cond_login_url_sz), v->name, v->value);
+                break;
+            case AM_CONF_IMAGE_NUM_LIST:
+            {
+                const int *l = *(int * const *) p;
+                if (l == NULL || count <= 0) break;
+                v.value = image_items(w, count * sizeof (int32_t));
+                if (w->base != NULL) {
+                    for (j = 0; j < count; j++) {
+                        ((int32_t *) (w->base + v.value))[j] = (int32_t) l[j];
+                    }
                 }
+                v.count = (uint32_t) count;
             }
-        }
-        if (c->cookie_http_only > 0) {
-            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_HTTP_ONLY_COOKIE, 0), c->cookie_http_only);
-        }
-        if (ISVALID(c->multi_attr_separator)) {
-            SAVE_CHAR_VALUE(conf, h, MAKE_TYPE(AM_CONF_ATTR_SEP, 0), c->multi_attr_separator);
-        }
-        if (c->logon_user_enable > 0) {
-            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_WIN_LOGON, 0), c->logon_user_enable);
-        }
-        if (c->password_header_enable > 0) {
-            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_WIN_PASS_HEADER, 0), c->password_header_enable);
-        }
-        if (c->json_url_map_sz > 0 && c->json_url_map != NULL) {
-            for (i = 0; i < c->json_url_map_sz; i++) {
-                am_config_map_t *v = &c->json_url_map[i];
-                if (ISVALID(v->name) && ISVALID(v->value)) {
-                    SAVE_CHAR2_VALUE(conf, h, MAKE_TYPE(AM_CONF_JSON_URL_MAP, c->json_url_map_sz), v->name, v->value);
+                break;
+            case AM_CONF_IMAGE_MAP:
+            {
+                const am_config_map_t *m = *(am_config_map_t * const *) p;
+                if (m == NULL || count <= 0) break;
+                v.value = image_items(w, count * 2 * sizeof (uint32_t));
+                for (j = 0; j < count; j++) {
+                    uint32_t name, value;
+                    if (!ISVALID(m[j].name) || !ISVALID(m[j].value)) continue;
+                    name = image_string(w, m[j].name);
+                    value = image_string(w, m[j].value);
+                    if (w->base != NULL) {
+                        ((uint32_t *) (w->base + v.value))[v.count * 2] = name;
+                        ((uint32_t *) (w->base + v.value))[v.count * 2 + 1] = value;
+                    }
+                    v.count++;
                 }
             }
+                break;
         }
-        if (c->audit_level > 0) {
-            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_AUDIT_LEVEL, 0), c->audit_level);
-        }
-        if (c->audit_remote_interval > 0) {
-            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_AUDIT_REMOTE_INTERVAL, 0), c->audit_remote_interval);
-        }
-        if (ISVALID(c->audit_file_remote)) {
-            SAVE_CHAR_VALUE(conf, h, MAKE_TYPE(AM_CONF_AUDIT_REMOTE_FILE, 0), c->audit_file_remote);
-        }
-        if (ISVALID(c->audit_file_disposition)) {
-            SAVE_CHAR_VALUE(conf, h, MAKE_TYPE(AM_CONF_AUDIT_FILE_DISPOSITION, 0), c->audit_file_disposition);
-        }
-        if (c->anon_remote_user_enable > 0) {
-            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_ANON_USER_ENABLE, 0), c->anon_remote_user_enable);
-        }
-        if (ISVALID(c->unauthenticated_user)) {
-            SAVE_CHAR_VALUE(conf, h, MAKE_TYPE(AM_CONF_ANON_USER_ID, 0), c->unauthenticated_user);
-        }
-        if (c->path_info_ignore > 0) {
-            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_PATHINFO_IGNORE, 0), c->path_info_ignore);
-        }
-        if (c->path_info_ignore_not_enforced > 0) {
-            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_PATHINFO_IGNORE_NOTENFORCED, 0), c->path_info_ignore_not_enforced);
+        if (image != NULL) {
+            image->field[i] = v;
         }
     }
-    return AM_SUCCESS;
 }
 
-static am_config_t *am_get_stored_agent_config(struct am_instance_entry *c) {
-    am_config_t *r = NULL;
-    struct am_instance_entry_data *i, *t, *h;
+static uint64_t image_hash(const struct config_image *image) {
+    const unsigned char *p = (const unsigned char *) image + AM_CONFIG_IMAGE_HEADER;
+    const unsigned char *end = (const unsigned char *) image + image->size;
+    uint64_t hash = 14695981039346656037ULL; /* FNV-1a */
+    for (; p < end; p++) {
+        hash ^= *p;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
 
-    if (c == NULL) return NULL;
-    r = calloc(1, sizeof (am_config_t));
-    if (r == NULL) return NULL;
-    h = (struct am_instance_entry_data *) AM_GET_POINTER(conf->pool, c->data.prev);
-
-    AM_OFFSET_LIST_FOR_EACH(conf->pool, h, i, t, struct am_instance_entry_data) {
-        int ty = GET_TYPE(i->type);
-        int sz = GET_SIZE(i->type);
-        switch (ty) {
-            case AM_CONF_LOCAL:
-                r->local = i->num_value;
-                break;
-            case AM_CONF_PDP_DIR:
-                r->pdp_dir = strndup(i->value, i->size[0]);
-                break;
-            case AM_CONF_NAMING_URL:
-                if (r->naming_url_sz == 0) {
-                    r->naming_url = malloc(sz * sizeof (char *));
-                }
-                if (r->naming_url != NULL && r->naming_url_sz < sz) {
-                    r->naming_url[r->naming_url_sz++] = strndup(i->value, i->size[0]);
-                }
-                break;
-            case AM_CONF_REALM:
-                r->realm = strndup(i->value, i->size[0]);
-                break;
-            case AM_CONF_USER:
-                r->user = strndup(i->value, i->size[0]);
-                break;
-            case AM_CONF_PASSWORD:
-                r->pass = strndup(i->value, i->size[0]);
-                break;
-            case AM_CONF_KEY:
-                r->key = strndup(i->value, i->size[0]);
-                break;
-            case AM_CONF_DEBUG:
-                r->debug = i->num_value;
-                break;
-            case AM_CONF_DEBUG_LEVEL:
-                r->debug_level = i->num_value;
-                break;
-            case AM_CONF_DEBUG_FILE:
-                r->debug_file = strndup(i->value, i->size[0]);
-                break;
-            case AM_CONF_AUDIT:
-                r->audit = i->num_value;
-                break;
-            case AM_CONF_AUDIT_LEVEL:
-                r->audit_level = i->num_value;
-                break;
-            case AM_CONF_AUDIT_FILE:
-                r->audit_file = strndup(i->value, i->size[0]);
-                break;
-            case AM_CONF_AUDIT_REMOTE_INTERVAL:
-                r->audit_remote_interval = i->num_value;
-                break;
-            case AM_CONF_AUDIT_REMOTE_FILE:
-                r->audit_file_remote = strndup(i->value, i->size[0]);
-                break;
-            case AM_CONF_AUDIT_FILE_DISPOSITION:
-                r->audit_file_disposition = strndup(i->value, i->size[0]);
-                break;
-            case AM_CONF_CERT_KEY_FILE:
-                r->cert_key_file = strndup(i->value, i->size[0]);
-                break;
-            case AM_CONF_CERT_KEY_PASS:
-                r->cert_key_pass = strndup(i->value, i->size[0]);
-                break;
-            case AM_CONF_CERT_FILE:
-                r->cert_file = strndup(i->value, i->size[0]);
-                break;
-            case AM_CONF_CERT_CA_FILE:
-                r->cert_ca_file = strndup(i->value, i->size[0]);
-                break;
-            case AM_CONF_CIPHERS:
-                r->ciphers = strndup(i->value, i->size[0]);
-                break;
-            case AM_CONF_TLS_OPTIONS:
-                r->tls_opts = strndup(i->value, i->size[0]);
-                break;
-            case AM_CONF_CERT_TRUST:
-                r->cert_trust = i->num_value;
-                break;
-            case AM_CONF_NET_TIMEOUT:
-                r->net_timeout = i->num_value;
-                break;
-            case AM_CONF_VALID_LEVEL:
-                r->valid_level = i->num_value;
-                break;
-            case AM_CONF_VALID_PING:
-                r->valid_ping = i->num_value;
-                break;
-            case AM_CONF_VALID_PING_MISS:
-                r->valid_ping_miss = i->num_value;
-                break;
-            case AM_CONF_VALID_PING_OK:
-                r->valid_ping_ok = i->num_value;
-                break;
-            case AM_CONF_VALID_DEFAULT_IDX:
-                if (r->valid_default_url_sz == 0) {
-                    r->valid_default_url = malloc(sz * sizeof (int));
-                }
-                if (r->valid_default_url != NULL && r->valid_default_url_sz < sz) {
-                    r->valid_default_url[r->valid_default_url_sz++] = i->num_value;
-                }
-                break;
-            case AM_CONF_HOST_MAP:
-                if (r->hostmap_sz == 0) {
-                    r->hostmap = malloc(sz * sizeof (char *));
-                }
-                if (r->hostmap != NULL && r->hostmap_sz < sz) {
-                    r->hostmap[r->hostmap_sz++] = strndup(i->value, i->size[0]);
-                }
-                break;
-            case AM_CONF_RETRY_MAX:
-                r->retry_max = i->num_value;
-                break;
-            case AM_CONF_RETRY_WAIT:
-                r->retry_wait = i->num_value;
-                break;
-            case AM_CONF_AGENT_URI:
-                r->agenturi = strndup(i->value, i->size[0]);
-                break;
-            case AM_CONF_COOKIE:
-                r->cookie_name = strndup(i->value, i->size[0]);
-                break;
-            case AM_CONF_LOGIN_URL:
-                if (r->login_url_sz == 0) {
-                    r->login_url = malloc(sz * sizeof (am_config_map_t));
-                }
-                if (r->login_url != NULL && r->login_url_sz < sz) {
-                    am_config_map_t *m = &r->login_url[r->login_url_sz++];
-                    m->name = malloc(i->size[0] + i->size[1] + 2);
-                    memcpy(m->name, i->value, i->size[0] + i->size[1] + 2);
-                    m->value = m->name + i->size[0] + 1;
-                }
-                break;
-            case AM_CONF_COOKIE_SECURE:
-                r->cookie_secure = i->num_value;
-                break;
-            case AM_CONF_NOTIF_ENABLE:
-                r->notif_enable = i->num_value;
-                break;
-            case AM_CONF_NOTIF_URL:
-                r->notif_url = strndup(i->value, i->size[0]);
-                break;
-            case AM_CONF_EVAL_CASE:
-                r->url_eval_case_ignore = i->num_value;
-                break;
-            case AM_CONF_POLICY_CACHE_VALID:
-                r->policy_cache_valid = i->num_value;
-                break;
-            case AM_CONF_TOKEN_CACHE_VALID:
-                r->token_cache_valid = i->num_value;
-                break;
-            case AM_CONF_UID_PARAM:
-                r->userid_param = strndup(i->value, i->size[0]);
-                break;
-            case AM_CONF_UID_PARAM_TYPE:
-                r->userid_param_type = strndup(i->value, i->size[0]);
-                break;
-            case AM_CONF_PROF_ATTR:
-                r->profile_attr_fetch = i->num_value;
-                break;
-            case AM_CONF_PROF_ATTR_MAP:
-                if (r->profile_attr_map_sz == 0) {
-                    r->profile_attr_map = malloc(sz * sizeof (am_config_map_t));
-                }
-                if (r->profile_attr_map != NULL && r->profile_attr_map_sz < sz) {
-                    am_config_map_t *m = &r->profile_attr_map[r->profile_attr_map_sz++];
-                    m->name = malloc(i->size[0] + i->size[1] + 2);
-                    memcpy(m->name, i->value, i->size[0] + i->size[1] + 2);
-                    m->value = m->name + i->size[0] + 1;
-                }
-                break;
-            case AM_CONF_SESS_ATTR:
-                r->session_attr_fetch = i->num_value;
-                break;
-            case AM_CONF_SESS_ATTR_MAP:
-                if (r->session_attr_map_sz == 0) {
-                    r->session_attr_map = malloc(sz * sizeof (am_config_map_t));
-                }
-                if (r->session_attr_map != NULL && r->session_attr_map_sz < sz) {
-                    am_config_map_t *m = &r->session_attr_map[r->session_attr_map_sz++];
-                    m->name = malloc(i->size[0] + i->size[1] + 2);
-                    memcpy(m->name, i->value, i->size[0] + i->size[1] + 2);
-                    m->value = m->name + i->size[0] + 1;
-                }
-                break;
-            case AM_CONF_RESP_ATTR:
-                r->response_attr_fetch = i->num_value;
-                break;
-            case AM_CONF_RESP_ATTR_MAP:
-                if (r->response_attr_map_sz == 0) {
-                    r->response_attr_map = malloc(sz * sizeof (am_config_map_t));
-                }
-                if (r->response_attr_map != NULL && r->response_attr_map_sz < sz) {
-                    am_config_map_t *m = &r->response_attr_map[r->response_attr_map_sz++];
-                    m->name = malloc(i->size[0] + i->size[1] + 2);
-                    memcpy(m->name, i->value, i->size[0] + i->size[1] + 2);
-                    m->value = m->name + i->size[0] + 1;
-                }
-                break;
-            case AM_CONF_LB_ENABLE:
-                r->lb_enable = i->num_value;
-                break;
-            case AM_CONF_KEEPALIVE_DISABLE:
-                r->keepalive_disable = i->num_value;
-                break;
-            case AM_CONF_SSO_ONLY:
-                r->sso_only = i->num_value;
-                break;
-            case AM_CONF_ACC_DENIED:
-                r->access_denied_url = strndup(i->value, i->size[0]);
-                break;
-            case AM_CONF_FQDN_CHECK:
-                r->fqdn_check_enable = i->num_value;
-                break;
-            case AM_CONF_FQDN_DEFAULT:
-                r->fqdn_default = strndup(i->value, i->size[0]);
-                break;
-            case AM_CONF_FQDN_MAP:
-                if (r->fqdn_map_sz == 0) {
-                    r->fqdn_map = malloc(sz * sizeof (am_config_map_t));
-                }
-                if (r->fqdn_map != NULL && r->fqdn_map_sz < sz) {
-                    am_config_map_t *m = &r->fqdn_map[r->fqdn_map_sz++];
-                    m->name = malloc(i->size[0] + i->size[1] + 2);
-                    memcpy(m->name, i->value, i->size[0] + i->size[1] + 2);
-                    m->value = m->name + i->size[0] + 1;
-                }
-                break;
-            case AM_CONF_COOKIE_RESET:
-                r->cookie_reset_enable = i->num_value;
-                break;
-            case AM_CONF_COOKIE_RESET_MAP:
-                if (r->cookie_reset_map_sz == 0) {
-                    r->cookie_reset_map = malloc(sz * sizeof (am_config_map_t));
-                }
-                if (r->cookie_reset_map != NULL && r->cookie_reset_map_sz < sz) {
-                    am_config_map_t *m = &r->cookie_reset_map[r->cookie_reset_map_sz++];
-                    m->name = malloc(i->size[0] + i->size[1] + 2);
-                    memcpy(m->name, i->value, i->size[0] + i->size[1] + 2);
-                    m->value = m->name + i->size[0] + 1;
-                }
-                break;
-            case AM_CONF_NEF_INVERT:
-                r->not_enforced_invert = i->num_value;
-                break;
-            case AM_CONF_NEF_ATTR:
-                r->not_enforced_fetch_attr = i->num_value;
-                break;
-            case AM_CONF_NEF_MAP:
-                if (r->not_enforced_map_sz == 0) {
-                    r->not_enforced_map = malloc(sz * sizeof (am_config_map_t));
-                }
-                if (r->not_enforced_map != NULL && r->not_enforced_map_sz < sz) {
-                    am_config_map_t *m = &r->not_enforced_map[r->not_enforced_map_sz++];
-                    m->name = malloc(i->size[0] + i->size[1] + 2);
-                    memcpy(m->name, i->value, i->size[0] + i->size[1] + 2);
-                    m->value = m->name + i->size[0] + 1;
-                }
-                break;
-            case AM_CONF_NEF_IP_MAP:
-                if (r->not_enforced_ip_map_sz == 0) {
-                    r->not_enforced_ip_map = malloc(sz * sizeof (am_config_map_t));
-                }
-                if (r->not_enforced_ip_map != NULL && r->not_enforced_ip_map_sz < sz) {
-                    am_config_map_t *m = &r->not_enforced_ip_map[r->not_enforced_ip_map_sz++];
-                    m->name = malloc(i->size[0] + i->size[1] + 2);
-                    memcpy(m->name, i->value, i->size[0] + i->size[1] + 2);
-                    m->value = m->name + i->size[0] + 1;
-                }
-                break;
-            case AM_CONF_NEF_EXT_MAP:
-                if (r->not_enforced_ext_map_sz == 0) {
-                    r->not_enforced_ext_map = malloc(sz * sizeof (am_config_map_t));
-                }
-                if (r->not_enforced_ext_map != NULL && r->not_enforced_ext_map_sz < sz) {
-                    am_config_map_t *m = &r->not_enforced_ext_map[r->not_enforced_ext_map_sz++];
-                    m->name = malloc(i->size[0] + i->size[1] + 2);
-                    memcpy(m->name, i->value, i->size[0] + i->size[1] + 2);
-                    m->value = m->name + i->size[0] + 1;
-                }
-                break;
-            case AM_CONF_NEF_REGEX_ENABLE:
-                r->not_enforced_regex_enable = i->num_value;
-                break;
-            case AM_CONF_NEF_EXT_REGEX_ENABLE:
-                r->not_enforced_ext_regex_enable = i->num_value;
-                break;
-            case AM_CONF_LOGOUT_REGEX_ENABLE:
-                r->logout_regex_enable = i->num_value;
-                break;
-            case AM_CONF_PDP:
-                r->pdp_enable = i->num_value;
-                break;
-            case AM_CONF_PDP_LBCOOKIE:
-                r->pdp_lb_cookie = strndup(i->value, i->size[0]);
-                break;
-            case AM_CONF_PDP_CACHE:
-                r->pdp_cache_valid = i->num_value;
-                break;
-            case AM_CONF_PDP_JS:
-                r->pdp_js_repost = i->num_value;
-                break;
-            case AM_CONF_PDP_SMODE:
-                r->pdp_sess_mode = strndup(i->value, i->size[0]);
-                break;
-            case AM_CONF_PDP_SVALUE:
-                r->pdp_sess_value = strndup(i->value, i->size[0]);
-                break;
-            case AM_CONF_PDP_PREFIX:
-                r->pdp_uri_prefix = strndup(i->value, i->size[0]);
-                break;
-            case AM_CONF_IP_VALIDATE:
-                r->client_ip_validate = i->num_value;
-                break;
-            case AM_CONF_COOKIE_PREFIX:
-                r->cookie_prefix = strndup(i->value, i->size[0]);
-                break;
-            case AM_CONF_COOKIE_MAXAGE:
-                r->cookie_maxage = i->num_value;
-                break;
-            case AM_CONF_CDSSO:
-                r->cdsso_enable = i->num_value;
-                break;
-            case AM_CONF_CDSSO_LOGIN_MAP:
-                if (r->cdsso_login_map_sz == 0) {
-                    r->cdsso_login_map = malloc(sz * sizeof (am_config_map_t));
-                }
-                if (r->cdsso_login_map != NULL && r->cdsso_login_map_sz < sz) {
-                    am_config_map_t *m = &r->cdsso_login_map[r->cdsso_login_map_sz++];
-                    m->name = malloc(i->size[0] + i->size[1] + 2);
-                    memcpy(m->name, i->value, i->size[0] + i->size[1] + 2);
-                    m->value = m->name + i->size[0] + 1;
-                }
-                break;
-            case AM_CONF_CDSSO_COOKIE_MAP:
-                if (r->cdsso_cookie_domain_map_sz == 0) {
-                    r->cdsso_cookie_domain_map = malloc(sz * sizeof (am_config_map_t));
-                }
-                if (r->cdsso_cookie_domain_map != NULL && r->cdsso_cookie_domain_map_sz < sz) {
-                    am_config_map_t *m = &r->cdsso_cookie_domain_map[r->cdsso_cookie_domain_map_sz++];
-                    m->name = malloc(i->size[0] + i->size[1] + 2);
-                    memcpy(m->name, i->value, i->size[0] + i->size[1] + 2);
-                    m->value = m->name + i->size[0] + 1;
-                }
-                break;
-            case AM_CONF_LOGOUT_COOKIE_MAP:
-                if (r->logout_cookie_reset_map_sz == 0) {
-                    r->logout_cookie_reset_map = malloc(sz * sizeof (am_config_map_t));
-                }
-                if (r->logout_cookie_reset_map != NULL && r->logout_cookie_reset_map_sz < sz) {
-                    am_config_map_t *m = &r->logout_cookie_reset_map[r->logout_cookie_reset_map_sz++];
-                    m->name = malloc(i->size[0] + i->size[1] + 2);
-                    memcpy(m->name, i->value, i->size[0] + i->size[1] + 2);
-                    m->value = m->name + i->size[0] + 1;
-                }
-                break;
-            case AM_CONF_LOGOUT_REDIRECT:
-                r->logout_redirect_url = strndup(i->value, i->size[0]);
+/**
+ * Size of the configuration image: bootstrap values are taken from 'boot', agent profile
+ * values from 'remote' (both point to the same configuration in local mode).
+ */
+static size_t config_image_size(const am_config_t *boot, const am_config_t *remote) {
+    struct config_image_writer w;
+    w.base = NULL;
+    w.items = (uint32_t) (AM_CONFIG_IMAGE_HEADER + AM_CONF_FIELDS * sizeof (struct config_image_field));
+    w.pool = 0;
+    image_write_fields(&w, boot, remote);
+    return (w.items + w.pool + 7) & ~((size_t) 7);
+}
+
+/**
+ * Serialize the configuration into the 'size' bytes long buffer (see config_image_size).
+ */
+static void config_image_write(void *buffer, size_t size, const am_config_t *boot, const am_config_t *remote) {
+    struct config_image *image = (struct config_image *) buffer;
+    struct config_image_writer w;
+    uint32_t items_size;
+
+    memset(buffer, 0, size);
+    w.base = NULL;
+    w.items = (uint32_t) (AM_CONFIG_IMAGE_HEADER + AM_CONF_FIELDS * sizeof (struct config_image_field));
+    w.pool = 0;
+    image_write_fields(&w, boot, remote);
+    items_size = w.items;
+
+    w.base = (char *) buffer;
+    w.items = (uint32_t) (AM_CONFIG_IMAGE_HEADER + AM_CONF_FIELDS * sizeof (struct config_image_field));
+    w.pool = items_size;
+    image_write_fields(&w, boot, remote);
+
+    image->magic = AM_CONFIG_IMAGE_MAGIC;
+    image->version = AM_CONFIG_IMAGE_VERSION;
+    image->size = (uint32_t) size;
+    image->fields = (uint32_t) AM_CONF_FIELDS;
+    image->hash = image_hash(image);
+}
+
+/**
+ * Create a (heap allocated) configuration image. Returns the image size in 'size'.
+ */
+void *am_config_image_create(const am_config_t *boot, const am_config_t *remote, size_t *size) {
+    size_t sz;
+    void *image;
+
+    if (boot == NULL || size == NULL) return NULL;
+    if (remote == NULL) remote = boot;
+
+    sz = config_image_size(boot, remote);
+    image = malloc(sz);
+    if (image == NULL) return NULL;
+    config_image_write(image, sz, boot, remote);
+    *size = sz;
+    return image;
+}
+
+/**
+ * Configuration image hash (0 if the image is not valid). Equal hash values mean equal
+ * configuration.
+ */
+uint64_t am_config_image_hash(const void *data) {
+    const struct config_image *image = (const struct config_image *) data;
+    if (image == NULL || image->magic != AM_CONFIG_IMAGE_MAGIC ||
+            image->version != AM_CONFIG_IMAGE_VERSION) {
+        return 0;
+    }
+    return image->hash;
+}
+
+static int image_offset_valid(const struct config_image *image, uint32_t offset, size_t size) {
+    return offset >= AM_CONFIG_IMAGE_HEADER && offset <= image->size && size <= image->size - offset;
+}
+
+/**
+ * Read the agent configuration from an image. String, list and map values point into
+ * a private copy of the image, allocated together with the list and map arrays as one
+ * block (am_config_t.image), which am_config_free releases in one go.
+ */
+am_config_t *am_config_image_load(const void *data, size_t size) {
+    const struct config_image *src = (const struct config_image *) data;
+    struct config_image *image;
+    am_config_t *r;
+    size_t arrays = 0, image_size;
+    char *block, *next;
+    unsigned int i;
+    uint32_t j;
+
+    if (src == NULL || size < AM_CONFIG_IMAGE_HEADER || src->magic != AM_CONFIG_IMAGE_MAGIC ||
+            src->version != AM_CONFIG_IMAGE_VERSION || src->fields != AM_CONF_FIELDS ||
+            src->size > size || src->size < AM_CONFIG_IMAGE_HEADER + AM_CONF_FIELDS * sizeof (struct config_image_field)) {
+        return NULL;
+    }
+
+    for (i = 0; i < AM_CONF_FIELDS; i++) {
+        const struct config_image_field *v = &src->field[i];
+        switch (config_fields[i].type) {
+            case AM_CONF_IMAGE_STR:
+                if (v->value != 0 && !image_offset_valid(src, v->value, 1)) return NULL;
                 break;
-            case AM_CONF_LOGOUT_URL_REGEX:
-                r->logout_url_regex = strndup(i->value, i->size[0]);
+            case AM_CONF_IMAGE_STR_LIST:
+                if (v->count == 0) break;
+                if (!image_offset_valid(src, v->value, v->count * sizeof (uint32_t))) return NULL;
+                arrays += v->count * sizeof (char *);
                 break;
-            case AM_CONF_LOGOUT_REDIR_DISABLE:
-                r->logout_redirect_disable = i->num_value;
+            case AM_CONF_IMAGE_NUM_LIST:
+                if (v->count > 0 && !image_offset_valid(src, v->value, v->count * sizeof (int32_t))) return NULL;
                 break;
-            case AM_CONF_LOGOUT_MAP:
-                if (r->logout_map_sz == 0) {
-                    r->logout_map = malloc(sz * sizeof (am_config_map_t));
-                }
-                if (r->logout_map != NULL && r->logout_map_sz < sz) {
-                    am_config_map_t *m = &r->logout_map[r->logout_map_sz++];
-                    m->name = malloc(i->size[0] + i->size[1] + 2);
-                    memcpy(m->name, i->value, i->size[0] + i->size[1] + 2);
-                    m->value = m->name + i->size[0] + 1;
-                }
+            case AM_CONF_IMAGE_MAP:
+                if (v->count == 0) break;
+                if (!image_offset_valid(src, v->value, v->count * 2 * sizeof (uint32_t))) return NULL;
+                arrays += v->count * sizeof (am_config_map_t);
                 break;
-            case AM_CONF_AMLOGOUT_MAP:
-                if (r->openam_logout_map_sz == 0) {
-                    r->openam_logout_map = malloc(sz * sizeof (am_config_map_t));
-                }
-                if (r->openam_logout_map != NULL && r->openam_logout_map_sz < sz) {
-                    am_config_map_t *m = &r->openam_logout_map[r->openam_logout_map_sz++];
-                    m->name = malloc(i->size[0] + i->size[1] + 2);
-                    memcpy(m->name, i->value, i->size[0] + i->size[1] + 2);
-                    m->value = m->name + i->size[0] + 1;
+        }
+    }
+
+    r = calloc(1, sizeof (am_config_t));
+    if (r == NULL) return NULL;
+    image_size = (src->size + 7) & ~((size_t) 7);
+    block = malloc(image_size + arrays);
+    if (block == NULL) {
+        free(r);
+        return NULL;
+    }
+    memcpy(block, src, src->size);
+    block[src->size - 1] = '\0'; /* string pool is always NUL terminated */
+    image = (struct config_image *) block;
+    next = block + image_size;
+    r->image = block;
+
+    for (i = 0; i < AM_CONF_FIELDS; i++) {
+        const struct config_field *f = &config_fields[i];
+        const struct config_image_field *v = &image->field[i];
+        char *p = (char *) r + f->offset;
+        int *count = f->size_offset != 0 ? (int *) ((char *) r + f->size_offset) : NULL;
+
+        switch (f->type) {
+            case AM_CONF_IMAGE_NUM:
+                *(int *) p = (int) (int32_t) v->value;
+                break;
+            case AM_CONF_IMAGE_STR:
+                *(char **) p = v->value != 0 ? block + v->value : NULL;
+                break;
+            case AM_CONF_IMAGE_STR_LIST:
+                if (v->count > 0) {
+                    const uint32_t *items = (const uint32_t *) (block + v->value);
+                    char **l = (char **) next;
+                    for (j = 0; j < v->count; j++) {
+                        l[j] = block + (items[j] < image->size ? items[j] : image->size - 1);
+                    }
+                    next += v->count * sizeof (char *);
+                    *(char ***) p = l;
+                    *count = (int) v->count;
                 }
                 break;
-            case AM_CONF_SCOPE:
-                r->policy_scope_subtree = i->num_value;
-                break;
-            case AM_CONF_CRESOLVE:
-                r->resolve_client_host = i->num_value;
-                break;
-            case AM_CONF_PE_ENC_CHARS:
-                r->policy_eval_encode_chars = i->num_value;
-                break;
-            case AM_CONF_CK_ENC_CHARS:
-                r->cookie_encode_chars = i->num_value;
-                break;
-            case AM_CONF_OV_PROTO:
-                r->override_protocol = i->num_value;
-                break;
-            case AM_CONF_OV_HOST:
-                r->override_host = i->num_value;
-                break;
-            case AM_CONF_OV_PORT:
-                r->override_port = i->num_value;
-                break;
-            case AM_CONF_OV_NURL:
-                r->override_notif_url = i->num_value;
-                break;
-            case AM_CONF_VALID:
-                r->config_valid = i->num_value;
-                break;
-            case AM_CONF_PASS_REPLY_KEY:
-                r->password_replay_key = strndup(i->value, i->size[0]);
-                break;
-            case AM_CONF_POL_CSKEW:
-                r->policy_clock_skew = i->num_value;
-                break;
-            case AM_CONF_URL_REDIR_PARAM:
-                r->url_redirect_param = strndup(i->value, i->size[0]);
-                break;
-            case AM_CONF_CACHE_HEADERS:
-                r->cache_control_enable = i->num_value;
-                break;
-            case AM_CONF_REDIRECT_ADVICE:
-                r->use_redirect_for_advice = i->num_value;
-                break;
-            case AM_CONF_CLIENT_IP_HEADER:
-                r->client_ip_header = strndup(i->value, i->size[0]);
-                break;
-            case AM_CONF_CLIENT_HOST_HEADER:
-                r->client_hostname_header = strndup(i->value, i->size[0]);
-                break;
-            case AM_CONF_URL_CHECK:
-                r->url_check_regex = strndup(i->value, i->size[0]);
-                break;
-            case AM_CONF_CONDLOGIN_MAP:
-                if (r->cond_login_url_sz == 0) {
-                    r->cond_login_url = malloc(sz * sizeof (am_config_map_t));
+            case AM_CONF_IMAGE_NUM_LIST:
+                if (v->count > 0) {
+                    *(int **) p = (int *) (block + v->value);
+                    *count = (int) v->count;
                 }
-                if (r->cond_login_url != NULL && r->cond_login_url_sz < sz) {
-                    am_config_map_t *m = &r->cond_login_url[r->cond_login_url_sz++];
-                    m->name = malloc(i->size[0] + i->size[1] + 2);
-                    memcpy(m->name, i->value, i->size[0] + i->size[1] + 2);
-                    m->value = m->name + i->size[0] + 1;
-                }
-                break;
-            case AM_CONF_HTTP_ONLY_COOKIE:
-                r->cookie_http_only = i->num_value;
-                break;
-            case AM_CONF_ATTR_SEP:
-                r->multi_attr_separator = strndup(i->value, i->size[0]);
-                break;
-            case AM_CONF_WIN_LOGON:
-                r->logon_user_enable = i->num_value;
                 break;
-            case AM_CONF_WIN_PASS_HEADER:
-                r->password_header_enable = i->num_value;
-                break;
-            case AM_CONF_JSON_URL_MAP:
-                if (r->json_url_map_sz == 0) {
-                    r->json_url_map = malloc(sz * sizeof (am_config_map_t));
-                }
-                if (r->json_url_map != NULL && r->json_url_map_sz < sz) {
-                    am_config_map_t *m = &r->json_url_map[r->json_url_map_sz++];
-                    m->name = malloc(i->size[0] + i->size[1] + 2);
-                    memcpy(m->name, i->value, i->size[0] + i->size[1] + 2);
-                    m->value = m->name + i->size[0] + 1;
+            case AM_CONF_IMAGE_MAP:
+                if (v->count > 0) {
+                    const uint32_t *items = (const uint32_t *) (block + v->value);
+                    am_config_map_t *m = (am_config_map_t *) next;
+                    for (j = 0; j < v->count; j++) {
+                        m[j].name = block + (items[j * 2] < image->size ? items[j * 2] : image->size - 1);
+                        m[j].value = block + (items[j * 2 + 1] < image->size ? items[j * 2 + 1] : image->size - 1);
+                    }
+                    next += v->count * sizeof (am_config_map_t);
+                    *(am_config_map_t **) p = m;
+                    *count = (int) v->count;
                 }
                 break;
-            case AM_CONF_ANON_USER_ENABLE:
-                r->anon_remote_user_enable = i->num_value;
-                break;
-            case AM_CONF_ANON_USER_ID:
-                r->unauthenticated_user = strndup(i->value, i->size[0]);
-                break;
-            case AM_CONF_PATHINFO_IGNORE:
-                r->path_info_ignore = i->num_value;
-                break;
-            case AM_CONF_PATHINFO_IGNORE_NOTENFORCED:
-                r->path_info_ignore_not_enforced = i->num_value;
-                break;
         }
     }
-
     return r;
 }
 
+/**
+ * Store agent configuration image in the instance entry (replacing the old one).
+ * Must be called with the configuration shared memory locked.
+ */
+static int am_create_instance_entry_data(struct am_instance_entry *e, am_config_t *boot, am_config_t *remote) {
+    size_t size = config_image_size(boot, remote);
+    void *image = am_shm_alloc(conf, size);
+    if (image == NULL) {
+        return AM_ENOMEM;
+    }
+    config_image_write(image, size, boot, remote);
+    if (e->image != 0) {
+        am_shm_free(conf, AM_GET_POINTER(conf->pool, e->image));
+    }
+    e->image = AM_GET_OFFSET(conf->pool, image);
+    e->image_size = size;
+    return AM_SUCCESS;
+}
+
+static am_config_t *am_get_stored_agent_config(struct am_instance_entry *c) {
+    if (c == NULL || c->image == 0) return NULL;
+    return am_config_image_load(AM_GET_POINTER(conf->pool, c->image), c->image_size);
+}
+
+/* configuration fields a change of which makes cached session and policy data stale */
+static const size_t config_cache_fields[] = {
+    offsetof(am_config_t, naming_url),
+    offsetof(am_config_t, realm),
+    offsetof(am_config_t, url_eval_case_ignore),
+    offsetof(am_config_t, policy_cache_valid),
+    offsetof(am_config_t, token_cache_valid),
+    offsetof(am_config_t, profile_attr_fetch),
+    offsetof(am_config_t, profile_attr_map),
+    offsetof(am_config_t, session_attr_fetch),
+    offsetof(am_config_t, session_attr_map),
+    offsetof(am_config_t, response_attr_fetch),
+    offsetof(am_config_t, response_attr_map),
+    offsetof(am_config_t, not_enforced_fetch_attr),
+    offsetof(am_config_t, policy_scope_subtree),
+    offsetof(am_config_t, policy_eval_encode_chars),
+    offsetof(am_config_t, policy_clock_skew)
+};
+
+static int image_valid(const struct config_image *image) {
+    return image != NULL && image->magic == AM_CONFIG_IMAGE_MAGIC &&
+            image->version == AM_CONFIG_IMAGE_VERSION && image->fields == AM_CONF_FIELDS &&
+            image->size >= AM_CONFIG_IMAGE_HEADER + AM_CONF_FIELDS * sizeof (struct config_image_field) &&
+            ((const char *) image)[image->size - 1] == '\0'; /* string pool is NUL terminated */
+}
+
+static int image_string_equal(const struct config_image *a, uint32_t va,
+        const struct config_image *b, uint32_t vb) {
+    if (va == 0 || vb == 0) return va == vb;
+    if (!image_offset_valid(a, va, 1) || !image_offset_valid(b, vb, 1)) return AM_FALSE;
+    return strcmp((const char *) a + va, (const char *) b + vb) == 0;
+}
+
+static int image_field_equal(const struct config_image *a, const struct config_image *b, unsigned int i) {
+    const struct config_image_field *fa = &a->field[i];
+    const struct config_image_field *fb = &b->field[i];
+    const uint32_t *ia, *ib;
+    uint32_t j, n;
+
+    switch (config_fields[i].type) {
+        case AM_CONF_IMAGE_NUM:
+            return fa->value == fb->value;
+        case AM_CONF_IMAGE_STR:
+            return image_string_equal(a, fa->value, b, fb->value);
+        case AM_CONF_IMAGE_NUM_LIST:
+            if (fa->count != fb->count) return AM_FALSE;
+            if (fa->count == 0) return AM_TRUE;
+            n = fa->count * sizeof (int32_t);
+            return image_offset_valid(a, fa->value, n) && image_offset_valid(b, fb->value, n) &&
+                    memcmp((const char *) a + fa->value, (const char *) b + fb->value, n) == 0;
+        case AM_CONF_IMAGE_STR_LIST:
+        case AM_CONF_IMAGE_MAP:
+            if (fa->count != fb->count) return AM_FALSE;
+            if (fa->count == 0) return AM_TRUE;
+            n = fa->count * (config_fields[i].type == AM_CONF_IMAGE_MAP ? 2 : 1);
+            if (!image_offset_valid(a, fa->value, n * sizeof (uint32_t)) ||
+                    !image_offset_valid(b, fb->value, n * sizeof (uint32_t))) {
+                return AM_FALSE;
+            }
+            ia = (const uint32_t *) ((const char *) a + fa->value);
+            ib = (const uint32_t *) ((const char *) b + fb->value);
+            for (j = 0; j < n; j++) {
+                if (!image_string_equal(a, ia[j], b, ib[j])) return AM_FALSE;
+            }
+            return AM_TRUE;
+    }
+    return AM_TRUE;
+}
+
+/**
+ * Compare two configuration images. Returns the number of fields which differ (or -1 if
+ * any of the images is not valid) and fills 'changed' with up to 'size' am_config_t field
+ * offsets of them.
+ */
+int am_config_image_diff(const void *a, const void *b, size_t *changed, int size) {
+    const struct config_image *ia = (const struct config_image *) a;
+    const struct config_image *ib = (const struct config_image *) b;
+    unsigned int i;
+    int count = 0;
+
+    if (!image_valid(ia) || !image_valid(ib)) return -1;
+    if (ia->hash == ib->hash && ia->size == ib->size) return 0;
+
+    for (i = 0; i < AM_CONF_FIELDS; i++) {
+        if (image_field_equal(ia, ib, i)) continue;
+        if (changed != NULL && count < size) {
+            changed[count] = config_fields[i].offset;
+        }
+        count++;
+    }
+    return count;
+}
+
+/**
+ * Parse agent profile xml. Remote configuration overrides logging and audit level bootstrap
+ * configuration values in 'bc', while some of the bootstrap values are copied over to the
+ * profile.
+ */
+static am_config_t *config_merge_profile(unsigned long instance_id, am_config_t *bc,
+        const char *xml, size_t xsz) {
+    am_config_t *cf = am_parse_config_xml(instance_id, xml, xsz, AM_TRUE);
+    if (cf == NULL) {
+        return NULL;
+    }
+    bc->debug_level = cf->debug_level;
+    bc->debug = cf->debug;
+    bc->audit_level = cf->audit_level;
+    bc->audit = cf->audit;
+    cf->keepalive_disable = bc->keepalive_disable;
+    cf->log_sync = bc->log_sync;
+    cf->log_rate = bc->log_rate;
+    cf->log_overflow_drop = bc->log_overflow_drop;
+    cf->log_deferred = bc->log_deferred;
+    am_free(cf->log_format);
+    cf->log_format = ISVALID(bc->log_format) ? strdup(bc->log_format) : NULL;
+    cf->log_segment_size = bc->log_segment_size;
+    cf->log_compress_disable = bc->log_compress_disable;
+    cf->log_retain_files = bc->log_retain_files;
+    cf->log_retain_size = bc->log_retain_size;
+    am_free(cf->status_url);
+    cf->status_url = ISVALID(bc->status_url) ? strdup(bc->status_url) : NULL;
+    return cf;
+}
+
 static int am_set_agent_config(unsigned long instance_id, const char *xml,
         size_t xsz, const char *token, const char *config_file, const char *name,
         am_config_t *bc, struct am_instance_entry **ie) {
@@ -1266,7 +791,6 @@ static int am_set_agent_config(unsigned long instance_id, const char *xml,
     struct am_instance_entry *c;
     int ret;
     struct am_instance *instance_data;
-    int hdr_offset;
 
     if (bc == NULL) return AM_EINVAL;
 
@@ -1303,8 +827,6 @@ static int am_set_agent_config(unsigned long instance_id, const char *xml,
         return AM_ENOMEM;
     }
 
-    hdr_offset = AM_GET_OFFSET(conf->pool, &c->data);
-
     c->instance_id = instance_id;
     c->ts = time(NULL);
     memset(c->token, 0, sizeof (c->token));
@@ -1320,31 +842,26 @@ static int am_set_agent_config(unsigned long instance_id, const char *xml,
         strncpy(c->name, name, sizeof (c->name) - 1);
     }
 
-    c->data.next = c->data.prev = 0;
+    c->image = 0;
+    c->image_size = 0;
+    c->refresh = 0;
     c->lh.next = c->lh.prev = 0;
     AM_OFFSET_LIST_INSERT(conf->pool, c, &instance_data->list, struct am_instance_entry);
 
     if (bc->local) {
-        ret = am_create_instance_entry_data(hdr_offset, bc, AM_CONF_ALL);
+        ret = am_create_instance_entry_data(c, bc, bc);
     } else {
         if (xml == NULL || xsz == 0) {
             ret = AM_EINVAL;
         } else {
-            am_config_t *cf = am_parse_config_xml(instance_id, xml, xsz, AM_TRUE);
+            am_config_t *cf = config_merge_profile(instance_id, bc, xml, xsz);
             if (cf == NULL) {
                 AM_LOG_ERROR(instance_id, "%s failed to parse agent profile xml",
                         thisfunc);
                 ret = AM_XML_ERROR;
             } else {
-                /* remote mode overrides logging and audit level bootstrap configuration */
-                bc->debug_level = cf->debug_level;
-                bc->debug = cf->debug;
-                bc->audit_level = cf->audit_level;
-                bc->audit = cf->audit;
-                cf->keepalive_disable = bc->keepalive_disable;
-
-                ret = am_create_instance_entry_data(hdr_offset, bc, AM_CONF_BOOT); /* store bootstrap properties */
-                ret = am_create_instance_entry_data(hdr_offset, cf, AM_CONF_REMOTE);
+                /* store bootstrap and agent profile properties */
+                ret = am_create_instance_entry_data(c, bc, cf);
                 am_config_free(&cf);
             }
         }
@@ -1355,6 +872,224 @@ static int am_set_agent_config(unsigned long instance_id, const char *xml,
     return ret;
 }
 
+struct config_refresh {
+    unsigned long instance_id;
+    char config[AM_PATH_SIZE];
+};
+
+static int config_cache_field_changed(const size_t *changed, int count) {
+    int i;
+    unsigned int j;
+    if (count < 0 || count > (int) AM_CONF_FIELDS) return AM_TRUE;
+    for (i = 0; i < count; i++) {
+        for (j = 0; j < sizeof (config_cache_fields) / sizeof (config_cache_fields[0]); j++) {
+            if (changed[i] == config_cache_fields[j]) return AM_TRUE;
+        }
+    }
+    return AM_FALSE;
+}
+
+/**
+ * Background agent configuration refresh: log in, fetch agent profile and publish the new
+ * configuration image in place of the old one. Requests keep on using the old configuration
+ * until then. Only the cached session and policy data which depends on the changed
+ * configuration values is removed.
+ */
+static void config_refresh_worker(void *arg) {
+    static const char *thisfunc = "config_refresh_worker():";
+    struct config_refresh *cr = (struct config_refresh *) arg;
+    unsigned long instance_id = cr->instance_id;
+    struct am_instance_entry *e;
+    am_config_t *ac = NULL, *cf = NULL;
+    am_net_options_t net_options;
+    am_request_t r;
+    char *agent_token = NULL, *profile_xml = NULL;
+    char old_token[AM_MAX_TOKEN_LENGTH];
+    size_t profile_xml_sz = 0, image_size = 0;
+    size_t changed[AM_CONF_FIELDS];
+    struct am_namevalue *agent_session = NULL;
+    void *image = NULL;
+    int rv = AM_ERROR, changes = -1;
+
+    if (conf == NULL) {
+        free(cr);
+        return;
+    }
+
+    ac = am_get_config_file(instance_id, cr->config);
+    if (ac == NULL) {
+        AM_LOG_WARNING(instance_id, "%s failed to load instance bootstrap %ld data",
+                thisfunc, instance_id);
+        rv = AM_FILE_ERROR;
+    } else {
+        am_net_options_create(ac, &net_options, NULL);
+        memset(&r, 0, sizeof (am_request_t));
+        r.conf = ac;
+        r.instance_id = instance_id;
+
+        rv = am_agent_login(instance_id, get_valid_openam_url(&r),
+                ac->user, ac->pass, ac->realm, &net_options,
+                &agent_token, &profile_xml, &profile_xml_sz, &agent_session);
+        am_net_options_delete(&net_options);
+
+        if (rv == AM_SUCCESS && (!ISVALID(agent_token) || agent_session == NULL)) {
+            rv = AM_ERROR;
+        }
+        if (rv == AM_SUCCESS && !ac->local) {
+            cf = profile_xml != NULL && profile_xml_sz > 0 ?
+                    config_merge_profile(instance_id, ac, profile_xml, profile_xml_sz) : NULL;
+            if (cf == NULL) {
+                rv = AM_XML_ERROR;
+            }
+        }
+        if (rv == AM_SUCCESS) {
+            image = am_config_image_create(ac, ac->local ? ac : cf, &image_size);
+            if (image == NULL) {
+                rv = AM_ENOMEM;
+            }
+        }
+    }
+
+    am_shm_lock(conf);
+    e = get_instance_entry(instance_id);
+    if (e != NULL && rv == AM_SUCCESS) {
+        void *stored = am_shm_alloc(conf, image_size);
+        if (stored == NULL) {
+            rv = AM_ENOMEM;
+        } else {
+            memcpy(stored, image, image_size);
+            if (e->image != 0) {
+                changes = am_config_image_diff(AM_GET_POINTER(conf->pool, e->image), image,
+                        changed, AM_CONF_FIELDS);
+                am_shm_free(conf, AM_GET_POINTER(conf->pool, e->image));
+            }
+            e->image = AM_GET_OFFSET(conf->pool, stored);
+            e->image_size = image_size;
+            strncpy(old_token, e->token, sizeof (old_token) - 1);
+            old_token[sizeof (old_token) - 1] = '\0';
+            memset(e->token, 0, sizeof (e->token));
+            strncpy(e->token, agent_token, sizeof (e->token) - 1);
+            e->ts = time(NULL);
+        }
+    } else if (e == NULL && rv == AM_SUCCESS) {
+        rv = AM_NOT_FOUND; /* instance was removed meanwhile */
+    }
+    if (e != NULL) {
+        e->refresh = 0;
+    }
+    am_shm_unlock(conf);
+
+    if (rv == AM_SUCCESS) {
+        if (config_cache_field_changed(changed, changes)) {
+            am_remove_instance_cache_entries(instance_id);
+        } else {
+            am_remove_cache_entry(instance_id, old_token); /* old agent session only */
+        }
+        am_add_session_policy_cache_entry(&r, agent_token, NULL, agent_session);
+        AM_LOG_INFO(instance_id, "%s agent configuration updated (%d value(s) changed)",
+                thisfunc, changes);
+    } else {
+        AM_LOG_WARNING(instance_id, "%s agent configuration refresh failed, keeping the current one (%s)",
+                thisfunc, am_strerror(rv));
+    }
+
+    am_free(image);
+    am_config_free(&cf);
+    am_config_free(&ac);
+    delete_am_namevalue_list(&agent_session);
+    AM_FREE(agent_token, profile_xml);
+    free(cr);
+}
+
+/**
+ * Start a background configuration refresh for the instance entry, unless one is
+ * running already. Must be called with the configuration shared memory locked.
+ * Returns AM_EINPROGRESS when the refresh is (or was already) started.
+ */
+static int config_refresh_dispatch(struct am_instance_entry *e) {
+    struct config_refresh *cr;
+    time_t now = time(NULL);
+
+    if (e->refresh != 0 && difftime(now, e->refresh) < AM_CONFIG_REFRESH_TIMEOUT) {
+        return AM_EINPROGRESS;
+    }
+
+    cr = (struct config_refresh *) malloc(sizeof (struct config_refresh));
+    if (cr == NULL) {
+        return AM_ENOMEM;
+    }
+    cr->instance_id = e->instance_id;
+    memcpy(cr->config, e->config, sizeof (cr->config));
+
+    e->refresh = now;
+    if (am_worker_dispatch_class(AM_WORKER_HIGH, config_refresh_worker, cr) != AM_SUCCESS) {
+        e->refresh = 0;
+        free(cr);
+        return AM_ERROR;
+    }
+    return AM_EINPROGRESS;
+}
+
+/**
+ * Refresh agent configuration of an instance the agent session 'token' of which is
+ * no longer valid. Returns:
+ *  AM_SUCCESS - configuration was refreshed already (with a new agent session),
+ *  AM_EINPROGRESS - background refresh is in progress, current configuration stays in use,
+ *  AM_NOT_FOUND - no configuration is stored (anymore), it has to be fetched with am_get_agent_config.
+ */
+int am_config_refresh(unsigned long instance_id, const char *token) {
+    struct am_instance_entry *e;
+    int rv;
+
+    if (conf == NULL || am_shm_lock(conf) != AM_SUCCESS) {
+        return AM_NOT_FOUND;
+    }
+
+    e = get_instance_entry(instance_id);
+    if (e == NULL) {
+        rv = AM_NOT_FOUND;
+    } else if (!ISVALID(token) || strcmp(e->token, token) != 0) {
+        rv = AM_SUCCESS;
+    } else {
+        rv = config_refresh_dispatch(e);
+        if (rv != AM_EINPROGRESS) {
+            /* no background refresh - fall back to a blocking configuration fetch */
+            remove_instance_entry(e);
+            rv = AM_NOT_FOUND;
+        }
+    }
+    am_shm_unlock(conf);
+    return rv;
+}
+
+/**
+ * Refresh agent configuration of all instances with agent id 'name' in background
+ * (agent configuration change notification).
+ */
+void am_config_refresh_byname(const char *name) {
+    struct am_instance_entry *e, *t, *h;
+    struct am_instance *instance_data;
+
+    if (conf == NULL || am_shm_lock(conf) != AM_SUCCESS) {
+        return;
+    }
+
+    instance_data = get_instance_data();
+    if (instance_data == NULL) {
+        am_shm_unlock(conf);
+        return;
+    }
+
+    h = (struct am_instance_entry *) AM_GET_POINTER(conf->pool, instance_data->list.prev);
+
+    AM_OFFSET_LIST_FOR_EACH(conf->pool, h, e, t, struct am_instance_entry) {
+        if (strcasecmp(e->name, name) == 0 && config_refresh_dispatch(e) != AM_EINPROGRESS) {
+            remove_instance_entry(e);
+        }
+    }
+    am_shm_unlock(conf);
+}
+
 int am_get_agent_config(unsigned long instance_id, const char *config_file, am_config_t **cnf) {
     static const char *thisfunc = "am_get_agent_config():";
     struct am_instance_entry *c;
@@ -1484,9 +1219,11 @@ int am_get_agent_config(unsigned long instance_id, const char *config_file, am_c
                 am_shm_unlock(conf);
 
                 if (!(*cnf)->local) {
+                    am_log_options_t log_options;
                     /* update instance logger registration data */
+                    am_config_log_options(*cnf, &log_options);
                     am_log_register_instance(instance_id, (*cnf)->debug_file, (*cnf)->debug_level, (*cnf)->debug,
-                            (*cnf)->audit_file, (*cnf)->audit_level, (*cnf)->audit, (*cnf)->config);
+                            (*cnf)->audit_file, (*cnf)->audit_level, (*cnf)->audit, &log_options, (*cnf)->config);
                 }
 
                 if (AM_BITMASK_CHECK((*cnf)->audit_level, AM_LOG_LEVEL_AUDIT_REMOTE)) {
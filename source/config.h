@@ -165,6 +165,9 @@ typedef struct {
     char *pdp_lb_cookie;
     int pdp_cache_valid;
     int pdp_js_repost;
+    int pdp_max_size; /* bytes, 0 - no limit */
+    int cache_quota; /* KB, 0 - no limit */
+    int cache_admission;
     char *pdp_sess_mode;
     char *pdp_sess_value;
     char *pdp_uri_prefix;
@@ -235,6 +238,18 @@ typedef struct {
     int path_info_ignore;
     int path_info_ignore_not_enforced;
     int keepalive_disable;
+    int log_sync;
+    int log_rate;
+    int log_overflow_drop;
+    int log_deferred;
+    char *log_format;
+    int log_segment_size;
+    int log_compress_disable;
+    int log_retain_files;
+    int log_retain_size;
+    char *status_url;
+
+    void *image; /* when set, values point into this block (see am_config_image_load) */
 
 } am_config_t;
 
@@ -277,6 +292,17 @@ typedef struct {
 #define AM_AGENTS_CONFIG_RETRY_WAIT "com.forgerock.agents.init.retry.wait"
 
 #define AM_AGENTS_CONFIG_KEEPALIVE_DISABLE "org.forgerock.agents.config.keepalive.disable"
+#define AM_AGENTS_CONFIG_LOG_SYNC "org.forgerock.agents.config.log.sync"
+#define AM_AGENTS_CONFIG_LOG_RATE "org.forgerock.agents.config.log.rate"
+#define AM_AGENTS_CONFIG_LOG_OVERFLOW_DROP "org.forgerock.agents.config.log.overflow.drop"
+#define AM_AGENTS_CONFIG_LOG_DEFERRED "org.forgerock.agents.config.log.deferred"
+#define AM_AGENTS_CONFIG_LOG_FORMAT "org.forgerock.agents.config.log.format"
+#define AM_AGENTS_CONFIG_LOG_SEGMENT_SIZE "org.forgerock.agents.config.log.segment.size"
+#define AM_AGENTS_CONFIG_LOG_COMPRESS_DISABLE "org.forgerock.agents.config.log.compress.disable"
+#define AM_AGENTS_CONFIG_LOG_RETAIN_FILES "org.forgerock.agents.config.log.retain.files"
+#define AM_AGENTS_CONFIG_LOG_RETAIN_SIZE "org.forgerock.agents.config.log.retain.size"
+/* agent status (statistics) url, answered only when the connection comes from a loopback address */
+#define AM_AGENTS_CONFIG_STATUS_URL "org.forgerock.agents.config.status.url"
 
 /* other options */
 
@@ -379,6 +405,9 @@ typedef struct {
 #define AM_AGENTS_CONFIG_IIS_PASSWORD_HEADER "com.sun.identity.agents.config.iis.password.header"
 
 #define AM_AGENTS_CONFIG_PDP_JS_REPOST "org.forgerock.agents.pdp.javascript.repost"
+#define AM_AGENTS_CONFIG_PDP_MAX_SIZE "org.forgerock.agents.pdp.max.size"
+#define AM_AGENTS_CONFIG_CACHE_QUOTA "org.forgerock.agents.cache.quota"
+#define AM_AGENTS_CONFIG_CACHE_ADMISSION "org.forgerock.agents.cache.admission"
 #define AM_AGENTS_CONFIG_EXT_NOT_ENFORCED_URL "org.forgerock.agents.config.notenforced.ipurl"
 #define AM_AGENTS_CONFIG_EXT_NOT_ENFORCED_REGEX_ENABLE "org.forgerock.agents.config.notenforced.ext.regex.enable"
 
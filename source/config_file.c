@@ -32,287 +32,513 @@ struct val_number_list {
     int *list;
 };
 
-static void *parse_value(const char *line, const char *name,
+static void *parse_value(const char *token, const char *key_val,
         int value_type, const char *mvsep) {
-    char set = 0, map = 0, *token = NULL, *key = NULL, *key_val = NULL;
     void *value = NULL;
-    size_t token_sz, name_sz = strlen(name);
-    char *orig, *tn, *tmp = strdup(line);
-    size_t line_sz;
     int *value_int;
 
-    if (tmp == NULL) {
+    if (!ISVALID(token)) {
         return NULL;
     }
-    orig = tmp;
-    line_sz = strlen(tmp);
-
-    tn = strchr(tmp, '=');
-    if (tn != NULL && ((size_t) (tn - tmp)) < line_sz) {
-
-        token = tn + 1; /* move past the '=' */
-        *tn = 0; /* terminate token key and reset the pointer */
-        tn = tmp;
-
-        trim(tn, ' ');
-        trim(token, ' ');
-
-        /* check if the key is what we're looking for */
-        if (strncmp(tn, name, name_sz) == 0) {
-            map = 0;
-            if ((token_sz = strlen(tn)) != name_sz) {
-                /* get map value key */
-                key = strstr(tn, "[");
-                if (key != NULL) {
-                    key++; /* move past the '[' */
-                    if (*key != ']') {
-                        tn[token_sz - 1] = 0;
-                        key_val = strdup(key);
-                        if (key_val != NULL) {
-                            map = 1;
-                        }
-                    }
-                }
-            }
-            set = 1;
-        }
 
-        if (set != 1 || !ISVALID(token)) {
-            AM_FREE(key_val, orig);
-            return NULL;
-        }
-
-        switch (value_type) {
-            case CONF_NUMBER:
-                value = malloc(sizeof (int));
-                if (value == NULL) {
-                    break;
-                }
-                value_int = (int *) value;
-                if (strcasecmp(token, "on") == 0 || strcasecmp(token, "true") == 0 || strcasecmp(token, "local") == 0) {
-                    *value_int = 1;
-                    break;
-                }
-                if (strcasecmp(token, "off") == 0 || strcasecmp(token, "false") == 0 || strcasecmp(token, "centralized") == 0) {
-                    *value_int = 0;
-                    break;
-                }
-                *value_int = strtol(token, NULL, AM_BASE_TEN);
+    switch (value_type) {
+        case CONF_NUMBER:
+            value = malloc(sizeof (int));
+            if (value == NULL) {
                 break;
-            case CONF_DEBUG_LEVEL:
-                value = malloc(sizeof (int));
-                if (value == NULL) {
-                    break;
-                }
-                value_int = (int *) value;
-                if (strncasecmp(token, "all", 3) == 0 || strcasecmp(token, "debug") == 0) {
-                    *value_int = AM_LOG_LEVEL_DEBUG;
-                    break;
-                }
-                if (strcasecmp(token, "error") == 0) {
-                    *value_int = AM_LOG_LEVEL_ERROR;
-                    break;
-                }
-                if (strcasecmp(token, "info") == 0) {
-                    *value_int = AM_LOG_LEVEL_INFO;
-                    break;
-                }
-                if (strcasecmp(token, "message") == 0) {
-                    *value_int = AM_LOG_LEVEL_WARNING;
-                    break;
-                }
-                if (strcasecmp(token, "warning") == 0) {
-                    *value_int = AM_LOG_LEVEL_WARNING;
-                    break;
-                }
-                *value_int = AM_LOG_LEVEL_NONE;
+            }
+            value_int = (int *) value;
+            if (strcasecmp(token, "on") == 0 || strcasecmp(token, "true") == 0 || strcasecmp(token, "local") == 0) {
+                *value_int = 1;
                 break;
-            case CONF_ATTR_MODE:
-                value = malloc(sizeof (int));
-                if (value == NULL) {
-                    break;
-                }
-                value_int = (int *) value;
-                if (strcasecmp(token, "HTTP_HEADER") == 0) {
-                    *value_int = AM_SET_ATTRS_AS_HEADER;
-                    break;
-                }
-                if (strcasecmp(token, "HTTP_COOKIE") == 0) {
-                    *value_int = AM_SET_ATTRS_AS_COOKIE;
-                    break;
-                }
-                *value_int = AM_SET_ATTRS_NONE;
+            }
+            if (strcasecmp(token, "off") == 0 || strcasecmp(token, "false") == 0 || strcasecmp(token, "centralized") == 0) {
+                *value_int = 0;
+                break;
+            }
+            *value_int = strtol(token, NULL, AM_BASE_TEN);
+            break;
+        case CONF_DEBUG_LEVEL:
+            value = malloc(sizeof (int));
+            if (value == NULL) {
+                break;
+            }
+            value_int = (int *) value;
+            if (strncasecmp(token, "all", 3) == 0 || strcasecmp(token, "debug") == 0) {
+                *value_int = AM_LOG_LEVEL_DEBUG;
+                break;
+            }
+            if (strcasecmp(token, "error") == 0) {
+                *value_int = AM_LOG_LEVEL_ERROR;
+                break;
+            }
+            if (strcasecmp(token, "info") == 0) {
+                *value_int = AM_LOG_LEVEL_INFO;
+                break;
+            }
+            if (strcasecmp(token, "message") == 0) {
+                *value_int = AM_LOG_LEVEL_WARNING;
+                break;
+            }
+            if (strcasecmp(token, "warning") == 0) {
+                *value_int = AM_LOG_LEVEL_WARNING;
+                break;
+            }
+            *value_int = AM_LOG_LEVEL_NONE;
+            break;
+        case CONF_ATTR_MODE:
+            value = malloc(sizeof (int));
+            if (value == NULL) {
+                break;
+            }
+            value_int = (int *) value;
+            if (strcasecmp(token, "HTTP_HEADER") == 0) {
+                *value_int = AM_SET_ATTRS_AS_HEADER;
                 break;
-            case CONF_AUDIT_LEVEL:
-                value = calloc(1, sizeof (int));
+            }
+            if (strcasecmp(token, "HTTP_COOKIE") == 0) {
+                *value_int = AM_SET_ATTRS_AS_COOKIE;
+                break;
+            }
+            *value_int = AM_SET_ATTRS_NONE;
+            break;
+        case CONF_AUDIT_LEVEL:
+            value = calloc(1, sizeof (int));
+            if (value == NULL) {
+                break;
+            }
+            value_int = (int *) value;
+            if (strcasecmp(token, "LOG_ALLOW") == 0) {
+                *value_int |= AM_LOG_LEVEL_AUDIT_ALLOW;
+                break;
+            }
+            if (strcasecmp(token, "LOG_BOTH") == 0) {
+                *value_int |= AM_LOG_LEVEL_AUDIT_ALLOW;
+                *value_int |= AM_LOG_LEVEL_AUDIT_DENY;
+                break;
+            }
+            if (strcasecmp(token, "LOG_DENY") == 0) {
+                *value_int |= AM_LOG_LEVEL_AUDIT_DENY;
+                break;
+            }
+            break;
+        case CONF_STRING:
+        {
+            if (key_val != NULL) {
+                size_t val_sz = strlen(token);
+                size_t key_sz = strlen(key_val);
+                /* value is stored as:
+                 * key\0value\0
+                 */
+                value = malloc(val_sz + key_sz + 2);
                 if (value == NULL) {
                     break;
                 }
-                value_int = (int *) value;
-                if (strcasecmp(token, "LOG_ALLOW") == 0) {
-                    *value_int |= AM_LOG_LEVEL_AUDIT_ALLOW;
-                    break;
-                }
-                if (strcasecmp(token, "LOG_BOTH") == 0) {
-                    *value_int |= AM_LOG_LEVEL_AUDIT_ALLOW;
-                    *value_int |= AM_LOG_LEVEL_AUDIT_DENY;
-                    break;
-                }
-                if (strcasecmp(token, "LOG_DENY") == 0) {
-                    *value_int |= AM_LOG_LEVEL_AUDIT_DENY;
-                    break;
-                }
+                memcpy(value, key_val, key_sz);
+                ((char *) value)[key_sz] = 0;
+                memcpy((char *) value + key_sz + 1, token, val_sz);
+                ((char *) value)[val_sz + key_sz + 1] = 0;
                 break;
-            case CONF_STRING:
-            {
-                if (map == 1) {
-                    size_t val_sz = strlen(token);
-                    size_t key_sz = strlen(key_val);
-                    /* value is stored as:
-                     * key\0value\0
-                     */
-                    value = malloc(val_sz + key_sz + 2);
-                    if (value == NULL) {
-                        break;
-                    }
-                    memcpy(value, key_val, key_sz);
-                    ((char *) value)[key_sz] = 0;
-                    memcpy((char *) value + key_sz + 1, token, val_sz);
-                    ((char *) value)[val_sz + key_sz + 1] = 0;
-                    free(key_val);
-                    key_val = NULL;
-                    break;
-                }
-                value = strdup(token);
             }
+            value = strdup(token);
+        }
+            break;
+        case CONF_STRING_LIST:
+        {
+            struct val_string_list *ret = NULL;
+            char *sl_token = NULL, *o, *sl_tmp = strdup(token);
+            char **vl = NULL;
+            int i = 0, vl_sz = 0;
+            if (sl_tmp == NULL) {
                 break;
-            case CONF_STRING_LIST:
-            {
-                struct val_string_list *ret = NULL;
-                char *sl_token = NULL, *o, *sl_tmp = strdup(token);
-                char **vl = NULL;
-                int i = 0, vl_sz = 0;
-                if (sl_tmp == NULL) {
-                    break;
-                }
-                o = sl_tmp;
-                while ((sl_token = am_strsep(&sl_tmp, mvsep)) != NULL) {
-                    trim(sl_token, ' ');
-                    if (!sl_token || sl_token[0] == '\0') {
-                        continue;
-                    }
-                    vl_sz++;
-                }
-                free(o);
-                if (vl_sz == 0) {
-                    break;
-                }
-                sl_tmp = strdup(token);
-                if (sl_tmp == NULL) {
-                    break;
-                }
-                o = sl_tmp;
-                vl = malloc(sizeof (char *) * vl_sz);
-                if (vl == NULL) {
-                    free(sl_tmp);
-                    break;
-                }
-                while ((sl_token = am_strsep(&sl_tmp, mvsep)) != NULL) {
-                    trim(sl_token, ' ');
-                    if (!sl_token || sl_token[0] == '\0') {
-                        continue;
-                    }
-                    vl[i] = strdup(sl_token);
-                    if (vl[i] == NULL) {
-                        break;
-                    }
-                    i++;
-                }
-                free(o);
-
-                ret = malloc(sizeof (struct val_string_list));
-                if (ret == NULL) {
-                    for (i = 0; i < vl_sz; i++) {
-                        am_free(vl[i]);
-                    }
-                    free(vl);
-                    break;
-                }
-                ret->size = vl_sz;
-                ret->list = vl;
-                value = ret;
-            }
-                break;
-            case CONF_NUMBER_LIST:
-            {
-                struct val_number_list *ret = NULL;
-                char *sl_token = NULL, *o, *sl_tmp = strdup(token);
-                int *vl = NULL;
-                int i = 0, vl_sz = 0;
-                if (sl_tmp == NULL) {
-                    break;
-                }
-                o = sl_tmp;
-                while ((sl_token = am_strsep(&sl_tmp, mvsep)) != NULL) {
-                    trim(sl_token, ' ');
-                    if (!sl_token || sl_token[0] == '\0') {
-                        continue;
-                    }
-                    vl_sz++;
+            }
+            o = sl_tmp;
+            while ((sl_token = am_strsep(&sl_tmp, mvsep)) != NULL) {
+                trim(sl_token, ' ');
+                if (!sl_token || sl_token[0] == '\0') {
+                    continue;
                 }
-                free(o);
-                if (vl_sz == 0) {
-                    break;
+                vl_sz++;
+            }
+            free(o);
+            if (vl_sz == 0) {
+                break;
+            }
+            sl_tmp = strdup(token);
+            if (sl_tmp == NULL) {
+                break;
+            }
+            o = sl_tmp;
+            vl = malloc(sizeof (char *) * vl_sz);
+            if (vl == NULL) {
+                free(sl_tmp);
+                break;
+            }
+            while ((sl_token = am_strsep(&sl_tmp, mvsep)) != NULL) {
+                trim(sl_token, ' ');
+                if (!sl_token || sl_token[0] == '\0') {
+                    continue;
                 }
-                sl_tmp = strdup(token);
-                if (sl_tmp == NULL) {
+                vl[i] = strdup(sl_token);
+                if (vl[i] == NULL) {
                     break;
                 }
-                o = sl_tmp;
-                vl = malloc(sizeof (int) * vl_sz);
-                if (vl == NULL) {
-                    free(sl_tmp);
-                    break;
+                i++;
+            }
+            free(o);
+
+            ret = malloc(sizeof (struct val_string_list));
+            if (ret == NULL) {
+                for (i = 0; i < vl_sz; i++) {
+                    am_free(vl[i]);
                 }
-                while ((sl_token = am_strsep(&sl_tmp, mvsep)) != NULL) {
-                    trim(sl_token, ' ');
-                    if (!sl_token || sl_token[0] == '\0') {
-                        continue;
-                    }
-                    vl[i] = strtol(sl_token, NULL, AM_BASE_TEN);
-                    i++;
+                free(vl);
+                break;
+            }
+            ret->size = vl_sz;
+            ret->list = vl;
+            value = ret;
+        }
+            break;
+        case CONF_NUMBER_LIST:
+        {
+            struct val_number_list *ret = NULL;
+            char *sl_token = NULL, *o, *sl_tmp = strdup(token);
+            int *vl = NULL;
+            int i = 0, vl_sz = 0;
+            if (sl_tmp == NULL) {
+                break;
+            }
+            o = sl_tmp;
+            while ((sl_token = am_strsep(&sl_tmp, mvsep)) != NULL) {
+                trim(sl_token, ' ');
+                if (!sl_token || sl_token[0] == '\0') {
+                    continue;
                 }
-                free(o);
-
-                ret = malloc(sizeof (struct val_number_list));
-                if (ret == NULL) {
-                    free(vl);
-                    break;
+                vl_sz++;
+            }
+            free(o);
+            if (vl_sz == 0) {
+                break;
+            }
+            sl_tmp = strdup(token);
+            if (sl_tmp == NULL) {
+                break;
+            }
+            o = sl_tmp;
+            vl = malloc(sizeof (int) * vl_sz);
+            if (vl == NULL) {
+                free(sl_tmp);
+                break;
+            }
+            while ((sl_token = am_strsep(&sl_tmp, mvsep)) != NULL) {
+                trim(sl_token, ' ');
+                if (!sl_token || sl_token[0] == '\0') {
+                    continue;
                 }
-                ret->size = vl_sz;
-                ret->list = vl;
-                value = ret;
+                vl[i] = strtol(sl_token, NULL, AM_BASE_TEN);
+                i++;
             }
+            free(o);
+
+            ret = malloc(sizeof (struct val_number_list));
+            if (ret == NULL) {
+                free(vl);
                 break;
+            }
+            ret->size = vl_sz;
+            ret->list = vl;
+            value = ret;
         }
-        am_free(key_val);
+            break;
     }
-    am_free(orig);
     return value;
 }
 
-static void parse_config_value(unsigned long instance_id, const char *line, const char *prm, int type,
-        int *itm_sz, void *itm, const char *sep) {
+/**
+ * Configuration property descriptor: value type and am_config_t field the value is stored in
+ * (with the item count field for lists and maps). Local properties are read only in case
+ * configuration is local.
+ */
+struct config_property {
+    const char *name;
+    int type;
+    int local;
+    size_t offset;
+    size_t size_offset;
+    const char *sep;
+};
+
+#define AM_CONF_VALUE(n, t, l, f) {n, t, l, offsetof(am_config_t, f), 0, NULL}
+#define AM_CONF_LIST(n, t, l, f, s, sep) {n, t, l, offsetof(am_config_t, f), offsetof(am_config_t, s), sep}
+
+static const struct config_property config_properties[] = {
+    /* bootstrap options */
+
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_LOCAL, CONF_NUMBER, AM_FALSE, local),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_POSTDATA_PRESERVE_DIR, CONF_STRING, AM_FALSE, pdp_dir),
+    AM_CONF_LIST(AM_AGENTS_CONFIG_NAMING_URL, CONF_STRING_LIST, AM_FALSE, naming_url, naming_url_sz, AM_SPACE_CHAR),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_REALM, CONF_STRING, AM_FALSE, realm),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_USER, CONF_STRING, AM_FALSE, user),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_PASSWORD, CONF_STRING, AM_FALSE, pass),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_KEY, CONF_STRING, AM_FALSE, key),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_DEBUG_OPT, CONF_NUMBER, AM_FALSE, debug),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_DEBUG_FILE, CONF_STRING, AM_FALSE, debug_file),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_DEBUG_LEVEL, CONF_DEBUG_LEVEL, AM_FALSE, debug_level),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_AUDIT_FILE, CONF_STRING, AM_FALSE, audit_file),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_AUDIT_OPT, CONF_NUMBER, AM_FALSE, audit),
+
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_CERT_KEY_FILE, CONF_STRING, AM_FALSE, cert_key_file),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_CERT_KEY_PASSWORD, CONF_STRING, AM_FALSE, cert_key_pass),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_CERT_FILE, CONF_STRING, AM_FALSE, cert_file),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_CA_FILE, CONF_STRING, AM_FALSE, cert_ca_file),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_CIPHERS, CONF_STRING, AM_FALSE, ciphers),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_TRUST_CERT, CONF_NUMBER, AM_FALSE, cert_trust),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_TLS_OPT, CONF_STRING, AM_FALSE, tls_opts),
+
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_NET_TIMEOUT, CONF_NUMBER, AM_FALSE, net_timeout),
+
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_URL_VALIDATE_LEVEL, CONF_NUMBER, AM_FALSE, valid_level),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_URL_VALIDATE_PING_INTERVAL, CONF_NUMBER, AM_FALSE, valid_ping),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_URL_VALIDATE_PING_MISS, CONF_NUMBER, AM_FALSE, valid_ping_miss),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_URL_VALIDATE_PING_OK, CONF_NUMBER, AM_FALSE, valid_ping_ok),
+    AM_CONF_LIST(AM_AGENTS_CONFIG_URL_VALIDATE_DEFAULT_SET, CONF_NUMBER_LIST, AM_FALSE, valid_default_url, valid_default_url_sz, AM_COMMA_CHAR),
+
+    /*
+     * com.forgerock.agents.config.hostmap format:
+     *  server1.domain.name|192.168.1.1,server2.domain.name|192.168.1.2
+     */
+    AM_CONF_LIST(AM_AGENTS_CONFIG_HOST_MAP, CONF_STRING_LIST, AM_FALSE, hostmap, hostmap_sz, AM_COMMA_CHAR),
+
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_RETRY_MAX, CONF_NUMBER, AM_FALSE, retry_max),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_RETRY_WAIT, CONF_NUMBER, AM_FALSE, retry_wait),
+
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_NOTIF_ENABLE, CONF_NUMBER, AM_FALSE, notif_enable),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_NOTIF_URL, CONF_STRING, AM_FALSE, notif_url),
+
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_LB_ENABLE, CONF_NUMBER, AM_FALSE, lb_enable),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_KEEPALIVE_DISABLE, CONF_NUMBER, AM_FALSE, keepalive_disable),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_LOG_SYNC, CONF_NUMBER, AM_FALSE, log_sync),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_LOG_RATE, CONF_NUMBER, AM_FALSE, log_rate),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_LOG_OVERFLOW_DROP, CONF_NUMBER, AM_FALSE, log_overflow_drop),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_LOG_DEFERRED, CONF_NUMBER, AM_FALSE, log_deferred),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_LOG_FORMAT, CONF_STRING, AM_FALSE, log_format),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_LOG_SEGMENT_SIZE, CONF_NUMBER, AM_FALSE, log_segment_size),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_LOG_COMPRESS_DISABLE, CONF_NUMBER, AM_FALSE, log_compress_disable),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_LOG_RETAIN_FILES, CONF_NUMBER, AM_FALSE, log_retain_files),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_LOG_RETAIN_SIZE, CONF_NUMBER, AM_FALSE, log_retain_size),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_STATUS_URL, CONF_STRING, AM_FALSE, status_url),
+
+
+    /* other options (read in case configuration is local) */
+
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_AGENT_URI, CONF_STRING, AM_TRUE, agenturi),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_COOKIE_NAME, CONF_STRING, AM_TRUE, cookie_name),
+    AM_CONF_LIST(AM_AGENTS_CONFIG_LOGIN_URL_MAP, CONF_STRING_MAP, AM_TRUE, login_url, login_url_sz, NULL),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_COOKIE_SECURE, CONF_NUMBER, AM_TRUE, cookie_secure),
+
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_CMP_CASE_IGNORE, CONF_NUMBER, AM_TRUE, url_eval_case_ignore),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_POLICY_CACHE_VALID, CONF_NUMBER, AM_TRUE, policy_cache_valid),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_TOKEN_CACHE_VALID, CONF_NUMBER, AM_TRUE, token_cache_valid),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_UID_PARAM, CONF_STRING, AM_TRUE, userid_param),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_UID_PARAM_TYPE, CONF_STRING, AM_TRUE, userid_param_type),
+
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_ATTR_PROFILE_MODE, CONF_ATTR_MODE, AM_TRUE, profile_attr_fetch),
+    AM_CONF_LIST(AM_AGENTS_CONFIG_ATTR_PROFILE_MAP, CONF_STRING_MAP, AM_TRUE, profile_attr_map, profile_attr_map_sz, NULL),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_ATTR_SESSION_MODE, CONF_ATTR_MODE, AM_TRUE, session_attr_fetch),
+    AM_CONF_LIST(AM_AGENTS_CONFIG_ATTR_SESSION_MAP, CONF_STRING_MAP, AM_TRUE, session_attr_map, session_attr_map_sz, NULL),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_ATTR_RESPONSE_MODE, CONF_ATTR_MODE, AM_TRUE, response_attr_fetch),
+    AM_CONF_LIST(AM_AGENTS_CONFIG_ATTR_RESPONSE_MAP, CONF_STRING_MAP, AM_TRUE, response_attr_map, response_attr_map_sz, NULL),
+
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_SSO_ONLY, CONF_NUMBER, AM_TRUE, sso_only),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_ACCESS_DENIED_URL, CONF_STRING, AM_TRUE, access_denied_url),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_FQDN_CHECK_ENABLE, CONF_NUMBER, AM_TRUE, fqdn_check_enable),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_FQDN_DEFAULT, CONF_STRING, AM_TRUE, fqdn_default),
+    AM_CONF_LIST(AM_AGENTS_CONFIG_FQDN_MAP, CONF_STRING_MAP, AM_TRUE, fqdn_map, fqdn_map_sz, NULL),
+
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_COOKIE_RESET_ENABLE, CONF_NUMBER, AM_TRUE, cookie_reset_enable),
+    AM_CONF_LIST(AM_AGENTS_CONFIG_COOKIE_RESET_MAP, CONF_STRING_MAP, AM_TRUE, cookie_reset_map, cookie_reset_map_sz, NULL),
+
+    AM_CONF_LIST(AM_AGENTS_CONFIG_NOT_ENFORCED_URL, CONF_STRING_MAP, AM_TRUE, not_enforced_map, not_enforced_map_sz, NULL),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_NOT_ENFORCED_INVERT, CONF_NUMBER, AM_TRUE, not_enforced_invert),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_NOT_ENFORCED_ATTR, CONF_NUMBER, AM_TRUE, not_enforced_fetch_attr),
+    AM_CONF_LIST(AM_AGENTS_CONFIG_NOT_ENFORCED_IP, CONF_STRING_MAP, AM_TRUE, not_enforced_ip_map, not_enforced_ip_map_sz, NULL),
+    AM_CONF_LIST(AM_AGENTS_CONFIG_EXT_NOT_ENFORCED_URL, CONF_STRING_MAP, AM_TRUE, not_enforced_ext_map, not_enforced_ext_map_sz, NULL),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_NOT_ENFORCED_REGEX_ENABLE, CONF_NUMBER, AM_TRUE, not_enforced_regex_enable),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_EXT_NOT_ENFORCED_REGEX_ENABLE, CONF_NUMBER, AM_TRUE, not_enforced_ext_regex_enable),
+
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_PDP_ENABLE, CONF_NUMBER, AM_TRUE, pdp_enable),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_PDP_VALID, CONF_NUMBER, AM_TRUE, pdp_cache_valid),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_PDP_COOKIE, CONF_STRING, AM_TRUE, pdp_lb_cookie),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_PDP_STICKYMODE, CONF_STRING, AM_TRUE, pdp_sess_mode),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_PDP_STICKYVALUE, CONF_STRING, AM_TRUE, pdp_sess_value),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_PDP_URI_PREFIX, CONF_STRING, AM_TRUE, pdp_uri_prefix),
+
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_CLIENT_IP_VALIDATE, CONF_NUMBER, AM_TRUE, client_ip_validate),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_ATTR_COOKIE_PREFIX, CONF_STRING, AM_TRUE, cookie_prefix),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_ATTR_COOKIE_MAX_AGE, CONF_NUMBER, AM_TRUE, cookie_maxage),
+
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_CDSSO_ENABLE, CONF_NUMBER, AM_TRUE, cdsso_enable),
+    AM_CONF_LIST(AM_AGENTS_CONFIG_CDSSO_LOGIN, CONF_STRING_MAP, AM_TRUE, cdsso_login_map, cdsso_login_map_sz, NULL),
+    AM_CONF_LIST(AM_AGENTS_CONFIG_CDSSO_DOMAIN, CONF_STRING_MAP, AM_TRUE, cdsso_cookie_domain_map, cdsso_cookie_domain_map_sz, NULL),
+
+    AM_CONF_LIST(AM_AGENTS_CONFIG_LOGOUT_URL, CONF_STRING_MAP, AM_TRUE, openam_logout_map, openam_logout_map_sz, NULL),
+    AM_CONF_LIST(AM_AGENTS_CONFIG_APP_LOGOUT_URL, CONF_STRING_MAP, AM_TRUE, logout_map, logout_map_sz, NULL),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_LOGOUT_REDIRECT_URL, CONF_STRING, AM_TRUE, logout_redirect_url),
+    AM_CONF_LIST(AM_AGENTS_CONFIG_LOGOUT_COOKIE_RESET, CONF_STRING_MAP, AM_TRUE, logout_cookie_reset_map, logout_cookie_reset_map_sz, NULL),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_LOGOUT_REGEX_ENABLE, CONF_NUMBER, AM_TRUE, logout_regex_enable),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_LOGOUT_URL_REGEX, CONF_STRING, AM_TRUE, logout_url_regex),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_LOGOUT_REDIRECT_DISABLE, CONF_NUMBER, AM_TRUE, logout_redirect_disable),
+
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_POLICY_SCOPE, CONF_NUMBER, AM_TRUE, policy_scope_subtree),
+
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_RESOLVE_CLIENT_HOST, CONF_NUMBER, AM_TRUE, resolve_client_host),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_POLICY_ENCODE_SPECIAL_CHAR, CONF_NUMBER, AM_TRUE, policy_eval_encode_chars),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_COOKIE_ENCODE_SPECIAL_CHAR, CONF_NUMBER, AM_TRUE, cookie_encode_chars),
 
-    if (itm == NULL || compare_property(line, prm) != AM_SUCCESS) {
-        return;
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_OVERRIDE_PROTO, CONF_NUMBER, AM_TRUE, override_protocol),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_OVERRIDE_HOST, CONF_NUMBER, AM_TRUE, override_host),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_OVERRIDE_PORT, CONF_NUMBER, AM_TRUE, override_port),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_OVERRIDE_NOTIFICATION_URL, CONF_NUMBER, AM_TRUE, override_notif_url),
+
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_VALID, CONF_NUMBER, AM_TRUE, config_valid),
+
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_PASSWORD_REPLAY_KEY, CONF_STRING, AM_TRUE, password_replay_key),
+
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_POLICY_CLOCK_SKEW, CONF_NUMBER, AM_TRUE, policy_clock_skew),
+
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_GOTO_PARAM_NAME, CONF_STRING, AM_TRUE, url_redirect_param),
+
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_CACHE_CONTROL_ENABLE, CONF_NUMBER, AM_TRUE, cache_control_enable),
+
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_USE_REDIRECT_ADVICE, CONF_NUMBER, AM_TRUE, use_redirect_for_advice),
+
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_CLIENT_IP_HEADER, CONF_STRING, AM_TRUE, client_ip_header),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_CLIENT_HOSTNAME_HEADER, CONF_STRING, AM_TRUE, client_hostname_header),
+
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_INVALID_URL, CONF_STRING, AM_TRUE, url_check_regex),
+
+    AM_CONF_LIST(AM_AGENTS_CONFIG_CONDITIONAL_LOGIN_URL, CONF_STRING_MAP, AM_TRUE, cond_login_url, cond_login_url_sz, NULL),
+
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_COOKIE_HTTP_ONLY, CONF_NUMBER, AM_TRUE, cookie_http_only),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_MULTI_VALUE_SEPARATOR, CONF_STRING, AM_TRUE, multi_attr_separator),
+
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_IIS_LOGON_USER, CONF_NUMBER, AM_TRUE, logon_user_enable),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_IIS_PASSWORD_HEADER, CONF_NUMBER, AM_TRUE, password_header_enable),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_PDP_JS_REPOST, CONF_NUMBER, AM_TRUE, pdp_js_repost),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_PDP_MAX_SIZE, CONF_NUMBER, AM_TRUE, pdp_max_size),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_CACHE_QUOTA, CONF_NUMBER, AM_TRUE, cache_quota),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_CACHE_ADMISSION, CONF_NUMBER, AM_TRUE, cache_admission),
+
+    AM_CONF_LIST(AM_AGENTS_CONFIG_JSON_URL, CONF_STRING_MAP, AM_TRUE, json_url_map, json_url_map_sz, NULL),
+
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_AUDIT_LEVEL, CONF_AUDIT_LEVEL, AM_TRUE, audit_level),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_AUDIT_REMOTE_INTERVAL, CONF_NUMBER, AM_TRUE, audit_remote_interval),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_AUDIT_REMOTE_FILE, CONF_STRING, AM_TRUE, audit_file_remote),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_AUDIT_DISPOSITION, CONF_STRING, AM_TRUE, audit_file_disposition),
+
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_ANONYMOUS_USER_ENABLE, CONF_NUMBER, AM_TRUE, anon_remote_user_enable),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_ANONYMOUS_USER_ID, CONF_STRING, AM_TRUE, unauthenticated_user),
+
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_IGNORE_PATHINFO, CONF_NUMBER, AM_TRUE, path_info_ignore),
+    AM_CONF_VALUE(AM_AGENTS_CONFIG_IGNORE_PATHINFO_NOT_ENFORCED, CONF_NUMBER, AM_TRUE, path_info_ignore_not_enforced),
+};
+
+#define AM_CONF_PROPERTIES (sizeof (config_properties) / sizeof (config_properties[0]))
+#define AM_CONF_HASH_SIZE 2048 /* power of two, well above the number of properties */
+#define AM_CONF_HASH_SEEDS 65536
+
+/*
+ * Property name lookup table. A hash seed for which every property name gets a slot of its own
+ * is searched for once, so that each configuration line costs a single hash and string compare.
+ * Slot holds the property descriptor index + 1 (zero marks an empty slot).
+ */
+static unsigned short config_property_table[AM_CONF_HASH_SIZE];
+static uint32_t config_property_seed = 0;
+static int config_property_hashed = AM_FALSE;
+#ifdef _WIN32
+static INIT_ONCE config_property_initialized = INIT_ONCE_STATIC_INIT;
+#else
+static pthread_once_t config_property_initialized = PTHREAD_ONCE_INIT;
+#endif
+
+static uint32_t property_hash(const char *name, uint32_t seed) {
+    uint32_t h = 2166136261U ^ seed; /* FNV-1a */
+    for (; *name != '\0'; name++) {
+        h ^= (unsigned char) *name;
+        h *= 16777619U;
     }
+    h ^= h >> 16;
+    return h & (AM_CONF_HASH_SIZE - 1);
+}
+
+static
+#ifdef _WIN32
+BOOL CALLBACK
+#else
+void
+#endif
+build_property_table(
+#ifdef _WIN32
+        PINIT_ONCE io, PVOID p, PVOID *c
+#endif
+        ) {
+    uint32_t seed;
+    unsigned int i;
+
+    for (seed = 1; seed < AM_CONF_HASH_SEEDS && !config_property_hashed; seed++) {
+        memset(config_property_table, 0, sizeof (config_property_table));
+        for (i = 0; i < AM_CONF_PROPERTIES; i++) {
+            uint32_t slot = property_hash(config_properties[i].name, seed);
+            if (config_property_table[slot] != 0) {
+                break;
+            }
+            config_property_table[slot] = (unsigned short) (i + 1);
+        }
+        if (i == AM_CONF_PROPERTIES) {
+            config_property_seed = seed;
+            config_property_hashed = AM_TRUE;
+        }
+    }
+#ifdef _WIN32
+    return TRUE;
+#endif
+}
+
+static const struct config_property *get_config_property(const char *name) {
+    unsigned int i;
+
+    if (config_property_hashed) {
+        unsigned short slot = config_property_table[property_hash(name, config_property_seed)];
+        if (slot != 0 && strcmp(config_properties[slot - 1].name, name) == 0) {
+            return &config_properties[slot - 1];
+        }
+        return NULL;
+    }
+
+    /* no collision free seed found - fall back to a linear search */
+    for (i = 0; i < AM_CONF_PROPERTIES; i++) {
+        if (strcmp(config_properties[i].name, name) == 0) {
+            return &config_properties[i];
+        }
+    }
+    return NULL;
+}
+
+static void parse_config_value(am_config_t *conf, const struct config_property *prop,
+        const char *key_val, const char *token) {
+    unsigned long instance_id = conf->instance_id;
+    const char *prm = prop->name;
+    void *itm = (char *) conf + prop->offset;
+    int *itm_sz = prop->size_offset != 0 ? (int *) ((char *) conf + prop->size_offset) : NULL;
+    int type = prop->type;
 
     switch (type) {
         case CONF_STRING:
         {
             char **value = (char **) itm;
-            *value = (char *) parse_value(line, prm, type, NULL);
+            am_free(*value);
+            *value = (char *) parse_value(token, NULL, type, NULL);
             if (strstr(prm, "password") != NULL) {
                 AM_LOG_DEBUG(instance_id, "am_get_config_file() %s is set to '%s'",
                         prm, *value == NULL ? "NULL" : "********");
@@ -328,7 +554,7 @@ static void parse_config_value(unsigned long instance_id, const char *line, cons
         case CONF_AUDIT_LEVEL:
         {
             int *value = (int *) itm;
-            int *value_tmp = (int *) parse_value(line, prm, type, NULL);
+            int *value_tmp = (int *) parse_value(token, NULL, type, NULL);
             if (value_tmp != NULL) {
                 *value = *value_tmp;
                 free(value_tmp);
@@ -339,8 +565,13 @@ static void parse_config_value(unsigned long instance_id, const char *line, cons
         case CONF_STRING_LIST:
         {
             char ***value = (char ***) itm;
-            struct val_string_list *value_tmp = (struct val_string_list *) parse_value(line, prm, type, sep);
+            struct val_string_list *value_tmp = (struct val_string_list *) parse_value(token, NULL, type, prop->sep);
             if (value_tmp != NULL) {
+                int i;
+                for (i = 0; *value != NULL && i < *itm_sz; i++) {
+                    am_free((*value)[i]);
+                }
+                am_free(*value);
                 *value = value_tmp->list;
                 *itm_sz = value_tmp->size;
                 free(value_tmp);
@@ -351,8 +582,9 @@ static void parse_config_value(unsigned long instance_id, const char *line, cons
         case CONF_NUMBER_LIST:
         {
             int **value = (int **) itm;
-            struct val_number_list *value_tmp = (struct val_number_list *) parse_value(line, prm, type, sep);
+            struct val_number_list *value_tmp = (struct val_number_list *) parse_value(token, NULL, type, prop->sep);
             if (value_tmp != NULL) {
+                am_free(*value);
                 *value = value_tmp->list;
                 *itm_sz = value_tmp->size;
                 free(value_tmp);
@@ -364,7 +596,12 @@ static void parse_config_value(unsigned long instance_id, const char *line, cons
         {
             int old_sz = *itm_sz;
             am_config_map_t **value = (am_config_map_t **) itm;
-            char *value_tmp = (char *) parse_value(line, prm, CONF_STRING, NULL);
+            char *value_tmp;
+            if (key_val == NULL) {
+                AM_LOG_WARNING(instance_id, "am_get_config_file() %s value is missing a map key", prm);
+                break;
+            }
+            value_tmp = (char *) parse_value(token, key_val, CONF_STRING, NULL);
             if (value_tmp == NULL) {
                 break;
             }
@@ -387,6 +624,17 @@ static void parse_config_value(unsigned long instance_id, const char *line, cons
     }
 }
 
+/**
+ * Returns the name of the configuration property 'index' (NULL past the last one).
+ * This is used to provide access to the property table for testing.
+ */
+const char *am_test_get_config_property(int index) {
+    if (index < 0 || (size_t) index >= AM_CONF_PROPERTIES) {
+        return NULL;
+    }
+    return config_properties[index].name;
+}
+
 am_config_t *am_get_config_file(unsigned long instance_id, const char *filename) {
     static const char *thisfunc = "am_get_config_file():";
     am_config_t *conf = NULL;
@@ -411,171 +659,56 @@ am_config_t *am_get_config_file(unsigned long instance_id, const char *filename)
         return NULL;
     }
 
+#ifdef _WIN32
+    InitOnceExecuteOnce(&config_property_initialized, build_property_table, NULL, NULL);
+#else
+    pthread_once(&config_property_initialized, build_property_table);
+#endif
+
     while ((read = get_line(&line, &len, file)) != -1) {
+        const struct config_property *prop;
+        char *name, *value, *key_val = NULL;
+        size_t name_sz;
+
         trim(line, '\n');
         trim(line, '\r');
         trim(line, ' ');
         if (line == NULL || line[0] == '\0' || line[0] == '#') continue;
 
-        /* bootstrap options */
-
-        parse_config_value(instance_id, line, AM_AGENTS_CONFIG_LOCAL, CONF_NUMBER, NULL, &conf->local, NULL);
-        parse_config_value(instance_id, line, AM_AGENTS_CONFIG_POSTDATA_PRESERVE_DIR, CONF_STRING, NULL, &conf->pdp_dir, NULL);
-        parse_config_value(instance_id, line, AM_AGENTS_CONFIG_NAMING_URL, CONF_STRING_LIST, &conf->naming_url_sz, &conf->naming_url, AM_SPACE_CHAR);
-        parse_config_value(instance_id, line, AM_AGENTS_CONFIG_REALM, CONF_STRING, NULL, &conf->realm, NULL);
-        parse_config_value(instance_id, line, AM_AGENTS_CONFIG_USER, CONF_STRING, NULL, &conf->user, NULL);
-        parse_config_value(instance_id, line, AM_AGENTS_CONFIG_PASSWORD, CONF_STRING, NULL, &conf->pass, NULL);
-        parse_config_value(instance_id, line, AM_AGENTS_CONFIG_KEY, CONF_STRING, NULL, &conf->key, NULL);
-        parse_config_value(instance_id, line, AM_AGENTS_CONFIG_DEBUG_OPT, CONF_NUMBER, NULL, &conf->debug, NULL);
-        parse_config_value(instance_id, line, AM_AGENTS_CONFIG_DEBUG_FILE, CONF_STRING, NULL, &conf->debug_file, NULL);
-        parse_config_value(instance_id, line, AM_AGENTS_CONFIG_DEBUG_LEVEL, CONF_DEBUG_LEVEL, NULL, &conf->debug_level, NULL);
-        parse_config_value(instance_id, line, AM_AGENTS_CONFIG_AUDIT_FILE, CONF_STRING, NULL, &conf->audit_file, NULL);
-        parse_config_value(instance_id, line, AM_AGENTS_CONFIG_AUDIT_OPT, CONF_NUMBER, NULL, &conf->audit, NULL);
-
-        parse_config_value(instance_id, line, AM_AGENTS_CONFIG_CERT_KEY_FILE, CONF_STRING, NULL, &conf->cert_key_file, NULL);
-        parse_config_value(instance_id, line, AM_AGENTS_CONFIG_CERT_KEY_PASSWORD, CONF_STRING, NULL, &conf->cert_key_pass, NULL);
-        parse_config_value(instance_id, line, AM_AGENTS_CONFIG_CERT_FILE, CONF_STRING, NULL, &conf->cert_file, NULL);
-        parse_config_value(instance_id, line, AM_AGENTS_CONFIG_CA_FILE, CONF_STRING, NULL, &conf->cert_ca_file, NULL);
-        parse_config_value(instance_id, line, AM_AGENTS_CONFIG_CIPHERS, CONF_STRING, NULL, &conf->ciphers, NULL);
-        parse_config_value(instance_id, line, AM_AGENTS_CONFIG_TRUST_CERT, CONF_NUMBER, NULL, &conf->cert_trust, NULL);
-        parse_config_value(instance_id, line, AM_AGENTS_CONFIG_TLS_OPT, CONF_STRING, NULL, &conf->tls_opts, NULL);
-
-        parse_config_value(instance_id, line, AM_AGENTS_CONFIG_NET_TIMEOUT, CONF_NUMBER, NULL, &conf->net_timeout, NULL);
-
-        parse_config_value(instance_id, line, AM_AGENTS_CONFIG_URL_VALIDATE_LEVEL, CONF_NUMBER, NULL, &conf->valid_level, NULL);
-        parse_config_value(instance_id, line, AM_AGENTS_CONFIG_URL_VALIDATE_PING_INTERVAL, CONF_NUMBER, NULL, &conf->valid_ping, NULL);
-        parse_config_value(instance_id, line, AM_AGENTS_CONFIG_URL_VALIDATE_PING_MISS, CONF_NUMBER, NULL, &conf->valid_ping_miss, NULL);
-        parse_config_value(instance_id, line, AM_AGENTS_CONFIG_URL_VALIDATE_PING_OK, CONF_NUMBER, NULL, &conf->valid_ping_ok, NULL);
-        parse_config_value(instance_id, line, AM_AGENTS_CONFIG_URL_VALIDATE_DEFAULT_SET, CONF_NUMBER_LIST, &conf->valid_default_url_sz, &conf->valid_default_url, AM_COMMA_CHAR);
-
         /*
-         * com.forgerock.agents.config.hostmap format:
-         *  server1.domain.name|192.168.1.1,server2.domain.name|192.168.1.2
+         * Split the line once: name[key] = value. The property name is matched exactly (anything
+         * following the name after a space is ignored). The earlier parser tested every
+         * property name against the start of the line, requiring it to be followed by a space,
+         * '=' or '[' - the same properties are picked up, only a list key without the closing
+         * ']' (which used to lose its last character) is now refused.
          */
-        parse_config_value(instance_id, line, AM_AGENTS_CONFIG_HOST_MAP, CONF_STRING_LIST, &conf->hostmap_sz, &conf->hostmap, AM_COMMA_CHAR);
-
-        parse_config_value(instance_id, line, AM_AGENTS_CONFIG_RETRY_MAX, CONF_NUMBER, NULL, &conf->retry_max, NULL);
-        parse_config_value(instance_id, line, AM_AGENTS_CONFIG_RETRY_WAIT, CONF_NUMBER, NULL, &conf->retry_wait, NULL);
-
-        parse_config_value(instance_id, line, AM_AGENTS_CONFIG_NOTIF_ENABLE, CONF_NUMBER, NULL, &conf->notif_enable, NULL);
-        parse_config_value(instance_id, line, AM_AGENTS_CONFIG_NOTIF_URL, CONF_STRING, NULL, &conf->notif_url, NULL);
-
-        parse_config_value(instance_id, line, AM_AGENTS_CONFIG_LB_ENABLE, CONF_NUMBER, NULL, &conf->lb_enable, NULL);
-        parse_config_value(instance_id, line, AM_AGENTS_CONFIG_KEEPALIVE_DISABLE, CONF_NUMBER, NULL, &conf->keepalive_disable, NULL);
-
-        if (conf->local) { /* do read other options in case configuration is local */
-
-            /* other options */
-
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_AGENT_URI, CONF_STRING, NULL, &conf->agenturi, NULL);
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_COOKIE_NAME, CONF_STRING, NULL, &conf->cookie_name, NULL);
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_LOGIN_URL_MAP, CONF_STRING_MAP, &conf->login_url_sz, &conf->login_url, NULL);
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_COOKIE_SECURE, CONF_NUMBER, NULL, &conf->cookie_secure, NULL);
-
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_CMP_CASE_IGNORE, CONF_NUMBER, NULL, &conf->url_eval_case_ignore, NULL);
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_POLICY_CACHE_VALID, CONF_NUMBER, NULL, &conf->policy_cache_valid, NULL);
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_TOKEN_CACHE_VALID, CONF_NUMBER, NULL, &conf->token_cache_valid, NULL);
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_UID_PARAM, CONF_STRING, NULL, &conf->userid_param, NULL);
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_UID_PARAM_TYPE, CONF_STRING, NULL, &conf->userid_param_type, NULL);
-
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_ATTR_PROFILE_MODE, CONF_ATTR_MODE, NULL, &conf->profile_attr_fetch, NULL);
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_ATTR_PROFILE_MAP, CONF_STRING_MAP, &conf->profile_attr_map_sz, &conf->profile_attr_map, NULL);
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_ATTR_SESSION_MODE, CONF_ATTR_MODE, NULL, &conf->session_attr_fetch, NULL);
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_ATTR_SESSION_MAP, CONF_STRING_MAP, &conf->session_attr_map_sz, &conf->session_attr_map, NULL);
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_ATTR_RESPONSE_MODE, CONF_ATTR_MODE, NULL, &conf->response_attr_fetch, NULL);
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_ATTR_RESPONSE_MAP, CONF_STRING_MAP, &conf->response_attr_map_sz, &conf->response_attr_map, NULL);
-
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_SSO_ONLY, CONF_NUMBER, NULL, &conf->sso_only, NULL);
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_ACCESS_DENIED_URL, CONF_STRING, NULL, &conf->access_denied_url, NULL);
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_FQDN_CHECK_ENABLE, CONF_NUMBER, NULL, &conf->fqdn_check_enable, NULL);
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_FQDN_DEFAULT, CONF_STRING, NULL, &conf->fqdn_default, NULL);
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_FQDN_MAP, CONF_STRING_MAP, &conf->fqdn_map_sz, &conf->fqdn_map, NULL);
-
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_COOKIE_RESET_ENABLE, CONF_NUMBER, NULL, &conf->cookie_reset_enable, NULL);
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_COOKIE_RESET_MAP, CONF_STRING_MAP, &conf->cookie_reset_map_sz, &conf->cookie_reset_map, NULL);
-
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_NOT_ENFORCED_URL, CONF_STRING_MAP, &conf->not_enforced_map_sz, &conf->not_enforced_map, NULL);
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_NOT_ENFORCED_INVERT, CONF_NUMBER, NULL, &conf->not_enforced_invert, NULL);
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_NOT_ENFORCED_ATTR, CONF_NUMBER, NULL, &conf->not_enforced_fetch_attr, NULL);
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_NOT_ENFORCED_IP, CONF_STRING_MAP, &conf->not_enforced_ip_map_sz, &conf->not_enforced_ip_map, NULL);
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_EXT_NOT_ENFORCED_URL, CONF_STRING_MAP, &conf->not_enforced_ext_map_sz, &conf->not_enforced_ext_map, NULL);
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_NOT_ENFORCED_REGEX_ENABLE, CONF_NUMBER, NULL, &conf->not_enforced_regex_enable, NULL);
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_EXT_NOT_ENFORCED_REGEX_ENABLE, CONF_NUMBER, NULL, &conf->not_enforced_ext_regex_enable, NULL);
-
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_PDP_ENABLE, CONF_NUMBER, NULL, &conf->pdp_enable, NULL);
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_PDP_VALID, CONF_NUMBER, NULL, &conf->pdp_cache_valid, NULL);
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_PDP_COOKIE, CONF_STRING, NULL, &conf->pdp_lb_cookie, NULL);
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_PDP_STICKYMODE, CONF_STRING, NULL, &conf->pdp_sess_mode, NULL);
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_PDP_STICKYVALUE, CONF_STRING, NULL, &conf->pdp_sess_value, NULL);
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_PDP_URI_PREFIX, CONF_STRING, NULL, &conf->pdp_uri_prefix, NULL);
-
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_CLIENT_IP_VALIDATE, CONF_NUMBER, NULL, &conf->client_ip_validate, NULL);
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_ATTR_COOKIE_PREFIX, CONF_STRING, NULL, &conf->cookie_prefix, NULL);
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_ATTR_COOKIE_MAX_AGE, CONF_NUMBER, NULL, &conf->cookie_maxage, NULL);
-
-
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_CDSSO_ENABLE, CONF_NUMBER, NULL, &conf->cdsso_enable, NULL);
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_CDSSO_LOGIN, CONF_STRING_MAP, &conf->cdsso_login_map_sz, &conf->cdsso_login_map, NULL);
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_CDSSO_DOMAIN, CONF_STRING_MAP, &conf->cdsso_cookie_domain_map_sz, &conf->cdsso_cookie_domain_map, NULL);
-
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_LOGOUT_URL, CONF_STRING_MAP, &conf->openam_logout_map_sz, &conf->openam_logout_map, NULL);
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_APP_LOGOUT_URL, CONF_STRING_MAP, &conf->logout_map_sz, &conf->logout_map, NULL);
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_LOGOUT_REDIRECT_URL, CONF_STRING, NULL, &conf->logout_redirect_url, NULL);
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_LOGOUT_COOKIE_RESET, CONF_STRING_MAP, &conf->logout_cookie_reset_map_sz, &conf->logout_cookie_reset_map, NULL);
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_LOGOUT_REGEX_ENABLE, CONF_NUMBER, NULL, &conf->logout_regex_enable, NULL);
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_LOGOUT_URL_REGEX, CONF_STRING, NULL, &conf->logout_url_regex, NULL);
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_LOGOUT_REDIRECT_DISABLE, CONF_NUMBER, NULL, &conf->logout_redirect_disable, NULL);
-
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_POLICY_SCOPE, CONF_NUMBER, NULL, &conf->policy_scope_subtree, NULL);
-
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_RESOLVE_CLIENT_HOST, CONF_NUMBER, NULL, &conf->resolve_client_host, NULL);
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_POLICY_ENCODE_SPECIAL_CHAR, CONF_NUMBER, NULL, &conf->policy_eval_encode_chars, NULL);
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_COOKIE_ENCODE_SPECIAL_CHAR, CONF_NUMBER, NULL, &conf->cookie_encode_chars, NULL);
-
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_OVERRIDE_PROTO, CONF_NUMBER, NULL, &conf->override_protocol, NULL);
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_OVERRIDE_HOST, CONF_NUMBER, NULL, &conf->override_host, NULL);
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_OVERRIDE_PORT, CONF_NUMBER, NULL, &conf->override_port, NULL);
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_OVERRIDE_NOTIFICATION_URL, CONF_NUMBER, NULL, &conf->override_notif_url, NULL);
-
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_VALID, CONF_NUMBER, NULL, &conf->config_valid, NULL);
-
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_PASSWORD_REPLAY_KEY, CONF_STRING, NULL, &conf->password_replay_key, NULL);
-
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_POLICY_CLOCK_SKEW, CONF_NUMBER, NULL, &conf->policy_clock_skew, NULL);
-
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_GOTO_PARAM_NAME, CONF_STRING, NULL, &conf->url_redirect_param, NULL);
-
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_CACHE_CONTROL_ENABLE, CONF_NUMBER, NULL, &conf->cache_control_enable, NULL);
-
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_USE_REDIRECT_ADVICE, CONF_NUMBER, NULL, &conf->use_redirect_for_advice, NULL);
-
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_CLIENT_IP_HEADER, CONF_STRING, NULL, &conf->client_ip_header, NULL);
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_CLIENT_HOSTNAME_HEADER, CONF_STRING, NULL, &conf->client_hostname_header, NULL);
-
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_INVALID_URL, CONF_STRING, NULL, &conf->url_check_regex, NULL);
-
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_CONDITIONAL_LOGIN_URL, CONF_STRING_MAP, &conf->cond_login_url_sz, &conf->cond_login_url, NULL);
-
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_COOKIE_HTTP_ONLY, CONF_NUMBER, NULL, &conf->cookie_http_only, NULL);
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_MULTI_VALUE_SEPARATOR, CONF_STRING, NULL, &conf->multi_attr_separator, NULL);
-
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_IIS_LOGON_USER, CONF_NUMBER, NULL, &conf->logon_user_enable, NULL);
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_IIS_PASSWORD_HEADER, CONF_NUMBER, NULL, &conf->password_header_enable, NULL);
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_PDP_JS_REPOST, CONF_NUMBER, NULL, &conf->pdp_js_repost, NULL);
+        value = strchr(line, '=');
+        if (value == NULL) continue;
+        *value++ = '\0';
+        name = line;
+        trim(name, ' ');
+        trim(value, ' ');
+
+        name_sz = strcspn(name, " [");
+        if (name[name_sz] != '\0') {
+            char *key = strchr(name + name_sz, '[');
+            if (key != NULL && key[1] != ']') {
+                size_t name_len = strlen(name);
+                if (name[name_len - 1] != ']') {
+                    AM_LOG_WARNING(instance_id, "%s ignoring %s (list key is not terminated with ']')",
+                            thisfunc, name);
+                    continue;
+                }
+                name[name_len - 1] = '\0'; /* drop the closing ']' */
+                key_val = key + 1;
+            }
+            name[name_sz] = '\0';
+        }
 
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_JSON_URL, CONF_STRING_MAP, &conf->json_url_map_sz, &conf->json_url_map, NULL);
+        prop = get_config_property(name);
+        if (prop == NULL || (prop->local && !conf->local)) continue;
 
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_AUDIT_LEVEL, CONF_AUDIT_LEVEL, NULL, &conf->audit_level, NULL);
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_AUDIT_REMOTE_INTERVAL, CONF_NUMBER, NULL, &conf->audit_remote_interval, NULL);
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_AUDIT_REMOTE_FILE, CONF_STRING, NULL, &conf->audit_file_remote, NULL);
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_AUDIT_DISPOSITION, CONF_STRING, NULL, &conf->audit_file_disposition, NULL);
-        
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_ANONYMOUS_USER_ENABLE, CONF_NUMBER, NULL, &conf->anon_remote_user_enable, NULL);
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_ANONYMOUS_USER_ID, CONF_STRING, NULL, &conf->unauthenticated_user, NULL);
-        
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_IGNORE_PATHINFO, CONF_NUMBER, NULL, &conf->path_info_ignore, NULL);
-            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_IGNORE_PATHINFO_NOT_ENFORCED, CONF_NUMBER, NULL, &conf->path_info_ignore_not_enforced, NULL);
-        }
+        parse_config_value(conf, prop, key_val, value);
     }
 
     conf->ts = time(NULL);
@@ -617,6 +750,13 @@ void am_config_free(am_config_t **cp) {
             am_secure_zero_memory(c->cert_key_pass, c->cert_key_pass_sz);
         }
 
+        if (c->image != NULL) {
+            /* all other values are part of the configuration image block */
+            AM_FREE(c->token, c->config, c->image);
+            free(c);
+            return;
+        }
+
         AM_FREE(c->token, c->config, c->pdp_dir, c->realm, c->user, c->pass,
                 c->key, c->debug_file, c->audit_file, c->cert_key_file,
                 c->cert_key_pass, c->cert_file, c->cert_ca_file, c->ciphers,
@@ -626,7 +766,8 @@ void am_config_free(am_config_t **cp) {
                 c->password_replay_key, c->url_redirect_param, c->client_ip_header,
                 c->client_hostname_header, c->url_check_regex, c->multi_attr_separator,
                 c->pdp_sess_mode, c->pdp_sess_value, c->pdp_uri_prefix, c->logout_url_regex,
-                c->audit_file_remote, c->audit_file_disposition, c->unauthenticated_user);
+                c->audit_file_remote, c->audit_file_disposition, c->unauthenticated_user,
+                c->log_format, c->status_url);
 
         AM_CONF_FREE(c->naming_url_sz, c->naming_url);
         AM_CONF_FREE(c->hostmap_sz, c->hostmap);
@@ -651,3 +792,23 @@ void am_config_free(am_config_t **cp) {
         c = NULL;
     }
 }
+
+/**
+ * Instance log settings (org.forgerock.agents.config.log.* bootstrap properties),
+ * passed on to am_log_register_instance.
+ */
+void am_config_log_options(const am_config_t *c, am_log_options_t *options) {
+    memset(options, 0, sizeof (am_log_options_t));
+    if (c == NULL) {
+        return;
+    }
+    options->sync = c->log_sync;
+    options->rate = c->log_rate;
+    options->overflow_drop = c->log_overflow_drop;
+    options->json = ISVALID(c->log_format) && strcasecmp(c->log_format, "json") == 0;
+    options->deferred = c->log_deferred || options->json;
+    options->segment_size = c->log_segment_size;
+    options->compress_disable = c->log_compress_disable;
+    options->retain_files = c->log_retain_files;
+    options->retain_size = c->log_retain_size;
+}
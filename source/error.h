@@ -17,6 +17,7 @@
 #ifndef ERROR_H
 #define ERROR_H
 
+#define AM__EEXIST                  (-31)
 #define AM__UNKNOWN                 (-30)
 #define AM__ENOTSTARTED             (-29)
 #define AM__EINPROGRESS             (-28)
@@ -92,6 +93,7 @@
   AE(NOT_IMPLEMENTED, "not implemented") \
   AE(DONE, "done") \
   AE(NOT_HANDLING, "not handling") \
+  AE(EEXIST, "already exists") \
   AE(EACCES, "permission denied")                                             
 
 typedef enum {
@@ -854,6 +854,7 @@ class OpenAMHttpModule : public CHttpModule{
         int rv;
         am_request_t d;
         const am_config_t *boot = NULL;
+        am_log_options_t log_options;
         am_config_t *rq_conf = NULL;
         OpenAMStoredConfig *conf = NULL;
         char ip[INET6_ADDRSTRLEN];
@@ -877,8 +878,9 @@ class OpenAMHttpModule : public CHttpModule{
             /* register and update instance logger configuration (for already registered
              * instances - update logging level only)
              */
+            am_config_log_options(boot, &log_options);
             am_log_register_instance(site->GetSiteId(), boot->debug_file, boot->debug_level, boot->debug,
-                    boot->audit_file, boot->audit_level, boot->audit, conf->GetPath(ctx));
+                    boot->audit_file, boot->audit_level, boot->audit, &log_options, conf->GetPath(ctx));
         } else {
             WriteEventLog("%s GetConfig boot == NULL (%d)", thisfunc, site->GetSiteId());
             res->SetStatus(AM_HTTP_STATUS_500, "Internal Server Error");
@@ -909,11 +911,7 @@ class OpenAMHttpModule : public CHttpModule{
         d.content_type = get_server_variable(ctx, d.instance_id, "CONTENT_TYPE");
         d.cookies = get_server_variable(ctx, d.instance_id, "HTTP_COOKIE");
 
-        if (ISVALID(d.conf->client_ip_header)) {
-            d.client_ip = (char *) get_server_variable(ctx, d.instance_id,
-                    d.conf->client_ip_header);
-        }
-        if (!ISVALID(d.client_ip)) {
+        {
             unsigned long s = sizeof (ip);
             PSOCKADDR sa = req->GetRemoteAddress();
             if (sa != NULL) {
@@ -923,7 +921,7 @@ class OpenAMHttpModule : public CHttpModule{
                     if (WSAAddressToStringA((LPSOCKADDR) ipv4, sizeof (*ipv4), NULL, ip, &s) == 0) {
                         char *b = strchr(ip, ':');
                         if (b != NULL) *b = 0;
-                        d.client_ip = ip;
+                        d.peer_ip = ip;
                     }
                 } else {
                     struct sockaddr_in6 *ipv6 = reinterpret_cast<struct sockaddr_in6 *>(sa);
@@ -934,11 +932,18 @@ class OpenAMHttpModule : public CHttpModule{
                         }
                         b = strchr(ip, ']');
                         if (b != NULL) *b = 0;
-                        d.client_ip = ip;
+                        d.peer_ip = ip;
                     }
                 }
             }
         }
+        if (ISVALID(d.conf->client_ip_header)) {
+            d.client_ip = (char *) get_server_variable(ctx, d.instance_id,
+                    d.conf->client_ip_header);
+        }
+        if (!ISVALID(d.client_ip)) {
+            d.client_ip = (char *) d.peer_ip;
+        }
         if (ISVALID(d.conf->client_hostname_header)) {
             d.client_host = (char *) get_server_variable(ctx, d.instance_id,
                     d.conf->client_hostname_header);
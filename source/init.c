@@ -96,10 +96,13 @@ int am_init(int id, int (*init_status_cb)(int)) {
     am_log_init(id, AM_SUCCESS);
     am_configuration_init(id);
     am_audit_init(id);
+    am_stats_init(id);
+    am_pdp_init(id);
     am_audit_processor_init();
     am_url_validator_init();
     rv = am_cache_init(id);
     am_worker_pool_init(init_status_cb);
+    am_notification_init();
 #endif
     return rv;
 }
@@ -112,6 +115,8 @@ int am_init_worker(int id) {
     am_log_init_worker(id, init.error);
     am_configuration_init(id);
     am_audit_init(id);
+    am_stats_init(id);
+    am_pdp_init(id);
     if (init.error == AM_SUCCESS || init.error == AM_EAGAIN) {
         am_audit_processor_init();
         am_url_validator_init();
@@ -119,6 +124,7 @@ int am_init_worker(int id) {
     am_cache_init(id);
 #endif
     am_worker_pool_init(NULL);
+    am_notification_init();
     return 0;
 }
 
@@ -126,6 +132,8 @@ int am_shutdown(int id) {
     am_url_validator_shutdown();
     am_audit_processor_shutdown();
     am_audit_shutdown();
+    am_stats_shutdown();
+    am_pdp_shutdown();
     am_cache_shutdown();
     am_configuration_shutdown();
     am_log_shutdown(id);
@@ -133,6 +141,7 @@ int am_shutdown(int id) {
     am_main_destroy();
 #else
     am_worker_pool_shutdown();
+    am_notification_shutdown();
     am_net_shutdown();
 #endif
     return 0;
@@ -155,6 +164,7 @@ int am_shutdown_worker() {
     am_main_init_unlock();
 #endif
     am_worker_pool_shutdown();
+    am_notification_shutdown();
 #ifdef _WIN32
     am_net_shutdown();
 #endif
@@ -200,7 +210,7 @@ static am_bool_t get_log_shm_name(int id, char *buffer, size_t buffer_sz) {
 
 static am_bool_t unlink_shm(char *shm_name, void (*log_cb)(void *arg, char *name, int error), void *cb_arg) {
     errno = 0;
-    if (shm_unlink(shm_name) == 0) {
+    if (am_shm_unlink(shm_name) == 0) {
         // warn: shared memory was present but successfully cleared
         log_cb(cb_arg, shm_name, 0);
     } else if (errno != ENOENT) {
@@ -271,6 +281,14 @@ am_status_t am_remove_shm_and_locks(int id, void (*log_cb)(void *arg, char *name
         status = AM_ERROR;
     }
 
+    if (!(get_shm_name(AM_STATS_SHM_NAME, id, name, sizeof (name)) && unlink_shm(name, log_cb, cb_arg))) {
+        status = AM_ERROR;
+    }
+
+    if (!(get_shm_name(AM_PDP_SHM_NAME, id, name, sizeof (name)) && unlink_shm(name, log_cb, cb_arg))) {
+        status = AM_ERROR;
+    }
+
     if (!(get_log_shm_name(id, name, sizeof (name)) && unlink_shm(name, log_cb, cb_arg))) {
         status = AM_ERROR;
     }
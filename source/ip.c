@@ -449,3 +449,20 @@ am_status_t ip_address_match(const char *ip, const char **list, unsigned int lis
     }
     return AM_NOT_FOUND;
 }
+
+/**
+ * Test whether an ip address is a loopback address (127.0.0.0/8, ::1 or an IPv4-mapped 127.x address).
+ */
+am_bool_t ip_address_loopback(const char *ip) {
+    static const char *loopback[] = {"127.0.0.0/8", "::1/128", "::ffff:127.0.0.0/104"};
+    unsigned int i;
+    if (ISINVALID(ip)) {
+        return AM_FALSE;
+    }
+    for (i = 0; i < sizeof (loopback) / sizeof (loopback[0]); i++) {
+        if (get_in_masked_range_status(ip, loopback[i]) == AM_SUCCESS) {
+            return AM_TRUE;
+        }
+    }
+    return AM_FALSE;
+}
@@ -18,8 +18,12 @@
 #include "am.h"
 #include "utility.h"
 #include "version.h"
+#include "thread.h"
 
-#define AM_LOG_BUFFER_MASK(index, size) ((index) & ((size) - 1))
+#define AM_LOG_CACHE_LINE       64
+#define AM_LOG_ALIGN(s)         (((s) + AM_LOG_CACHE_LINE - 1) & ~((uint64_t) AM_LOG_CACHE_LINE - 1))
+#define AM_LOG_RING_MIN_SIZE    (AM_LOG_MESSAGE_SIZE * 16)
+#define AM_LOG_RING_MAX_SIZE    (256 * 1024 * 1024)
 
 #if defined(_WIN32)
 static HANDLE ic_sem = NULL;
@@ -40,6 +44,7 @@ struct am_shared_log {
     pid_t reader_pid;
     pthread_t reader_thr;
 #endif
+    am_timer_event_t *maintenance; /* log file rotation, compression and retention (see log_maintenance) */
 };
 
 static struct am_shared_log *am_log_handle = NULL;
@@ -59,13 +64,64 @@ static struct am_shared_log_lock_s am_log_lck = {NULL, NULL, NULL, NULL};
 
 #endif
 
+enum {
+    AM_LOG_RECORD_FREE = 0,
+    AM_LOG_RECORD_COMMITTED,
+    AM_LOG_RECORD_PADDING /* unused space at the end of the ring, skip to the ring start */
+};
+
+enum {
+    AM_LOG_OVERFLOW_BLOCK = 0,
+    AM_LOG_OVERFLOW_DROP
+};
+
+/**
+ * Log ring record. Records are variable length and always start at a cache line
+ * boundary. A record is not visible to the log worker until its state is set to
+ * AM_LOG_RECORD_COMMITTED (or AM_LOG_RECORD_PADDING).
+ */
+struct log_record {
+    volatile uint32_t state;
+    uint32_t size; /* record size, including this header; a multiple of AM_LOG_CACHE_LINE */
+    uint32_t data_size;
+    int level;
+    uint32_t flags; /* AM_LOG_RECORD_DEFERRED - data is a struct log_deferred, not text */
+    unsigned long instance_id;
+    char data[1];
+};
+
+#define AM_LOG_RECORD_DEFERRED 0x1
+
+enum {
+    AM_LOG_ROTATE_NONE = 0,
+    AM_LOG_ROTATE_SIZE, /* rotate into <file>.<n> (by size or date) */
+    AM_LOG_ROTATE_SEGMENT, /* roll over into a segment file, see segment_file_name */
+    AM_LOG_ROTATE_REOPEN /* file has been renamed or deleted externally, just re-open it */
+};
+
+struct log_message {
+    char *data;
+    size_t size;
+};
+
+#define AM_LOG_RECORD_HEADER offsetof(struct log_record, data)
+
+/**
+ * Multi-producer, single-consumer log ring: writers reserve space by advancing
+ * the head (compare-and-swap, no locks), fill their record in and commit it;
+ * the log worker reads committed records in the order of reservation, zeroes
+ * them and advances the tail. Head and tail are byte counters which are never
+ * wrapped, ring position is (counter & (ring_size - 1)).
+ */
 struct am_log {
-    volatile unsigned int in;
-    volatile unsigned int out;
-    volatile unsigned int read_count;
-    volatile unsigned int write_count;
-    unsigned int bucket_count;
-    unsigned int bucket_size;
+    volatile uint64_t head; /* next byte to be reserved by a writer */
+    char head_pad[AM_LOG_CACHE_LINE - sizeof (uint64_t)];
+    volatile uint64_t tail; /* next byte to be read by the log worker */
+    char tail_pad[AM_LOG_CACHE_LINE - sizeof (uint64_t)];
+    volatile int reader_waiting;
+    volatile int writers_waiting;
+    uint64_t ring_size; /* ring capacity in bytes, a power of two */
+    volatile uint32_t level_generation; /* files[] level table version: odd while being updated */
 #ifndef _WIN32
     pthread_mutex_t lock;
     pthread_mutex_t exit;
@@ -73,14 +129,6 @@ struct am_log {
     pthread_cond_t new_space_cond;
 #endif
 
-    struct log_bucket {
-        char data[AM_LOG_MESSAGE_SIZE];
-        size_t size;
-        unsigned long instance_id;
-        int level;
-        volatile char ready_to_read;
-    } bucket[AM_LOG_QUEUE_SIZE];
-
     struct log_files {
         int used;
         unsigned long instance_id;
@@ -95,9 +143,36 @@ struct am_log {
         int level_audit;
         time_t created_debug;
         time_t created_audit;
+        int sync; /* 0 - fsync after each batch, >0 - at most every N seconds, -1 - never */
+        int rate; /* max number of messages per second, per call site and level (0 - no limit) */
+        int overflow; /* AM_LOG_OVERFLOW_BLOCK or AM_LOG_OVERFLOW_DROP */
+        int deferred; /* log.h macros store deferred (binary) records, see am_log_record */
+        int json; /* write records as JSON objects (implies deferred) */
+        uint64_t segment_size; /* roll log files over into segments of this size (0 - disabled) */
+        int compress; /* gzip rotated log files */
+        unsigned int retain_files; /* max number of rotated files kept per log file (0 - no limit) */
+        uint64_t retain_size; /* max size of rotated files kept per log file (0 - no limit) */
+        time_t synced_debug;
+        time_t synced_audit;
+        int pending_debug;
+        int pending_audit;
+        volatile uint64_t dropped; /* number of messages dropped on log ring overflow */
+        uint64_t dropped_reported;
+        volatile int rotate_debug; /* rotation requested by the log worker (AM_LOG_ROTATE_*) */
+        volatile int rotate_audit;
+        char rotated_debug[AM_PATH_SIZE]; /* rotated file, waiting to be compressed */
+        char rotated_audit[AM_PATH_SIZE];
+        volatile int closed_debug; /* rotated file has been closed by the log worker */
+        volatile int closed_audit;
 #ifndef _WIN32
-        ino_t node_debug;
+        volatile int fd_next_debug; /* new file opened by log_maintenance, taken over by the log worker */
+        volatile int fd_next_audit;
+        uint64_t size_debug; /* current file size, tracked by the writer */
+        uint64_t size_audit;
+        ino_t node_debug; /* fd_debug/fd_audit and their inodes are only ever used by the log worker */
         ino_t node_audit;
+        time_t checked_debug; /* last check for a file renamed or deleted externally */
+        time_t checked_audit;
 #endif
     } files[AM_MAX_INSTANCES];
 
@@ -117,6 +192,52 @@ struct am_log {
     } init[AM_MAX_INSTANCES];
 };
 
+#define AM_LOG_RING(log) ((char *) (log) + AM_LOG_ALIGN(sizeof (struct am_log)))
+
+#define AM_LOG_LEVEL_CACHE_SIZE 4 /* must be a power of two */
+
+/**
+ * Per-thread copy of instance log and audit levels, valid for as long as the
+ * shared level table generation does not change.
+ */
+static AM_THREAD_LOCAL struct log_level_cache {
+    void *area;
+    unsigned long instance_id;
+    uint32_t generation;
+    int slot;
+    int level_debug;
+    int level_audit;
+    int rate;
+    int deferred;
+} level_cache[AM_LOG_LEVEL_CACHE_SIZE];
+
+#define AM_LOG_RATE_SITES       256 /* must be a power of two */
+#define AM_LOG_RATE_PROBE       8
+
+/**
+ * Per-process log rate limiter state, one token bucket per call site and level.
+ * The bucket state is the last refill time (seconds, upper 32 bits) and the number
+ * of tokens left (lower 32 bits).
+ */
+static struct log_site {
+    volatile uint64_t key;
+    volatile uint64_t state;
+    volatile uint64_t suppressed;
+} log_sites[AM_LOG_RATE_SITES];
+
+/**
+ * Level table update (seqlock write side). Must be called with log->lock held.
+ */
+static void log_levels_update_begin(struct am_log *log) {
+    log->level_generation++;
+    AM_MEMORY_BARRIER();
+}
+
+static void log_levels_update_end(struct am_log *log) {
+    AM_MEMORY_BARRIER();
+    log->level_generation++;
+}
+
 #ifndef _WIN32
 
 /*****************************************************************************************/
@@ -134,21 +255,58 @@ static am_bool_t should_exit(pthread_mutex_t *mtx) {
 
 /*****************************************************************************************/
 
-static void rename_file(const char *file_name) {
-    unsigned int idx = 1;
-    static char tmp[AM_PATH_SIZE];
+#endif /* _WIN32 */
+
+/*****************************************************************************************/
+
+/**
+ * Check whether a rotated file (or its compressed copy) exists.
+ */
+static am_bool_t rotated_file_exists(const char *file_name) {
+    char gz[AM_PATH_SIZE];
+    snprintf(gz, sizeof (gz), "%s.gz", file_name);
+#ifdef _WIN32
+    return _access(file_name, 0) == 0 || _access(gz, 0) == 0;
+#else
+    return access(file_name, F_OK) == 0 || access(gz, F_OK) == 0;
+#endif
+}
+
+/**
+ * Name of a log segment file: <file_name>.<UTC date and time>.<sequence>, e.g. audit.log.20151020T101500Z.000;
+ * segment names sort in the order the segments were written.
+ */
+static void segment_file_name(char *buf, size_t size, const char *file_name) {
+    char ts[32];
+    struct tm now;
+    time_t t = time(NULL);
+    unsigned int idx = 0;
+#ifdef _WIN32
+    gmtime_s(&now, &t);
+#else
+    gmtime_r(&t, &now);
+#endif
+    strftime(ts, sizeof (ts), "%Y%m%dT%H%M%SZ", &now);
     do {
-        snprintf(tmp, sizeof (tmp), "%s.%d", file_name, idx);
+        snprintf(buf, size, "%s.%s.%03u", file_name, ts, idx);
         idx++;
-    } while (access(tmp, F_OK) == 0);
-    if (rename(file_name, tmp) != 0) {
-        fprintf(stderr, "could not rotate log file %s (error: %d)\n", file_name, errno);
-    }
+    } while (rotated_file_exists(buf));
 }
 
-#endif /* _WIN32 */
-
-/*****************************************************************************************/
+/**
+ * Name of a rotated log file: <file_name>.<n> (first unused index) or a segment file name.
+ */
+static void rotated_file_name(char *buf, size_t size, const char *file_name, int segment) {
+    unsigned int idx = 1;
+    if (segment) {
+        segment_file_name(buf, size, file_name);
+        return;
+    }
+    do {
+        snprintf(buf, size, "%s.%d", file_name, idx);
+        idx++;
+    } while (rotated_file_exists(buf));
+}
 
 static am_bool_t should_rotate_time(time_t ct) {
     time_t ts = ct;
@@ -159,263 +317,1166 @@ static am_bool_t should_rotate_time(time_t ct) {
     return AM_FALSE;
 }
 
+/**
+ * Format a log message header (same as the one set by the log.h macros) for the message
+ * logged at sec.usec (seconds and microseconds since the epoch) by the thread/pid.
+ */
+static int log_header_at(char *buf, size_t size, const char *level, int64_t sec, long usec,
+        uint64_t thread, int pid, const char *file, int line) {
+    int sz;
+#ifdef _WIN32
+    char time_string[25];
+    char tze[6];
+    int minutes;
+    TIME_ZONE_INFORMATION tz;
+    SYSTEMTIME st;
+    ULARGE_INTEGER ut;
+    FILETIME ft, lft;
+
+    ut.QuadPart = (ULONGLONG) sec * 10000000 + (ULONGLONG) usec * 10 + 116444736000000000ULL;
+    ft.dwLowDateTime = ut.LowPart;
+    ft.dwHighDateTime = ut.HighPart;
+    FileTimeToLocalFileTime(&ft, &lft);
+    FileTimeToSystemTime(&lft, &st);
+    GetTimeZoneInformation(&tz);
+    GetTimeFormatA(LOCALE_USER_DEFAULT, TIME_NOTIMEMARKER | TIME_FORCE24HOURFORMAT, &st,
+            "HH':'mm':'ss", time_string, sizeof (time_string));
+    minutes = -(tz.Bias);
+    sprintf_s(tze, sizeof (tze), "%03d%02d", minutes / 60, abs(minutes % 60));
+    if (*tze == '0') {
+        *tze = '+';
+    }
+    sz = sprintf_s(buf, size, "%04d-%02d-%02d %s.%03d %s %s [%d:%d]",
+            st.wYear, st.wMonth, st.wDay, time_string, st.wMilliseconds, tze, level,
+            (int) thread, pid);
+#else
+    char time_string[25];
+    char tz[8];
+    struct tm now;
+    time_t ts = (time_t) sec;
+    localtime_r(&ts, &now);
+    strftime(time_string, sizeof (time_string) - 1, "%Y-%m-%d %H:%M:%S", &now);
+    strftime(tz, sizeof (tz) - 1, "%z", &now);
+    sz = snprintf(buf, size, "%s.%03ld %s %s [%p:%d]",
+            time_string, usec / 1000L, tz, level, (void *) (uintptr_t) thread, pid);
+#endif
+    if (sz < 0 || (size_t) sz >= size) {
+        return 0;
+    }
+    if (file != NULL) {
+        int fsz = snprintf(buf + sz, size - sz, "[%s:%d]", file, line);
+        if (fsz > 0 && (size_t) fsz < size - sz) {
+            sz += fsz;
+        }
+    }
+    if ((size_t) sz + 1 < size) {
+        buf[sz++] = ' ';
+        buf[sz] = '\0';
+    }
+    return sz;
+}
+
+/**
+ * Current time (seconds and microseconds since the epoch) and the calling thread id.
+ */
+static void log_now(int64_t *sec, long *usec, uint64_t *thread) {
+#ifdef _WIN32
+    FILETIME ft;
+    ULARGE_INTEGER ut;
+    GetSystemTimeAsFileTime(&ft);
+    ut.LowPart = ft.dwLowDateTime;
+    ut.HighPart = ft.dwHighDateTime;
+    ut.QuadPart -= 116444736000000000ULL;
+    *sec = (int64_t) (ut.QuadPart / 10000000);
+    *usec = (long) ((ut.QuadPart % 10000000) / 10);
+    *thread = GetCurrentThreadId();
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    *sec = tv.tv_sec;
+    *usec = tv.tv_usec;
+    *thread = (uint64_t) (uintptr_t) pthread_self();
+#endif
+}
+
+/**
+ * Format a log message header for the messages written by the log worker itself.
+ */
+static int log_header(char *buf, size_t size, const char *level) {
+    int64_t sec;
+    long usec;
+    uint64_t thread;
+    log_now(&sec, &usec, &thread);
+    return log_header_at(buf, size, level, sec, usec, thread, getpid(), NULL, 0);
+}
+
 /*****************************************************************************************/
 
-static void *am_log_worker(void *arg) {
-    struct am_log *log = AM_LOG();
-    int i, level, is_audit;
-    unsigned int index;
-    char *data;
-    size_t data_sz;
-    unsigned long instance_id;
+/**
+ * Open instance log and/or audit file (if not opened already) and read its current size.
+ */
+static int log_file_open(struct log_files *f, int is_audit) {
+    char *file_name = is_audit ? f->name_audit : f->name_debug;
     struct stat st;
-    struct log_files *f;
+    int fd;
+#ifdef _WIN32
+    fd = _open(file_name, _O_CREAT | _O_WRONLY | _O_APPEND | _O_BINARY, _S_IREAD | _S_IWRITE);
+    if (fd != -1 && stat(file_name, &st) == 0) {
+        if (is_audit) {
+            f->created_audit = st.st_ctime;
+        } else {
+            f->created_debug = st.st_ctime;
+        }
+        f->owner = getpid();
+    }
+#else
+    fd = open(file_name, O_CREAT | O_WRONLY | O_APPEND, S_IWUSR | S_IRUSR);
+    if (fd != -1 && fstat(fd, &st) == 0) {
+        if (is_audit) {
+            f->node_audit = st.st_ino;
+            f->created_audit = st.st_ctime;
+            f->size_audit = st.st_size;
+        } else {
+            f->node_debug = st.st_ino;
+            f->created_debug = st.st_ctime;
+            f->size_debug = st.st_size;
+        }
+        f->owner = getpid();
+    }
+#endif
+    if (is_audit) {
+        f->fd_audit = fd;
+    } else {
+        f->fd_debug = fd;
+    }
+    return fd;
+}
 
-    if (log == NULL) {
-        return NULL;
+#ifndef _WIN32
+
+/**
+ * Take over the file opened by log_maintenance after rotation (atomic fd exchange):
+ * the new file descriptor replaces the current one, which is closed.
+ */
+static void log_file_swap(struct log_files *f, int is_audit) {
+    volatile int *fd_next = is_audit ? &f->fd_next_audit : &f->fd_next_debug;
+    int *fd = is_audit ? &f->fd_audit : &f->fd_debug;
+    int old = *fd, next = *fd_next;
+    struct stat st;
+
+    if (next == -1 || !AM_ATOMIC_CAS_32(fd_next, next, -1)) {
+        return;
+    }
+    *fd = next;
+    if (fstat(*fd, &st) == 0) {
+        if (is_audit) {
+            f->node_audit = st.st_ino;
+            f->created_audit = st.st_ctime;
+            f->size_audit = st.st_size;
+        } else {
+            f->node_debug = st.st_ino;
+            f->created_debug = st.st_ctime;
+            f->size_debug = st.st_size;
+        }
+    }
+    if (old != -1) {
+        if (f->sync >= 0) fsync(old);
+        close(old);
+    }
+    AM_MEMORY_BARRIER();
+    if (is_audit) {
+        f->closed_audit = AM_TRUE;
+    } else {
+        f->closed_debug = AM_TRUE;
     }
+}
 
+#endif
+
+static am_bool_t log_files_open(struct log_files *f) {
+#ifndef _WIN32
+    /* switch over to the new file(s) after rotation */
+    if (f->fd_next_debug != -1) {
+        log_file_swap(f, AM_FALSE);
+    }
+    if (f->fd_next_audit != -1) {
+        log_file_swap(f, AM_TRUE);
+    }
+#endif
+    if (f->fd_debug == -1 && log_file_open(f, AM_FALSE) == -1) {
+        fprintf(stderr, "am_log_worker() failed to open log file %s: error: %d", f->name_debug, errno);
+        return AM_FALSE;
+    }
+    if (f->fd_audit == -1 && log_file_open(f, AM_TRUE) == -1) {
+        fprintf(stderr, "am_log_worker() failed to open audit file %s: error: %d", f->name_audit, errno);
+        return AM_FALSE;
+    }
+    return AM_TRUE;
+}
+
+/*****************************************************************************************/
+
+
+/**
+ * Write a run of messages (all for the same instance log or audit file).
+ */
+static void log_write_messages(struct log_files *f, int is_audit, struct log_message *msg, int count) {
+    int file_handle = is_audit ? f->fd_audit : f->fd_debug;
 #ifdef _WIN32
-    WaitForSingleObject(am_log_lck.lock, INFINITE);
+    int i;
+    for (i = 0; i < count; i++) {
+        write(file_handle, msg[i].data, (unsigned int) msg[i].size);
+        write(file_handle, "\r\n", 2);
+    }
 #else
-    pthread_mutex_lock(&log->lock);
+    struct iovec iov[AM_LOG_BATCH_SIZE * 2], *v = iov;
+    ssize_t wrote;
+    int i, n = count * 2;
+    for (i = 0; i < count; i++) {
+        iov[i * 2].iov_base = msg[i].data;
+        iov[i * 2].iov_len = msg[i].size;
+        iov[i * 2 + 1].iov_base = "\n";
+        iov[i * 2 + 1].iov_len = 1;
+    }
+    while (n > 0) {
+        wrote = writev(file_handle, v, n);
+        if (wrote < 0 && errno == EINTR) {
+            continue;
+        }
+        if (wrote <= 0) {
+            break;
+        }
+        if (is_audit) {
+            f->size_audit += wrote;
+        } else {
+            f->size_debug += wrote;
+        }
+        /* short write (disk full, signal, pipe) - skip over what went out and retry the rest */
+        while (n > 0 && (size_t) wrote >= v->iov_len) {
+            wrote -= v->iov_len;
+            v++;
+            n--;
+        }
+        if (n > 0) {
+            v->iov_base = (char *) v->iov_base + wrote;
+            v->iov_len -= wrote;
+        }
+    }
 #endif
+    if (is_audit) {
+        f->pending_audit = AM_TRUE;
+    } else {
+        f->pending_debug = AM_TRUE;
+    }
+}
 
-    for (;;) {
-        index = log->out;
 
+/**
+ * Batch boundary: sync (as configured) and check whether the log or audit file is due
+ * for rotation. Rotation itself (rename, re-open, compression) is done by log_maintenance,
+ * the log worker only swaps in the new file once it is ready.
+ */
+static void log_file_commit(struct log_files *f, int is_audit) {
+    int file_handle = is_audit ? f->fd_audit : f->fd_debug;
+    int max_size = is_audit ? f->max_size_audit : f->max_size_debug;
+    time_t file_created = is_audit ? f->created_audit : f->created_debug;
+    time_t *synced = is_audit ? &f->synced_audit : &f->synced_debug;
+    volatile int *rotate = is_audit ? &f->rotate_audit : &f->rotate_debug;
+    time_t now = time(NULL);
+    uint64_t segment_size = f->segment_size;
+    uint64_t file_size = 0;
 #ifdef _WIN32
-        while (log->read_count == 0 || !log->bucket[index].ready_to_read) {
-            ReleaseMutex(am_log_lck.lock);
-            if (WaitForSingleObject(am_log_lck.new_data_cond, 1000) == WAIT_TIMEOUT) {
-                if (WaitForSingleObject(am_log_lck.exit, 0) == WAIT_OBJECT_0) {
-                    return NULL;
-                }
-            }
-            WaitForSingleObject(am_log_lck.lock, INFINITE);
-        }
+    BY_HANDLE_FILE_INFORMATION info;
+
+    if (f->sync == 0 || (f->sync > 0 && difftime(now, *synced) >= f->sync)) {
+        _commit(file_handle);
+        *synced = now;
+    }
+    if ((max_size > 0 || segment_size > 0) &&
+            GetFileInformationByHandle((HANDLE) _get_osfhandle(file_handle), &info)) {
+        file_size = ((DWORDLONG) (((DWORD) (info.nFileSizeLow)) |
+                (((DWORDLONG) ((DWORD) (info.nFileSizeHigh))) << 32)));
+    }
+
+    /* file is re-opened with each batch; log_maintenance renames it while it is closed */
+    _close(file_handle);
+    if (is_audit) {
+        f->fd_audit = -1;
+    } else {
+        f->fd_debug = -1;
+    }
 #else
-        while (log->read_count == 0 || !log->bucket[index].ready_to_read) {
-            struct timeval now = {0, 0};
-            struct timespec ts = {0, 0};
-            gettimeofday(&now, NULL);
-            ts.tv_sec = now.tv_sec + 1;
-            ts.tv_nsec = now.tv_usec * 1000;
-            if (pthread_cond_timedwait(&log->new_data_cond, &log->lock, &ts) == ETIMEDOUT) {
-                if (should_exit(&log->exit)) {
-                    pthread_mutex_unlock(&log->lock);
-                    return NULL;
-                }
-            }
+    volatile int *fd_next = is_audit ? &f->fd_next_audit : &f->fd_next_debug;
+    time_t *checked = is_audit ? &f->checked_audit : &f->checked_debug;
+    struct stat st;
+
+    if (f->sync == 0 || (f->sync > 0 && difftime(now, *synced) >= f->sync)) {
+        fsync(file_handle);
+        *synced = now;
+    }
+    if (*fd_next != -1) {
+        return; /* rotation is complete, new file is taken over with the next batch */
+    }
+    file_size = is_audit ? f->size_audit : f->size_debug;
+#endif
+
+    if (*rotate != AM_LOG_ROTATE_NONE) {
+        return; /* already requested */
+    }
+    if (segment_size > 0 && file_size >= segment_size) {
+        /* roll over to a new segment */
+        *rotate = AM_LOG_ROTATE_SEGMENT;
+    } else if ((max_size == -1 && should_rotate_time(file_created)) ||
+            (max_size > 0 && (file_size + 1024) > (uint64_t) max_size)) {
+        /* rotate by date or size */
+        *rotate = AM_LOG_ROTATE_SIZE;
+    }
+#ifndef _WIN32
+    else if (difftime(now, *checked) >= AM_LOG_MAINTENANCE_INTERVAL) {
+        char *file_name = is_audit ? f->name_audit : f->name_debug;
+        ino_t file_inode = is_audit ? f->node_audit : f->node_debug;
+        *checked = now;
+        if (stat(file_name, &st) != 0 || st.st_ino != file_inode) {
+            /* renamed or deleted externally - log_maintenance opens a new file */
+            *rotate = AM_LOG_ROTATE_REOPEN;
         }
-#endif  /* _WIN32 */
+    }
+#endif
+}
+
+/**
+ * Compress the rotated log or audit file once the log worker has closed it and delete
+ * old rotated files according to the retention settings.
+ */
+static void log_compress_rotated(struct am_log *log, struct log_files *f, int is_audit) {
+    char *file_name = is_audit ? f->name_audit : f->name_debug;
+    char *rotated = is_audit ? f->rotated_audit : f->rotated_debug;
+    volatile int *closed = is_audit ? &f->closed_audit : &f->closed_debug;
+    char gz[AM_PATH_SIZE + 3]; /* rotated file name + ".gz" */
+
+    if (ISINVALID(rotated) || !*closed) {
+        return;
+    }
+    AM_MEMORY_BARRIER();
+    snprintf(gz, sizeof (gz), "%s.gz", rotated);
+    if (f->compress && gzip_file(rotated, gz) == AM_SUCCESS) {
+        unlink(rotated);
+    }
+    rotated[0] = '\0';
+    delete_rotated_files(file_name, f->retain_files, f->retain_size);
+}
+
+/**
+ * Rotate (or re-open) the log or audit file as requested by the log worker.
+ */
+static void log_maintain_file(struct am_log *log, struct log_files *f, int is_audit) {
+    char *file_name = is_audit ? f->name_audit : f->name_debug;
+    char *rotated = is_audit ? f->rotated_audit : f->rotated_debug;
+    volatile int *rotate = is_audit ? &f->rotate_audit : &f->rotate_debug;
+    volatile int *closed = is_audit ? &f->closed_audit : &f->closed_debug;
+#ifndef _WIN32
+    volatile int *fd_next = is_audit ? &f->fd_next_audit : &f->fd_next_debug;
+#endif
+
+    log_compress_rotated(log, f, is_audit);
 
-        log->bucket[index].ready_to_read = AM_FALSE;
 #ifdef _WIN32
-        ReleaseMutex(am_log_lck.lock);
+    if (*rotate != AM_LOG_ROTATE_NONE && ISINVALID(rotated)) {
+        char tmp[AM_PATH_SIZE];
+        rotated_file_name(tmp, sizeof (tmp), file_name, *rotate == AM_LOG_ROTATE_SEGMENT);
+        /* fails with a sharing violation while the log worker has the file open - retry with the next run */
+        if (MoveFileExA(file_name, tmp, 0)) {
+            strcpy(rotated, tmp);
+            *closed = AM_TRUE;
+            *rotate = AM_LOG_ROTATE_NONE;
+        }
+    }
 #else
-        pthread_mutex_unlock(&log->lock);
-#endif  /* _WIN32 */
+    /* rotation is requested by the log worker (which owns the open files, see log_file_commit);
+     * all that is shared with it here are the rotate/closed flags and the new file in fd_next */
+    if (*fd_next != -1 || ISVALID(rotated)) {
+        return; /* the previous rotation is not complete */
+    }
+    if (*rotate != AM_LOG_ROTATE_NONE) {
+        char tmp[AM_PATH_SIZE];
+        int fd_new;
+
+        if (*rotate != AM_LOG_ROTATE_REOPEN) {
+            /* the log worker keeps writing into the renamed file until it swaps in the new one */
+            rotated_file_name(tmp, sizeof (tmp), file_name, *rotate == AM_LOG_ROTATE_SEGMENT);
+            if (rename(file_name, tmp) != 0) {
+                fprintf(stderr, "could not rotate log file %s (error: %d)\n", file_name, errno);
+                return;
+            }
+            *closed = AM_FALSE;
+            strcpy(rotated, tmp);
+        }
+        fd_new = open(file_name, O_CREAT | O_WRONLY | O_APPEND, S_IWUSR | S_IRUSR);
+        if (fd_new == -1) {
+            fprintf(stderr, "log_maintenance() log file re-open failed with error: %d\n", errno);
+            return;
+        }
+        if (!AM_ATOMIC_CAS_32(fd_next, -1, fd_new)) {
+            close(fd_new);
+            return;
+        }
+        *rotate = AM_LOG_ROTATE_NONE;
+    }
+#endif
+}
+
+/**
+ * Log file maintenance task, run periodically (AM_LOG_MAINTENANCE_INTERVAL) in the log worker process.
+ */
+static void log_maintenance(void *arg) {
+    struct am_log *log = AM_LOG();
+    int i;
+    if (log == NULL) {
+        return;
+    }
+    for (i = 0; i < AM_MAX_INSTANCES; i++) {
+        struct log_files *f = &log->files[i];
+        if (!f->used || ISINVALID(f->name_debug) || ISINVALID(f->name_audit)) {
+            continue;
+        }
+        log_maintain_file(log, f, AM_FALSE);
+        log_maintain_file(log, f, AM_TRUE);
+    }
+}
 
-        data = log->bucket[index].data;
-        data_sz = log->bucket[index].size;
-        level = log->bucket[index].level;
-        is_audit = (level & AM_LOG_LEVEL_AUDIT) != 0;
-        instance_id = log->bucket[index].instance_id;
+static void log_maintenance_start() {
+    am_timer_event_t *e;
+    if (am_log_handle->maintenance != NULL) {
+        return;
+    }
+    e = am_create_timer_event(AM_TIMER_EVENT_RECURRING, AM_LOG_MAINTENANCE_INTERVAL, NULL, log_maintenance);
+    if (e == NULL) {
+        return;
+    }
+    if (e->error != 0) {
+        fprintf(stderr, "log_maintenance_start() failed to create timer (error: %d)\n", e->error);
+        am_close_timer_event(e);
+        return;
+    }
+    am_start_timer_event(e);
+    am_log_handle->maintenance = e;
+}
 
-        f = NULL;
+static void log_maintenance_stop() {
+    if (am_log_handle != NULL && am_log_handle->maintenance != NULL) {
+        am_close_timer_event(am_log_handle->maintenance);
+        am_log_handle->maintenance = NULL;
+    }
+}
 
-        for (i = 0; i < AM_MAX_INSTANCES; i++) {
-            f = &log->files[i];
-            if (f->used && f->instance_id == instance_id) {
-                break;
+/*****************************************************************************************/
+
+/*
+ * Deferred (binary) log records: the writer stores a raw timestamp, thread and process
+ * ids, the format string and the argument values, the log worker does all the formatting.
+ */
+
+enum {
+    LOG_ARG_DEFAULT = 0,
+    LOG_ARG_HH,
+    LOG_ARG_H,
+    LOG_ARG_L,
+    LOG_ARG_LL,
+    LOG_ARG_Z,
+    LOG_ARG_J,
+    LOG_ARG_T,
+    LOG_ARG_LD
+};
+
+struct log_spec {
+    const char *start;
+    size_t size;
+    int width_arg; /* width is set with '*' */
+    int precision_arg; /* precision is set with '.*' */
+    int precision;
+    int length;
+    char conversion;
+};
+
+struct log_deferred {
+    int64_t sec;
+    int32_t usec;
+    int32_t pid;
+    uint64_t thread;
+    int32_t line;
+    uint32_t file_size;
+    uint32_t format_size;
+    uint32_t args_size;
+};
+
+#define AM_LOG_ARG_ALIGN(s) (((s) + 7) & ~((size_t) 7))
+
+/**
+ * Parse a conversion specification starting at p (pointing at '%'). Returns the first
+ * character after the specification, or NULL if it is not supported.
+ */
+static const char *log_parse_spec(const char *p, struct log_spec *s) {
+    memset(s, 0, sizeof (struct log_spec));
+    s->start = p++;
+    s->precision = -1;
+    while (*p != '\0' && strchr("-+ #0'", *p) != NULL) p++;
+    if (*p == '*') {
+        s->width_arg = AM_TRUE;
+        p++;
+    } else {
+        while (isdigit(*p)) p++;
+    }
+    if (*p == '.') {
+        p++;
+        if (*p == '*') {
+            s->precision_arg = AM_TRUE;
+            p++;
+        } else {
+            s->precision = 0;
+            while (isdigit(*p)) {
+                s->precision = s->precision * 10 + (*p - '0');
+                p++;
             }
         }
+    }
+    switch (*p) {
+        case 'h':
+            s->length = p[1] == 'h' ? LOG_ARG_HH : LOG_ARG_H;
+            p += p[1] == 'h' ? 2 : 1;
+            break;
+        case 'l':
+            s->length = p[1] == 'l' ? LOG_ARG_LL : LOG_ARG_L;
+            p += p[1] == 'l' ? 2 : 1;
+            break;
+        case 'z':
+            s->length = LOG_ARG_Z;
+            p++;
+            break;
+        case 'j':
+            s->length = LOG_ARG_J;
+            p++;
+            break;
+        case 't':
+            s->length = LOG_ARG_T;
+            p++;
+            break;
+        case 'L':
+            s->length = LOG_ARG_LD;
+            p++;
+            break;
+    }
+    if (*p == '\0' || strchr("diouxXcsfFeEgGaAp", *p) == NULL ||
+            ((*p == 's' || *p == 'c') && s->length != LOG_ARG_DEFAULT)) {
+        return NULL; /* %n, wide characters/strings, etc */
+    }
+    s->conversion = *p++;
+    s->size = p - s->start;
+    return s->size < 32 ? p : NULL;
+}
 
-        if (f != NULL) {
+static am_bool_t log_put(char *buf, size_t size, size_t *pos, const void *value, size_t value_size) {
+    if (*pos + AM_LOG_ARG_ALIGN(value_size) > size) {
+        return AM_FALSE;
+    }
+    memcpy(buf + *pos, value, value_size);
+    *pos += AM_LOG_ARG_ALIGN(value_size);
+    return AM_TRUE;
+}
 
-            if (ISINVALID(f->name_debug)) {
-                fprintf(stderr, "am_log_worker(): the debug file name is invalid (i.e. empty or null)\n");
-                f->fd_debug = -1;
-                f->fd_audit = -1;
-                return NULL;
+/**
+ * Store the values of all the format arguments into buf. Returns the number of bytes used
+ * or -1 in case the format is not supported (or the values do not fit).
+ */
+static int log_serialize(char *buf, size_t size, const char *format, va_list args) {
+    const char *p = format;
+    struct log_spec s;
+    size_t pos = 0;
+    int ok = AM_TRUE;
+
+    while (ok && (p = strchr(p, '%')) != NULL) {
+        int32_t precision = -1;
+        int64_t iv = 0;
+        double dv;
+        long double ldv;
+
+        if (p[1] == '%') {
+            p += 2;
+            continue;
+        }
+        if ((p = log_parse_spec(p, &s)) == NULL) {
+            return -1;
+        }
+        if (s.width_arg) {
+            int32_t width = va_arg(args, int);
+            ok = log_put(buf, size, &pos, &width, sizeof (width));
+        }
+        if (s.precision_arg) {
+            precision = va_arg(args, int);
+            ok = ok && log_put(buf, size, &pos, &precision, sizeof (precision));
+        } else {
+            precision = s.precision;
+        }
+        if (!ok) break;
+
+        switch (s.conversion) {
+            case 's':
+            {
+                const char *v = va_arg(args, const char *);
+                uint32_t len = v == NULL ? (uint32_t) - 1 : (uint32_t) (precision >= 0 ?
+                        strnlen(v, precision) : strlen(v));
+                ok = log_put(buf, size, &pos, &len, sizeof (len));
+                if (ok && v != NULL) {
+                    if (pos + AM_LOG_ARG_ALIGN(len + 1) > size) {
+                        ok = AM_FALSE;
+                    } else {
+                        memcpy(buf + pos, v, len);
+                        buf[pos + len] = '\0';
+                        pos += AM_LOG_ARG_ALIGN(len + 1);
+                    }
+                }
+                break;
+            }
+            case 'p':
+            {
+                uint64_t v = (uint64_t) (uintptr_t) va_arg(args, void *);
+                ok = log_put(buf, size, &pos, &v, sizeof (v));
+                break;
             }
+            case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+                if (s.length == LOG_ARG_LD) {
+                    ldv = va_arg(args, long double);
+                    ok = log_put(buf, size, &pos, &ldv, sizeof (ldv));
+                } else {
+                    dv = va_arg(args, double);
+                    ok = log_put(buf, size, &pos, &dv, sizeof (dv));
+                }
+                break;
+            default:
+                /* integer conversions; the value is replayed with the same length modifier */
+                switch (s.length) {
+                    case LOG_ARG_L: iv = (int64_t) va_arg(args, long);
+                        break;
+                    case LOG_ARG_LL: iv = (int64_t) va_arg(args, long long);
+                        break;
+                    case LOG_ARG_Z: iv = (int64_t) va_arg(args, size_t);
+                        break;
+                    case LOG_ARG_J: iv = (int64_t) va_arg(args, intmax_t);
+                        break;
+                    case LOG_ARG_T: iv = (int64_t) va_arg(args, ptrdiff_t);
+                        break;
+                    default: iv = (int64_t) va_arg(args, int);
+                        break;
+                }
+                ok = log_put(buf, size, &pos, &iv, sizeof (iv));
+                break;
+        }
+    }
+    return ok ? (int) pos : -1;
+}
 
-            if (ISINVALID(f->name_audit)) {
-                fprintf(stderr, "am_log_worker(): the audit file name is invalid (i.e. empty or null)\n");
-                f->fd_debug = -1;
-                f->fd_audit = -1;
-                return NULL;
+#define LOG_SNPRINTF(out, avail, spec, s, width, precision, value) \
+    ((s).width_arg && (s).precision_arg ? snprintf(out, avail, spec, width, precision, value) : \
+    (s).width_arg ? snprintf(out, avail, spec, width, value) : \
+    (s).precision_arg ? snprintf(out, avail, spec, precision, value) : snprintf(out, avail, spec, value))
+
+static const char *log_level_name(int level) {
+    if (level & AM_LOG_LEVEL_AUDIT) return "AUDIT";
+    if (level & AM_LOG_LEVEL_DEBUG) return "DEBUG";
+    if (level & AM_LOG_LEVEL_WARNING) return "WARNING";
+    if (level & AM_LOG_LEVEL_ERROR) return "ERROR";
+    return "INFO";
+}
+
+/**
+ * Format a deferred log record into buf (with the message header if 'header' is set).
+ * Returns the message size.
+ */
+static size_t log_format_deferred(char *buf, size_t size, struct log_record *r, int header) {
+    struct log_deferred *d = (struct log_deferred *) r->data;
+    const char *file = d->file_size > 0 ? r->data + sizeof (struct log_deferred) : NULL;
+    const char *format = r->data + sizeof (struct log_deferred) + d->file_size;
+    const char *args = format + d->format_size;
+    const char *p = format;
+    size_t pos = 0, arg = 0;
+    struct log_spec s;
+    char spec[32];
+
+    if (header) {
+        pos = log_header_at(buf, size, log_level_name(r->level), d->sec, d->usec, d->thread, d->pid, file, d->line);
+    }
+
+    while (*p != '\0' && pos < size - 1) {
+        int32_t width = 0, precision = 0;
+        const char *next;
+        int n;
+
+        if (*p != '%' || p[1] == '%') {
+            buf[pos++] = *p;
+            p += *p == '%' ? 2 : 1;
+            continue;
+        }
+        if ((next = log_parse_spec(p, &s)) == NULL) {
+            break; /* must not happen - the format has been checked by the writer */
+        }
+        memcpy(spec, s.start, s.size);
+        spec[s.size] = '\0';
+        p = next;
+
+        if (s.width_arg) {
+            memcpy(&width, args + arg, sizeof (width));
+            arg += AM_LOG_ARG_ALIGN(sizeof (width));
+        }
+        if (s.precision_arg) {
+            memcpy(&precision, args + arg, sizeof (precision));
+            arg += AM_LOG_ARG_ALIGN(sizeof (precision));
+        }
+
+        switch (s.conversion) {
+            case 's':
+            {
+                uint32_t len;
+                memcpy(&len, args + arg, sizeof (len));
+                arg += AM_LOG_ARG_ALIGN(sizeof (len));
+                /* a null string is printed as "(null)" (as glibc does), not passed on to snprintf */
+                n = LOG_SNPRINTF(buf + pos, size - pos, spec, s, width, precision,
+                        len == (uint32_t) - 1 ? "(null)" : args + arg);
+                if (len != (uint32_t) - 1) {
+                    arg += AM_LOG_ARG_ALIGN(len + 1);
+                }
+                break;
+            }
+            case 'p':
+            {
+                uint64_t v;
+                memcpy(&v, args + arg, sizeof (v));
+                arg += AM_LOG_ARG_ALIGN(sizeof (v));
+                n = LOG_SNPRINTF(buf + pos, size - pos, spec, s, width, precision, (void *) (uintptr_t) v);
+                break;
             }
+            case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+            {
+                if (s.length == LOG_ARG_LD) {
+                    long double v;
+                    memcpy(&v, args + arg, sizeof (v));
+                    arg += AM_LOG_ARG_ALIGN(sizeof (v));
+                    n = LOG_SNPRINTF(buf + pos, size - pos, spec, s, width, precision, v);
+                } else {
+                    double v;
+                    memcpy(&v, args + arg, sizeof (v));
+                    arg += AM_LOG_ARG_ALIGN(sizeof (v));
+                    n = LOG_SNPRINTF(buf + pos, size - pos, spec, s, width, precision, v);
+                }
+                break;
+            }
+            default:
+            {
+                int64_t v;
+                int is_signed = s.conversion == 'd' || s.conversion == 'i';
+                memcpy(&v, args + arg, sizeof (v));
+                arg += AM_LOG_ARG_ALIGN(sizeof (v));
+                switch (s.length) {
+                    case LOG_ARG_L:
+                        n = is_signed ? LOG_SNPRINTF(buf + pos, size - pos, spec, s, width, precision, (long) v) :
+                                LOG_SNPRINTF(buf + pos, size - pos, spec, s, width, precision, (unsigned long) v);
+                        break;
+                    case LOG_ARG_LL:
+                    case LOG_ARG_J:
+                        n = is_signed ? LOG_SNPRINTF(buf + pos, size - pos, spec, s, width, precision, (long long) v) :
+                                LOG_SNPRINTF(buf + pos, size - pos, spec, s, width, precision, (unsigned long long) v);
+                        break;
+                    case LOG_ARG_Z:
+                    case LOG_ARG_T:
+                        n = LOG_SNPRINTF(buf + pos, size - pos, spec, s, width, precision, (size_t) v);
+                        break;
+                    default:
+                        n = is_signed ? LOG_SNPRINTF(buf + pos, size - pos, spec, s, width, precision, (int) v) :
+                                LOG_SNPRINTF(buf + pos, size - pos, spec, s, width, precision, (unsigned int) v);
+                        break;
+                }
+                break;
+            }
+        }
+        if (n < 0 || (size_t) n >= size - pos) {
+            pos = size - 1;
+            break;
+        }
+        pos += n;
+    }
+    buf[pos] = '\0';
+    return pos;
+}
+
+/*
+ * Audit messages which are written with their arguments as separate JSON fields.
+ * All of them have user, client ip and url (%s) arguments.
+ */
+static const struct log_audit_format {
+    const char *format;
+    const char *decision;
+} log_audit_formats[] = {
+    {AUDIT_ALLOW_USER_MESSAGE, "allow"},
+    {AUDIT_DENY_USER_MESSAGE, "deny"},
+    {NULL, NULL}
+};
+
+/**
+ * Append ,"key":"value" to a JSON object being written into buf (one byte is always
+ * kept for the closing brace). NULL value is written as an empty string.
+ */
+static void log_json_string(char *buf, size_t size, size_t *pos, const char *key, const char *value, size_t len) {
+    size_t key_sz = strlen(key);
+    if (*pos + key_sz + 8 >= size) {
+        return;
+    }
+    buf[(*pos)++] = ',';
+    *pos += am_json_escape_to(buf + *pos, size - *pos - 1, key, key_sz);
+    buf[(*pos)++] = ':';
+    *pos += am_json_escape_to(buf + *pos, size - *pos - 1, value != NULL ? value : "", value != NULL ? len : 0);
+}
+
+/**
+ * Read the next serialized string argument of a deferred record (NULL for a null string).
+ */
+static const char *log_string_arg(const char **args) {
+    const char *value;
+    uint32_t len;
+    memcpy(&len, *args, sizeof (len));
+    *args += AM_LOG_ARG_ALIGN(sizeof (len));
+    if (len == (uint32_t) -1) {
+        return NULL;
+    }
+    value = *args;
+    *args += AM_LOG_ARG_ALIGN(len + 1);
+    return value;
+}
+
+/**
+ * Format a log record as a single line JSON object:
+ * {"timestamp":"2015-10-20T10:15:00.123Z","level":"AUDIT","instance":1,"pid":12,"tid":"0x7f00",
+ *  "source":"file.c:10","message":"...","decision":"allow","user":"..","client_ip":"..","url":".."}
+ * Records which could not be deferred have only the timestamp (taken by the log worker), level,
+ * instance and the complete text line as the message.
+ */
+static size_t log_format_json(char *buf, size_t size, struct log_record *r) {
+    char message[AM_LOG_MESSAGE_SIZE];
+    char ts[32];
+    struct tm tm;
+    time_t t;
+    int64_t sec;
+    long usec;
+    uint64_t thread;
+    size_t pos, message_sz;
+    int n, i;
+    struct log_deferred *d = NULL;
+    const char *file = NULL, *format = NULL;
+
+    if (r->flags & AM_LOG_RECORD_DEFERRED) {
+        d = (struct log_deferred *) r->data;
+        file = d->file_size > 0 ? r->data + sizeof (struct log_deferred) : NULL;
+        format = r->data + sizeof (struct log_deferred) + d->file_size;
+        sec = d->sec;
+        usec = d->usec;
+        message_sz = log_format_deferred(message, sizeof (message), r, AM_FALSE);
+    } else {
+        log_now(&sec, &usec, &thread);
+        message_sz = r->data_size < sizeof (message) ? r->data_size : sizeof (message) - 1;
+        memcpy(message, r->data, message_sz);
+    }
 
-            /* log files are not opened yet, do it now */
-            if (f->fd_audit == -1 && f->fd_debug == -1) {
+    t = (time_t) sec;
 #ifdef _WIN32
+    gmtime_s(&tm, &t);
+#else
+    gmtime_r(&t, &tm);
+#endif
+    strftime(ts, sizeof (ts), "%Y-%m-%dT%H:%M:%S", &tm);
+    n = snprintf(buf, size - 1, "{\"timestamp\":\"%s.%03ldZ\",\"level\":\"%s\",\"instance\":%lu",
+            ts, usec / 1000L, log_level_name(r->level), r->instance_id);
+    if (n < 0 || (size_t) n >= size - 1) {
+        return 0;
+    }
+    pos = n;
+    if (d != NULL) {
+        n = snprintf(buf + pos, size - pos - 1, ",\"pid\":%d,\"tid\":\"0x%lx\"", d->pid, (unsigned long) d->thread);
+        if (n > 0 && (size_t) n < size - pos - 1) {
+            pos += n;
+        }
+        if (file != NULL) {
+            n = snprintf(buf + pos, size - pos - 1, ",\"source\":\"%s:%d\"", file, d->line);
+            if (n > 0 && (size_t) n < size - pos - 1) {
+                pos += n;
+            }
+        }
+    }
+    log_json_string(buf, size, &pos, "message", message, message_sz);
+
+    for (i = 0; format != NULL && log_audit_formats[i].format != NULL; i++) {
+        if (strcmp(format, log_audit_formats[i].format) == 0) {
+            const char *args = format + d->format_size, *value;
+            log_json_string(buf, size, &pos, "decision", log_audit_formats[i].decision,
+                    strlen(log_audit_formats[i].decision));
+            value = log_string_arg(&args);
+            log_json_string(buf, size, &pos, "user", value, value != NULL ? strlen(value) : 0);
+            value = log_string_arg(&args);
+            log_json_string(buf, size, &pos, "client_ip", value, value != NULL ? strlen(value) : 0);
+            value = log_string_arg(&args);
+            log_json_string(buf, size, &pos, "url", value, value != NULL ? strlen(value) : 0);
+            break;
+        }
+    }
 
-                f->fd_debug = _open(f->name_debug, _O_CREAT | _O_WRONLY | _O_APPEND | _O_BINARY,
-                        _S_IREAD | _S_IWRITE);
-                f->fd_audit = _open(f->name_audit, _O_CREAT | _O_WRONLY | _O_APPEND | _O_BINARY,
-                        _S_IREAD | _S_IWRITE);
-                if (f->fd_debug != -1 && stat(f->name_debug, &st) == 0) {
-                    f->created_debug = st.st_ctime;
-                    f->owner = getpid();
+    buf[pos++] = '}';
+    buf[pos] = '\0';
+    return pos;
+}
+
+/**
+ * Write a batch of committed log records into the log files.
+ * Messages are grouped into one write per consecutive run of the same target file;
+ * files are synced and checked for rotation only once per batch.
+ */
+static void log_write_batch(struct am_log *log, struct log_record **batch, unsigned int count, char *scratch) {
+    struct log_message run[AM_LOG_BATCH_SIZE];
+    struct log_files *f = NULL, *touched[AM_MAX_INSTANCES];
+    int run_count = 0, run_audit = AM_FALSE, touched_count = 0;
+    unsigned int n;
+    int i;
+
+    for (n = 0; n <= count; n++) {
+        struct log_record *b = NULL;
+        struct log_files *bf = NULL;
+        int is_audit = AM_FALSE;
+
+        if (n < count) {
+            b = batch[n];
+            is_audit = (b->level & AM_LOG_LEVEL_AUDIT) != 0;
+            for (i = 0; i < AM_MAX_INSTANCES; i++) {
+                if (log->files[i].used && log->files[i].instance_id == b->instance_id) {
+                    bf = &log->files[i];
+                    break;
                 }
-                if (f->fd_audit != -1 && stat(f->name_audit, &st) == 0) {
-                    f->created_audit = st.st_ctime;
-                    f->owner = getpid();
+            }
+        }
+
+        /* flush the current run when the target file changes (or at the end of the batch) */
+        if (run_count > 0 && (b == NULL || bf != f || is_audit != run_audit)) {
+            log_write_messages(f, run_audit, run, run_count);
+            run_count = 0;
+        }
+        if (b == NULL || bf == NULL) {
+            continue;
+        }
+
+        if (ISINVALID(bf->name_debug) || ISINVALID(bf->name_audit)) {
+            fprintf(stderr, "am_log_worker(): the %s file name is invalid (i.e. empty or null)\n",
+                    ISINVALID(bf->name_debug) ? "debug" : "audit");
+            continue;
+        }
+
+        /* log files are not opened yet, do it now */
+        if (!log_files_open(bf)) {
+            continue;
+        }
+
+        for (i = 0; i < touched_count && touched[i] != bf; i++);
+        if (i == touched_count) {
+            touched[touched_count++] = bf;
+        }
+        f = bf;
+        run_audit = is_audit;
+        if (bf->json || (b->flags & AM_LOG_RECORD_DEFERRED)) {
+            if (scratch == NULL) {
+                /* no scratch buffer - format and write this record on its own */
+                char message[AM_LOG_MESSAGE_SIZE];
+                struct log_message one;
+                if (run_count > 0) {
+                    log_write_messages(f, run_audit, run, run_count);
+                    run_count = 0;
                 }
+                one.data = message;
+                one.size = bf->json ? log_format_json(message, sizeof (message), b) :
+                        log_format_deferred(message, sizeof (message), b, AM_TRUE);
+                log_write_messages(bf, is_audit, &one, 1);
+                continue;
+            }
+            /* format the record into the scratch buffer slot of this run position */
+            run[run_count].data = scratch + run_count * AM_LOG_MESSAGE_SIZE;
+            run[run_count].size = bf->json ?
+                    log_format_json(run[run_count].data, AM_LOG_MESSAGE_SIZE, b) :
+                    log_format_deferred(run[run_count].data, AM_LOG_MESSAGE_SIZE, b, AM_TRUE);
+        } else {
+            run[run_count].data = b->data;
+            run[run_count].size = b->data_size;
+        }
+        run_count++;
+    }
+
+    for (i = 0; i < touched_count; i++) {
+        f = touched[i];
+        if (f->pending_debug && f->fd_debug != -1) {
+            log_file_commit(f, AM_FALSE);
+        }
+        if (f->pending_audit && f->fd_audit != -1) {
+            log_file_commit(f, AM_TRUE);
+        }
+        f->pending_debug = f->pending_audit = AM_FALSE;
+    }
+}
+
+/*****************************************************************************************/
+
+/**
+ * Report messages dropped (on log ring overflow) since the last report into the instance debug log.
+ */
+static void log_report_dropped(struct am_log *log) {
+    int i;
+    for (i = 0; i < AM_MAX_INSTANCES; i++) {
+        struct log_files *f = &log->files[i];
+        uint64_t dropped = f->dropped;
+        char line[256];
+        int line_sz;
 
+        if (!f->used || dropped == f->dropped_reported || ISINVALID(f->name_debug) ||
+                ISINVALID(f->name_audit) || !log_files_open(f)) {
+            continue;
+        }
+        if (f->json) {
+            line_sz = snprintf(line, sizeof (line), "{\"level\":\"WARNING\",\"instance\":%lu,\"message\":"
+                    "\"am_log_worker(): log buffer overflow, %lu message(s) dropped\"}", f->instance_id,
+                    (unsigned long) (dropped - f->dropped_reported));
+        } else {
+            line_sz = log_header(line, sizeof (line), "WARNING");
+            line_sz += snprintf(line + line_sz, sizeof (line) - line_sz,
+                    "am_log_worker(): log buffer overflow, %lu message(s) dropped",
+                    (unsigned long) (dropped - f->dropped_reported));
+        }
+        line_sz += snprintf(line + line_sz, sizeof (line) - line_sz,
+#ifdef _WIN32
+                "\r\n"
 #else
-                f->fd_debug = open(f->name_debug, O_CREAT | O_WRONLY | O_APPEND, S_IWUSR | S_IRUSR);
-                f->fd_audit = open(f->name_audit, O_CREAT | O_WRONLY | O_APPEND, S_IWUSR | S_IRUSR);
-                if (f->fd_debug != -1 && stat(f->name_debug, &st) == 0) {
-                    f->node_debug = st.st_ino;
-                    f->created_debug = st.st_ctime;
-                    f->owner = getpid();
-                }
-                if (f->fd_audit != -1 && stat(f->name_audit, &st) == 0) {
-                    f->node_audit = st.st_ino;
-                    f->created_audit = st.st_ctime;
-                    f->owner = getpid();
-                }
+                "\n"
 #endif
-            }
+                );
+        if (write(f->fd_debug, line, (unsigned int) line_sz) > 0) {
+#ifndef _WIN32
+            f->size_debug += line_sz;
+#endif
+        }
+        f->dropped_reported = dropped;
+        log_file_commit(f, AM_FALSE);
+    }
+}
+
+/**
+ * Collect up to AM_LOG_BATCH_SIZE committed records starting at the ring tail.
+ * Returns the ring position following the last record taken (or skipped).
+ */
+static uint64_t log_read_batch(struct am_log *log, struct log_record **batch, unsigned int *count) {
+    uint64_t pos = log->tail;
+    uint64_t head = AM_ATOMIC_ADD_64(&log->head, 0);
+    char *ring = AM_LOG_RING(log);
+
+    *count = 0;
+    while (pos < head && *count < AM_LOG_BATCH_SIZE) {
+        struct log_record *r = (struct log_record *) (ring + (pos & (log->ring_size - 1)));
+        if (r->state == AM_LOG_RECORD_FREE) {
+            break; /* reserved, but not committed yet */
+        }
+        AM_MEMORY_BARRIER();
+        if (r->state == AM_LOG_RECORD_COMMITTED) {
+            batch[(*count)++] = r;
+        }
+        pos += r->size;
+    }
+    return pos;
+}
+
+/**
+ * Clear ring space between tail and pos and make it available to the writers.
+ */
+static void log_release(struct am_log *log, uint64_t pos) {
+    char *ring = AM_LOG_RING(log);
+    uint64_t mask = log->ring_size - 1;
+    uint64_t from = log->tail & mask;
+    uint64_t size = pos - log->tail;
+
+    if (from + size > log->ring_size) {
+        memset(ring + from, 0, (size_t) (log->ring_size - from));
+        memset(ring, 0, (size_t) (size - (log->ring_size - from)));
+    } else {
+        memset(ring + from, 0, (size_t) size);
+    }
+    AM_MEMORY_BARRIER();
+    AM_ATOMIC_ADD_64(&log->tail, size);
 
-            if (f->fd_debug == -1) {
-                fprintf(stderr, "am_log_worker() failed to open log file %s: error: %d", f->name_debug, errno);
-                f->fd_debug = f->fd_audit = -1;
-            } else if (f->fd_audit == -1) {
-                fprintf(stderr, "am_log_worker() failed to open audit file %s: error: %d", f->name_audit, errno);
-                f->fd_debug = f->fd_audit = -1;
-            } else {
-                int file_handle = is_audit ? f->fd_audit : f->fd_debug;
-                char *file_name = is_audit ? f->name_audit : f->name_debug;
-                int max_size = is_audit ? f->max_size_audit : f->max_size_debug;
-                time_t file_created = is_audit ? f->created_audit : f->created_debug;
+    if (log->writers_waiting > 0) {
 #ifdef _WIN32
-                int wrote;
-#else 
-                ssize_t wrote;
-                ino_t file_inode = is_audit ? f->node_audit : f->node_debug;
+        SetEvent(am_log_lck.new_space_cond);
+#else
+        pthread_mutex_lock(&log->lock);
+        pthread_cond_broadcast(&log->new_space_cond);
+        pthread_mutex_unlock(&log->lock);
 #endif
-                wrote = write(file_handle, data, (unsigned int) data_sz);
-#ifdef _WIN32
-                wrote = write(file_handle, "\r\n", 2);
-                _commit(file_handle);
-
-                /* check file timestamp; rotate by date if set so */
-                if (max_size == -1 && should_rotate_time(file_created)) {
-                    HANDLE fh = (HANDLE) _get_osfhandle(file_handle);
-                    unsigned int idx = 1;
-                    static char tmp[AM_PATH_SIZE];
-
-                    do {
-                        snprintf(tmp, sizeof (tmp), "%s.%d", file_name, idx);
-                        idx++;
-                    } while (_access(tmp, 0) == 0);
-
-                    if (CopyFileExA(file_name, tmp, NULL, NULL, FALSE, COPY_FILE_NO_BUFFERING)) {
-                        SetFilePointer(fh, 0, NULL, FILE_BEGIN);
-                        SetEndOfFile(fh);
-                        if (is_audit) {
-                            f->created_audit = time(NULL);
-                        } else {
-                            f->created_debug = time(NULL);
-                        }
-                    } else {
-                        fprintf(stderr, "could not rotate log file %s (error: %d)\n",
-                                file_name, GetLastError());
-                    }
-                }
+    }
+}
 
-                /* check file size; rotate by size if set so */
-                if (max_size > 0) {
-                    BY_HANDLE_FILE_INFORMATION info;
-                    uint64_t fsz = 0;
-                    HANDLE fh = (HANDLE) _get_osfhandle(file_handle);
-                    if (GetFileInformationByHandle(fh, &info)) {
-                        fsz = ((DWORDLONG) (((DWORD) (info.nFileSizeLow)) |
-                                (((DWORDLONG) ((DWORD) (info.nFileSizeHigh))) << 32)));
-                    }
-                    if ((fsz + 1024) > max_size) {
-                        unsigned int idx = 1;
-                        static char tmp[AM_PATH_SIZE];
-
-                        do {
-                            snprintf(tmp, sizeof (tmp), "%s.%d", file_name, idx);
-                            idx++;
-                        } while (_access(tmp, 0) == 0);
-
-                        if (CopyFileExA(file_name, tmp, NULL, NULL, FALSE, COPY_FILE_NO_BUFFERING)) {
-                            SetFilePointer(fh, 0, NULL, FILE_BEGIN);
-                            SetEndOfFile(fh);
-                            if (is_audit) {
-                                f->created_audit = time(NULL);
-                            } else {
-                                f->created_debug = time(NULL);
-                            }
-                        } else {
-                            fprintf(stderr, "could not rotate log file %s (error: %d)\n",
-                                    file_name, GetLastError());
-                        }
-                    }
-                }
+static void *am_log_worker(void *arg) {
+    struct am_log *log = AM_LOG();
+    struct log_record *batch[AM_LOG_BATCH_SIZE];
+    unsigned int count;
+    uint64_t pos;
+    char *scratch;
 
-                _close(file_handle);
-                if (is_audit) {
-                    f->fd_audit = -1;
-                } else {
-                    f->fd_debug = -1;
-                }
-#else
-                wrote = write(file_handle, "\n", 1);
-                fsync(file_handle);
+    if (log == NULL) {
+        return NULL;
+    }
 
-                /* check file timestamp; rotate by date if set so */
-                if (max_size == -1 && should_rotate_time(file_created)) {
-                    rename_file(file_name);
-                }
+    /* deferred log records are formatted here */
+    scratch = (char *) malloc(AM_LOG_BATCH_SIZE * AM_LOG_MESSAGE_SIZE);
 
-                /* check file size; rotate by size if set so */
-                if (max_size > 0 && stat(file_name, &st) == 0 && (st.st_size + 1024) > max_size) {
-                    rename_file(file_name);
-                }
+    for (;;) {
+        pos = log_read_batch(log, batch, &count);
 
-                /* reset file inode number (in case it has changed as a result of rename_file) */
-                if (stat(file_name, &st) != 0 || st.st_ino != file_inode) {
-                    close(file_handle);
-                    if (is_audit) {
-                        f->fd_audit = open(f->name_audit, O_CREAT | O_WRONLY | O_APPEND, S_IWUSR | S_IRUSR);
-                        f->node_audit = st.st_ino;
-                        f->created_audit = st.st_ctime;
-                        f->owner = getpid();
-                    } else {
-                        f->fd_debug = open(f->name_debug, O_CREAT | O_WRONLY | O_APPEND, S_IWUSR | S_IRUSR);
-                        f->node_debug = st.st_ino;
-                        f->created_debug = st.st_ctime;
-                        f->owner = getpid();
-                    }
-                    if (f->fd_debug == -1 || f->fd_audit == -1) {
-                        fprintf(stderr, "am_log_worker() log file re-open failed with error: %d", errno);
-                        f->fd_debug = f->fd_audit = -1;
-                    }
+        if (pos == log->tail) {
+            /* nothing to read, wait for a writer to wake us up (or for a timeout) */
+#ifdef _WIN32
+            log->reader_waiting = AM_TRUE;
+            AM_MEMORY_BARRIER();
+            if (log_read_batch(log, batch, &count) == log->tail &&
+                    WaitForSingleObject(am_log_lck.new_data_cond, 1000) == WAIT_TIMEOUT &&
+                    WaitForSingleObject(am_log_lck.exit, 0) == WAIT_OBJECT_0) {
+                log->reader_waiting = AM_FALSE;
+                free(scratch);
+                return NULL;
+            }
+            log->reader_waiting = AM_FALSE;
+#else
+            pthread_mutex_lock(&log->lock);
+            log->reader_waiting = AM_TRUE;
+            AM_MEMORY_BARRIER();
+            if (log_read_batch(log, batch, &count) == log->tail) {
+                struct timeval now = {0, 0};
+                struct timespec ts = {0, 0};
+                gettimeofday(&now, NULL);
+                ts.tv_sec = now.tv_sec + 1;
+                ts.tv_nsec = now.tv_usec * 1000;
+                if (pthread_cond_timedwait(&log->new_data_cond, &log->lock, &ts) == ETIMEDOUT &&
+                        should_exit(&log->exit)) {
+                    log->reader_waiting = AM_FALSE;
+                    pthread_mutex_unlock(&log->lock);
+                    free(scratch);
+                    return NULL;
                 }
-#endif                            
             }
+            log->reader_waiting = AM_FALSE;
+            pthread_mutex_unlock(&log->lock);
+#endif  /* _WIN32 */
+            continue;
         }
 
-        log->out = AM_LOG_BUFFER_MASK(log->out + 1, log->bucket_count);
-#ifdef _WIN32
-        WaitForSingleObject(am_log_lck.lock, INFINITE);
-#else
-        pthread_mutex_lock(&log->lock);
-#endif
-        log->read_count--;
-#ifdef _WIN32
-        SetEvent(am_log_lck.new_space_cond);
-#else
-        pthread_cond_broadcast(&log->new_space_cond);
-#endif
+        log_write_batch(log, batch, count, scratch);
+        log_release(log, pos);
+        log_report_dropped(log);
     }
     return NULL;
 }
@@ -430,6 +1491,7 @@ void am_log_re_init(int status) {
         log->owner = getpid();
         am_log_handle->reader_thr = CreateThread(NULL, 0,
                 (LPTHREAD_START_ROUTINE) am_log_worker, NULL, 0, NULL);
+        log_maintenance_start();
         ReleaseMutex(am_log_lck.lock);
     }
 #endif
@@ -437,6 +1499,28 @@ void am_log_re_init(int status) {
 
 /*****************************************************************************************/
 
+/**
+ * Log ring capacity (in bytes): AM_LOG_RING_SIZE or the value set with AM_LOG_RING_SIZE_VAR
+ * environment variable, rounded up to a power of two.
+ */
+static uint64_t log_ring_size() {
+    uint64_t size = AM_LOG_RING_SIZE, ring_size = AM_LOG_RING_MIN_SIZE;
+    char *env = getenv(AM_LOG_RING_SIZE_VAR);
+    if (ISVALID(env)) {
+        char *endp = NULL;
+        unsigned long v = strtoul(env, &endp, 0);
+        if (env < endp && *endp == '\0' && v > 0) {
+            size = v;
+        }
+    }
+    while (ring_size < size && ring_size < AM_LOG_RING_MAX_SIZE) {
+        ring_size <<= 1;
+    }
+    return ring_size;
+}
+
+/*****************************************************************************************/
+
 void am_log_init(int id, int status) {
     int i;
     char opened = 0;
@@ -454,6 +1538,7 @@ void am_log_init(int id, int status) {
         if (am_log_handle == NULL) {
             return;
         }
+        am_log_handle->maintenance = NULL;
     }
 #ifndef _WIN32
     else if (am_log_handle->reader_pid == getpid()) {
@@ -470,7 +1555,7 @@ void am_log_init(int id, int status) {
             AM_GLOBAL_PREFIX"am_log_%d"
 #endif
             , id);
-    am_log_handle->area_size = page_size(sizeof (struct am_log));
+    am_log_handle->area_size = am_shm_page_size(AM_LOG_ALIGN(sizeof (struct am_log)) + log_ring_size());
 
 #ifdef _WIN32
     if (InitializeSecurityDescriptor(&sec_descr, SECURITY_DESCRIPTOR_REVISION) &&
@@ -528,9 +1613,9 @@ void am_log_init(int id, int status) {
             struct am_log *log = (struct am_log *) am_log_handle->area;
 
             memset(log, 0, am_log_handle->area_size);
-            log->bucket_count = AM_LOG_QUEUE_SIZE;
-            log->bucket_size = AM_LOG_MESSAGE_SIZE;
-            log->in = log->out = log->read_count = log->write_count = 0;
+            log->ring_size = log_ring_size();
+            log->head = log->tail = 0;
+            log->level_generation = ((uint32_t) time(NULL)) << 1;
 
             for (i = 0; i < AM_MAX_INSTANCES; i++) {
                 struct log_files *f = &log->files[i];
@@ -544,39 +1629,39 @@ void am_log_init(int id, int status) {
             log->owner = getpid();
             am_log_handle->reader_thr = CreateThread(NULL, 0,
                     (LPTHREAD_START_ROUTINE) am_log_worker, NULL, 0, NULL);
+            log_maintenance_start();
         }
     }
 
 #else
-    am_log_handle->area_file_id = shm_open(am_log_handle->area_file_name, O_CREAT | O_EXCL | O_RDWR, 0666);
+    am_log_handle->area_file_id = am_shm_open(am_log_handle->area_file_name, O_CREAT | O_EXCL | O_RDWR);
     if (am_log_handle->area_file_id == -1 && EEXIST != errno) {
         return;
     }
     if (am_log_handle->area_file_id == -1) {
         /* already there, open without O_EXCL and go; if
          * something goes wrong, close and cleanup */
-        am_log_handle->area_file_id = shm_open(am_log_handle->area_file_name, O_RDWR, 0666);
+        am_log_handle->area_file_id = am_shm_open(am_log_handle->area_file_name, O_RDWR);
         if (am_log_handle->area_file_id == -1) {
             fprintf(stderr, "am_log_init() shm_open failed (%d)\n", errno);
             free(am_log_handle);
             am_log_handle = NULL;
             return;
         } else {
+            struct stat st;
             opened = 1;
-        }
-    } else {
-        /* we just created the shm area, must setup; if
-         * something goes wrong, delete the shm area and
-         * cleanup
-         */
-        if (ftruncate(am_log_handle->area_file_id, am_log_handle->area_size) == -1) {
-            fprintf(stderr, "am_log_init() ftruncate failed\n");
-            return;
+            /* use the size of the existing area (log ring capacity might be set differently here) */
+            if (fstat(am_log_handle->area_file_id, &st) == 0 && st.st_size > 0) {
+                am_log_handle->area_size = st.st_size;
+            }
         }
     }
     if (am_log_handle->area_file_id != -1) {
-        am_log_handle->area = mmap(NULL, am_log_handle->area_size,
-                PROT_READ | PROT_WRITE, MAP_SHARED, am_log_handle->area_file_id, 0);
+        /* when we just created the shm area, it is sized and set up here */
+        am_log_handle->area = opened ?
+                am_shm_map(am_log_handle->area_file_id, am_log_handle->area_size, AM_FALSE) :
+                am_shm_map_new(am_log_handle->area_file_name, &am_log_handle->area_file_id,
+                AM_LOG_ALIGN(sizeof (struct am_log)) + log_ring_size(), 0, &am_log_handle->area_size);
         if (am_log_handle->area == MAP_FAILED) {
             fprintf(stderr, "am_log_init() mmap failed (%d)\n", errno);
             free(am_log_handle);
@@ -600,13 +1685,14 @@ void am_log_init(int id, int status) {
 
                 memset(log, 0, am_log_handle->area_size);
 
-                log->bucket_count = AM_LOG_QUEUE_SIZE;
-                log->bucket_size = AM_LOG_MESSAGE_SIZE;
-                log->in = log->out = log->read_count = log->write_count = 0;
+                log->ring_size = log_ring_size();
+                log->head = log->tail = 0;
+                log->level_generation = ((uint32_t) time(NULL)) << 1;
 
                 for (i = 0; i < AM_MAX_INSTANCES; i++) {
                     struct log_files *f = &log->files[i];
                     f->fd_audit = f->fd_debug = -1;
+                    f->fd_next_audit = f->fd_next_debug = -1;
                     f->used = AM_FALSE;
                     f->instance_id = 0;
                     f->level_debug = f->level_audit = AM_LOG_LEVEL_NONE;
@@ -621,6 +1707,7 @@ void am_log_init(int id, int status) {
                 pthread_mutex_lock(&log->exit);
                 pthread_create(&am_log_handle->reader_thr, NULL, am_log_worker, NULL);
                 log->owner = getpid();
+                log_maintenance_start();
             }
 
             pthread_mutexattr_destroy(&exit_attr);
@@ -646,10 +1733,13 @@ void am_log_init_worker(int id, int status) {
  * need to log given the logger level settings for this instance.  Note that the function
  * should return an am_bool_t, but because of a circular dependency between am.h (which
  * defines that type) and log.h (which needs that type), I'm changing it to "int".
+ * In deferred logging mode the (true) value returned is AM_LOG_DEFERRED.
  */
 int perform_logging(unsigned long instance_id, int level) {
     int i;
     struct am_log *log = AM_LOG();
+    struct log_level_cache *c;
+    uint32_t generation;
     int log_level = AM_LOG_LEVEL_NONE;
     int audit_level = AM_LOG_LEVEL_NONE;
 
@@ -663,25 +1753,40 @@ int perform_logging(unsigned long instance_id, int level) {
         return AM_FALSE;
     }
 
-#ifdef _WIN32
-    WaitForSingleObject(am_log_lck.lock, INFINITE);
-#else
-    pthread_mutex_lock(&log->lock);
-#endif
+    c = &level_cache[instance_id & (AM_LOG_LEVEL_CACHE_SIZE - 1)];
+    generation = log->level_generation;
 
-    for (i = 0; i < AM_MAX_INSTANCES; i++) {
-        if (log->files[i].instance_id == instance_id) {
-            log_level = log->files[i].level_debug;
-            audit_level = log->files[i].level_audit;
-            break;
-        }
+    if (c->generation != generation || c->instance_id != instance_id || c->area != (void *) log) {
+        /* level table has changed (or this instance is not cached yet) - read it again */
+        do {
+            generation = log->level_generation;
+            if (generation & 1) {
+                continue;
+            }
+            AM_MEMORY_BARRIER();
+            if (c->instance_id != instance_id || c->area != (void *) log || c->slot == -1 ||
+                    log->files[c->slot].instance_id != instance_id) {
+                c->slot = -1;
+                for (i = 0; i < AM_MAX_INSTANCES; i++) {
+                    if (log->files[i].instance_id == instance_id) {
+                        c->slot = i;
+                        break;
+                    }
+                }
+            }
+            c->level_debug = c->slot != -1 ? log->files[c->slot].level_debug : AM_LOG_LEVEL_NONE;
+            c->level_audit = c->slot != -1 ? log->files[c->slot].level_audit : AM_LOG_LEVEL_NONE;
+            c->rate = c->slot != -1 ? log->files[c->slot].rate : 0;
+            c->deferred = c->slot != -1 ? log->files[c->slot].deferred : AM_FALSE;
+            c->instance_id = instance_id;
+            c->area = (void *) log;
+            AM_MEMORY_BARRIER();
+        } while ((generation & 1) || generation != log->level_generation);
+        c->generation = generation;
     }
 
-#ifdef _WIN32
-    ReleaseMutex(am_log_lck.lock);
-#else
-    pthread_mutex_unlock(&log->lock);
-#endif
+    log_level = c->level_debug;
+    audit_level = c->level_audit;
 
     /* Do not log in the following cases:
      *
@@ -707,9 +1812,221 @@ int perform_logging(unsigned long instance_id, int level) {
         return AM_FALSE;
     }
 
+    return c->deferred ? AM_LOG_DEFERRED : AM_TRUE;
+}
+
+/**
+ * Wait (with the writers_waiting count raised) until the log worker has released
+ * ring space up to the position "tail".
+ */
+static void log_wait_for_space(struct am_log *log, uint64_t tail) {
+#ifdef _WIN32
+    InterlockedIncrement((volatile LONG *) &log->writers_waiting);
+    while (AM_ATOMIC_ADD_64(&log->tail, 0) < tail) {
+        WaitForSingleObject(am_log_lck.new_space_cond, 100);
+    }
+    InterlockedDecrement((volatile LONG *) &log->writers_waiting);
+#else
+    pthread_mutex_lock(&log->lock);
+    log->writers_waiting++;
+    AM_MEMORY_BARRIER();
+    while (AM_ATOMIC_ADD_64(&log->tail, 0) < tail) {
+        struct timeval now = {0, 0};
+        struct timespec ts = {0, 0};
+        gettimeofday(&now, NULL);
+        ts.tv_sec = now.tv_sec + 1;
+        ts.tv_nsec = now.tv_usec * 1000;
+        pthread_cond_timedwait(&log->new_space_cond, &log->lock, &ts);
+    }
+    log->writers_waiting--;
+    pthread_mutex_unlock(&log->lock);
+#endif
+}
+
+/**
+ * Reserve a record of "size" bytes (a multiple of AM_LOG_CACHE_LINE) in the log ring.
+ * A record never wraps around the ring end - the space left there is reserved together
+ * with the record and marked as padding. Returns NULL when the ring is full and the
+ * overflow policy is set to drop messages.
+ */
+static struct log_record *log_reserve(struct am_log *log, unsigned long instance_id, uint32_t size) {
+    uint64_t mask = log->ring_size - 1;
+    uint64_t head, tail, need, contiguous;
+    char *ring = AM_LOG_RING(log);
+    struct log_record *r;
+    int i;
+
+    for (;;) {
+        head = AM_ATOMIC_ADD_64(&log->head, 0);
+        tail = AM_ATOMIC_ADD_64(&log->tail, 0);
+        contiguous = log->ring_size - (head & mask);
+        need = size <= contiguous ? size : contiguous + size;
+
+        if (head + need - tail > log->ring_size) {
+            for (i = 0; i < AM_MAX_INSTANCES; i++) {
+                if (log->files[i].instance_id == instance_id) {
+                    break;
+                }
+            }
+            if (i < AM_MAX_INSTANCES && log->files[i].overflow == AM_LOG_OVERFLOW_DROP) {
+                AM_ATOMIC_ADD_64(&log->files[i].dropped, 1);
+                am_stats_add(AM_STATS_LOG_DROPPED, 1);
+                return NULL;
+            }
+            am_stats_add(AM_STATS_LOG_WAITS, 1);
+            log_wait_for_space(log, head + need - log->ring_size);
+            continue;
+        }
+        if (AM_ATOMIC_CAS_64(&log->head, head, head + need)) {
+            break;
+        }
+    }
+    am_stats_add(AM_STATS_LOG_MESSAGES, 1);
+    am_stats_record(AM_STATS_LOG_QUEUE_DEPTH, head - tail);
+
+    if (need != size) {
+        /* not enough space left at the ring end */
+        r = (struct log_record *) (ring + (head & mask));
+        r->size = (uint32_t) contiguous;
+        AM_MEMORY_BARRIER();
+        r->state = AM_LOG_RECORD_PADDING;
+        head += contiguous;
+    }
+    r = (struct log_record *) (ring + (head & mask));
+    r->size = size;
+    return r;
+}
+
+/**
+ * Copy the message (or deferred record) data into the log ring and make it visible to the log worker.
+ */
+static void log_commit(struct am_log *log, unsigned long instance_id, int level, uint32_t flags,
+        const char *data, size_t size) {
+    struct log_record *r = log_reserve(log, instance_id, (uint32_t) AM_LOG_ALIGN(AM_LOG_RECORD_HEADER + size + 1));
+    if (r == NULL) {
+        return;
+    }
+
+    memcpy(r->data, data, size);
+    r->data[size] = '\0';
+    r->data_size = (uint32_t) size;
+    r->instance_id = instance_id;
+    r->level = level;
+    r->flags = flags;
+
+    AM_MEMORY_BARRIER();
+    r->state = AM_LOG_RECORD_COMMITTED;
+    AM_MEMORY_BARRIER();
+
+    if (log->reader_waiting) {
+#ifdef _WIN32
+        SetEvent(am_log_lck.new_data_cond);
+#else
+        pthread_mutex_lock(&log->lock);
+        pthread_cond_signal(&log->new_data_cond);
+        pthread_mutex_unlock(&log->lock);
+#endif
+    }
+}
+
+/**
+ * Take a token from the call site bucket. Returns AM_FALSE when the call site is over its rate;
+ * otherwise the number of messages suppressed since the last one logged is returned in *suppressed.
+ */
+static am_bool_t log_rate_take(unsigned long instance_id, int level, const char *file, int line,
+        int rate, uint64_t *suppressed) {
+    uint64_t key = (((uint64_t) (uintptr_t) file * 31 + line) * 31 + level) * 31 + instance_id;
+    uint64_t now = (uint64_t) time(NULL) & 0xFFFFFFFF;
+    uint64_t old, tokens, last, n;
+    struct log_site *site = NULL;
+    unsigned int i, index;
+
+    key |= 1; /* zero is an empty slot */
+    index = (unsigned int) (key ^ (key >> 17)) & (AM_LOG_RATE_SITES - 1);
+    for (i = 0; i < AM_LOG_RATE_PROBE; i++) {
+        struct log_site *s = &log_sites[(index + i) & (AM_LOG_RATE_SITES - 1)];
+        if (s->key == 0) {
+            AM_ATOMIC_CAS_64(&s->key, 0, key);
+        }
+        if (s->key == key) {
+            site = s;
+            break;
+        }
+    }
+    if (site == NULL) {
+        return AM_TRUE; /* no room to track this call site */
+    }
+
+    for (;;) {
+        old = site->state;
+        last = old >> 32;
+        tokens = old & 0xFFFFFFFF;
+        if (last == 0) {
+            tokens = rate;
+        } else if (now > last) {
+            tokens += (now - last) * rate;
+            if (tokens > (uint64_t) rate) {
+                tokens = rate;
+            }
+        }
+        if (tokens == 0) {
+            AM_ATOMIC_ADD_64(&site->suppressed, 1);
+            return AM_FALSE;
+        }
+        if (AM_ATOMIC_CAS_64(&site->state, old, (now << 32) | (tokens - 1))) {
+            break;
+        }
+    }
+
+    do {
+        n = site->suppressed;
+    } while (n > 0 && !AM_ATOMIC_CAS_64(&site->suppressed, n, 0));
+    *suppressed = n;
     return AM_TRUE;
 }
 
+/**
+ * Log level check with per call site rate limiting, used by the log.h macros.
+ * Returns the same value as perform_logging, or AM_FALSE in case the message is
+ * suppressed. The first message logged after some have been suppressed is preceded
+ * by a "suppressed" summary.
+ */
+int am_log_check(unsigned long instance_id, int level, const char *file, int line) {
+    struct am_log *log = AM_LOG();
+    struct log_level_cache *c;
+    uint64_t suppressed = 0;
+    int rv = perform_logging(instance_id, level);
+
+    if (rv == AM_FALSE || (level & (AM_LOG_LEVEL_AUDIT | AM_LOG_LEVEL_ALWAYS)) != 0) {
+        return rv;
+    }
+
+    c = &level_cache[instance_id & (AM_LOG_LEVEL_CACHE_SIZE - 1)];
+    if (c->rate <= 0 || c->instance_id != instance_id) {
+        return rv;
+    }
+
+    if (!log_rate_take(instance_id, level, file, line, c->rate, &suppressed)) {
+        return AM_FALSE;
+    }
+
+    if (suppressed > 0) {
+        char message[AM_PATH_SIZE];
+        int message_sz = log_header(message, sizeof (message), log_level_name(level));
+        int sz = snprintf(message + message_sz, sizeof (message) - message_sz,
+                "%s:%d: %lu message(s) suppressed (log rate limit is %d per second)",
+                file, line, (unsigned long) suppressed, c->rate);
+        if (sz > 0) {
+            message_sz += sz;
+            if (message_sz >= sizeof (message)) {
+                message_sz = sizeof (message) - 1;
+            }
+            log_commit(log, instance_id, level, 0, message, message_sz);
+        }
+    }
+    return rv;
+}
+
 /**
  * This routine is primarily responsible for all logging within this application.
  *   instance_id: the instance that has something to log
@@ -732,7 +2049,8 @@ int perform_logging(unsigned long instance_id, int level) {
 void am_log_write(unsigned long instance_id, int level, const char* header, int header_sz, const char *format, ...) {
     struct am_log *log = AM_LOG();
     va_list args;
-    unsigned int index;
+    char message[AM_LOG_MESSAGE_SIZE];
+    int message_sz;
 
     /**
      * An instance id of zero indicates that we are running in unit test mode, shared memory is not
@@ -752,60 +2070,91 @@ void am_log_write(unsigned long instance_id, int level, const char* header, int
         return;
     }
 
-#ifdef _WIN32
-    WaitForSingleObject(am_log_lck.lock, INFINITE);
-    while (log->read_count + log->write_count >= log->bucket_count) {
-        ReleaseMutex(am_log_lck.lock);
-        WaitForSingleObject(am_log_lck.new_space_cond, INFINITE);
-        WaitForSingleObject(am_log_lck.lock, INFINITE);
+    /* format the message first, so that we know how much ring space to reserve */
+    if (header_sz >= sizeof (message)) {
+        header_sz = sizeof (message) - 1;
     }
-#else
-    pthread_mutex_lock(&log->lock);
-    while (log->read_count + log->write_count >= log->bucket_count) {
-        pthread_cond_wait(&log->new_space_cond, &log->lock);
+    memcpy(message, header, header_sz);
+    va_start(args, format);
+    message_sz = vsnprintf(message + header_sz, sizeof (message) - header_sz, format, args);
+    va_end(args);
+    if (message_sz < 0) {
+        return;
+    }
+    message_sz += header_sz;
+    if (message_sz >= sizeof (message)) {
+        message_sz = sizeof (message) - 1;
     }
-#endif
 
-    index = log->in;
-    log->in = AM_LOG_BUFFER_MASK(log->in + 1, log->bucket_count);
-    log->write_count++;
+    log_commit(log, instance_id, level, 0, message, message_sz);
+}
 
-#ifdef _WIN32
-    ReleaseMutex(am_log_lck.lock);
-#else
-    pthread_mutex_unlock(&log->lock);
-#endif
+/**
+ * Deferred counterpart of am_log_write, used by the log.h macros when deferred logging is
+ * enabled for the instance (org.forgerock.agents.config.log.deferred): the message header and text are formatted later by the log worker.
+ * The calling thread only copies the time, thread and process ids, the format string and
+ * the argument values. Formats which can not be deferred (or too large messages) are
+ * formatted right away.
+ */
+void am_log_record(unsigned long instance_id, int level, const char *file, int line, const char *format, ...) {
+    struct am_log *log = AM_LOG();
+    uint64_t buffer[AM_LOG_MESSAGE_SIZE / sizeof (uint64_t)];
+    struct log_deferred *d = (struct log_deferred *) buffer;
+    char *data = (char *) buffer;
+    size_t file_size = file != NULL ? strlen(file) + 1 : 0;
+    size_t format_size = strlen(format) + 1;
+    size_t pos = sizeof (struct log_deferred) + file_size + format_size;
+    int64_t sec;
+    long usec;
+    uint64_t thread;
+    va_list args;
+    int args_size = -1;
+
+    if (log == NULL) {
+        return;
+    }
 
-    /* copy header into the bucket */
-    if (strncpy(log->bucket[index].data, header, log->bucket_size - 1) != NULL) {
+    log_now(&sec, &usec, &thread);
+
+    if (pos < sizeof (buffer)) {
         va_start(args, format);
-        /* and the rest of the message */
-        log->bucket[index].size = vsnprintf(log->bucket[index].data + header_sz,
-                log->bucket_size - header_sz, format, args) + header_sz;
-        log->bucket[index].data[log->bucket[index].size] = '\0';
+        args_size = log_serialize(data + pos, sizeof (buffer) - pos, format, args);
         va_end(args);
     }
 
-    log->bucket[index].instance_id = instance_id;
-    log->bucket[index].level = level;
-
-#ifdef _WIN32
-    WaitForSingleObject(am_log_lck.lock, INFINITE);
-#else
-    pthread_mutex_lock(&log->lock);
-#endif
+    if (args_size < 0) {
+        /* can't defer - format the message now */
+        int message_sz = log_header_at(data, sizeof (buffer), log_level_name(level), sec, usec,
+                thread, getpid(), file, line);
+        int sz;
+        va_start(args, format);
+        sz = vsnprintf(data + message_sz, sizeof (buffer) - message_sz, format, args);
+        va_end(args);
+        if (sz < 0) {
+            return;
+        }
+        message_sz += sz;
+        if (message_sz >= sizeof (buffer)) {
+            message_sz = sizeof (buffer) - 1;
+        }
+        log_commit(log, instance_id, level, 0, data, message_sz);
+        return;
+    }
 
-    log->read_count++;
-    log->write_count--;
-    log->bucket[index].ready_to_read = AM_TRUE;
+    d->sec = sec;
+    d->usec = (int32_t) usec;
+    d->pid = getpid();
+    d->thread = thread;
+    d->line = line;
+    d->file_size = (uint32_t) file_size;
+    d->format_size = (uint32_t) format_size;
+    d->args_size = (uint32_t) args_size;
+    if (file != NULL) {
+        memcpy(data + sizeof (struct log_deferred), file, file_size);
+    }
+    memcpy(data + sizeof (struct log_deferred) + file_size, format, format_size);
 
-#ifdef _WIN32
-    SetEvent(am_log_lck.new_data_cond);
-    ReleaseMutex(am_log_lck.lock);
-#else
-    pthread_cond_signal(&log->new_data_cond);
-    pthread_mutex_unlock(&log->lock);
-#endif
+    log_commit(log, instance_id, level, AM_LOG_RECORD_DEFERRED, data, pos + args_size);
 }
 
 void am_log_shutdown(int id) {
@@ -826,6 +2175,8 @@ void am_log_shutdown(int id) {
         }
     }
 
+    log_maintenance_stop();
+
 #ifdef _WIN32
     if (log->owner == pid) {
         SetEvent(am_log_lck.exit);
@@ -838,6 +2189,7 @@ void am_log_shutdown(int id) {
     CloseHandle(am_log_handle->reader_thr);
 
     WaitForSingleObject(am_log_lck.lock, INFINITE);
+    log_levels_update_begin(log);
     /* close log file(s) */
     for (i = 0; i < AM_MAX_INSTANCES; i++) {
         struct log_files *f = &log->files[i];
@@ -850,6 +2202,8 @@ void am_log_shutdown(int id) {
                 _close(f->fd_audit);
                 f->fd_audit = -1;
             }
+            log_compress_rotated(log, f, AM_FALSE);
+            log_compress_rotated(log, f, AM_TRUE);
             f->used = AM_FALSE;
             f->instance_id = 0;
             f->owner = 0;
@@ -858,6 +2212,7 @@ void am_log_shutdown(int id) {
             break;
         }
     }
+    log_levels_update_end(log);
     ReleaseMutex(am_log_lck.lock);
     CloseHandle(am_log_lck.lock);
     UnmapViewOfFile(am_log_handle->area);
@@ -874,26 +2229,43 @@ void am_log_shutdown(int id) {
     pthread_cond_destroy(&log->new_data_cond);
     pthread_cond_destroy(&log->new_space_cond);
     /* close log file(s) */
+    log_levels_update_begin(log);
     for (i = 0; i < AM_MAX_INSTANCES; i++) {
         struct log_files *f = &log->files[i];
         if (f->fd_debug != -1) {
+            if (f->sync > 0) fsync(f->fd_debug);
             close(f->fd_debug);
             f->fd_debug = -1;
         }
         if (f->fd_audit != -1) {
+            if (f->sync > 0) fsync(f->fd_audit);
             close(f->fd_audit);
             f->fd_audit = -1;
         }
+        if (f->fd_next_debug != -1) {
+            close(f->fd_next_debug);
+            f->fd_next_debug = -1;
+        }
+        if (f->fd_next_audit != -1) {
+            close(f->fd_next_audit);
+            f->fd_next_audit = -1;
+        }
+        if (f->used) {
+            f->closed_debug = f->closed_audit = AM_TRUE;
+            log_compress_rotated(log, f, AM_FALSE);
+            log_compress_rotated(log, f, AM_TRUE);
+        }
         f->used = AM_FALSE;
         f->instance_id = 0;
         f->level_debug = f->level_audit = AM_LOG_LEVEL_NONE;
         f->max_size_debug = f->max_size_audit = 0;
     }
+    log_levels_update_end(log);
     if (munmap((char *) am_log_handle->area, am_log_handle->area_size) == -1) {
         fprintf(stderr, "am_log_shutdown() munmap failed (%d)\n", errno);
     }
     close(am_log_handle->area_file_id);
-    if (shm_unlink(am_log_handle->area_file_name) == -1) {
+    if (am_shm_unlink(am_log_handle->area_file_name) == -1) {
         fprintf(stderr, "am_log_shutdown() shm_unlink failed (%d)\n", errno);
     }
 #endif
@@ -928,8 +2300,53 @@ int am_log_get_current_owner() {
 
 /***************************************************************************/
 
+/**
+ * Apply instance log settings (see am_config_log_options); defaults when options is NULL.
+ */
+static void log_set_options(struct log_files *f, const am_log_options_t *options) {
+    am_log_options_t none;
+    if (options == NULL) {
+        memset(&none, 0, sizeof (none));
+        options = &none;
+    }
+    f->sync = options->sync;
+    f->rate = options->rate;
+    f->overflow = options->overflow_drop ? AM_LOG_OVERFLOW_DROP : AM_LOG_OVERFLOW_BLOCK;
+    f->json = options->json;
+    f->deferred = options->deferred || options->json;
+    f->segment_size = options->segment_size > 0 ? (uint64_t) options->segment_size : 0;
+    f->compress = !options->compress_disable;
+    f->retain_files = options->retain_files > 0 ? (unsigned int) options->retain_files : 0;
+    f->retain_size = options->retain_size > 0 ? (uint64_t) options->retain_size : 0;
+}
+
+#define DEFAULT_LOG_SIZE (1024 * 1024 * 5) /* 5MB */
+
+/**
+ * Apply instance log levels, file size limits and settings.
+ */
+static void log_set_levels(struct log_files *f, int log_level, int log_size, int audit_level, int audit_size,
+        const am_log_options_t *options) {
+    f->max_size_debug = log_size > 0 && log_size < DEFAULT_LOG_SIZE ? DEFAULT_LOG_SIZE : log_size;
+    f->max_size_audit = audit_size > 0 && audit_size < DEFAULT_LOG_SIZE ? DEFAULT_LOG_SIZE : audit_size;
+    f->level_debug = log_level;
+    f->level_audit = audit_level;
+    log_set_options(f, options);
+}
+
+/**
+ * Compare the values set by log_set_levels.
+ */
+static int log_levels_equal(const struct log_files *a, const struct log_files *b) {
+    return a->max_size_debug == b->max_size_debug && a->max_size_audit == b->max_size_audit &&
+            a->level_debug == b->level_debug && a->level_audit == b->level_audit &&
+            a->sync == b->sync && a->rate == b->rate && a->overflow == b->overflow &&
+            a->json == b->json && a->deferred == b->deferred && a->segment_size == b->segment_size &&
+            a->compress == b->compress && a->retain_files == b->retain_files && a->retain_size == b->retain_size;
+}
+
 void am_log_register_instance(unsigned long instance_id, const char *debug_log, int log_level, int log_size,
-        const char *audit_log, int audit_level, int audit_size, const char *config_file) {
+        const char *audit_log, int audit_level, int audit_size, const am_log_options_t *options, const char *config_file) {
     int i, exist = AM_NOT_FOUND;
     struct am_log *log = AM_LOG();
     struct log_files *f = NULL;
@@ -954,6 +2371,7 @@ void am_log_register_instance(unsigned long instance_id, const char *debug_log,
         }
     }
     if (exist == AM_NOT_FOUND) {
+        log_levels_update_begin(log);
         for (i = 0; i < AM_MAX_INSTANCES; i++) {
             f = &log->files[i];
             if (!f->used) {
@@ -961,19 +2379,19 @@ void am_log_register_instance(unsigned long instance_id, const char *debug_log,
                 strncpy(f->name_debug, debug_log, sizeof (f->name_debug) - 1);
                 strncpy(f->name_audit, audit_log, sizeof (f->name_audit) - 1);
                 f->used = AM_TRUE;
-
-#define DEFAULT_LOG_SIZE (1024 * 1024 * 5) /* 5MB */
-
-                f->max_size_debug = log_size > 0 && log_size < DEFAULT_LOG_SIZE ? DEFAULT_LOG_SIZE : log_size;
-                f->max_size_audit = audit_size > 0 && audit_size < DEFAULT_LOG_SIZE ? DEFAULT_LOG_SIZE : audit_size;
-                f->level_debug = log_level;
-                f->level_audit = audit_level;
+                log_set_levels(f, log_level, log_size, audit_level, audit_size, options);
+                f->synced_debug = f->synced_audit = 0;
+                f->pending_debug = f->pending_audit = AM_FALSE;
                 f->created_debug = f->created_audit = 0;
+                f->rotate_debug = f->rotate_audit = AM_LOG_ROTATE_NONE;
+                f->rotated_debug[0] = f->rotated_audit[0] = '\0';
+                f->closed_debug = f->closed_audit = AM_FALSE;
                 f->owner = 0;
                 exist = AM_DONE;
                 break;
             }
         }
+        log_levels_update_end(log);
 
         /* register instance in valid-url-index table */
         if (ISVALID(config_file)) {
@@ -990,11 +2408,16 @@ void am_log_register_instance(unsigned long instance_id, const char *debug_log,
             }
         }
     } else {
-        /* update instance logging level configuration */
-        f->max_size_debug = log_size > 0 && log_size < DEFAULT_LOG_SIZE ? DEFAULT_LOG_SIZE : log_size;
-        f->max_size_audit = audit_size > 0 && audit_size < DEFAULT_LOG_SIZE ? DEFAULT_LOG_SIZE : audit_size;
-        f->level_debug = log_level;
-        f->level_audit = audit_level;
+        /* update instance logging level configuration; this runs with every request, so the level
+         * table version (and with it every thread's level_cache) changes only along with the values */
+        struct log_files levels;
+        memset(&levels, 0, sizeof (levels));
+        log_set_levels(&levels, log_level, log_size, audit_level, audit_size, options);
+        if (!log_levels_equal(f, &levels)) {
+            log_levels_update_begin(log);
+            log_set_levels(f, log_level, log_size, audit_level, audit_size, options);
+            log_levels_update_end(log);
+        }
     }
 #ifdef _WIN32
     ReleaseMutex(am_log_lck.lock);
@@ -1011,6 +2434,15 @@ void am_log_register_instance(unsigned long instance_id, const char *debug_log,
     }
 }
 
+/**
+ * Returns the level table version (log_level_cache is refreshed whenever it changes).
+ * This is used to check instance re-registration in tests.
+ */
+uint32_t am_test_get_log_level_generation() {
+    struct am_log *log = AM_LOG();
+    return log != NULL ? log->level_generation : 0;
+}
+
 /***************************************************************************/
 
 int get_valid_url_index(unsigned long instance_id) {
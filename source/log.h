@@ -17,8 +17,16 @@
 #ifndef LOG_H
 #define LOG_H
 
+#define AM_LOG_DEFERRED 2 /* perform_logging: log the message with am_log_record */
+
+/* audit messages - arguments are user, client ip and url (see log_audit_formats in log.c) */
+#define AUDIT_ALLOW_USER_MESSAGE    "user %s (%s) was allowed access to %s"
+#define AUDIT_DENY_USER_MESSAGE     "user %s (%s) was denied access to %s"
+
 int perform_logging(unsigned long instance_id, int level);
+int am_log_check(unsigned long instance_id, int level, const char *file, int line);
 void am_log_write(unsigned long instance_id, int level, const char* header, int header_sz, const char *format, ...);
+void am_log_record(unsigned long instance_id, int level, const char *file, int line, const char *format, ...);
 
 #ifdef _WIN32
 #define AM_LOG_ALWAYS(instance, format, ...)\
@@ -70,7 +78,10 @@ void am_log_write(unsigned long instance_id, int level, const char* header, int
 #ifdef _WIN32
 #define AM_LOG_INFO(instance, format, ...) \
     do {\
-        if (format != NULL && perform_logging(instance, AM_LOG_LEVEL_INFO)) {\
+        int log_mode = format != NULL ? am_log_check(instance, AM_LOG_LEVEL_INFO, __FILE__, __LINE__) : 0;\
+        if (log_mode == AM_LOG_DEFERRED) {\
+            am_log_record(instance, AM_LOG_LEVEL_INFO, NULL, 0, format, ##__VA_ARGS__);\
+        } else if (log_mode) {\
             char header[128];\
             char time_string[25];\
             char tze[6];\
@@ -95,7 +106,10 @@ void am_log_write(unsigned long instance_id, int level, const char* header, int
 #else
 #define AM_LOG_INFO(instance, format, ...) \
     do {\
-        if (format != NULL && perform_logging(instance, AM_LOG_LEVEL_INFO)) {\
+        int log_mode = format != NULL ? am_log_check(instance, AM_LOG_LEVEL_INFO, __FILE__, __LINE__) : 0;\
+        if (log_mode == AM_LOG_DEFERRED) {\
+            am_log_record(instance, AM_LOG_LEVEL_INFO, NULL, 0, format, ##__VA_ARGS__);\
+        } else if (log_mode) {\
             char header[128];\
             char time_string[25];\
             char tz[8];\
@@ -117,7 +131,10 @@ void am_log_write(unsigned long instance_id, int level, const char* header, int
 #ifdef _WIN32
 #define AM_LOG_WARNING(instance, format, ...) \
     do {\
-        if (format != NULL && perform_logging(instance, AM_LOG_LEVEL_WARNING)) {\
+        int log_mode = format != NULL ? am_log_check(instance, AM_LOG_LEVEL_WARNING, __FILE__, __LINE__) : 0;\
+        if (log_mode == AM_LOG_DEFERRED) {\
+            am_log_record(instance, AM_LOG_LEVEL_WARNING, NULL, 0, format, ##__VA_ARGS__);\
+        } else if (log_mode) {\
             char header[128];\
             char time_string[25];\
             char tze[6];\
@@ -142,7 +159,10 @@ void am_log_write(unsigned long instance_id, int level, const char* header, int
 #else
 #define AM_LOG_WARNING(instance, format, ...) \
     do {\
-        if (format != NULL && perform_logging(instance, AM_LOG_LEVEL_WARNING)) {\
+        int log_mode = format != NULL ? am_log_check(instance, AM_LOG_LEVEL_WARNING, __FILE__, __LINE__) : 0;\
+        if (log_mode == AM_LOG_DEFERRED) {\
+            am_log_record(instance, AM_LOG_LEVEL_WARNING, NULL, 0, format, ##__VA_ARGS__);\
+        } else if (log_mode) {\
             char header[128];\
             char time_string[25];\
             char tz[8];\
@@ -164,7 +184,10 @@ void am_log_write(unsigned long instance_id, int level, const char* header, int
 #ifdef _WIN32
 #define AM_LOG_ERROR(instance, format, ...) \
     do {\
-        if (format != NULL && perform_logging(instance, AM_LOG_LEVEL_ERROR)) {\
+        int log_mode = format != NULL ? am_log_check(instance, AM_LOG_LEVEL_ERROR, __FILE__, __LINE__) : 0;\
+        if (log_mode == AM_LOG_DEFERRED) {\
+            am_log_record(instance, AM_LOG_LEVEL_ERROR, NULL, 0, format, ##__VA_ARGS__);\
+        } else if (log_mode) {\
             char header[128];\
             char time_string[25];\
             char tze[6];\
@@ -189,7 +212,10 @@ void am_log_write(unsigned long instance_id, int level, const char* header, int
 #else
 #define AM_LOG_ERROR(instance, format, ...) \
     do {\
-        if (format != NULL && perform_logging(instance, AM_LOG_LEVEL_ERROR)) {\
+        int log_mode = format != NULL ? am_log_check(instance, AM_LOG_LEVEL_ERROR, __FILE__, __LINE__) : 0;\
+        if (log_mode == AM_LOG_DEFERRED) {\
+            am_log_record(instance, AM_LOG_LEVEL_ERROR, NULL, 0, format, ##__VA_ARGS__);\
+        } else if (log_mode) {\
             char header[128];\
             char time_string[25];\
             char tz[8];\
@@ -211,7 +237,10 @@ void am_log_write(unsigned long instance_id, int level, const char* header, int
 #ifdef _WIN32
 #define AM_LOG_DEBUG(instance, format, ...) \
     do {\
-        if (format != NULL && perform_logging(instance, AM_LOG_LEVEL_DEBUG)) {\
+        int log_mode = format != NULL ? am_log_check(instance, AM_LOG_LEVEL_DEBUG, __FILE__, __LINE__) : 0;\
+        if (log_mode == AM_LOG_DEFERRED) {\
+            am_log_record(instance, AM_LOG_LEVEL_DEBUG, __FILE__, __LINE__, format, ##__VA_ARGS__);\
+        } else if (log_mode) {\
             char header[128];\
             char time_string[25];\
             char tze[6];\
@@ -236,7 +265,10 @@ void am_log_write(unsigned long instance_id, int level, const char* header, int
 #else
 #define AM_LOG_DEBUG(instance, format, ...) \
     do {\
-        if (format != NULL && perform_logging(instance, AM_LOG_LEVEL_DEBUG)) {\
+        int log_mode = format != NULL ? am_log_check(instance, AM_LOG_LEVEL_DEBUG, __FILE__, __LINE__) : 0;\
+        if (log_mode == AM_LOG_DEFERRED) {\
+            am_log_record(instance, AM_LOG_LEVEL_DEBUG, __FILE__, __LINE__, format, ##__VA_ARGS__);\
+        } else if (log_mode) {\
             char header[128];\
             char time_string[25];\
             char tz[8];\
@@ -258,7 +290,10 @@ void am_log_write(unsigned long instance_id, int level, const char* header, int
 #ifdef _WIN32
 #define AM_LOG_AUDIT(instance, format, ...) \
     do {\
-        if (format != NULL && perform_logging(instance, AM_LOG_LEVEL_AUDIT)) {\
+        int log_mode = format != NULL ? am_log_check(instance, AM_LOG_LEVEL_AUDIT, __FILE__, __LINE__) : 0;\
+        if (log_mode == AM_LOG_DEFERRED) {\
+            am_log_record(instance, AM_LOG_LEVEL_AUDIT, NULL, 0, format, ##__VA_ARGS__);\
+        } else if (log_mode) {\
             char header[128];\
             char time_string[25];\
             char tze[6];\
@@ -283,7 +318,10 @@ void am_log_write(unsigned long instance_id, int level, const char* header, int
 #else
 #define AM_LOG_AUDIT(instance, format, ...) \
     do {\
-        if (format != NULL && perform_logging(instance, AM_LOG_LEVEL_AUDIT)) {\
+        int log_mode = format != NULL ? am_log_check(instance, AM_LOG_LEVEL_AUDIT, __FILE__, __LINE__) : 0;\
+        if (log_mode == AM_LOG_DEFERRED) {\
+            am_log_record(instance, AM_LOG_LEVEL_AUDIT, NULL, 0, format, ##__VA_ARGS__);\
+        } else if (log_mode) {\
             char header[128];\
             char time_string[25];\
             char tz[8];\
@@ -302,6 +302,37 @@ void am_net_options_create(am_config_t *conf, am_net_options_t *options, void (*
     }
 }
 
+/**
+ * Make a deep copy of the net options (used to hand a cached set of options over
+ * to a worker, which owns and deletes its copy).
+ */
+void am_net_options_copy(am_net_options_t *dst, const am_net_options_t *src) {
+    int i;
+    if (dst == NULL || src == NULL) return;
+
+    memcpy(dst, src, sizeof (am_net_options_t));
+    dst->server_id = ISVALID(src->server_id) ? strdup(src->server_id) : NULL;
+    dst->notif_url = ISVALID(src->notif_url) ? strdup(src->notif_url) : NULL;
+    dst->ciphers = ISVALID(src->ciphers) ? strdup(src->ciphers) : NULL;
+    dst->cert_ca_file = ISVALID(src->cert_ca_file) ? strdup(src->cert_ca_file) : NULL;
+    dst->cert_file = ISVALID(src->cert_file) ? strdup(src->cert_file) : NULL;
+    dst->cert_key_file = ISVALID(src->cert_key_file) ? strdup(src->cert_key_file) : NULL;
+    dst->cert_key_pass = ISVALID(src->cert_key_pass) ? strndup(src->cert_key_pass, src->cert_key_pass_sz) : NULL;
+    dst->tls_opts = ISVALID(src->tls_opts) ? strdup(src->tls_opts) : NULL;
+    dst->hostmap = NULL;
+    dst->hostmap_sz = 0;
+
+    if (src->hostmap_sz > 0 && src->hostmap != NULL) {
+        dst->hostmap = malloc(src->hostmap_sz * sizeof (char *));
+        if (dst->hostmap != NULL) {
+            for (i = 0; i < src->hostmap_sz; i++) {
+                dst->hostmap[i] = strdup(src->hostmap[i]);
+            }
+            dst->hostmap_sz = src->hostmap_sz;
+        }
+    }
+}
+
 void am_net_options_delete(am_net_options_t *options) {
     int i;
     if (options == NULL) return;
@@ -98,6 +98,7 @@ void am_net_sync_recv(am_net_t *n, int timeout_ms);
 int am_net_close(am_net_t *n);
 
 void am_net_options_create(am_config_t *ac, am_net_options_t *options, void (*log)(const char *, ...));
+void am_net_options_copy(am_net_options_t *dst, const am_net_options_t *src);
 void am_net_options_delete(am_net_options_t *options);
 
 int am_agent_login(unsigned long instance_id, const char *openam,
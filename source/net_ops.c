@@ -78,6 +78,22 @@ static am_bool_t is_complete(void *udata) {
     return ld->message_complete;
 }
 
+/**
+ * Wait for the response to a request just sent and add the OpenAM call latency
+ * (request sent to response received) to the agent statistics.
+ */
+static void sync_recv(am_net_t *conn) {
+    uint64_t start, stop;
+    am_timer(&start);
+    am_net_sync_recv(conn, AM_NET_POOL_TIMEOUT);
+    am_timer(&stop);
+    am_stats_add(AM_STATS_OPENAM_REQUESTS, 1);
+    if (conn->http_status == 0 || conn->http_status >= 500) {
+        am_stats_add(AM_STATS_OPENAM_ERRORS, 1);
+    }
+    am_stats_record(AM_STATS_OPENAM_LATENCY, am_timer_usec(start, stop));
+}
+
 static void create_cookie_header(am_net_t *conn, const char *token) {
     static const char *thisfunc = "create_cookie_header():";
     int i;
@@ -226,7 +242,7 @@ static int send_authcontext_request(am_net_t *conn, const char *realm, char **to
     free(post);
 
     if (status == AM_SUCCESS) {
-        am_net_sync_recv(conn, AM_NET_POOL_TIMEOUT);
+        sync_recv(conn);
     }
 
     AM_LOG_DEBUG(conn->instance_id, "%s response status code: %d\n%s",
@@ -361,7 +377,7 @@ static int send_login_request(am_net_t *conn, char **token, const char *user, co
     *token = NULL;
 
     if (status == AM_SUCCESS) {
-        am_net_sync_recv(conn, AM_NET_POOL_TIMEOUT);
+        sync_recv(conn);
     }
 
     AM_LOG_DEBUG(conn->instance_id, "%s authenticate response status code: %d\n%s",
@@ -445,7 +461,7 @@ static int send_attribute_request(am_net_t *conn, char **token, char **pxml, siz
     free(post);
 
     if (status == AM_SUCCESS) {
-        am_net_sync_recv(conn, AM_NET_POOL_TIMEOUT);
+        sync_recv(conn);
     }
 
     AM_LOG_DEBUG(conn->instance_id, "%s response status code: %d\n%s",
@@ -570,7 +586,7 @@ static int send_session_request(am_net_t *conn, char **token, const char *user_t
     AM_FREE(post, post_data, token_b64, token_in, lsnr_req);
 
     if (status == AM_SUCCESS) {
-        am_net_sync_recv(conn, AM_NET_POOL_TIMEOUT);
+        sync_recv(conn);
     }
 
     AM_LOG_DEBUG(conn->instance_id, "%s response status code: %d\n%s",
@@ -674,7 +690,7 @@ static int send_policychange_request(am_net_t *conn, char **token) {
     free(post);
 
     if (status == AM_SUCCESS) {
-        am_net_sync_recv(conn, AM_NET_POOL_TIMEOUT);
+        sync_recv(conn);
     }
 
     AM_LOG_DEBUG(conn->instance_id, "%s authenticate response status code: %d\n%s",
@@ -771,7 +787,7 @@ static int send_policy_request(am_net_t *conn, const char *token, const char *us
     AM_FREE(post_data, post, req_url_escaped);
 
     if (status == AM_SUCCESS) {
-        am_net_sync_recv(conn, AM_NET_POOL_TIMEOUT);
+        sync_recv(conn);
     }
 
     AM_LOG_DEBUG(conn->instance_id, "%s authenticate response status code: %d\n%s",
@@ -1059,7 +1075,7 @@ int am_agent_logout(unsigned long instance_id, const char *openam, const char *t
 
 
     if (status == AM_SUCCESS) {
-        am_net_sync_recv(conn, AM_NET_POOL_TIMEOUT);
+        sync_recv(conn);
     } else {
         AM_LOG_DEBUG(instance_id, "%s closing connection after failure", thisfunc);
         if (options != NULL && options->log != NULL) {
@@ -1245,7 +1261,7 @@ int am_url_validate(unsigned long instance_id, const char* url, am_net_options_t
     }
 
     if (status == AM_SUCCESS) {
-        am_net_sync_recv(conn, AM_NET_POOL_TIMEOUT);
+        sync_recv(conn);
     } else {
         AM_LOG_DEBUG(instance_id, "%s closing connection after failure", thisfunc);
         if (options != NULL && options->log != NULL) {
@@ -1340,12 +1356,16 @@ int am_agent_audit_request(unsigned long instance_id, const char *openam, const
     }
 
     if (status == AM_SUCCESS) {
-        am_net_sync_recv(conn, AM_NET_POOL_TIMEOUT);
+        sync_recv(conn);
     } else {
         AM_LOG_DEBUG(instance_id, "%s closing connection after failure", thisfunc);
     }
 
     AM_LOG_DEBUG(instance_id, "%s response status code: %d", thisfunc, conn->http_status);
+    if (status == AM_SUCCESS && conn->http_status != 200) {
+        /* records are not acknowledged unless the logging service accepts them */
+        status = AM_ERROR;
+    }
 
     am_net_close(conn);
     if (req_data != NULL) {
@@ -0,0 +1,857 @@
+/**
+ * The contents of this file are subject to the terms of the Common Development and
+ * Distribution License (the License). You may not use this file except in compliance with the
+ * License.
+ *
+ * You can obtain a copy of the License at legal/CDDLv1.0.txt. See the License for the
+ * specific language governing permission and limitations under the License.
+ *
+ * When distributing Covered Software, include this CDDL Header Notice in each file and include
+ * the License file at legal/CDDLv1.0.txt. If applicable, add the following below the CDDL
+ * Header, with the fields enclosed by brackets [] replaced by your own identifying
+ * information: "Portions copyright [year] [name of copyright owner]".
+ *
+ * Copyright 2015 ForgeRock AS.
+ */
+
+#include "platform.h"
+#include "am.h"
+#include "utility.h"
+#include "list.h"
+#include "thread.h"
+
+/*
+ * Post data preservation store.
+ *
+ * Preserved POST requests (url, content type and body) are appended as records to segment
+ * files (<pdp_dir>/am_pdp.<n>) instead of a file each. A writer checks a segment out for the
+ * duration of one append, so that request bodies can be streamed in without knowing their size
+ * up front and concurrent writers never share a segment. A segment is sealed once it grows over
+ * AM_PDP_SEGMENT_SIZE bytes.
+ *
+ * Shared memory holds the segment table and the record index (key -> segment, offset, size,
+ * expiry time). Records are never changed in place, apart from the removed mark which keeps them
+ * from being recovered. Compaction drops expired index entries, deletes segments without live
+ * records and copies live records out of mostly dead segments. Segment files are deleted one
+ * compaction interval after they die, so that readers which have just looked a record up can
+ * still open them.
+ *
+ * <pdp_dir>/am_pdp.idx lists the segments of the directory; they are scanned on the first use of
+ * the directory after the shared memory was created (crash recovery). A record is valid if its
+ * header is complete and the hash of its data matches - torn tails are ignored.
+ */
+
+#define PDP_RECORD_MAGIC    0x52445041 /* APDR */
+#define PDP_RECORD_REMOVED  0x58445041 /* APDX */
+#define PDP_INDEX_MAGIC     0x49445041 /* APDI */
+#define PDP_KEY_SIZE        40
+#define PDP_ALIGN(s)        (((s) + 7) & ~((uint64_t) 7))
+#define PDP_WRITE_TIMEOUT   3600 /* checked out segment of a writer which went away */
+#define PDP_INDEX_MASK      (AM_PDP_INDEX_SIZE - 1)
+#define PDP_GET_RETRIES     4 /* record lookups after the record was moved by compaction */
+
+enum {
+    PDP_SEGMENT_FREE = 0,
+    PDP_SEGMENT_OPEN, /* writable, not in use */
+    PDP_SEGMENT_BUSY, /* checked out by a writer */
+    PDP_SEGMENT_SEALED,
+    PDP_SEGMENT_DEAD /* no live records, file is deleted after a while */
+};
+
+struct pdp_record {
+    uint32_t magic;
+    uint32_t hash; /* of url, content type and data */
+    char key[PDP_KEY_SIZE];
+    int64_t expires; /* 0 - never */
+    uint32_t url_size; /* with the terminating NUL */
+    uint32_t type_size;
+    uint64_t data_size;
+};
+
+struct pdp_dir {
+    char path[AM_PATH_SIZE]; /* empty - not used */
+    uint64_t next_seq;
+};
+
+struct pdp_segment {
+    int state;
+    int dir;
+    uint64_t seq;
+    uint64_t end; /* size of written data */
+    uint64_t live_bytes;
+    uint32_t live; /* number of live records */
+    time_t ts; /* checked out (busy) or died (dead) */
+};
+
+struct pdp_index_entry {
+    char key[PDP_KEY_SIZE]; /* empty - free */
+    int segment;
+    uint64_t offset;
+    uint64_t size; /* whole record, aligned */
+    int64_t expires;
+};
+
+struct pdp_store {
+    time_t compacted;
+    unsigned int count;
+    struct pdp_dir dir[AM_MAX_INSTANCES];
+    struct pdp_segment segment[AM_PDP_SEGMENTS];
+    struct pdp_index_entry index[AM_PDP_INDEX_SIZE];
+};
+
+struct pdp_index_file {
+    uint32_t magic;
+    uint32_t count;
+    uint64_t next_seq;
+    uint64_t seq[AM_PDP_SEGMENTS];
+};
+
+static am_shm_t *pdp_shm = NULL;
+
+int am_pdp_init(int id) {
+    if (pdp_shm != NULL) return AM_SUCCESS;
+
+    pdp_shm = am_shm_create(get_global_name(AM_PDP_SHM_NAME, id), sizeof (struct pdp_store) + 4096);
+    if (pdp_shm == NULL) {
+        return AM_ERROR;
+    }
+    if (pdp_shm->error != AM_SUCCESS) {
+        return pdp_shm->error;
+    }
+
+    if (pdp_shm->init) {
+        struct pdp_store *store = (struct pdp_store *) am_shm_alloc(pdp_shm, sizeof (struct pdp_store));
+        if (store == NULL) {
+            return AM_ENOMEM;
+        }
+        am_shm_lock(pdp_shm);
+        memset(store, 0, sizeof (struct pdp_store));
+        store->compacted = time(NULL);
+        am_shm_set_user_offset(pdp_shm, AM_GET_OFFSET(pdp_shm->pool, store));
+        am_shm_unlock(pdp_shm);
+    }
+    return AM_SUCCESS;
+}
+
+int am_pdp_shutdown() {
+    am_shm_shutdown(pdp_shm);
+    pdp_shm = NULL;
+    return AM_SUCCESS;
+}
+
+static struct pdp_store *get_store() {
+    return pdp_shm != NULL ? (struct pdp_store *) am_shm_get_user_pointer(pdp_shm) : NULL;
+}
+
+static int pdp_open(const char *name, int create) {
+#ifdef _WIN32
+    return _open(name, (create ? _O_CREAT : 0) | _O_RDWR | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+    return open(name, (create ? O_CREAT : 0) | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+#endif
+}
+
+static void pdp_close(int fd) {
+#ifdef _WIN32
+    _close(fd);
+#else
+    close(fd);
+#endif
+}
+
+/**
+ * Read or write 'size' bytes at 'offset'. Returns AM_SUCCESS or AM_EOF.
+ */
+static int pdp_io(int fd, void *buf, size_t size, uint64_t offset, int write_data) {
+    char *p = (char *) buf;
+#ifdef _WIN32
+    if (_lseeki64(fd, (__int64) offset, SEEK_SET) != (__int64) offset) {
+        return AM_EOF;
+    }
+#endif
+    while (size > 0) {
+        ssize_t n;
+#ifdef _WIN32
+        n = write_data ? _write(fd, p, (unsigned int) size) : _read(fd, p, (unsigned int) size);
+#else
+        n = write_data ? pwrite(fd, p, size, (off_t) offset) : pread(fd, p, size, (off_t) offset);
+#endif
+        if (n <= 0) {
+            return AM_EOF;
+        }
+        p += n;
+        size -= (size_t) n;
+        offset += (uint64_t) n;
+    }
+    return AM_SUCCESS;
+}
+
+static uint32_t pdp_hash(uint32_t hash, const char *data, size_t size) {
+    size_t i;
+    for (i = 0; i < size; i++) {
+        hash ^= (unsigned char) data[i];
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+static void segment_name(struct pdp_store *store, int dir, uint64_t seq, char *name, size_t size) {
+    snprintf(name, size, "%s/am_pdp.%lu", store->dir[dir].path, (unsigned long) seq);
+}
+
+static uint32_t index_slot(const char *key) {
+    return pdp_hash(2166136261U, key, strlen(key)) & PDP_INDEX_MASK;
+}
+
+static struct pdp_index_entry *index_find(struct pdp_store *store, const char *key) {
+    uint32_t i, n;
+    for (i = index_slot(key), n = 0; n < AM_PDP_INDEX_SIZE; i = (i + 1) & PDP_INDEX_MASK, n++) {
+        struct pdp_index_entry *e = &store->index[i];
+        if (e->key[0] == '\0') break;
+        if (strcmp(e->key, key) == 0) return e;
+    }
+    return NULL;
+}
+
+static struct pdp_index_entry *index_add(struct pdp_store *store, const char *key) {
+    uint32_t i, n;
+    if (store->count >= AM_PDP_INDEX_SIZE - 1) return NULL;
+    for (i = index_slot(key), n = 0; n < AM_PDP_INDEX_SIZE; i = (i + 1) & PDP_INDEX_MASK, n++) {
+        struct pdp_index_entry *e = &store->index[i];
+        if (e->key[0] == '\0') {
+            strncpy(e->key, key, PDP_KEY_SIZE - 1);
+            store->count++;
+            return e;
+        }
+        if (strcmp(e->key, key) == 0) return NULL;
+    }
+    return NULL;
+}
+
+/**
+ * Remove an index entry (linear probing, backward shift deletion) and update the
+ * segment counters.
+ */
+static void index_remove(struct pdp_store *store, struct pdp_index_entry *e) {
+    uint32_t i = (uint32_t) (e - store->index), j = i;
+    struct pdp_segment *g = &store->segment[e->segment];
+
+    if (g->live > 0) {
+        g->live--;
+        g->live_bytes -= e->size < g->live_bytes ? e->size : g->live_bytes;
+    }
+    for (;;) {
+        uint32_t k;
+        j = (j + 1) & PDP_INDEX_MASK;
+        if (store->index[j].key[0] == '\0') break;
+        k = index_slot(store->index[j].key);
+        if ((j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j))) {
+            store->index[i] = store->index[j];
+            i = j;
+        }
+    }
+    memset(&store->index[i], 0, sizeof (struct pdp_index_entry));
+    store->count--;
+}
+
+/**
+ * Write the list of the directory segments. Called with the store locked.
+ */
+static void write_index_file(struct pdp_store *store, int dir) {
+    struct pdp_index_file idx;
+    char name[AM_PATH_SIZE + 32];
+    int i, fd;
+
+    memset(&idx, 0, sizeof (struct pdp_index_file));
+    idx.magic = PDP_INDEX_MAGIC;
+    idx.next_seq = store->dir[dir].next_seq;
+    for (i = 0; i < AM_PDP_SEGMENTS; i++) {
+        struct pdp_segment *g = &store->segment[i];
+        if (g->state != PDP_SEGMENT_FREE && g->dir == dir) {
+            idx.seq[idx.count++] = g->seq;
+        }
+    }
+    snprintf(name, sizeof (name), "%s/am_pdp.idx", store->dir[dir].path);
+    fd = pdp_open(name, AM_TRUE);
+    if (fd != -1) {
+        pdp_io(fd, &idx, sizeof (struct pdp_index_file), 0, AM_TRUE);
+        pdp_close(fd);
+    }
+}
+
+static int find_free_segment(struct pdp_store *store) {
+    int i;
+    for (i = 0; i < AM_PDP_SEGMENTS; i++) {
+        if (store->segment[i].state == PDP_SEGMENT_FREE) return i;
+    }
+    return -1;
+}
+
+/**
+ * Scan a segment file and add its valid records to the index. Returns the end of the
+ * valid data.
+ */
+static uint64_t recover_segment(struct pdp_store *store, int slot, int fd, time_t now) {
+    struct pdp_segment *g = &store->segment[slot];
+    struct pdp_record rec;
+    uint64_t off = 0;
+    char *buf = malloc(AM_POST_DATA_CHUNK_SIZE);
+
+    if (buf == NULL) return 0;
+
+    while (pdp_io(fd, &rec, sizeof (struct pdp_record), off, AM_FALSE) == AM_SUCCESS &&
+            (rec.magic == PDP_RECORD_MAGIC || rec.magic == PDP_RECORD_REMOVED) &&
+            rec.key[PDP_KEY_SIZE - 1] == '\0' && rec.url_size > 0 && rec.type_size > 0) {
+        uint64_t payload = (uint64_t) rec.url_size + rec.type_size + rec.data_size, done = 0;
+        uint64_t size = PDP_ALIGN(sizeof (struct pdp_record) + payload);
+        uint32_t hash = 2166136261U;
+        struct pdp_index_entry *e;
+
+        while (done < payload) {
+            size_t n = payload - done > AM_POST_DATA_CHUNK_SIZE ? AM_POST_DATA_CHUNK_SIZE : (size_t) (payload - done);
+            if (pdp_io(fd, buf, n, off + sizeof (struct pdp_record) + done, AM_FALSE) != AM_SUCCESS) break;
+            hash = pdp_hash(hash, buf, n);
+            done += n;
+        }
+        if (done < payload || hash != rec.hash) {
+            break; /* torn record */
+        }
+        if (rec.magic == PDP_RECORD_MAGIC && (rec.expires == 0 || rec.expires > (int64_t) now) &&
+                (e = index_add(store, rec.key)) != NULL) {
+            e->segment = slot;
+            e->offset = off;
+            e->size = size;
+            e->expires = rec.expires;
+            g->live++;
+            g->live_bytes += size;
+        }
+        off += size;
+    }
+    free(buf);
+    return off;
+}
+
+/**
+ * Find (or register) the store directory. On the first use the directory segments are
+ * recovered. Called with the store locked.
+ */
+static int get_dir(struct pdp_store *store, const char *path) {
+    struct pdp_index_file idx;
+    char name[AM_PATH_SIZE + 32];
+    int i, dir = -1, fd;
+    uint32_t j;
+    time_t now;
+
+    for (i = 0; i < AM_MAX_INSTANCES; i++) {
+        if (store->dir[i].path[0] == '\0') {
+            if (dir == -1) dir = i;
+        } else if (strcmp(store->dir[i].path, path) == 0) {
+            return i;
+        }
+    }
+    if (dir == -1 || strlen(path) >= AM_PATH_SIZE) return -1;
+
+    strncpy(store->dir[dir].path, path, AM_PATH_SIZE - 1);
+    store->dir[dir].next_seq = 0;
+
+    snprintf(name, sizeof (name), "%s/am_pdp.idx", path);
+    fd = pdp_open(name, AM_FALSE);
+    if (fd == -1) {
+        return dir;
+    }
+    if (pdp_io(fd, &idx, sizeof (struct pdp_index_file), 0, AM_FALSE) != AM_SUCCESS ||
+            idx.magic != PDP_INDEX_MAGIC || idx.count > AM_PDP_SEGMENTS) {
+        pdp_close(fd);
+        return dir;
+    }
+    pdp_close(fd);
+
+    now = time(NULL);
+    store->dir[dir].next_seq = idx.next_seq;
+    for (j = 0; j < idx.count; j++) {
+        int slot = find_free_segment(store);
+        struct pdp_segment *g;
+        if (slot == -1) break;
+        g = &store->segment[slot];
+        segment_name(store, dir, idx.seq[j], name, sizeof (name));
+        fd = pdp_open(name, AM_FALSE);
+        if (fd == -1) continue;
+        memset(g, 0, sizeof (struct pdp_segment));
+        g->dir = dir;
+        g->seq = idx.seq[j];
+        g->end = recover_segment(store, slot, fd, now);
+        g->state = g->live > 0 ? PDP_SEGMENT_SEALED : PDP_SEGMENT_FREE;
+        pdp_close(fd);
+        if (g->state == PDP_SEGMENT_FREE) {
+            unlink(name);
+        }
+    }
+    write_index_file(store, dir);
+    return dir;
+}
+
+/**
+ * Check a segment of the directory out for writing. Called with the store locked.
+ */
+static int checkout_segment(struct pdp_store *store, int dir) {
+    int i, slot = -1;
+    for (i = 0; i < AM_PDP_SEGMENTS; i++) {
+        struct pdp_segment *g = &store->segment[i];
+        if (g->state == PDP_SEGMENT_OPEN && g->dir == dir) {
+            slot = i;
+            break;
+        }
+    }
+    if (slot == -1) {
+        struct pdp_segment *g;
+        slot = find_free_segment(store);
+        if (slot == -1) return -1;
+        g = &store->segment[slot];
+        memset(g, 0, sizeof (struct pdp_segment));
+        g->dir = dir;
+        g->seq = store->dir[dir].next_seq++;
+        g->state = PDP_SEGMENT_BUSY;
+        write_index_file(store, dir);
+    }
+    store->segment[slot].state = PDP_SEGMENT_BUSY;
+    store->segment[slot].ts = time(NULL);
+    return slot;
+}
+
+static void checkin_segment(struct pdp_store *store, int slot, uint64_t end) {
+    struct pdp_segment *g = &store->segment[slot];
+    if (end > g->end) {
+        g->end = end;
+    }
+    g->state = g->end >= AM_PDP_SEGMENT_SIZE ? PDP_SEGMENT_SEALED : PDP_SEGMENT_OPEN;
+}
+
+/**
+ * Remove what a failed append left past the end of the segment data - a partial (client supplied)
+ * request body, or a record which did not make it into the index - before the segment is checked in:
+ * recover_segment would pick it up once another record is appended in front of it. Returns the end
+ * of the segment data to check the segment in with.
+ */
+static uint64_t discard_append(int fd, uint64_t offset) {
+    struct pdp_record rec;
+#ifdef _WIN32
+    if (_chsize_s(fd, (__int64) offset) == 0) return offset;
+#else
+    if (ftruncate(fd, (off_t) offset) == 0) return offset;
+#endif
+    /* end the segment data with an empty header and seal it */
+    memset(&rec, 0, sizeof (struct pdp_record));
+    pdp_io(fd, &rec, sizeof (struct pdp_record), offset, AM_TRUE);
+    return AM_PDP_SEGMENT_SIZE;
+}
+
+static void pdp_compact_worker(void *arg) {
+    am_pdp_compact(time(NULL));
+}
+
+/**
+ * Store a preserved POST request. Request body is read in chunks with 'read_f' (see
+ * write_file_stream) and appended to a segment file as it arrives.
+ *
+ * @return AM_SUCCESS, AM_EAGAIN if the store can not take the request (nothing was read),
+ * AM_E2BIG if the body is larger than 'max_size' bytes (0 - no limit), AM_EEXIST if a request
+ * with the same key is already stored (nothing was read, unless it was stored concurrently) or an
+ * I/O error
+ */
+int am_pdp_store(const char *dir, const char *key, const char *url, const char *content_type, int ttl,
+        ssize_t(*read_f)(void *, char *, size_t), void *arg, size_t max_size, size_t *data_sz) {
+    struct pdp_store *store = get_store();
+    struct pdp_record rec;
+    struct pdp_index_entry *e;
+    char name[AM_PATH_SIZE + 32], *buf;
+    uint64_t offset, pos;
+    int d, slot, fd, status = AM_SUCCESS, compact = AM_FALSE;
+    time_t now = time(NULL);
+
+    if (data_sz != NULL) *data_sz = 0;
+    if (store == NULL || ISINVALID(dir) || ISINVALID(key) || strlen(key) >= PDP_KEY_SIZE ||
+            url == NULL || content_type == NULL || read_f == NULL) {
+        return AM_EAGAIN;
+    }
+
+    buf = malloc(AM_POST_DATA_CHUNK_SIZE);
+    if (buf == NULL) return AM_EAGAIN;
+
+    am_shm_lock(pdp_shm);
+    if (index_find(store, key) != NULL) {
+        /* do not read the body in only to find the key taken */
+        am_shm_unlock(pdp_shm);
+        free(buf);
+        return AM_EEXIST;
+    }
+    d = get_dir(store, dir);
+    slot = d == -1 || store->count >= AM_PDP_INDEX_SIZE / 4 * 3 ? -1 : checkout_segment(store, d);
+    if (slot == -1) {
+        am_shm_unlock(pdp_shm);
+        free(buf);
+        return AM_EAGAIN;
+    }
+    segment_name(store, d, store->segment[slot].seq, name, sizeof (name));
+    offset = store->segment[slot].end;
+    am_shm_unlock(pdp_shm);
+
+    memset(&rec, 0, sizeof (struct pdp_record));
+    strncpy(rec.key, key, PDP_KEY_SIZE - 1);
+    rec.expires = ttl > 0 ? (int64_t) now + ttl : 0;
+    rec.url_size = (uint32_t) strlen(url) + 1;
+    rec.type_size = (uint32_t) strlen(content_type) + 1;
+    rec.hash = pdp_hash(pdp_hash(2166136261U, url, rec.url_size), content_type, rec.type_size);
+
+    fd = pdp_open(name, AM_TRUE);
+    if (fd == -1) {
+        am_shm_lock(pdp_shm);
+        checkin_segment(store, slot, offset);
+        am_shm_unlock(pdp_shm);
+        free(buf);
+        return AM_EAGAIN;
+    }
+
+    /* payload first, the header (which makes the record valid) last */
+    pos = offset + sizeof (struct pdp_record);
+    if (pdp_io(fd, (void *) url, rec.url_size, pos, AM_TRUE) != AM_SUCCESS ||
+            pdp_io(fd, (void *) content_type, rec.type_size, pos + rec.url_size, AM_TRUE) != AM_SUCCESS) {
+        status = AM_EOF;
+    }
+    pos += rec.url_size + rec.type_size;
+    while (status == AM_SUCCESS) {
+        ssize_t rd = read_f(arg, buf, AM_POST_DATA_CHUNK_SIZE);
+        if (rd == 0) break;
+        if (rd < 0) {
+            status = AM_ERROR;
+            break;
+        }
+        if (max_size > 0 && rec.data_size + rd > max_size) {
+            status = AM_E2BIG;
+            break;
+        }
+        if (pdp_io(fd, buf, (size_t) rd, pos, AM_TRUE) != AM_SUCCESS) {
+            status = AM_EOF;
+            break;
+        }
+        rec.hash = pdp_hash(rec.hash, buf, (size_t) rd);
+        rec.data_size += rd;
+        pos += rd;
+    }
+    if (status == AM_SUCCESS) {
+        rec.magic = PDP_RECORD_MAGIC;
+        status = pdp_io(fd, &rec, sizeof (struct pdp_record), offset, AM_TRUE);
+    }
+    free(buf);
+
+    am_shm_lock(pdp_shm);
+    if (status == AM_SUCCESS) {
+        e = index_add(store, key);
+        if (e != NULL) {
+            struct pdp_segment *g = &store->segment[slot];
+            e->segment = slot;
+            e->offset = offset;
+            e->size = PDP_ALIGN(sizeof (struct pdp_record) + rec.url_size + rec.type_size + rec.data_size);
+            e->expires = rec.expires;
+            g->live++;
+            g->live_bytes += e->size;
+            checkin_segment(store, slot, offset + e->size);
+        } else {
+            status = index_find(store, key) != NULL ? AM_EEXIST : AM_ENOMEM;
+        }
+    }
+    if (difftime(now, store->compacted) >= AM_PDP_COMPACT_INTERVAL) {
+        store->compacted = now;
+        compact = AM_TRUE;
+    }
+    am_shm_unlock(pdp_shm);
+
+    if (status != AM_SUCCESS) {
+        /* the segment is still checked out - nobody appends past offset in the meantime */
+        uint64_t end = discard_append(fd, offset);
+        am_shm_lock(pdp_shm);
+        checkin_segment(store, slot, end);
+        am_shm_unlock(pdp_shm);
+    }
+    pdp_close(fd);
+
+    if (compact) {
+        am_worker_dispatch_class(AM_WORKER_LOW, pdp_compact_worker, NULL);
+    }
+    if (status == AM_SUCCESS && data_sz != NULL) {
+        *data_sz = (size_t) rec.data_size;
+    }
+    return status;
+}
+
+/**
+ * Read url and content type of the record 'key' at 'record' (header into 'rec').
+ *
+ * @return AM_SUCCESS, AM_NOT_FOUND (no such record at 'record' - it was moved or removed) or
+ * AM_ENOMEM
+ */
+static int pdp_read_record(const char *name, uint64_t record, const char *key, struct pdp_record *rec,
+        char **url, char **content_type) {
+    int fd, status = AM_SUCCESS;
+
+    fd = pdp_open(name, AM_FALSE);
+    if (fd == -1) {
+        return AM_NOT_FOUND;
+    }
+    if (pdp_io(fd, rec, sizeof (struct pdp_record), record, AM_FALSE) != AM_SUCCESS ||
+            rec->magic != PDP_RECORD_MAGIC || strncmp(rec->key, key, PDP_KEY_SIZE) != 0) {
+        status = AM_NOT_FOUND;
+    } else {
+        *url = malloc(rec->url_size);
+        *content_type = malloc(rec->type_size);
+        if (*url == NULL || *content_type == NULL) {
+            status = AM_ENOMEM;
+        } else if (pdp_io(fd, *url, rec->url_size, record + sizeof (struct pdp_record), AM_FALSE) != AM_SUCCESS ||
+                pdp_io(fd, *content_type, rec->type_size,
+                record + sizeof (struct pdp_record) + rec->url_size, AM_FALSE) != AM_SUCCESS) {
+            status = AM_NOT_FOUND;
+        } else {
+            (*url)[rec->url_size - 1] = '\0';
+            (*content_type)[rec->type_size - 1] = '\0';
+        }
+    }
+    pdp_close(fd);
+    if (status != AM_SUCCESS) {
+        AM_FREE(*url, *content_type);
+        *url = *content_type = NULL;
+    }
+    return status;
+}
+
+/**
+ * Look a preserved POST request up. Request body is stored in 'file' (allocated), 'size' bytes
+ * at 'offset'.
+ *
+ * Record is read once the lock is released, so compaction might have copied it out of its
+ * segment meanwhile (the old header is marked removed): the lookup is repeated for as long as the
+ * index entry keeps on moving.
+ *
+ * @return AM_SUCCESS, AM_NOT_FOUND or AM_ETIMEDOUT (the request is removed)
+ */
+int am_pdp_get(const char *dir, const char *key, char **url, char **content_type,
+        char **file, uint64_t *offset, size_t *size) {
+    struct pdp_store *store = get_store();
+    struct pdp_index_entry *e;
+    struct pdp_record rec;
+    char name[AM_PATH_SIZE + 32];
+    uint64_t record = 0, seq = 0;
+    int d, attempt, status = AM_NOT_FOUND;
+
+    if (store == NULL || ISINVALID(dir) || ISINVALID(key) || url == NULL ||
+            content_type == NULL || file == NULL || offset == NULL || size == NULL) {
+        return AM_EINVAL;
+    }
+    *url = *content_type = NULL;
+
+    for (attempt = 0; attempt < PDP_GET_RETRIES && status == AM_NOT_FOUND; attempt++) {
+        am_shm_lock(pdp_shm);
+        d = get_dir(store, dir);
+        e = d == -1 ? NULL : index_find(store, key);
+        if (e == NULL || store->segment[e->segment].dir != d) {
+            am_shm_unlock(pdp_shm);
+            return AM_NOT_FOUND;
+        }
+        if (e->expires != 0 && e->expires <= (int64_t) time(NULL)) {
+            index_remove(store, e);
+            am_shm_unlock(pdp_shm);
+            return AM_ETIMEDOUT;
+        }
+        if (attempt > 0 && store->segment[e->segment].seq == seq && e->offset == record) {
+            /* index entry did not move - the record is not there */
+            am_shm_unlock(pdp_shm);
+            break;
+        }
+        seq = store->segment[e->segment].seq;
+        record = e->offset;
+        segment_name(store, d, seq, name, sizeof (name));
+        am_shm_unlock(pdp_shm);
+
+        status = pdp_read_record(name, record, key, &rec, url, content_type);
+    }
+
+    if (status == AM_SUCCESS) {
+        *file = strdup(name);
+        *offset = record + sizeof (struct pdp_record) + rec.url_size + rec.type_size;
+        *size = (size_t) rec.data_size;
+        if (*file == NULL) {
+            AM_FREE(*url, *content_type);
+            *url = *content_type = NULL;
+            status = AM_ENOMEM;
+        }
+    }
+    return status;
+}
+
+/**
+ * Remove a preserved POST request (once it was replayed).
+ */
+int am_pdp_remove(const char *dir, const char *key) {
+    struct pdp_store *store = get_store();
+    struct pdp_index_entry *e;
+    char name[AM_PATH_SIZE + 32];
+    uint64_t record;
+    uint32_t magic = PDP_RECORD_REMOVED;
+    int d, fd;
+
+    if (store == NULL || ISINVALID(dir) || ISINVALID(key)) return AM_EINVAL;
+
+    am_shm_lock(pdp_shm);
+    d = get_dir(store, dir);
+    e = d == -1 ? NULL : index_find(store, key);
+    if (e == NULL || store->segment[e->segment].dir != d) {
+        am_shm_unlock(pdp_shm);
+        return AM_NOT_FOUND;
+    }
+    segment_name(store, d, store->segment[e->segment].seq, name, sizeof (name));
+    record = e->offset;
+    index_remove(store, e);
+    am_shm_unlock(pdp_shm);
+
+    /* keep it from being recovered */
+    fd = pdp_open(name, AM_FALSE);
+    if (fd != -1) {
+        pdp_io(fd, &magic, sizeof (magic), record, AM_TRUE);
+        pdp_close(fd);
+    }
+    return AM_SUCCESS;
+}
+
+/**
+ * Copy live records of a mostly dead segment to another one.
+ */
+static void copy_segment(struct pdp_store *store, int from) {
+    struct pdp_index_entry *list = NULL, *e;
+    char src_name[AM_PATH_SIZE + 32], dst_name[AM_PATH_SIZE + 32], *buf = NULL;
+    int i, n = 0, to, src = -1, dst = -1, dir;
+    uint32_t magic = PDP_RECORD_REMOVED;
+    uint64_t end;
+
+    am_shm_lock(pdp_shm);
+    dir = store->segment[from].dir;
+    list = malloc(store->segment[from].live * sizeof (struct pdp_index_entry));
+    to = list != NULL ? checkout_segment(store, dir) : -1;
+    if (to == -1) {
+        am_shm_unlock(pdp_shm);
+        free(list);
+        return;
+    }
+    for (i = 0; i < AM_PDP_INDEX_SIZE && n < (int) store->segment[from].live; i++) {
+        if (store->index[i].key[0] != '\0' && store->index[i].segment == from) {
+            list[n++] = store->index[i];
+        }
+    }
+    segment_name(store, dir, store->segment[from].seq, src_name, sizeof (src_name));
+    segment_name(store, dir, store->segment[to].seq, dst_name, sizeof (dst_name));
+    end = store->segment[to].end;
+    am_shm_unlock(pdp_shm);
+
+    src = pdp_open(src_name, AM_FALSE);
+    dst = pdp_open(dst_name, AM_TRUE);
+    buf = malloc(AM_POST_DATA_CHUNK_SIZE);
+
+    for (i = 0; i < n && src != -1 && dst != -1 && buf != NULL; i++) {
+        uint64_t done = 0;
+        while (done < list[i].size) {
+            size_t sz = list[i].size - done > AM_POST_DATA_CHUNK_SIZE ? AM_POST_DATA_CHUNK_SIZE : (size_t) (list[i].size - done);
+            if (pdp_io(src, buf, sz, list[i].offset + done, AM_FALSE) != AM_SUCCESS ||
+                    pdp_io(dst, buf, sz, end + done, AM_TRUE) != AM_SUCCESS) {
+                break;
+            }
+            done += sz;
+        }
+        if (done < list[i].size) break;
+
+        am_shm_lock(pdp_shm);
+        e = index_find(store, list[i].key);
+        if (e != NULL && e->segment == from && e->offset == list[i].offset) {
+            /* not removed meanwhile */
+            struct pdp_segment *g = &store->segment[from];
+            g->live--;
+            g->live_bytes -= e->size < g->live_bytes ? e->size : g->live_bytes;
+            e->segment = to;
+            e->offset = end;
+            store->segment[to].live++;
+            store->segment[to].live_bytes += e->size;
+        }
+        end += list[i].size;
+        store->segment[to].end = end;
+        am_shm_unlock(pdp_shm);
+
+        /* the copy is the one to be recovered */
+        pdp_io(src, &magic, sizeof (magic), list[i].offset, AM_TRUE);
+    }
+
+    if (src != -1) pdp_close(src);
+    if (dst != -1) pdp_close(dst);
+    am_shm_lock(pdp_shm);
+    checkin_segment(store, to, end);
+    am_shm_unlock(pdp_shm);
+    AM_FREE(list, buf);
+}
+
+/**
+ * Drop expired records, delete segments without live records and copy live records out
+ * of segments which are mostly dead. Returns the number of segment files deleted.
+ */
+int am_pdp_compact(time_t now) {
+    struct pdp_store *store = get_store();
+    int copy[AM_PDP_SEGMENTS];
+    int i, n = 0, deleted = 0;
+
+    if (store == NULL) return 0;
+
+    am_shm_lock(pdp_shm);
+    store->compacted = now;
+    for (i = 0; i < AM_PDP_INDEX_SIZE; i++) {
+        struct pdp_index_entry *e = &store->index[i];
+        /* backward shift moves the next entry into this slot - check it again */
+        while (e->key[0] != '\0' && e->expires != 0 && e->expires <= (int64_t) now) {
+            index_remove(store, e);
+        }
+    }
+    for (i = 0; i < AM_PDP_SEGMENTS; i++) {
+        struct pdp_segment *g = &store->segment[i];
+        switch (g->state) {
+            case PDP_SEGMENT_DEAD:
+                if (difftime(now, g->ts) >= AM_PDP_COMPACT_INTERVAL) {
+                    char name[AM_PATH_SIZE + 32];
+                    segment_name(store, g->dir, g->seq, name, sizeof (name));
+                    unlink(name);
+                    g->state = PDP_SEGMENT_FREE;
+                    write_index_file(store, g->dir);
+                    deleted++;
+                }
+                break;
+            case PDP_SEGMENT_BUSY:
+                if (difftime(now, g->ts) >= PDP_WRITE_TIMEOUT) {
+                    g->state = PDP_SEGMENT_SEALED;
+                }
+                break;
+            case PDP_SEGMENT_OPEN:
+            case PDP_SEGMENT_SEALED:
+                if (g->live == 0 && g->end > 0) {
+                    g->state = PDP_SEGMENT_DEAD;
+                    g->ts = now;
+                } else if (g->state == PDP_SEGMENT_SEALED && g->live_bytes * 2 < g->end) {
+                    copy[n++] = i;
+                }
+                break;
+        }
+    }
+    am_shm_unlock(pdp_shm);
+
+    for (i = 0; i < n; i++) {
+        copy_segment(store, copy[i]);
+        am_shm_lock(pdp_shm);
+        if (store->segment[copy[i]].live == 0) {
+            store->segment[copy[i]].state = PDP_SEGMENT_DEAD;
+            store->segment[copy[i]].ts = now;
+        }
+        am_shm_unlock(pdp_shm);
+    }
+    return deleted;
+}
@@ -97,6 +97,7 @@ typedef long                gid_t;
 #include <sys/socket.h>
 #include <sys/ipc.h>
 #include <sys/sem.h>
+#include <sys/uio.h>
 #include <ftw.h>
 #include <dirent.h>
 #include <dlfcn.h>
@@ -116,6 +117,9 @@ typedef long                gid_t;
 #ifndef AIX
 #include <sys/sendfile.h>
 #endif
+#ifdef __sun
+#include <atomic.h>
+#endif
 #endif /* __APPLE */
 
 #define sockpoll            poll
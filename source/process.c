@@ -19,11 +19,11 @@
 #include "utility.h"
 #include "list.h"
 #include "net_client.h"
+#include "thread.h"
 
 #define POST_PRESERVE_URI           "/dummypost/ampostpreserve"
 #define COMPOSITE_ADVICE_KEY        "sunamcompositeadvice"
-#define AUDIT_ALLOW_USER_MESSAGE    "user %s (%s) was allowed access to %s"
-#define AUDIT_DENY_USER_MESSAGE     "user %s (%s) was denied access to %s"
+#define POST_PRESERVE_RAW_SUFFIX    ".raw" /* post data file holds raw bytes (older ones are base64 encoded) */
 
 enum {
     AM_SESSION_ATTRIBUTE = 0,
@@ -118,8 +118,11 @@ static am_bool_t is_json_request(am_request_t *request) {
 static am_return_t setup_request_data(am_request_t *r) {
     static const char *thisfunc = "setup_request_data():";
     am_status_t status = AM_ERROR, status_token_query = AM_ERROR;
-    char *s, *v;
-    struct url u, au;
+    char *s, *v, au_buf[AM_URL_VIEW_SIZE];
+    struct url_view au;
+    const char *proto, *host;
+    unsigned int port;
+    am_arena_t *arena;
 
     if (r == NULL || r->ctx == NULL || r->conf == NULL) {
         return AM_FAIL;
@@ -137,9 +140,11 @@ static am_return_t setup_request_data(am_request_t *r) {
         return AM_FAIL;
     }
 
+    arena = am_request_arena(r);
     s = strstr(r->client_ip, AM_COMMA_CHAR);
     /* if the client ip header contains more than one value, use only the first one */
-    v = s != NULL ? strndup(r->client_ip, s - r->client_ip) : strdup(r->client_ip);
+    v = s != NULL ? am_arena_strndup(arena, r->client_ip, s - r->client_ip) :
+            am_arena_strdup(arena, r->client_ip);
     if (v == NULL) {
         AM_LOG_ERROR(r->instance_id, "%s memory allocation failure", thisfunc);
         r->status = AM_ENOMEM;
@@ -153,7 +158,8 @@ static am_return_t setup_request_data(am_request_t *r) {
     if (ISVALID(r->client_host)) {
         s = strstr(r->client_host, AM_COMMA_CHAR);
         /* if the client host header contains more than one value, use only the first one */
-        v = s != NULL ? strndup(r->client_host, s - r->client_host) : strdup(r->client_host);
+        v = s != NULL ? am_arena_strndup(arena, r->client_host, s - r->client_host) :
+                am_arena_strdup(arena, r->client_host);
         if (v != NULL) {
             s = strstr(v, ":");
             /* if client_host contains the port number, remove it */
@@ -176,8 +182,7 @@ static am_return_t setup_request_data(am_request_t *r) {
                 errcode = getnameinfo((struct sockaddr *) res->ai_addr, slen,
                         client_host, sizeof (client_host), NULL, 0, NI_NAMEREQD);
                 if (errcode == 0) {
-                    am_free(r->client_host);
-                    r->client_host = strdup(client_host);
+                    r->client_host = am_arena_strdup(arena, client_host);
                     break;
                 }
                 res = res->ai_next;
@@ -198,7 +203,7 @@ static am_return_t setup_request_data(am_request_t *r) {
         return AM_FAIL;
     }
 
-    am_asprintf(&r->normalized_url, "%s://%s:%d%s%s", r->url.proto, r->url.host,
+    am_arena_asprintf(arena, &r->normalized_url, "%s://%s:%d%s%s", r->url.proto, r->url.host,
             r->url.port, r->url.path, r->url.query);
     if (r->normalized_url == NULL) {
         AM_LOG_ERROR(r->instance_id, "%s memory allocation failure", thisfunc);
@@ -209,7 +214,7 @@ static am_return_t setup_request_data(am_request_t *r) {
     if (ISVALID(r->path_info) && (r->conf->path_info_ignore_not_enforced || r->conf->path_info_ignore)) {
         char *pos;
 
-        r->normalized_url_pathinfo = strdup(r->normalized_url);
+        r->normalized_url_pathinfo = am_arena_strdup(arena, r->normalized_url);
         if (r->normalized_url_pathinfo == NULL) {
             AM_LOG_ERROR(r->instance_id, "%s memory allocation failure", thisfunc);
             r->status = AM_ENOMEM;
@@ -234,23 +239,25 @@ static am_return_t setup_request_data(am_request_t *r) {
     }
 
     /* re-format normalized request url depending on override parameter values */
-    memcpy(&u, &r->url, sizeof (struct url));
-    if (parse_url(r->conf->agenturi, &au) == 0) {
+    proto = r->url.proto;
+    host = r->url.host;
+    port = r->url.port;
+    if (parse_url_view(r->conf->agenturi, &au, au_buf, sizeof (au_buf)) == AM_SUCCESS) {
         if (r->conf->override_protocol) {
-            strncpy(u.proto, au.proto, sizeof (u.proto) - 1);
+            proto = URL_VIEW_PART(&au, proto);
         }
         if (r->conf->override_host) {
-            strncpy(u.host, au.host, sizeof (u.host) - 1);
+            host = URL_VIEW_PART(&au, host);
         }
         if (r->conf->override_port) {
-            u.port = au.port;
+            port = au.port;
         }
     } else {
         AM_LOG_WARNING(r->instance_id, "%s failed to parse agenturi.prefix %s",
                 thisfunc, LOGEMPTY(r->conf->agenturi));
     }
 
-    am_asprintf(&r->overridden_url, "%s://%s:%d%s%s", u.proto, u.host, u.port, u.path, u.query);
+    am_arena_asprintf(arena, &r->overridden_url, "%s://%s:%d%s%s", proto, host, port, r->url.path, r->url.query);
     if (r->overridden_url == NULL) {
         AM_LOG_ERROR(r->instance_id, "%s memory allocation failure", thisfunc);
         r->status = AM_ENOMEM;
@@ -260,7 +267,7 @@ static am_return_t setup_request_data(am_request_t *r) {
     if (ISVALID(r->path_info) && r->conf->path_info_ignore) {
         char *pos;
 
-        r->overridden_url_pathinfo = strdup(r->overridden_url);
+        r->overridden_url_pathinfo = am_arena_strdup(arena, r->overridden_url);
         if (r->overridden_url_pathinfo == NULL) {
             AM_LOG_ERROR(r->instance_id, "%s memory allocation failure", thisfunc);
             r->status = AM_ENOMEM;
@@ -344,6 +351,31 @@ static am_return_t handle_notification(am_request_t *r) {
 
     AM_LOG_DEBUG(r->instance_id, "%s", thisfunc);
 
+    /* local status endpoint: request processing latency statistics; served to loopback
+     * connections only - for anyone else it is just another url, subject to enforcement.
+     * The client ip header can be set by the client, so without the connection peer address
+     * the check is only made when no such header is configured */
+    if (r->method == AM_REQUEST_GET && ISVALID(r->conf->status_url) && ISVALID(r->normalized_url) &&
+            (r->conf->url_eval_case_ignore ? strcasecmp(r->normalized_url, r->conf->status_url) :
+            strcmp(r->normalized_url, r->conf->status_url)) == 0) {
+        const char *peer = ISVALID(r->peer_ip) ? r->peer_ip :
+                (ISVALID(r->conf->client_ip_header) ? NULL : r->client_ip);
+        char *report;
+        if (!ip_address_loopback(peer)) {
+            AM_LOG_WARNING(r->instance_id, "%s agent status url requested by a remote client %s, ignored",
+                    thisfunc, LOGEMPTY(ISVALID(r->peer_ip) ? r->peer_ip : r->client_ip));
+            return AM_FAIL;
+        }
+        report = am_latency_report(AM_TRUE);
+        AM_LOG_DEBUG(r->instance_id, "%s %s is an agent status url", thisfunc, r->normalized_url);
+        if (r->am_set_custom_response_f != NULL) {
+            r->am_set_custom_response_f(r, report != NULL ? report : "{}", "application/json");
+        }
+        am_free(report);
+        r->status = AM_NOTIFICATION_DONE;
+        return AM_OK;
+    }
+
     /* check if notifications are enabled */
     if (r->method == AM_REQUEST_POST && ISVALID(r->conf->notif_url)) {
         struct notification_worker_data *wd;
@@ -376,10 +408,8 @@ static am_return_t handle_notification(am_request_t *r) {
             wd->post_data_sz = r->post_data_sz;
         }
         status = AM_OK;
-        /* process notification message */
-        if (am_worker_dispatch(notification_worker, wd) != 0) {
-            am_free(wd->post_data);
-            free(wd);
+        /* queue notification message for processing */
+        if (am_notification_dispatch(wd) != AM_SUCCESS) {
             r->status = AM_ERROR;
             AM_LOG_WARNING(r->instance_id, "%s failed to dispatch notification worker", thisfunc);
             return status;
@@ -785,8 +815,7 @@ static am_return_t validate_token(am_request_t *r) {
 
     if (status != AM_SUCCESS) {
         /* finally, see if a token is in Cookie-s */
-        status = get_cookie_value(r, ";", r->conf->cookie_name,
-                r->cookies, &r->token);
+        status = get_cookie_value(r, r->conf->cookie_name, &r->token);
         if (status != AM_SUCCESS && status != AM_NOT_FOUND) {
             AM_LOG_ERROR(r->instance_id, "%s error while getting sso token "
                     "from a cookie header: %s", thisfunc, am_strerror(status));
@@ -1022,10 +1051,12 @@ static am_return_t validate_policy(am_request_t *r) {
         AM_LOG_WARNING(r->instance_id,
                 "%s agent session is invalid, trying to fetch new configuration/session",
                 thisfunc);
-        /* delete all cached data for this agent instance */
-        remove_agent_instance_byname(r->conf->user);
-        /* fetch and update with the new configuration */
-        rv = am_get_agent_config(r->instance_id, r->conf->config, &boot);
+        /* refresh configuration in background (or pick up an already refreshed one) */
+        rv = am_config_refresh(r->instance_id, r->conf->token);
+        if (rv == AM_SUCCESS || rv == AM_NOT_FOUND) {
+            /* fetch and update with the new configuration */
+            rv = am_get_agent_config(r->instance_id, r->conf->config, &boot);
+        }
         if (rv == AM_SUCCESS && boot != NULL) {
             am_config_free(&r->conf);
             AM_LOG_DEBUG(r->instance_id, "%s agent configuration/session updated",
@@ -1042,8 +1073,13 @@ static am_return_t validate_policy(am_request_t *r) {
             r->retry++;
             return AM_RETRY;
         }
-        AM_LOG_ERROR(r->instance_id, "%s failed to fetch new agent configuration/session",
-                thisfunc);
+        if (rv == AM_EINPROGRESS) {
+            AM_LOG_WARNING(r->instance_id, "%s agent configuration/session refresh is in progress",
+                    thisfunc);
+        } else {
+            AM_LOG_ERROR(r->instance_id, "%s failed to fetch new agent configuration/session",
+                    thisfunc);
+        }
     }
 
     if (status == AM_INVALID_SESSION) {
@@ -1260,8 +1296,10 @@ static void do_cookie_set_generic(am_request_t *r, const char *prefix, const cha
     long sec;
     char *cookie_value, *cookie = NULL, *name_tmp, *name_sep;
     int sep_count = 0;
+    am_arena_t *arena;
 
     if (r == NULL || r->conf == NULL || r->am_add_header_in_response_f == NULL || !ISVALID(name)) return;
+    arena = am_request_arena(r);
 
     /* cookie-reset list can contain the following values:
      *  cookiename
@@ -1279,7 +1317,7 @@ static void do_cookie_set_generic(am_request_t *r, const char *prefix, const cha
     }
 
     /* set cookie prefix */
-    am_asprintf(&cookie, "%s", NOTNULL(prefix));
+    am_arena_asprintf(arena, &cookie, "%s", NOTNULL(prefix));
 
     /* set cookie name */
     if (cookie != NULL) {
@@ -1287,28 +1325,26 @@ static void do_cookie_set_generic(am_request_t *r, const char *prefix, const cha
             /* cookie-reset with "name and domain" is supplied without '=' after the name - add it here
              * as otherwise cookie might not get reset in a browser
              */
-            name_tmp = strdup(name);
+            name_tmp = am_arena_strdup(arena, name);
             if (name_tmp != NULL) {
                 name_sep = strchr(name_tmp, ';');
                 if (name_sep != NULL) {
                     *name_sep++ = '\0';
-                    am_asprintf(&cookie, "%s%s=;%s", cookie, name_tmp, name_sep);
+                    am_arena_asprintf(arena, &cookie, "%s%s=;%s", cookie, name_tmp, name_sep);
                 }
-                free(name_tmp);
             } else {
                 AM_LOG_ERROR(r->instance_id, "%s memory allocation failure", thisfunc);
-                am_free(cookie);
                 return;
             }
         } else {
-            am_asprintf(&cookie, "%s%s%s", cookie, name, sep_count == 0 ? "=" : "");
+            am_arena_asprintf(arena, &cookie, "%s%s%s", cookie, name, sep_count == 0 ? "=" : "");
         }
     }
 
     /* set cookie value */
     if (cookie != NULL) {
         cookie_value = r->conf->cookie_encode_chars ? url_encode((char *) value) : (char *) value;
-        am_asprintf(&cookie, "%s%s", cookie, NOTNULL(cookie_value));
+        am_arena_asprintf(arena, &cookie, "%s%s", cookie, NOTNULL(cookie_value));
         if (r->conf->cookie_encode_chars) {
             am_free(cookie_value);
         }
@@ -1317,7 +1353,7 @@ static void do_cookie_set_generic(am_request_t *r, const char *prefix, const cha
     if (cookie != NULL) {
         if (!ISVALID(value)) {
             /* no value is provided - we are resetting a cookie */
-            am_asprintf(&cookie, "%s;Max-Age=0;Expires=Thu, 01-Jan-1970 00:00:01 GMT", cookie);
+            am_arena_asprintf(arena, &cookie, "%s;Max-Age=0;Expires=Thu, 01-Jan-1970 00:00:01 GMT", cookie);
         } else {
             /* check if maxage option is provided, if so - use it;
              * if not - try cookie_maxage parameter;
@@ -1327,7 +1363,7 @@ static void do_cookie_set_generic(am_request_t *r, const char *prefix, const cha
             sec = ISVALID(maxage) ? strtol(maxage, NULL, AM_BASE_TEN)
                     : r->conf->cookie_maxage > 0 ? r->conf->cookie_maxage : 300;
             if (sec <= 0 || errno == ERANGE) {
-                am_asprintf(&cookie, "%s;Max-Age=0;Expires=Thu, 01-Jan-1970 00:00:01 GMT", cookie);
+                am_arena_asprintf(arena, &cookie, "%s;Max-Age=0;Expires=Thu, 01-Jan-1970 00:00:01 GMT", cookie);
             } else {
                 time(&raw);
                 raw += sec;
@@ -1342,29 +1378,29 @@ static void do_cookie_set_generic(am_request_t *r, const char *prefix, const cha
                         gmtime_r(&raw, &now)
 #endif
                         );
-                am_asprintf(&cookie, "%s;Max-Age=%d;Expires=%s", cookie, sec, time_string);
+                am_arena_asprintf(arena, &cookie, "%s;Max-Age=%d;Expires=%s", cookie, sec, time_string);
             }
         }
     }
 
     /* set cookie domain value */
     if (cookie != NULL && ISVALID(domain) && sep_count < 2) {
-        am_asprintf(&cookie, "%s;Domain=%s", cookie, domain);
+        am_arena_asprintf(arena, &cookie, "%s;Domain=%s", cookie, domain);
     }
 
     /* set cookie path value */
     if (cookie != NULL) {
-        am_asprintf(&cookie, "%s;Path=/%s", cookie, NOTNULL(path));
+        am_arena_asprintf(arena, &cookie, "%s;Path=/%s", cookie, NOTNULL(path));
     }
 
     /* set cookie Secure attribute */
     if (cookie != NULL && r->conf->cookie_secure) {
-        am_asprintf(&cookie, "%s;Secure", cookie);
+        am_arena_asprintf(arena, &cookie, "%s;Secure", cookie);
     }
 
     /* set cookie HttpOnly attribute */
     if (cookie != NULL && r->conf->cookie_http_only) {
-        am_asprintf(&cookie, "%s;HttpOnly", cookie);
+        am_arena_asprintf(arena, &cookie, "%s;HttpOnly", cookie);
     }
 
     if (cookie == NULL) {
@@ -1374,7 +1410,6 @@ static void do_cookie_set_generic(am_request_t *r, const char *prefix, const cha
 
     AM_LOG_DEBUG(r->instance_id, "%s %s", thisfunc, LOGEMPTY(cookie));
     r->am_add_header_in_response_f(r, cookie, NULL);
-    am_free(cookie);
 }
 
 static void do_cookie_set_type(am_request_t *r, am_config_map_t *map, int sz,
@@ -1479,14 +1514,13 @@ static void set_user_attributes(am_request_t *r) {
                         LOGEMPTY(r->conf->cookie_name), LOGEMPTY(r->cookies));
             } else {
 
-                am_asprintf(&new_cookie_hdr, "%s%s%s=%s",
+                am_arena_asprintf(am_request_arena(r), &new_cookie_hdr, "%s%s%s=%s",
                         new_cookie_hdr == NULL ? "" : new_cookie_hdr,
                         new_cookie_hdr != NULL ? ";" : "",
                         r->conf->cookie_name,
                         r->token);
                 if (new_cookie_hdr != NULL) {
                     r->am_set_header_in_request_f(r, "Cookie", new_cookie_hdr);
-                    free(new_cookie_hdr);
                 }
 
                 /* if no domain is configured, don't set it,
@@ -1692,6 +1726,73 @@ static char *find_active_login_server(am_request_t *r, char add_goto_value) {
     return login_url;
 }
 
+static ssize_t read_post_data_chunk(void *arg, char *buf, size_t size) {
+    am_request_t *r = (am_request_t *) arg;
+    return r->am_read_post_data_f(r, buf, size);
+}
+
+struct post_data_buffer {
+    const char *data;
+    size_t size;
+};
+
+static ssize_t read_post_data_buffer(void *arg, char *buf, size_t size) {
+    struct post_data_buffer *b = (struct post_data_buffer *) arg;
+    size_t n = b->size < size ? b->size : size;
+    if (n > 0) {
+        memcpy(buf, b->data, n);
+        b->data += n;
+        b->size -= n;
+    }
+    return (ssize_t) n;
+}
+
+/**
+ * Store request body (raw bytes), url and content type in the post data preservation store.
+ * When the store can't take the request, body is written into a file of its own, registered
+ * in the cache. Container modules which can read the body in chunks have it streamed as it
+ * arrives, for all others it is read into memory first. Stored data size is returned
+ * in r->post_data_sz.
+ */
+static am_status_t store_post_data(am_request_t *r, const char *key, const char *url) {
+    size_t max_size = r->conf->pdp_max_size > 0 ? (size_t) r->conf->pdp_max_size : 0;
+    int stream = r->post_data == NULL && r->am_read_post_data_f != NULL;
+    struct post_data_buffer buffer;
+    am_status_t status;
+    char *file = NULL;
+    ssize_t wrote;
+
+    buffer.data = r->post_data;
+    buffer.size = r->post_data != NULL ? r->post_data_sz : 0;
+    status = am_pdp_store(r->conf->pdp_dir, key, url, r->content_type, r->conf->pdp_cache_valid,
+            stream ? read_post_data_chunk : read_post_data_buffer, stream ? (void *) r : (void *) &buffer,
+            max_size, &r->post_data_sz);
+    if (status != AM_EAGAIN) {
+        return status;
+    }
+
+    am_asprintf(&file, "%s/%s"POST_PRESERVE_RAW_SUFFIX, r->conf->pdp_dir, key);
+    if (file == NULL) {
+        return AM_ENOMEM;
+    }
+    if (stream) {
+        status = write_file_stream(file, read_post_data_chunk, r, max_size, &r->post_data_sz);
+    } else if (r->post_data == NULL || r->post_data_sz == 0) {
+        r->post_data_sz = 0;
+        status = AM_SUCCESS;
+    } else if (max_size > 0 && r->post_data_sz > max_size) {
+        status = AM_E2BIG;
+    } else {
+        wrote = write_file(file, r->post_data, r->post_data_sz);
+        status = wrote == (ssize_t) r->post_data_sz ? AM_SUCCESS : AM_EOF;
+    }
+    if (status != AM_E2BIG) {
+        am_add_pdp_cache_entry(r, key, url, r->post_data_sz > 0 ? file : "0", r->content_type);
+    }
+    free(file);
+    return status;
+}
+
 static am_return_t handle_exit(am_request_t *r) {
     static const char *thisfunc = "handle_exit():";
     int valid_idx, i;
@@ -1760,7 +1861,7 @@ static am_return_t handle_exit(am_request_t *r) {
                                 wd->options->server_id = r->conf->lb_enable && ISVALID(r->session_info.si) ? strdup(r->session_info.si) : NULL;
                             }
 
-                            if (am_worker_dispatch(session_logout_worker, wd) != 0) {
+                            if (am_worker_dispatch_class(AM_WORKER_HIGH, session_logout_worker, wd) != 0) {
                                 am_net_options_delete(wd->options);
                                 AM_FREE(wd->token, wd->openam, wd->options, wd);
                                 r->status = AM_ERROR;
@@ -1869,15 +1970,50 @@ static am_return_t handle_exit(am_request_t *r) {
                 am_status_t pdp_status = AM_ERROR;
                 const char *key = r->url.query + 1; /* skip '?' */
                 if (ISVALID(key)) {
-                    char *data = NULL /* url\0file\0 format */, *content_type = NULL;
-                    size_t url_sz = 0;
-
-                    pdp_status = am_get_pdp_cache_entry(r, key, &data, &url_sz, &content_type);
+                    char *url = NULL, *content_type = NULL, *file = NULL, *post_clear = NULL;
+                    size_t post_sz = 0;
+                    uint64_t offset = 0;
+                    int stored, cached = AM_FALSE;
+
+                    pdp_status = am_pdp_get(r->conf->pdp_dir, key, &url, &content_type, &file, &offset, &post_sz);
+                    stored = pdp_status == AM_SUCCESS;
+                    if (pdp_status == AM_NOT_FOUND) {
+                        /* post data preserved in a file of its own */
+                        char *data = NULL /* url\0file\0 format */;
+                        size_t url_sz = 0;
+                        pdp_status = am_get_pdp_cache_entry(r, key, &data, &url_sz, &content_type);
+                        if (pdp_status == AM_SUCCESS) {
+                            struct stat st;
+                            cached = AM_TRUE;
+                            url = strdup(data);
+                            if (strcmp(data + url_sz + 1, "0") != 0) {
+                                size_t file_sz = strlen(data + url_sz + 1), sfx_sz = strlen(POST_PRESERVE_RAW_SUFFIX);
+                                file = strdup(data + url_sz + 1);
+                                if (file == NULL || stat(file, &st) != 0) {
+                                    pdp_status = AM_EINVAL;
+                                } else if (file_sz < sfx_sz || strcmp(file + file_sz - sfx_sz, POST_PRESERVE_RAW_SUFFIX) != 0) {
+                                    /* base64 encoded file, stored by an earlier agent version */
+                                    char *post_enc = load_file(file, &post_sz);
+                                    post_clear = post_enc != NULL ? base64_decode(post_enc, &post_sz) : NULL;
+                                    am_free(post_enc);
+                                    if (post_clear == NULL) {
+                                        pdp_status = AM_EINVAL;
+                                    }
+                                } else {
+                                    post_sz = (size_t) st.st_size;
+                                }
+                            }
+                            if (url == NULL) {
+                                pdp_status = AM_ENOMEM;
+                            }
+                        }
+                        am_free(data);
+                    }
                     if (pdp_status == AM_SUCCESS) {
-                        const char *file = data + url_sz + 1;
-                        AM_LOG_DEBUG(r->instance_id, "%s found post data preservation cache "
-                                "entry: %s, url: %s, file: %s, content type: %s",
-                                thisfunc, key, LOGEMPTY(data), LOGEMPTY(file), LOGEMPTY(content_type));
+                        AM_LOG_DEBUG(r->instance_id, "%s found post data preservation "
+                                "entry: %s, url: %s, file: %s, offset: %lu, size: %lu, content type: %s",
+                                thisfunc, key, LOGEMPTY(url), LOGEMPTY(file), (unsigned long) offset,
+                                (unsigned long) post_sz, LOGEMPTY(content_type));
 
                         /* reset pdp sticky-session load-balancer cookie */
                         if (ISVALID(r->conf->pdp_sess_mode) && ISVALID(r->conf->pdp_sess_value)
@@ -1896,84 +2032,98 @@ static am_return_t handle_exit(am_request_t *r) {
                             }
                         }
 
-                        if (strcmp(file, "0") == 0) {
+                        if (post_sz == 0) {
                             /* empty post */
                             r->method = AM_REQUEST_POST;
                             r->status = AM_PDP_DONE;
-                            r->post_data_url = data;
+                            r->post_data_url = url;
                             r->post_data_sz = 0;
                             am_free(r->post_data);
                             r->post_data = NULL;
                             /* empty pdp does not need post data set */
                             r->am_set_custom_response_f(r, AM_SPACE_CHAR, content_type);
-                        } else {
-                            size_t post_sz = 0;
-                            char *post = load_file(file, &post_sz);
+                        } else if (r->conf->pdp_js_repost) {
+                            /* IE10+ only */
+                            size_t enc_sz = post_sz;
+                            char *post = post_clear != NULL ? post_clear : load_file_range(file, offset, post_sz);
+                            post_clear = NULL;
                             if (post != NULL) {
-                                if (r->conf->pdp_js_repost) {
-                                    /* IE10+ only */
-                                    char *repost = NULL;
-                                    am_asprintf(&repost, "<html><head><script type=\"text/javascript\">"
-                                            "function base64toBlob(b64Data, contentType, sliceSize) {contentType = contentType || '';"
-                                            "sliceSize = sliceSize || 512;var byteCharacters = atob(b64Data);var byteArrays = [];"
-                                            "for (var offset = 0; offset < byteCharacters.length; offset += sliceSize) {"
-                                            "var slice = byteCharacters.slice(offset, offset + sliceSize);"
-                                            "var byteNumbers = new Array(slice.length);"
-                                            "for (var i = 0; i < slice.length; i++) {byteNumbers[i] = slice.charCodeAt(i);}"
-                                            "var byteArray = new Uint8Array(byteNumbers);byteArrays.push(byteArray);}"
-                                            "var blob = new Blob(byteArrays, {type: contentType});"
-                                            "return blob;}"
-                                            "function sendpost() {var r = new XMLHttpRequest();r.open(\"POST\", \"%s\", true);"
-                                            "r.onreadystatechange=function(e) {var x = e.target; "
-                                            "if (x.readyState==4 && x.status === 200) {"
-                                            "document.body.innerHTML = x.responseText;"
-                                            "document.title = !x.response.pageTitle ? x.responseURL : x.response.pageTitle;"
-                                            "window.history.pushState({\"html\":x.response,\"pageTitle\":x.response.pageTitle},\"\",\"%s\");}};"
-                                            "var b = base64toBlob(\"%s\", \"%s\");r.send(b);"
-                                            "}</script></head><body onload=\"sendpost();\">"
-                                            "</body><p></p></html>",
-                                            data, data,
-                                            post,
-                                            content_type);
-                                    r->status = AM_SUCCESS;
-                                    r->am_set_custom_response_f(r, repost, "text/html");
-                                    am_free(repost);
+                                char *repost = NULL, *post_enc = base64_encode(post, &enc_sz);
+                                am_asprintf(&repost, "<html><head><script type=\"text/javascript\">"
+                                        "function base64toBlob(b64Data, contentType, sliceSize) {contentType = contentType || '';"
+                                        "sliceSize = sliceSize || 512;var byteCharacters = atob(b64Data);var byteArrays = [];"
+                                        "for (var offset = 0; offset < byteCharacters.length; offset += sliceSize) {"
+                                        "var slice = byteCharacters.slice(offset, offset + sliceSize);"
+                                        "var byteNumbers = new Array(slice.length);"
+                                        "for (var i = 0; i < slice.length; i++) {byteNumbers[i] = slice.charCodeAt(i);}"
+                                        "var byteArray = new Uint8Array(byteNumbers);byteArrays.push(byteArray);}"
+                                        "var blob = new Blob(byteArrays, {type: contentType});"
+                                        "return blob;}"
+                                        "function sendpost() {var r = new XMLHttpRequest();r.open(\"POST\", \"%s\", true);"
+                                        "r.onreadystatechange=function(e) {var x = e.target; "
+                                        "if (x.readyState==4 && x.status === 200) {"
+                                        "document.body.innerHTML = x.responseText;"
+                                        "document.title = !x.response.pageTitle ? x.responseURL : x.response.pageTitle;"
+                                        "window.history.pushState({\"html\":x.response,\"pageTitle\":x.response.pageTitle},\"\",\"%s\");}};"
+                                        "var b = base64toBlob(\"%s\", \"%s\");r.send(b);"
+                                        "}</script></head><body onload=\"sendpost();\">"
+                                        "</body><p></p></html>",
+                                        url, url,
+                                        NOTNULL(post_enc),
+                                        content_type);
+                                r->status = AM_SUCCESS;
+                                r->am_set_custom_response_f(r, repost, "text/html");
+                                AM_FREE(repost, post_enc);
+                            } else {
+                                pdp_status = AM_EINVAL;
+                            }
+                            am_free(post);
+                        } else {
+                            /* container modules which can stream post data replay it straight from the file */
+                            int stream = r->am_read_post_data_f != NULL && post_clear == NULL;
+                            char *post = post_clear;
+
+                            post_clear = NULL;
+                            if (stream || post != NULL || (post = load_file_range(file, offset, post_sz)) != NULL) {
+                                r->method = AM_REQUEST_POST;
+                                r->status = AM_PDP_DONE;
+                                r->post_data_url = url;
+                                r->post_data_sz = post_sz;
+                                r->post_data_fn = stream ? file : NULL;
+                                r->post_data_offset = stream ? offset : 0;
+                                am_free(r->post_data);
+                                r->post_data = post; /* will be released with am_request_t cleanup */
+                                if (r->am_set_post_data_f != NULL) {
+                                    r->am_set_post_data_f(r);
                                 } else {
-                                    char *post_clear = base64_decode(post, &post_sz);
-                                    r->method = AM_REQUEST_POST;
-                                    r->status = AM_PDP_DONE;
-                                    r->post_data_url = data;
-                                    r->post_data_sz = post_sz;
-                                    am_free(r->post_data);
-                                    r->post_data = post_clear; /* will be released with am_request_t cleanup */
-                                    if (r->am_set_post_data_f != NULL) {
-                                        r->am_set_post_data_f(r);
-                                    } else {
-                                        AM_LOG_DEBUG(r->instance_id, "%s am_set_post_data_f is NULL",
-                                                thisfunc);
-                                    }
-                                    r->am_set_custom_response_f(r, AM_SPACE_CHAR, content_type);
+                                    AM_LOG_DEBUG(r->instance_id, "%s am_set_post_data_f is NULL",
+                                            thisfunc);
                                 }
+                                r->am_set_custom_response_f(r, AM_SPACE_CHAR, content_type);
+                                r->post_data_fn = NULL;
+                                r->post_data_offset = 0;
                             } else {
                                 pdp_status = AM_EINVAL;
                             }
-                            am_free(post);
                         }
 
-                        /* delete cache file */
-                        if (ISVALID(file) && strcmp(file, "0") != 0) {
-                            unlink(file);
-                        }
-                        /* delete cache entry */
-                        am_remove_cache_entry(r->instance_id, key);
-
                     } else {
                         AM_LOG_WARNING(r->instance_id,
-                                "%s post data preservation cache entry %s is not available (%s)",
+                                "%s post data preservation entry %s is not available (%s)",
                                 thisfunc, key, am_strerror(pdp_status));
                     }
 
-                    AM_FREE(data, content_type);
+                    if (stored) {
+                        am_pdp_remove(r->conf->pdp_dir, key);
+                    } else if (cached) {
+                        /* delete cache file and entry */
+                        if (ISVALID(file)) {
+                            unlink(file);
+                        }
+                        am_remove_cache_entry(r->instance_id, key);
+                    }
+
+                    AM_FREE(url, content_type, file, post_clear);
                 } else {
                     AM_LOG_WARNING(r->instance_id,
                             "%s invalid post data preservation key value", thisfunc);
@@ -2033,14 +2183,13 @@ static am_return_t handle_exit(am_request_t *r) {
                 if (r->method == AM_REQUEST_POST && r->conf->pdp_enable &&
                         status != AM_INVALID_FQDN_ACCESS) {
                     am_status_t pdp_status = AM_SUCCESS;
-                    char key[37], *file = NULL;
-                    ssize_t wrote;
+                    char key[37];
 
                     /* post data should already be read in validate_token (with cdsso)
-                     * if not - read it here */
+                     * if not - read it here, unless it can be streamed into the file below */
 
                     /* read post data (blocking) */
-                    if (!r->conf->cdsso_enable) {
+                    if (!r->conf->cdsso_enable && r->am_read_post_data_f == NULL) {
                         if (r->am_get_post_data_f != NULL) {
                             r->am_get_post_data_f(r);
                         } else {
@@ -2063,23 +2212,22 @@ static am_return_t handle_exit(am_request_t *r) {
                         /* generate unique post data identifier */
                         uuid(key, sizeof (key));
 
-                        /* create a file name to store post data */
-                        am_asprintf(&file, "%s/%s", r->conf->pdp_dir, key);
                         am_asprintf(&repost_uri, "%s%s", r->url.path, r->url.query);
 
-                        if (r->post_data_sz > 0) {
-                            size_t post_enc_sz = r->post_data_sz;
-                            char *post_enc = base64_encode(r->post_data, &post_enc_sz);
-
-                            wrote = write_file(file, post_enc, post_enc_sz);
-                            if (wrote != (ssize_t) post_enc_sz) {
-                                AM_LOG_ERROR(r->instance_id,
-                                        "%s could not write %d bytes to %s",
-                                        thisfunc, post_enc_sz, LOGEMPTY(file));
-                            }
-                            am_add_pdp_cache_entry(r, key, repost_uri, file, r->content_type);
-                        } else {
-                            am_add_pdp_cache_entry(r, key, repost_uri, "0", r->content_type);
+                        pdp_status = store_post_data(r, key, repost_uri);
+                        if (pdp_status == AM_E2BIG) {
+                            AM_LOG_WARNING(r->instance_id,
+                                    "%s post data exceeds %d bytes, not preserved",
+                                    thisfunc, r->conf->pdp_max_size);
+                            am_free(repost_uri);
+                            r->status = AM_FORBIDDEN;
+                            break;
+                        }
+                        if (pdp_status != AM_SUCCESS) {
+                            AM_LOG_ERROR(r->instance_id,
+                                    "%s could not store %lu bytes of post data %s (%s)",
+                                    thisfunc, (unsigned long) r->post_data_sz, key,
+                                    am_strerror(pdp_status));
                         }
 
                         /* pdp sticky session value, if set, has to be in a correct format: param=value */
@@ -2135,7 +2283,7 @@ static am_return_t handle_exit(am_request_t *r) {
                             }
                         }
 
-                        AM_FREE(goto_value, goto_encoded, file, repost_uri);
+                        AM_FREE(goto_value, goto_encoded, repost_uri);
                     }
 
                 } else if (status == AM_INVALID_FQDN_ACCESS) {
@@ -2255,12 +2403,28 @@ void am_process_request(am_request_t *r) {
     am_state_t cur_state = ENTRY_STATE;
     am_return_t rc = AM_FAIL;
     am_state_func_t fn;
+    uint64_t start, stop, elapsed[AM_STATS_STAGES] = {0};
+    unsigned int stages = 0;
     for (;;) {
         fn = am_request_state[cur_state];
+        am_timer(&start);
         rc = fn(r);
+        am_timer(&stop);
+        if (cur_state < AM_STATS_STAGES) {
+            elapsed[cur_state] += am_timer_usec(start, stop); /* validate_policy might be retried */
+            stages |= 1U << cur_state;
+        }
         if (EXIT_STATE == cur_state) break;
         cur_state = lookup_transition(cur_state, rc);
     }
+    am_latency_record(elapsed, stages);
+    am_stats_add(AM_STATS_REQUESTS, 1);
+    if (r->status == AM_REDIRECT) {
+        am_stats_add(AM_STATS_REQUESTS_REDIRECTED, 1);
+    } else if (r->status == AM_FORBIDDEN) {
+        am_stats_add(AM_STATS_REQUESTS_FORBIDDEN, 1);
+    }
+    am_prefilter_update(r->conf);
 }
 
 /**
@@ -2275,3 +2439,275 @@ void am_test_get_state_funcs(am_state_func_t const ** func_array_ptr, int * arra
     * array_len_ptr = (&am_request_state)[1] - am_request_state;
 }
 
+
+/*
+ * Static asset pre-filter.
+ *
+ * A compact, per-thread copy of the not-enforced url list (only the entries which do not
+ * depend on the request scheme, host or port - file extension and path prefix patterns)
+ * that lets the web server modules decide whether a request is not enforced looking only
+ * at its method and the raw request uri - before any agent configuration instance is
+ * fetched or any request data is set up.
+ *
+ * The filter is rebuilt from the agent configuration by am_process_request and is disabled
+ * completely with any option which would make a not-enforced request do more than just
+ * pass through (attribute fetch, inverted list, fqdn check, logout urls, CDSSO, audit etc).
+ * A miss is never an error - the request is then processed as usual.
+ */
+
+#define AM_PREFILTER_EXT        0
+#define AM_PREFILTER_PREFIX     1
+
+struct prefilter_rule {
+    char type;
+    char method; /* AM_REQUEST_UNKNOWN - any method */
+    unsigned short len;
+    char value[AM_PREFILTER_RULE_SIZE];
+};
+
+struct prefilter {
+    unsigned long instance_id;
+    time_t ts; /* agent configuration timestamp */
+    time_t expires;
+    char enabled;
+    char case_ignore;
+    unsigned char ext_map[32]; /* last character of all the extensions */
+    unsigned char prefix_map[32]; /* second character of all the prefixes */
+    char pdp_path[AM_PREFILTER_RULE_SIZE];
+    int rule_count;
+    struct prefilter_rule rules[AM_PREFILTER_RULES];
+};
+
+static AM_THREAD_LOCAL struct prefilter *prefilter_table[AM_MAX_INSTANCES];
+
+#define PREFILTER_MAP_SET(m,c)  ((m)[(unsigned char) (c) >> 3] |= (unsigned char) (1 << ((unsigned char) (c) & 7)))
+#define PREFILTER_MAP_TEST(m,c) ((m)[(unsigned char) (c) >> 3] & (1 << ((unsigned char) (c) & 7)))
+
+static void prefilter_thread_cleanup() {
+    int i;
+    for (i = 0; i < AM_MAX_INSTANCES; i++) {
+        am_free(prefilter_table[i]);
+        prefilter_table[i] = NULL;
+    }
+}
+
+static struct prefilter *prefilter_find(unsigned long instance_id, int create) {
+    int i, free_slot = -1;
+    for (i = 0; i < AM_MAX_INSTANCES; i++) {
+        struct prefilter *f = prefilter_table[i];
+        if (f == NULL) {
+            if (free_slot == -1) free_slot = i;
+            continue;
+        }
+        if (f->instance_id == instance_id) {
+            return f;
+        }
+    }
+    if (create && free_slot != -1) {
+        struct prefilter *f = calloc(1, sizeof (struct prefilter));
+        if (f != NULL) {
+            f->instance_id = instance_id;
+            prefilter_table[free_slot] = f;
+            am_thread_cleanup_register(prefilter_thread_cleanup);
+        }
+        return f;
+    }
+    return NULL;
+}
+
+/**
+ * Compile one not-enforced url pattern into a pre-filter rule. Only the patterns matching
+ * any scheme ("*" or "http*"), any host and any port are accepted, with a path part
+ * being either a file extension (slash, wildcard, dot, extension) or a literal prefix
+ * followed by a wildcard.
+ */
+static am_bool_t prefilter_add_rule(struct prefilter *f, const char *pattern, char method) {
+    struct prefilter_rule *rule;
+    const char *p, *path;
+    size_t len;
+
+    if (f->rule_count >= AM_PREFILTER_RULES || ISINVALID(pattern)) return AM_FALSE;
+
+    /* scheme */
+    p = strstr(pattern, "://");
+    if (p == NULL) return AM_FALSE;
+    len = p - pattern;
+    if (!((len == 1 && pattern[0] == '*') || (len == 5 && memcmp(pattern, "http*", 5) == 0))) {
+        return AM_FALSE;
+    }
+
+    /* host[:port] */
+    p += 3;
+    path = p + strcspn(p, "/?");
+    len = path - p;
+    if (*path != '/' || !((len == 1 && p[0] == '*') || (len == 3 && memcmp(p, "*:*", 3) == 0))) {
+        return AM_FALSE;
+    }
+
+    if (strpbrk(path, " ?") != NULL) return AM_FALSE;
+
+    rule = &f->rules[f->rule_count];
+    rule->method = method;
+
+    if (path[1] == '*' && path[2] == '.' && path[3] != '\0') {
+        /* file extension */
+        const char *e = path + 2;
+        for (p = e + 1; *p != '\0'; p++) {
+            if (!isalnum((unsigned char) *p)) return AM_FALSE;
+        }
+        len = p - e;
+        if (len >= sizeof (rule->value)) return AM_FALSE;
+        rule->type = AM_PREFILTER_EXT;
+        memcpy(rule->value, e, len);
+        PREFILTER_MAP_SET(f->ext_map, f->case_ignore ? tolower((unsigned char) e[len - 1]) : e[len - 1]);
+    } else {
+        /* path prefix */
+        p = strchr(path, '*');
+        if (p == NULL || p[1] != '\0' || p - path < 2) return AM_FALSE;
+        len = p - path;
+        if (len >= sizeof (rule->value)) return AM_FALSE;
+        rule->type = AM_PREFILTER_PREFIX;
+        memcpy(rule->value, path, len);
+        PREFILTER_MAP_SET(f->prefix_map, f->case_ignore ? tolower((unsigned char) path[1]) : path[1]);
+    }
+
+    rule->value[len] = '\0';
+    rule->len = (unsigned short) len;
+    f->rule_count++;
+    return AM_TRUE;
+}
+
+/**
+ * (Re)build the calling thread's pre-filter for this agent configuration instance.
+ * Called for each fully processed request; does nothing unless the configuration
+ * has changed or the filter has expired (AM_PREFILTER_TTL).
+ */
+void am_prefilter_update(am_config_t *conf) {
+    static const char *thisfunc = "am_prefilter_update():";
+    struct prefilter *f;
+    time_t now;
+    int i;
+
+    if (conf == NULL) return;
+
+    now = time(NULL);
+    f = prefilter_find(conf->instance_id, AM_TRUE);
+    if (f == NULL || (f->ts == conf->ts && f->expires > now)) return;
+
+    f->ts = conf->ts;
+    f->expires = now + AM_PREFILTER_TTL;
+    f->enabled = AM_FALSE;
+    f->case_ignore = conf->url_eval_case_ignore ? AM_TRUE : AM_FALSE;
+    f->rule_count = 0;
+    memset(f->ext_map, 0, sizeof (f->ext_map));
+    memset(f->prefix_map, 0, sizeof (f->prefix_map));
+
+    if (conf->not_enforced_map_sz <= 0 || conf->not_enforced_invert || conf->not_enforced_fetch_attr ||
+            conf->not_enforced_regex_enable || conf->path_info_ignore || conf->path_info_ignore_not_enforced ||
+            conf->fqdn_check_enable || conf->cdsso_enable || conf->logout_map_sz > 0 ||
+            ISVALID(conf->logout_url_regex) || ISVALID(conf->url_check_regex) ||
+            (conf->anon_remote_user_enable && ISVALID(conf->unauthenticated_user)) ||
+            AM_BITMASK_CHECK(conf->audit_level, AM_LOG_LEVEL_AUDIT_ALLOW)) {
+        AM_LOG_DEBUG(conf->instance_id, "%s static asset pre-filter is not enabled", thisfunc);
+        return;
+    }
+
+    snprintf(f->pdp_path, sizeof (f->pdp_path), "%s%s%s",
+            ISVALID(conf->pdp_uri_prefix) && conf->pdp_uri_prefix[0] != '/' ? "/" : "",
+            NOTNULL(conf->pdp_uri_prefix), POST_PRESERVE_URI);
+
+    for (i = 0; i < conf->not_enforced_map_sz; i++) {
+        am_config_map_t *m = &conf->not_enforced_map[i];
+        char method = AM_REQUEST_UNKNOWN;
+        char *p = strstr(m->name, AM_COMMA_CHAR);
+        if (p != NULL) {
+            /* method-extended [GET,0]=not-enforced-url option */
+            char *pv = strndup(m->name, p - m->name);
+            if (pv == NULL) continue;
+            method = (char) am_method_str_to_num(pv);
+            free(pv);
+            if (method != AM_REQUEST_GET && method != AM_REQUEST_HEAD) continue;
+        }
+        prefilter_add_rule(f, m->value, method);
+    }
+
+    f->enabled = f->rule_count > 0;
+    AM_LOG_DEBUG(conf->instance_id, "%s static asset pre-filter %s (%d rules)", thisfunc,
+            f->enabled ? "enabled" : "is not enabled", f->rule_count);
+}
+
+/**
+ * Check whether the request can be passed through without any further agent processing.
+ * 
+ * @param instance_id agent configuration instance id
+ * @param method request method (AM_REQUEST_GET or AM_REQUEST_HEAD only)
+ * @param uri raw request uri (path with an optional query string)
+ * 
+ * @return AM_TRUE if the request uri is not enforced, AM_FALSE if it must be processed as usual
+ */
+int am_prefilter_request(unsigned long instance_id, int method, const char *uri) {
+    static const char *thisfunc = "am_prefilter_request():";
+    const struct prefilter *f;
+    const char *p, *ext = NULL;
+    size_t path_sz;
+    int i;
+
+    if ((method != AM_REQUEST_GET && method != AM_REQUEST_HEAD) || uri == NULL || uri[0] != '/') {
+        return AM_FALSE;
+    }
+
+    f = prefilter_find(instance_id, AM_FALSE);
+    if (f == NULL || !f->enabled || f->expires <= time(NULL)) {
+        return AM_FALSE;
+    }
+
+    /* the path has to be in its normalized form already; anything uri_normalize would
+     * change (escapes, empty or dot segments) is left to the regular request processing */
+    for (p = uri; *p != '\0' && *p != '?'; p++) {
+        unsigned char c = (unsigned char) *p;
+        if (c <= ' ' || c >= 0x7f || c == '%' || c == '*' || c == '\\' || c == '#') {
+            return AM_FALSE;
+        }
+        if (c == '/') {
+            if (p[1] == '/' || (p[1] == '.' && (p[2] == '/' || p[2] == '\0' || p[2] == '?' ||
+                    (p[2] == '.' && (p[3] == '/' || p[3] == '\0' || p[3] == '?'))))) {
+                return AM_FALSE;
+            }
+            ext = NULL;
+        } else if (c == '.') {
+            ext = p;
+        }
+    }
+    path_sz = p - uri;
+    if (path_sz < 2 || (strlen(f->pdp_path) == path_sz && memcmp(f->pdp_path, uri, path_sz) == 0)) {
+        return AM_FALSE;
+    }
+
+    /* extension rules apply only to a path without a query string (the pattern has to match the query too) */
+    if (ext != NULL && *p == '\0' && p - ext > 1 && ext[-1] != '/' &&
+            PREFILTER_MAP_TEST(f->ext_map, f->case_ignore ? tolower((unsigned char) p[-1]) : p[-1])) {
+        size_t ext_sz = p - ext;
+        for (i = 0; i < f->rule_count; i++) {
+            const struct prefilter_rule *r = &f->rules[i];
+            if (r->type != AM_PREFILTER_EXT || r->len != ext_sz ||
+                    (r->method != AM_REQUEST_UNKNOWN && r->method != method)) continue;
+            if (f->case_ignore ? strncasecmp(r->value, ext, ext_sz) == 0 : memcmp(r->value, ext, ext_sz) == 0) {
+                AM_LOG_DEBUG(instance_id, "%s %s is not enforced (*%s)", thisfunc, uri, r->value);
+                return AM_TRUE;
+            }
+        }
+    }
+
+    if (PREFILTER_MAP_TEST(f->prefix_map, f->case_ignore ? tolower((unsigned char) uri[1]) : uri[1])) {
+        for (i = 0; i < f->rule_count; i++) {
+            const struct prefilter_rule *r = &f->rules[i];
+            if (r->type != AM_PREFILTER_PREFIX || r->len >= path_sz ||
+                    (r->method != AM_REQUEST_UNKNOWN && r->method != method)) continue;
+            if (f->case_ignore ? strncasecmp(r->value, uri, r->len) == 0 : memcmp(r->value, uri, r->len) == 0) {
+                AM_LOG_DEBUG(instance_id, "%s %s is not enforced (%s*)", thisfunc, uri, r->value);
+                return AM_TRUE;
+            }
+        }
+    }
+    return AM_FALSE;
+}
@@ -19,6 +19,11 @@
 #include "utility.h"
 #include "list.h"
 
+#if defined(LINUX)
+#include <sys/vfs.h>
+#include <sys/syscall.h>
+#endif
+
 #define AM_ALIGNMENT 8
 #define AM_ALIGN(size) (((size) + (AM_ALIGNMENT-1)) & ~(AM_ALIGNMENT-1))
 
@@ -34,6 +39,7 @@ struct mem_pool {
     size_t size;
     size_t max_size;
     size_t user_offset;
+    size_t free_size; /* total size of the chunks on the freelists */
     int open;
     int freelist_hdrs[3];
     struct offset_list lh; /* first, last */
@@ -130,6 +136,7 @@ static void add_to_freelist(struct mem_pool *pool, struct mem_chunk *chunk) {
         FREELIST_FROM_CHUNK(AM_GET_POINTER(pool, fl->next))->prev = AM_GET_OFFSET(pool, chunk);
     }
     pool->freelist_hdrs[hdr_offset] = AM_GET_OFFSET(pool, chunk);
+    pool->free_size += chunk->size;
 #ifdef FREELIST_DEBUG
     verify_freelists(pool, "add (after)");
 #endif
@@ -153,6 +160,7 @@ static void remove_from_freelist(struct mem_pool *pool, struct mem_chunk *chunk)
     if (fl->next != FREELIST_END) {
         FREELIST_FROM_CHUNK(AM_GET_POINTER(pool, fl->next))->prev = fl->prev;
     }
+    pool->free_size -= chunk->size;
 #ifdef FREELIST_DEBUG
     verify_freelists(pool, "remove (after)");
 #endif
@@ -191,8 +199,264 @@ size_t am_shm_max_pool_size() {
     return AM_SHARED_MAX_SIZE;
 }
 
+/*
+ * Huge page and NUMA placement options for the shared memory segments (pools and the log area),
+ * all set with environment variables - segments are created before the agent configuration is read:
+ *
+ * AM_SHARED_HUGEPAGES "thp" - ask for transparent huge pages (madvise); effective for shm_open
+ *   segments only when /sys/kernel/mm/transparent_hugepage/shmem_enabled is "advise" (or "always").
+ * AM_SHARED_HUGEPAGES "/dev/hugepages" (any hugetlbfs mount directory) - create the segment files there,
+ *   segment sizes are rounded up to the huge page size. Falls back to shm_open (and regular pages) in case
+ *   the file can't be created, sized or mapped (no access, no huge pages reserved) - the first failure to
+ *   size or map one turns hugetlbfs off for the rest of the segments created by the process.
+ * AM_SHARED_PREFAULT "1" - fault all pages in when a segment is created or extended
+ *   (instead of on first use in the request path).
+ * AM_SHARED_NUMA "interleave" - interleave segment pages over all online NUMA nodes (Linux).
+ */
+
+#define HUGETLBFS_MAGIC 0x958458f6
+
+static volatile int shm_hugetlbfs_failed = AM_FALSE; /* a hugetlbfs segment could not be sized or mapped */
+
+/**
+ * Huge page size of the hugetlbfs mount set with AM_SHARED_HUGEPAGES, zero if not set (or not a hugetlbfs).
+ */
+static size_t shm_hugetlbfs_page_size() {
+#if defined(LINUX)
+    struct statfs sfs;
+    char *dir = getenv(AM_SHARED_HUGEPAGES_VAR);
+    if (ISVALID(dir) && dir[0] == '/' && statfs(dir, &sfs) == 0 && sfs.f_type == HUGETLBFS_MAGIC) {
+        return (size_t) sfs.f_bsize;
+    }
+#endif
+    return 0;
+}
+
+/**
+ * Huge page size new segments are created with, zero when they use regular pages.
+ */
+static size_t shm_huge_page_size() {
+    return shm_hugetlbfs_failed ? 0 : shm_hugetlbfs_page_size();
+}
+
+/**
+ * Shared memory segment size (rounded up to the page or huge page size).
+ */
+size_t am_shm_page_size(size_t size) {
+    size_t huge = shm_huge_page_size();
+    if (huge > 0) {
+        return huge * ((size + huge - 1) / huge);
+    }
+    return page_size(size);
+}
+
+#ifndef _WIN32
+
+static int shm_env_is(const char *var, const char *value) {
+    char *env = getenv(var);
+    return ISVALID(env) && strcasecmp(env, value) == 0;
+}
+
+static int shm_hugetlbfs_path(char *buffer, size_t size, const char *name) {
+    int sz;
+    if (shm_hugetlbfs_page_size() == 0) {
+        return AM_FALSE;
+    }
+    sz = snprintf(buffer, size, "%s/%s", getenv(AM_SHARED_HUGEPAGES_VAR), name[0] == '/' ? name + 1 : name);
+    return sz > 0 && (size_t) sz < size;
+}
+
+/**
+ * Size of the segment opened as fd, rounded up to its page size (a huge page on hugetlbfs).
+ */
+static size_t shm_fd_page_size(int fd, size_t size) {
+#if defined(LINUX)
+    struct statfs sfs;
+    if (fstatfs(fd, &sfs) == 0 && sfs.f_type == HUGETLBFS_MAGIC) {
+        return (size_t) sfs.f_bsize * ((size + sfs.f_bsize - 1) / sfs.f_bsize);
+    }
+#endif
+    return page_size(size);
+}
+
+/**
+ * Open (or create) a shared memory segment file - on hugetlbfs, when configured, with shm_open otherwise.
+ */
+int am_shm_open(const char *name, int flags) {
+    char path[AM_PATH_SIZE];
+    if (shm_hugetlbfs_path(path, sizeof (path), name) && (!(flags & O_CREAT) || !shm_hugetlbfs_failed)) {
+        int fd;
+        if (flags & O_CREAT) {
+            /* the segment might be there already, created by a process which fell back to shm_open */
+            fd = shm_open(name, flags & ~(O_CREAT | O_EXCL), 0666);
+            if (fd != -1 && (flags & O_EXCL)) {
+                close(fd);
+                errno = EEXIST;
+                return -1;
+            }
+            if (fd != -1) {
+                return fd;
+            }
+        }
+        fd = open(path, flags, 0666);
+        if (fd != -1 || errno == EEXIST) {
+            return fd;
+        }
+    }
+    return shm_open(name, flags, 0666);
+}
+
+/**
+ * Size and map a segment just created with am_shm_open(name, O_CREAT | O_EXCL | O_RDWR). The segment
+ * size (request rounded up to the page size, at most max_size unless that is 0) is returned in size.
+ * A hugetlbfs file which can't be sized or mapped (not enough huge pages reserved) is removed and the
+ * segment is created again with shm_open, in regular pages.
+ */
+void *am_shm_map_new(const char *name, int *fd, size_t request, size_t max_size, size_t *size) {
+    char path[AM_PATH_SIZE];
+    void *area = MAP_FAILED;
+    int error, fdflags;
+
+    *size = am_shm_page_size(request);
+    if (max_size > 0 && *size > max_size) {
+        *size = max_size;
+    }
+    if (ftruncate(*fd, *size) == 0) {
+        area = am_shm_map(*fd, *size, AM_TRUE);
+    }
+    if (area != MAP_FAILED || shm_fd_page_size(*fd, 1) == page_size(1) ||
+            !shm_hugetlbfs_path(path, sizeof (path), name)) {
+        return area;
+    }
+
+    error = errno;
+    shm_hugetlbfs_failed = AM_TRUE;
+    close(*fd);
+    unlink(path);
+    *fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0666);
+    if (*fd == -1) {
+        if (errno == EEXIST) {
+            errno = error;
+        }
+        return MAP_FAILED;
+    }
+    /* reset FD_CLOEXEC */
+    fdflags = fcntl(*fd, F_GETFD);
+    fdflags &= ~FD_CLOEXEC;
+    fcntl(*fd, F_SETFD, fdflags);
+
+    *size = page_size(request);
+    if (max_size > 0 && *size > max_size) {
+        *size = max_size;
+    }
+    if (ftruncate(*fd, *size) == -1) {
+        return MAP_FAILED;
+    }
+    return am_shm_map(*fd, *size, AM_TRUE);
+}
+
+/**
+ * Remove a shared memory segment file created with am_shm_open.
+ */
+int am_shm_unlink(const char *name) {
+    char path[AM_PATH_SIZE];
+    int removed = shm_hugetlbfs_path(path, sizeof (path), name) && unlink(path) == 0;
+    if (shm_unlink(name) == 0 || removed) {
+        return 0;
+    }
+    return -1;
+}
+
+#if defined(LINUX)
+
+/**
+ * Set the interleave memory policy for the segment pages over all online NUMA nodes.
+ */
+static void shm_interleave(void *area, size_t size) {
+    unsigned long mask[16]; /* up to 1024 nodes */
+    char online[256], *p;
+    int nodes = 0;
+    FILE *f;
+
+    /* sysfs files report a page size, not their content size - load_file won't do */
+    f = fopen("/sys/devices/system/node/online", "r");
+    if (f == NULL) {
+        return;
+    }
+    p = fgets(online, sizeof (online), f);
+    fclose(f);
+    if (p == NULL) {
+        return;
+    }
+    memset(mask, 0, sizeof (mask));
+    for (p = online; *p >= '0' && *p <= '9';) {
+        unsigned long first = strtoul(p, &p, 10), last = first;
+        if (*p == '-') {
+            last = strtoul(p + 1, &p, 10);
+        }
+        for (; first <= last && first < sizeof (mask) * 8; first++, nodes++) {
+            mask[first / (sizeof (unsigned long) * 8)] |= 1UL << (first % (sizeof (unsigned long) * 8));
+        }
+        if (*p == ',') {
+            p++;
+        }
+    }
+    if (nodes > 1) {
+        syscall(SYS_mbind, area, size, 3 /* MPOL_INTERLEAVE */, mask, sizeof (mask) * 8, 0);
+    }
+}
+
+#endif
+
+/**
+ * Map a shared memory segment, applying the huge page and NUMA options. The segment creator
+ * (or extender) sets the NUMA policy and prefaults the pages.
+ */
+void *am_shm_map(int fd, size_t size, int create) {
+    int flags = MAP_SHARED;
+    int thp = shm_env_is(AM_SHARED_HUGEPAGES_VAR, "thp");
+    int interleave = create && shm_env_is(AM_SHARED_NUMA_VAR, "interleave");
+    int prefault = create && shm_env_is(AM_SHARED_PREFAULT_VAR, "1");
+    void *area;
+
+#ifdef MAP_POPULATE
+    if (prefault && !thp && !interleave) {
+        /* nothing to set up before the pages are faulted in */
+        flags |= MAP_POPULATE;
+        prefault = AM_FALSE;
+    }
+#endif
+    area = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, fd, 0);
+    if (area == MAP_FAILED) {
+        return area;
+    }
+#ifdef MADV_HUGEPAGE
+    if (thp) {
+        madvise(area, size, MADV_HUGEPAGE);
+    }
+#endif
+#if defined(LINUX)
+    if (interleave) {
+        shm_interleave(area, size);
+    }
+#endif
+    if (prefault) {
+        size_t i, step = shm_huge_page_size();
+        if (step == 0) {
+            step = page_size(1);
+        }
+        for (i = 0; i < size; i += step) {
+            (void) ((volatile char *) area)[i];
+        }
+    }
+    return area;
+}
+
+#endif
+
 int am_shm_lock(am_shm_t *am) {
     int rv = AM_SUCCESS;
+    uint64_t start, stop;
 #ifdef _WIN32
     SECURITY_DESCRIPTOR sec_descr;
     SECURITY_ATTRIBUTES sec_attr, *sec = NULL;
@@ -204,9 +468,18 @@ int am_shm_lock(am_shm_t *am) {
      */
 
 #ifdef _WIN32
-    do {
-        am->error = WaitForSingleObject(am->h[0], INFINITE);
-    } while (am->error == WAIT_ABANDONED);
+    am->error = WaitForSingleObject(am->h[0], 0);
+    if (am->error == WAIT_TIMEOUT) {
+        /* contended - time the wait */
+        am_timer(&start);
+        do {
+            am->error = WaitForSingleObject(am->h[0], INFINITE);
+        } while (am->error == WAIT_ABANDONED);
+        am_timer(&stop);
+        am_stats_add(AM_STATS_SHM_LOCKS_CONTENDED, 1);
+        am_stats_record(AM_STATS_SHM_LOCK_WAIT, am_timer_usec(start, stop));
+    }
+    am_stats_add(AM_STATS_SHM_LOCKS, 1);
 
     if (am->error == WAIT_FAILED) return AM_ERROR;
     
@@ -244,7 +517,16 @@ int am_shm_lock(am_shm_t *am) {
 
 #else
     pthread_mutex_t *lock = (pthread_mutex_t *) am->lock;
-    am->error = pthread_mutex_lock(lock);
+    am->error = pthread_mutex_trylock(lock);
+    if (am->error == EBUSY) {
+        /* contended - time the wait */
+        am_timer(&start);
+        am->error = pthread_mutex_lock(lock);
+        am_timer(&stop);
+        am_stats_add(AM_STATS_SHM_LOCKS_CONTENDED, 1);
+        am_stats_record(AM_STATS_SHM_LOCK_WAIT, am_timer_usec(start, stop));
+    }
+    am_stats_add(AM_STATS_SHM_LOCKS, 1);
 #if !defined(__APPLE__) && !defined(AIX)
     if (am->error == EOWNERDEAD) {
         am->error = pthread_mutex_consistent_np(lock);
@@ -256,7 +538,7 @@ int am_shm_lock(am_shm_t *am) {
             am->error = errno;
             rv = AM_EFAULT;
         }
-        am->pool = mmap(NULL, *(am->global_size), PROT_READ | PROT_WRITE, MAP_SHARED, am->fd, 0);
+        am->pool = am_shm_map(am->fd, *(am->global_size), AM_FALSE);
         if (am->pool == MAP_FAILED) {
             am->error = errno;
             rv = AM_EFAULT;
@@ -344,7 +626,7 @@ void am_shm_shutdown(am_shm_t *am) {
         close(am->fd);
     }
     if (open == 0) {
-        shm_unlink(am->name[1]);
+        am_shm_unlink(am->name[1]);
         munmap(am->lock, sizeof(pthread_mutex_t));
         munmap(am->global_size, sizeof(size_t));
     }
@@ -419,8 +701,11 @@ am_shm_t *am_shm_create(const char *name, size_t usize) {
             , name); /* shared memory name */
 #endif
 
-    size = page_size(usize + SIZEOF_mem_pool); /* need at least the size of the mem_pool header */
+    size = am_shm_page_size(usize + SIZEOF_mem_pool); /* need at least the size of the mem_pool header */
     max_size = am_shm_max_pool_size();
+    if (shm_huge_page_size() > 0) {
+        max_size -= max_size % shm_huge_page_size();
+    }
 
     /* enable shm size limits */
     if (max_size < size) {
@@ -567,7 +852,7 @@ am_shm_t *am_shm_create(const char *name, size_t usize) {
 
     am_shm_lock(ret);
 
-    ret->fd = shm_open(ret->name[1], O_CREAT | O_EXCL | O_RDWR, 0666);
+    ret->fd = am_shm_open(ret->name[1], O_CREAT | O_EXCL | O_RDWR);
     error = errno;
     if (ret->fd == -1 && error != EEXIST) {
         munmap(ret->lock, sizeof(pthread_mutex_t));
@@ -576,7 +861,7 @@ am_shm_t *am_shm_create(const char *name, size_t usize) {
         return ret;
     }
     if (ret->fd == -1) {
-        ret->fd = shm_open(ret->name[1], O_RDWR, 0666);
+        ret->fd = am_shm_open(ret->name[1], O_RDWR);
         error = errno;
         if (ret->fd == -1) {
             munmap(ret->lock, sizeof(pthread_mutex_t));
@@ -589,19 +874,19 @@ am_shm_t *am_shm_create(const char *name, size_t usize) {
         fdflags &= ~FD_CLOEXEC;
         fcntl(ret->fd, F_SETFD, fdflags);
         /* try with just a header */
-        area = mmap(NULL, SIZEOF_mem_pool, PROT_READ | PROT_WRITE, MAP_SHARED, ret->fd, 0);
+        area = mmap(NULL, shm_fd_page_size(ret->fd, SIZEOF_mem_pool), PROT_READ | PROT_WRITE, MAP_SHARED, ret->fd, 0);
         if (area == MAP_FAILED) {
             ret->error = errno;
             am_shm_unlock(ret);
             return ret;
         }
         size = ((struct mem_pool *) area)->size;
-        if (munmap(area, SIZEOF_mem_pool) == -1) {
+        if (munmap(area, shm_fd_page_size(ret->fd, SIZEOF_mem_pool)) == -1) {
             ret->error = errno;
             am_shm_unlock(ret);
             return ret;
         }
-        area = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, ret->fd, 0);
+        area = am_shm_map(ret->fd, size, AM_FALSE);
         if (area == MAP_FAILED) {
             ret->error = errno;
             am_shm_unlock(ret);
@@ -613,17 +898,13 @@ am_shm_t *am_shm_create(const char *name, size_t usize) {
         fdflags = fcntl(ret->fd, F_GETFD);
         fdflags &= ~FD_CLOEXEC;
         fcntl(ret->fd, F_SETFD, fdflags);
-        if (ftruncate(ret->fd, size) == -1) {
-            ret->error = errno;
-            am_shm_unlock(ret);
-            return ret;
-        }
-        area = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, ret->fd, 0);
+        area = am_shm_map_new(ret->name[1], &ret->fd, usize + SIZEOF_mem_pool, max_size, &size);
         if (area == MAP_FAILED) {
             ret->error = errno;
             am_shm_unlock(ret);
             return ret;
         }
+        *(ret->global_size) = ret->local_size = size;
     }
 
 #endif
@@ -635,6 +916,7 @@ am_shm_t *am_shm_create(const char *name, size_t usize) {
         pool->size = size;
         pool->max_size = max_size;
         pool->user_offset = 0;
+        pool->free_size = 0;
         pool->open = 1;
 
         initialise_freelist(pool);
@@ -684,6 +966,8 @@ static int am_shm_extend(am_shm_t *am, size_t usize) {
 #ifdef _WIN32
     SECURITY_DESCRIPTOR sec_descr;
     SECURITY_ATTRIBUTES sec_attr, *sec = NULL;
+#else
+    void *area;
 #endif
 
     if (usize == 0 || am == NULL || am->pool == NULL) {
@@ -691,7 +975,12 @@ static int am_shm_extend(am_shm_t *am, size_t usize) {
     }
 
     pool = (struct mem_pool *) am->pool;
-    size = page_size(usize + SIZEOF_mem_pool);
+#ifdef _WIN32
+    size = am_shm_page_size(usize + SIZEOF_mem_pool);
+#else
+    /* the segment file decides: another process might have created it on hugetlbfs (or fallen back) */
+    size = shm_fd_page_size(am->fd, usize + SIZEOF_mem_pool);
+#endif
 
     /* enable shm size limits */
     if (pool->size == pool->max_size) {
@@ -739,12 +1028,17 @@ static int am_shm_extend(am_shm_t *am, size_t usize) {
         am->error = errno;
         return AM_EINVAL;
     }
-    munmap(am->pool, osize);
-    am->pool = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, am->fd, 0);
-    if (am->pool == MAP_FAILED) {
+    area = am_shm_map(am->fd, size, AM_TRUE);
+    if (area == MAP_FAILED) {
+        /* keep the pool as it is (e.g. there are no more huge pages to grow a hugetlbfs segment with) */
         am->error = errno;
-        rv = AM_ERROR;
-    } else
+        if (ftruncate(am->fd, osize) == -1) {
+            return AM_ERROR;
+        }
+        return AM_ENOMEM;
+    }
+    munmap(am->pool, osize);
+    am->pool = area;
 #endif
     {
         struct mem_chunk *last;
@@ -846,6 +1140,10 @@ void *am_shm_alloc_with_gc(am_shm_t *am, size_t usize, int (* gc)(unsigned long)
     }
 
     if (ret == NULL) {
+        if (pool->free_size >= size) {
+            /* enough free space, but split into chunks too small for the size */
+            am_stats_add(AM_STATS_SHM_ALLOC_FRAGMENTED, 1);
+        }
         // gc (evict obsolete cache data) from the pool and retry allocation
         if (gc) {
             if (gc(id)) {
@@ -862,6 +1160,7 @@ void *am_shm_alloc_with_gc(am_shm_t *am, size_t usize, int (* gc)(unsigned long)
         verify_freelists(pool, "extend (before)");
 #endif
         if (am_shm_extend(am, (pool->size + size) * 2) == AM_SUCCESS) {
+            am_stats_add(AM_STATS_SHM_EXTENDS, 1);
             am_shm_unlock(am);
             return am_shm_alloc(am, usize);
         }
@@ -873,6 +1172,11 @@ void *am_shm_alloc_with_gc(am_shm_t *am, size_t usize, int (* gc)(unsigned long)
 #ifdef FREELIST_DEBUG
     verify_freelists(pool, "after insert");
 #endif
+    if (ret != NULL) {
+        am_stats_add(AM_STATS_SHM_ALLOCS, 1);
+    } else {
+        am_stats_add(AM_STATS_SHM_ALLOC_FAILURES, 1);
+    }
     am_shm_unlock(am);
     return ret;
 }
@@ -884,6 +1188,13 @@ void *am_shm_alloc(am_shm_t *am, size_t usize) {
     return am_shm_alloc_with_gc(am, usize, NULL, 0ul);
 }
 
+/**
+ * Size of the memory chunk (with its header) allocated with am_shm_alloc.
+ */
+size_t am_shm_size(void *ptr) {
+    return ptr != NULL ? ((struct mem_chunk *) ((char *) ptr - CHUNK_HEADER_SIZE))->size : 0;
+}
+
 
 void am_shm_free(am_shm_t *am, void *ptr) {
     size_t size;
@@ -945,6 +1256,7 @@ void am_shm_free(am_shm_t *am, void *ptr) {
 #ifdef FREELIST_DEBUG
     verify_freelists(pool, "after free");
 #endif
+    am_stats_add(AM_STATS_SHM_FREES, 1);
     am_shm_unlock(am);
 }
 
@@ -0,0 +1,422 @@
+/**
+ * The contents of this file are subject to the terms of the Common Development and
+ * Distribution License (the License). You may not use this file except in compliance with the
+ * License.
+ *
+ * You can obtain a copy of the License at legal/CDDLv1.0.txt. See the License for the
+ * specific language governing permission and limitations under the License.
+ *
+ * When distributing Covered Software, include this CDDL Header Notice in each file and include
+ * the License file at legal/CDDLv1.0.txt. If applicable, add the following below the CDDL
+ * Header, with the fields enclosed by brackets [] replaced by your own identifying
+ * information: "Portions copyright [year] [name of copyright owner]".
+ *
+ * Copyright 2015 ForgeRock AS.
+ */
+
+#include "platform.h"
+#include "am.h"
+#include "utility.h"
+
+/*
+ * Append-only, memory mapped segment spool. Records are appended to the tail segment and
+ * read (and acknowledged) from the head segment; at most these two segments are mapped at any
+ * time. A fully acknowledged head segment is deleted once the writer has moved on.
+ *
+ * Files: <base>.idx holds head and tail segment numbers, <base>.<n> are the segments. Each
+ * segment starts with a header holding the acknowledged offset, followed by records
+ * (size, hash, data padded to 8 bytes). A zero size marks the end of written data - new
+ * segments are zero filled - and a record with a bad hash is treated the same way on replay.
+ *
+ * A spool handle is not thread safe and must be owned by a single process.
+ */
+
+#define SPOOL_MAGIC         0x4c4f4f53 /* SOOL */
+#define SPOOL_ALIGN(s)      (((s) + 7) & ~((size_t) 7))
+
+struct spool_index {
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t head;
+    uint64_t tail;
+};
+
+struct spool_segment_hdr {
+    uint32_t magic;
+    uint32_t ack; /* offset of the first record not acknowledged yet */
+    uint64_t seq;
+};
+
+struct spool_record {
+    uint32_t size;
+    uint32_t hash;
+};
+
+struct spool_segment {
+    uint64_t seq;
+    char *base;
+    size_t end; /* offset of the first free byte */
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE map;
+#endif
+};
+
+struct am_spool {
+    char base[AM_PATH_SIZE];
+    size_t segment_size;
+    int max_segments;
+    int index_fd;
+    struct spool_index index;
+    struct spool_segment head;
+    struct spool_segment tail;
+    unsigned int pending;
+};
+
+static uint32_t spool_hash(const char *data, size_t size) {
+    uint32_t hash = 2166136261U;
+    size_t i;
+    for (i = 0; i < size; i++) {
+        hash ^= (unsigned char) data[i];
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+static void spool_segment_name(am_spool_t *s, uint64_t seq, char *name, size_t size) {
+    snprintf(name, size, "%s.%lu", s->base, (unsigned long) seq);
+}
+
+static int spool_index_write(am_spool_t *s) {
+#ifdef _WIN32
+    if (_lseek(s->index_fd, 0, SEEK_SET) != 0 ||
+            _write(s->index_fd, &s->index, sizeof (struct spool_index)) != sizeof (struct spool_index)) {
+        return AM_FILE_ERROR;
+    }
+#else
+    if (pwrite(s->index_fd, &s->index, sizeof (struct spool_index), 0) != sizeof (struct spool_index)) {
+        return AM_FILE_ERROR;
+    }
+#endif
+    return AM_SUCCESS;
+}
+
+static void spool_segment_unmap(am_spool_t *s, struct spool_segment *g) {
+    if (g->base == NULL) return;
+#ifdef _WIN32
+    FlushViewOfFile(g->base, 0);
+    UnmapViewOfFile(g->base);
+    CloseHandle(g->map);
+    CloseHandle(g->file);
+#else
+    msync(g->base, s->segment_size, MS_ASYNC);
+    munmap(g->base, s->segment_size);
+#endif
+    g->base = NULL;
+}
+
+/**
+ * Map segment 'seq' (creating it when 'create' is set) and find the end of the
+ * written data. Records not acknowledged yet are added to 'pending' (if not NULL).
+ */
+static int spool_segment_map(am_spool_t *s, struct spool_segment *g, uint64_t seq, int create, unsigned int *pending) {
+    char name[AM_PATH_SIZE + 32];
+    struct spool_segment_hdr *hdr;
+    size_t off;
+
+    spool_segment_name(s, seq, name, sizeof (name));
+#ifdef _WIN32
+    g->file = CreateFileA(name, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL,
+            create ? OPEN_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (g->file == INVALID_HANDLE_VALUE) {
+        return AM_FILE_ERROR;
+    }
+    g->map = CreateFileMappingA(g->file, NULL, PAGE_READWRITE, 0, (DWORD) s->segment_size, NULL);
+    if (g->map == NULL) {
+        CloseHandle(g->file);
+        return AM_FILE_ERROR;
+    }
+    g->base = MapViewOfFile(g->map, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+    if (g->base == NULL) {
+        CloseHandle(g->map);
+        CloseHandle(g->file);
+        return AM_FILE_ERROR;
+    }
+#else
+    {
+        struct stat st;
+        int fd = open(name, create ? O_CREAT | O_RDWR : O_RDWR, S_IWUSR | S_IRUSR);
+        if (fd == -1) {
+            return AM_FILE_ERROR;
+        }
+        if (fstat(fd, &st) != 0 || ((size_t) st.st_size < s->segment_size &&
+                ftruncate(fd, s->segment_size) != 0)) {
+            close(fd);
+            return AM_FILE_ERROR;
+        }
+        g->base = mmap(NULL, s->segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (g->base == MAP_FAILED) {
+            g->base = NULL;
+            return AM_FILE_ERROR;
+        }
+    }
+#endif
+
+    g->seq = seq;
+    hdr = (struct spool_segment_hdr *) g->base;
+    if (hdr->magic != SPOOL_MAGIC || hdr->seq != seq) {
+        /* new (or unusable) segment */
+        memset(g->base, 0, s->segment_size);
+        hdr->magic = SPOOL_MAGIC;
+        hdr->seq = seq;
+        hdr->ack = sizeof (struct spool_segment_hdr);
+    }
+
+    /* replay: find the end of the written data */
+    off = sizeof (struct spool_segment_hdr);
+    while (off + sizeof (struct spool_record) <= s->segment_size) {
+        struct spool_record *r = (struct spool_record *) (g->base + off);
+        if (r->size == 0 || off + sizeof (struct spool_record) + r->size > s->segment_size ||
+                r->hash != spool_hash(g->base + off + sizeof (struct spool_record), r->size)) {
+            break;
+        }
+        if (pending != NULL && off >= hdr->ack) {
+            (*pending)++;
+        }
+        off += SPOOL_ALIGN(sizeof (struct spool_record) + r->size);
+    }
+    g->end = off;
+    if (hdr->ack > off) {
+        hdr->ack = (uint32_t) off;
+    }
+    return AM_SUCCESS;
+}
+
+static void spool_segment_delete(am_spool_t *s, uint64_t seq) {
+    char name[AM_PATH_SIZE + 32];
+    spool_segment_name(s, seq, name, sizeof (name));
+    unlink(name);
+}
+
+/**
+ * Open (and replay) the spool stored in files <base>.*
+ *
+ * @param base spool file name prefix
+ * @param segment_size size of a segment file
+ * @param max_segments maximum number of segment files
+ * @return spool handle or NULL on error
+ */
+am_spool_t *am_spool_open(const char *base, size_t segment_size, int max_segments) {
+    char name[AM_PATH_SIZE + 32];
+    am_spool_t *s;
+    uint64_t seq;
+
+    if (ISINVALID(base) || segment_size < 4096 || max_segments < 2) {
+        return NULL;
+    }
+
+    s = calloc(1, sizeof (am_spool_t));
+    if (s == NULL) {
+        return NULL;
+    }
+    strncpy(s->base, base, sizeof (s->base) - 1);
+    s->segment_size = SPOOL_ALIGN(segment_size);
+    s->max_segments = max_segments;
+
+    snprintf(name, sizeof (name), "%s.idx", base);
+#ifdef _WIN32
+    s->index_fd = _open(name, _O_CREAT | _O_RDWR | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+    s->index_fd = open(name, O_CREAT | O_RDWR, S_IWUSR | S_IRUSR);
+#endif
+    if (s->index_fd == -1) {
+        free(s);
+        return NULL;
+    }
+
+#ifdef _WIN32
+    if (_read(s->index_fd, &s->index, sizeof (struct spool_index)) != sizeof (struct spool_index) ||
+#else
+    if (read(s->index_fd, &s->index, sizeof (struct spool_index)) != sizeof (struct spool_index) ||
+#endif
+            s->index.magic != SPOOL_MAGIC || s->index.head > s->index.tail) {
+        s->index.magic = SPOOL_MAGIC;
+        s->index.head = s->index.tail = 0;
+    }
+
+    /* segments between head and tail are not mapped until the reader gets to them -
+     * only count their records */
+    for (seq = s->index.head + 1; seq < s->index.tail; seq++) {
+        struct spool_segment g;
+        memset(&g, 0, sizeof (struct spool_segment));
+        if (spool_segment_map(s, &g, seq, AM_FALSE, &s->pending) == AM_SUCCESS) {
+            spool_segment_unmap(s, &g);
+        }
+    }
+    if (spool_segment_map(s, &s->tail, s->index.tail, AM_TRUE, &s->pending) != AM_SUCCESS ||
+            (s->index.head != s->index.tail &&
+            spool_segment_map(s, &s->head, s->index.head, AM_TRUE, &s->pending) != AM_SUCCESS) ||
+            spool_index_write(s) != AM_SUCCESS) {
+        am_spool_close(s);
+        return NULL;
+    }
+    return s;
+}
+
+void am_spool_close(am_spool_t *s) {
+    if (s == NULL) return;
+    spool_segment_unmap(s, &s->head);
+    spool_segment_unmap(s, &s->tail);
+    if (s->index_fd != -1) {
+#ifdef _WIN32
+        _close(s->index_fd);
+#else
+        close(s->index_fd);
+#endif
+    }
+    free(s);
+}
+
+/**
+ * Number of records not acknowledged yet.
+ */
+unsigned int am_spool_pending(am_spool_t *s) {
+    return s != NULL ? s->pending : 0;
+}
+
+/**
+ * Check whether there is room for a record of 'size' bytes.
+ */
+int am_spool_has_room(am_spool_t *s, size_t size) {
+    size_t need = SPOOL_ALIGN(sizeof (struct spool_record) + size);
+    if (s == NULL) return AM_FALSE;
+    return s->tail.end + need <= s->segment_size ||
+            (int) (s->index.tail - s->index.head) + 1 < s->max_segments;
+}
+
+/**
+ * Append a record to the spool.
+ *
+ * @return AM_SUCCESS, AM_E2BIG if the record does not fit into a segment, AM_EAGAIN
+ * if the spool is full (nothing is dropped - the caller must retry once records have been
+ * acknowledged) or AM_FILE_ERROR
+ */
+int am_spool_append(am_spool_t *s, const void *data, size_t size) {
+    size_t need = SPOOL_ALIGN(sizeof (struct spool_record) + size);
+    struct spool_record *r;
+
+    if (s == NULL || data == NULL || size == 0) return AM_EINVAL;
+    if (need > s->segment_size - sizeof (struct spool_segment_hdr)) return AM_E2BIG;
+
+    if (s->tail.end + need > s->segment_size) {
+        if (!am_spool_has_room(s, size)) {
+            return AM_EAGAIN;
+        }
+        /* seal the tail segment and move on to a new one */
+        if (s->index.head == s->index.tail) {
+            /* the reader keeps its mapping */
+            s->head = s->tail;
+        } else {
+            spool_segment_unmap(s, &s->tail);
+        }
+        memset(&s->tail, 0, sizeof (struct spool_segment));
+        if (spool_segment_map(s, &s->tail, s->index.tail + 1, AM_TRUE, NULL) != AM_SUCCESS) {
+            return AM_FILE_ERROR;
+        }
+        s->index.tail++;
+        if (spool_index_write(s) != AM_SUCCESS) {
+            return AM_FILE_ERROR;
+        }
+    }
+
+    r = (struct spool_record *) (s->tail.base + s->tail.end);
+    memcpy(s->tail.base + s->tail.end + sizeof (struct spool_record), data, size);
+    r->hash = spool_hash(data, size);
+    r->size = (uint32_t) size;
+    s->tail.end += need;
+    s->pending++;
+    return AM_SUCCESS;
+}
+
+static struct spool_segment *spool_head(am_spool_t *s) {
+    return s->index.head == s->index.tail ? &s->tail : &s->head;
+}
+
+/**
+ * Move the reader on to the next segment if the head segment is fully acknowledged
+ * and the writer has left it.
+ */
+static void spool_advance(am_spool_t *s) {
+    int moved = AM_FALSE;
+    while (s->index.head != s->index.tail) {
+        struct spool_segment *g = &s->head;
+        if (g->base != NULL && ((struct spool_segment_hdr *) g->base)->ack < g->end) {
+            break;
+        }
+        spool_segment_unmap(s, g);
+        spool_segment_delete(s, s->index.head);
+        s->index.head++;
+        moved = AM_TRUE;
+        if (s->index.head != s->index.tail &&
+                spool_segment_map(s, g, s->index.head, AM_FALSE, NULL) != AM_SUCCESS) {
+            /* segment is gone - skip it */
+            g->base = NULL;
+        }
+    }
+    if (moved) {
+        spool_index_write(s);
+    }
+}
+
+/**
+ * Read up to 'max' records, starting with the oldest one not acknowledged yet. Records
+ * are not consumed until am_spool_ack is called. Record data passed to the callback is valid
+ * only during the call.
+ *
+ * @return number of records read
+ */
+int am_spool_read(am_spool_t *s, int max, void (*cb)(void *arg, const char *data, size_t size), void *arg) {
+    struct spool_segment *g;
+    size_t off;
+    int count = 0;
+
+    if (s == NULL || cb == NULL) return 0;
+    spool_advance(s);
+    g = spool_head(s);
+    if (g->base == NULL) return 0;
+
+    off = ((struct spool_segment_hdr *) g->base)->ack;
+    while (count < max && off < g->end) {
+        struct spool_record *r = (struct spool_record *) (g->base + off);
+        cb(arg, g->base + off + sizeof (struct spool_record), r->size);
+        off += SPOOL_ALIGN(sizeof (struct spool_record) + r->size);
+        count++;
+    }
+    return count;
+}
+
+/**
+ * Acknowledge (and release) 'count' oldest records.
+ */
+int am_spool_ack(am_spool_t *s, int count) {
+    struct spool_segment *g;
+    struct spool_segment_hdr *hdr;
+
+    if (s == NULL) return AM_EINVAL;
+    g = spool_head(s);
+    if (g->base == NULL) return AM_EINVAL;
+    hdr = (struct spool_segment_hdr *) g->base;
+
+    while (count > 0 && hdr->ack < g->end) {
+        struct spool_record *r = (struct spool_record *) (g->base + hdr->ack);
+        hdr->ack += (uint32_t) SPOOL_ALIGN(sizeof (struct spool_record) + r->size);
+        s->pending--;
+        count--;
+    }
+#ifndef _WIN32
+    msync(g->base, sizeof (struct spool_segment_hdr), MS_ASYNC);
+#endif
+    spool_advance(s);
+    return AM_SUCCESS;
+}
@@ -0,0 +1,547 @@
+/**
+ * The contents of this file are subject to the terms of the Common Development and
+ * Distribution License (the License). You may not use this file except in compliance with the
+ * License.
+ *
+ * You can obtain a copy of the License at legal/CDDLv1.0.txt. See the License for the
+ * specific language governing permission and limitations under the License.
+ *
+ * When distributing Covered Software, include this CDDL Header Notice in each file and include
+ * the License file at legal/CDDLv1.0.txt. If applicable, add the following below the CDDL
+ * Header, with the fields enclosed by brackets [] replaced by your own identifying
+ * information: "Portions copyright [year] [name of copyright owner]".
+ *
+ * Copyright 2015 ForgeRock AS.
+ */
+
+#include "platform.h"
+#include "am.h"
+#include "utility.h"
+#include "list.h"
+#include "thread.h"
+
+/*
+ * Request processing latency and agent runtime statistics.
+ *
+ * Each am_process_request stage is timed and the result is added to a log-linear
+ * (HDR style) histogram in shared memory: values below AM_STATS_SUB_BUCKETS microseconds
+ * are counted exactly, all others in one of AM_STATS_SUB_BUCKETS buckets per power of two,
+ * which keeps the relative error of any reported percentile under 1/AM_STATS_SUB_BUCKETS.
+ *
+ * Every process claims a slot of its own, so that the counters are updated with plain
+ * atomic additions and never contended across processes. When all slots are taken,
+ * processes share one (still lock-free) slot. Readers merge all slots.
+ *
+ * Next to the stage histograms, each slot holds the runtime counters (cache, shared memory
+ * pool and lock, log ring, OpenAM call) and histograms updated from the other modules with
+ * am_stats_add/am_stats_record. Slots, counter blocks and histograms start on a cache line
+ * boundary so that processes (and the counters of one process) do not share cache lines.
+ */
+
+#define AM_STATS_SUB_BUCKET_BITS 4
+#define AM_STATS_SUB_BUCKETS (1 << AM_STATS_SUB_BUCKET_BITS)
+#define AM_STATS_MAX_BITS 36 /* values up to 2^36 usec (about 19 hours) */
+#define AM_STATS_BUCKETS ((AM_STATS_MAX_BITS - AM_STATS_SUB_BUCKET_BITS + 1) * AM_STATS_SUB_BUCKETS)
+#define AM_STATS_CACHE_LINE 64
+#define AM_STATS_LINE_WORDS (AM_STATS_CACHE_LINE / 8)
+#define AM_STATS_PAD_WORDS(n) (AM_STATS_LINE_WORDS - (n) % AM_STATS_LINE_WORDS)
+
+struct am_stats_histogram {
+    volatile uint64_t count;
+    volatile uint64_t sum;
+    volatile uint64_t max;
+    volatile uint64_t bucket[AM_STATS_BUCKETS];
+    uint64_t pad[AM_STATS_PAD_WORDS(AM_STATS_BUCKETS + 3)];
+};
+
+struct am_stats_process {
+    volatile uint64_t pid;
+    uint64_t pad[AM_STATS_LINE_WORDS - 1];
+    volatile uint64_t counter[AM_STATS_COUNTERS + AM_STATS_PAD_WORDS(AM_STATS_COUNTERS)];
+    struct am_stats_histogram stage[AM_STATS_STAGES];
+    struct am_stats_histogram histogram[AM_STATS_HISTOGRAMS];
+};
+
+struct am_stats {
+    struct am_stats_process process[AM_STATS_PROCESSES];
+};
+
+/* in am_process_request state order */
+static const char *stage_names[AM_STATS_STAGES] = {
+    "setup_request_data",
+    "validate_url",
+    "handle_notification",
+    "validate_token",
+    "validate_fqdn_access",
+    "handle_not_enforced",
+    "validate_policy",
+    "handle_exit"
+};
+
+static const char *counter_names[AM_STATS_COUNTERS] = {
+    "cache_hits",
+    "cache_misses",
+    "cache_admitted",
+    "cache_rejected",
+    "cache_evicted",
+    "shm_locks",
+    "shm_locks_contended",
+    "shm_allocs",
+    "shm_alloc_failures",
+    "shm_alloc_fragmented",
+    "shm_frees",
+    "shm_extends",
+    "log_messages",
+    "log_dropped",
+    "log_waits",
+    "openam_requests",
+    "openam_errors",
+    "requests",
+    "requests_redirected",
+    "requests_forbidden"
+};
+
+static const char *histogram_names[AM_STATS_HISTOGRAMS] = {
+    "shm_lock_wait_usec",
+    "log_queue_depth_bytes",
+    "openam_latency_usec"
+};
+
+static const char *histogram_units[AM_STATS_HISTOGRAMS] = {
+    "usec",
+    "bytes",
+    "usec"
+};
+
+#define AM_STATS_STAGE_UNIT "usec"
+
+static am_shm_t *stats_shm = NULL;
+static struct am_stats_process *process_slot = NULL; /* slot of this process, reset in a forked child */
+static int stats_id = 0;
+
+#ifndef _WIN32
+
+static void reset_process_slot() {
+    process_slot = NULL;
+}
+
+#endif
+
+int am_stats_init(int id) {
+#ifndef _WIN32
+    static int atfork_registered = AM_FALSE;
+#endif
+    if (stats_shm != NULL) return AM_SUCCESS;
+
+#ifndef _WIN32
+    if (!atfork_registered) {
+        pthread_atfork(NULL, NULL, reset_process_slot);
+        atfork_registered = AM_TRUE;
+    }
+#endif
+    stats_id = id;
+    process_slot = NULL;
+    stats_shm = am_shm_create(get_global_name(AM_STATS_SHM_NAME, id), sizeof (struct am_stats) + 4096);
+    if (stats_shm == NULL) {
+        return AM_ERROR;
+    }
+    if (stats_shm->error != AM_SUCCESS) {
+        return stats_shm->error;
+    }
+
+    if (stats_shm->init) {
+        char *area = (char *) am_shm_alloc(stats_shm, sizeof (struct am_stats) + AM_STATS_CACHE_LINE);
+        struct am_stats *stats;
+        if (area == NULL) {
+            return AM_ENOMEM;
+        }
+        /* the pool is page aligned in every process - align the table offset to a cache line */
+        stats = (struct am_stats *) (area + (AM_STATS_CACHE_LINE -
+                AM_GET_OFFSET(stats_shm->pool, area) % AM_STATS_CACHE_LINE) % AM_STATS_CACHE_LINE);
+        am_shm_lock(stats_shm);
+        memset(stats, 0, sizeof (struct am_stats));
+        /* store table offset (for other processes) */
+        am_shm_set_user_offset(stats_shm, AM_GET_OFFSET(stats_shm->pool, stats));
+        am_shm_unlock(stats_shm);
+    }
+    return AM_SUCCESS;
+}
+
+static struct am_stats *get_stats() {
+    return stats_shm != NULL ? (struct am_stats *) am_shm_get_user_pointer(stats_shm) : NULL;
+}
+
+int am_stats_shutdown() {
+    struct am_stats *stats = get_stats();
+    am_shm_t *shm;
+    if (stats != NULL) {
+        /* hand the slot (and its counters) over to the next process */
+        uint64_t pid = (uint64_t) getpid();
+        int i;
+        for (i = 0; i < AM_STATS_PROCESSES; i++) {
+            AM_ATOMIC_CAS_64(&stats->process[i].pid, pid, 0);
+        }
+    }
+    shm = stats_shm;
+    /* no more updates from am_shm_lock/am_shm_free while the segment is being unmapped */
+    stats_shm = NULL;
+    process_slot = NULL;
+    am_shm_shutdown(shm);
+    return AM_SUCCESS;
+}
+
+/**
+ * Find (or claim) the slot of the calling process. The slot is looked up once and
+ * remembered - until am_stats_shutdown or a fork (the child looks its own slot up).
+ */
+static struct am_stats_process *get_process_slot(struct am_stats *stats) {
+    struct am_stats_process *slot = process_slot;
+    uint64_t pid;
+    int i, free_slot = -1;
+
+    if (slot != NULL) {
+        return slot;
+    }
+
+    pid = (uint64_t) getpid();
+    for (i = 0; i < AM_STATS_PROCESSES && slot == NULL; i++) {
+        uint64_t owner = stats->process[i].pid;
+        if (owner == pid) {
+            slot = &stats->process[i];
+        } else if (owner == 0 && free_slot == -1) {
+            free_slot = i;
+        }
+    }
+    for (i = free_slot; slot == NULL && i >= 0 && i < AM_STATS_PROCESSES; i++) {
+        if (AM_ATOMIC_CAS_64(&stats->process[i].pid, 0, pid)) {
+            slot = &stats->process[i];
+        }
+    }
+    if (slot == NULL) {
+        slot = &stats->process[pid % AM_STATS_PROCESSES];
+    }
+    process_slot = slot;
+    return slot;
+}
+
+static int bucket_index(uint64_t value) {
+    int msb = 0;
+    uint64_t v;
+    if (value < AM_STATS_SUB_BUCKETS) {
+        return (int) value;
+    }
+    if (value >= ((uint64_t) 1 << AM_STATS_MAX_BITS)) {
+        return AM_STATS_BUCKETS - 1;
+    }
+    for (v = value; v > 1; v >>= 1) {
+        msb++;
+    }
+    return (msb - AM_STATS_SUB_BUCKET_BITS + 1) * AM_STATS_SUB_BUCKETS +
+            (int) ((value >> (msb - AM_STATS_SUB_BUCKET_BITS)) & (AM_STATS_SUB_BUCKETS - 1));
+}
+
+/**
+ * Highest value counted in a bucket.
+ */
+static uint64_t bucket_value(int index) {
+    int shift;
+    uint64_t sub;
+    if (index < AM_STATS_SUB_BUCKETS) {
+        return (uint64_t) index;
+    }
+    shift = index / AM_STATS_SUB_BUCKETS - 1;
+    sub = AM_STATS_SUB_BUCKETS + (uint64_t) (index % AM_STATS_SUB_BUCKETS);
+    return ((sub + 1) << shift) - 1;
+}
+
+static void histogram_add(struct am_stats_histogram *h, uint64_t value) {
+    uint64_t max;
+    AM_ATOMIC_ADD_64(&h->bucket[bucket_index(value)], 1);
+    AM_ATOMIC_ADD_64(&h->sum, value);
+    AM_ATOMIC_ADD_64(&h->count, 1);
+    for (max = h->max; value > max; max = h->max) {
+        if (AM_ATOMIC_CAS_64(&h->max, max, value)) break;
+    }
+}
+
+/**
+ * Add request processing stage timings (in microseconds) to the latency histograms.
+ * Bit 'i' in 'stages' is set when usec[i] holds a value for the stage 'i'.
+ */
+void am_latency_record(const uint64_t *usec, unsigned int stages) {
+    struct am_stats *stats = get_stats();
+    struct am_stats_process *slot;
+    int i;
+
+    if (stats == NULL || usec == NULL || stages == 0) return;
+
+    slot = get_process_slot(stats);
+    for (i = 0; i < AM_STATS_STAGES; i++) {
+        if (stages & (1U << i)) {
+            histogram_add(&slot->stage[i], usec[i]);
+        }
+    }
+}
+
+static uint64_t percentile(const uint64_t *bucket, uint64_t count, uint64_t max, double q) {
+    uint64_t rank, seen = 0;
+    int i;
+    if (count == 0) return 0;
+    rank = (uint64_t) (q * (double) count + 0.5);
+    if (rank == 0) rank = 1;
+    for (i = 0; i < AM_STATS_BUCKETS; i++) {
+        seen += bucket[i];
+        if (seen >= rank) {
+            uint64_t v = bucket_value(i);
+            return v < max ? v : max;
+        }
+    }
+    return max;
+}
+
+/**
+ * Add a value to one of the runtime counters of the calling process.
+ */
+void am_stats_add(am_stats_counter_t counter, uint64_t value) {
+    struct am_stats *stats = get_stats();
+    if (stats == NULL || counter < 0 || counter >= AM_STATS_COUNTERS) return;
+    AM_ATOMIC_ADD_64(&get_process_slot(stats)->counter[counter], value);
+}
+
+/**
+ * Add a value to one of the runtime histograms of the calling process.
+ */
+void am_stats_record(am_stats_histogram_t histogram, uint64_t value) {
+    struct am_stats *stats = get_stats();
+    if (stats == NULL || histogram < 0 || histogram >= AM_STATS_HISTOGRAMS) return;
+    histogram_add(&get_process_slot(stats)->histogram[histogram], value);
+}
+
+/**
+ * Runtime counter value, summed over all processes.
+ */
+uint64_t am_stats_get(am_stats_counter_t counter) {
+    struct am_stats *stats = get_stats();
+    uint64_t value = 0;
+    int p;
+    if (stats == NULL || counter < 0 || counter >= AM_STATS_COUNTERS) return 0;
+    for (p = 0; p < AM_STATS_PROCESSES; p++) {
+        value += stats->process[p].counter[counter];
+    }
+    return value;
+}
+
+/**
+ * Merge one histogram (at 'offset' in each process slot) of all processes into a summary.
+ * Returns the sum of all values.
+ */
+static uint64_t histogram_merge(struct am_stats *stats, size_t offset, const char *name, am_latency_stage_t *l) {
+    uint64_t bucket[AM_STATS_BUCKETS];
+    uint64_t sum = 0;
+    int p, i;
+
+    memset(l, 0, sizeof (am_latency_stage_t));
+    memset(bucket, 0, sizeof (bucket));
+    l->name = name;
+    for (p = 0; p < AM_STATS_PROCESSES; p++) {
+        struct am_stats_histogram *h = (struct am_stats_histogram *) ((char *) &stats->process[p] + offset);
+        for (i = 0; i < AM_STATS_BUCKETS; i++) {
+            bucket[i] += h->bucket[i];
+        }
+        l->count += h->count;
+        sum += h->sum;
+        if (h->max > l->max) {
+            l->max = h->max;
+        }
+    }
+    if (l->count > 0) {
+        l->mean = sum / l->count;
+        l->p50 = percentile(bucket, l->count, l->max, 0.5);
+        l->p99 = percentile(bucket, l->count, l->max, 0.99);
+        l->p999 = percentile(bucket, l->count, l->max, 0.999);
+    }
+    return sum;
+}
+
+static size_t stage_offset(struct am_stats *stats, int stage) {
+    return (size_t) ((char *) &stats->process[0].stage[stage] - (char *) &stats->process[0]);
+}
+
+static size_t histogram_offset(struct am_stats *stats, int histogram) {
+    return (size_t) ((char *) &stats->process[0].histogram[histogram] - (char *) &stats->process[0]);
+}
+
+/**
+ * Merge the histograms of all processes and compute the latency summary for each
+ * request processing stage. Returns the number of stages in 'out'.
+ */
+int am_latency_get(am_latency_stage_t *out, int size) {
+    struct am_stats *stats = get_stats();
+    int s;
+
+    if (stats == NULL || out == NULL) return 0;
+
+    for (s = 0; s < AM_STATS_STAGES && s < size; s++) {
+        histogram_merge(stats, stage_offset(stats, s), stage_names[s], &out[s]);
+    }
+    return s;
+}
+
+/**
+ * Summary of one runtime histogram, merged over all processes.
+ */
+int am_stats_histogram_get(am_stats_histogram_t histogram, am_latency_stage_t *out) {
+    struct am_stats *stats = get_stats();
+    if (stats == NULL || out == NULL || histogram < 0 || histogram >= AM_STATS_HISTOGRAMS) return AM_EINVAL;
+    histogram_merge(stats, histogram_offset(stats, histogram), histogram_names[histogram], out);
+    return AM_SUCCESS;
+}
+
+static char *summary_json(char *out, const am_latency_stage_t *l, const char *unit, int first) {
+    am_asprintf(&out, "%s%s{\"name\":\"%s\",\"count\":%lu,\"mean\":%lu,\"p50\":%lu,"
+            "\"p99\":%lu,\"p999\":%lu,\"max\":%lu,\"unit\":\"%s\"}", out, first ? "" : ",", l->name,
+            (unsigned long) l->count, (unsigned long) l->mean, (unsigned long) l->p50,
+            (unsigned long) l->p99, (unsigned long) l->p999, (unsigned long) l->max, unit);
+    return out;
+}
+
+static char *summary_text(char *out, const am_latency_stage_t *l) {
+    am_asprintf(&out, "%s%-22s %12lu %10lu %10lu %10lu %10lu %10lu\n", out, l->name,
+            (unsigned long) l->count, (unsigned long) l->mean, (unsigned long) l->p50,
+            (unsigned long) l->p99, (unsigned long) l->p999, (unsigned long) l->max);
+    return out;
+}
+
+static char *summary_prometheus(char *out, const char *metric, const char *label, const am_latency_stage_t *l, uint64_t sum) {
+    am_asprintf(&out, "%s%s{agent_id=\"%d\"%s,quantile=\"0.5\"} %lu\n"
+            "%s{agent_id=\"%d\"%s,quantile=\"0.99\"} %lu\n"
+            "%s{agent_id=\"%d\"%s,quantile=\"0.999\"} %lu\n"
+            "%s_sum{agent_id=\"%d\"%s} %lu\n"
+            "%s_count{agent_id=\"%d\"%s} %lu\n", out,
+            metric, stats_id, label, (unsigned long) l->p50,
+            metric, stats_id, label, (unsigned long) l->p99,
+            metric, stats_id, label, (unsigned long) l->p999,
+            metric, stats_id, label, (unsigned long) sum,
+            metric, stats_id, label, (unsigned long) l->count);
+    return out;
+}
+
+/**
+ * Latency summary as a plain text table or a JSON document (allocated, caller must free it).
+ */
+char *am_latency_report(int json) {
+    am_latency_stage_t stages[AM_STATS_STAGES];
+    char *out = NULL;
+    int i, n = am_latency_get(stages, AM_STATS_STAGES);
+
+    if (json) {
+        am_asprintf(&out, "{\"stages\":[");
+        for (i = 0; i < n && out != NULL; i++) {
+            out = summary_json(out, &stages[i], AM_STATS_STAGE_UNIT, i == 0);
+        }
+        if (out != NULL) {
+            am_asprintf(&out, "%s]}", out);
+        }
+        return out;
+    }
+
+    am_asprintf(&out, "%-22s %12s %10s %10s %10s %10s %10s\n", "stage ("AM_STATS_STAGE_UNIT")",
+            "count", "mean", "p50", "p99", "p999", "max");
+    for (i = 0; i < n && out != NULL; i++) {
+        out = summary_text(out, &stages[i]);
+    }
+    return out;
+}
+
+static unsigned long ratio(uint64_t part, uint64_t total) {
+    return total > 0 ? (unsigned long) (part * 100 / total) : 0;
+}
+
+/**
+ * Runtime counters, histograms and request processing stage latencies (merged over all processes)
+ * as a plain text table, a JSON document or in Prometheus text exposition format (allocated,
+ * caller must free it). Reads the statistics segment only - no agent locks are taken.
+ */
+char *am_stats_report(int format) {
+    struct am_stats *stats = get_stats();
+    am_latency_stage_t stage[AM_STATS_STAGES], histogram[AM_STATS_HISTOGRAMS];
+    uint64_t stage_sum[AM_STATS_STAGES], histogram_sum[AM_STATS_HISTOGRAMS], counter[AM_STATS_COUNTERS];
+    char *out = NULL, label[64];
+    int i;
+
+    if (stats == NULL) return NULL;
+
+    for (i = 0; i < AM_STATS_COUNTERS; i++) {
+        counter[i] = am_stats_get((am_stats_counter_t) i);
+    }
+    for (i = 0; i < AM_STATS_HISTOGRAMS; i++) {
+        histogram_sum[i] = histogram_merge(stats, histogram_offset(stats, i), histogram_names[i], &histogram[i]);
+    }
+    for (i = 0; i < AM_STATS_STAGES; i++) {
+        stage_sum[i] = histogram_merge(stats, stage_offset(stats, i), stage_names[i], &stage[i]);
+    }
+
+    switch (format) {
+        case AM_STATS_FORMAT_JSON:
+            am_asprintf(&out, "{\"counters\":{");
+            for (i = 0; i < AM_STATS_COUNTERS && out != NULL; i++) {
+                am_asprintf(&out, "%s%s\"%s\":%lu", out, i > 0 ? "," : "", counter_names[i],
+                        (unsigned long) counter[i]);
+            }
+            if (out != NULL) am_asprintf(&out, "%s},\"histograms\":[", out);
+            for (i = 0; i < AM_STATS_HISTOGRAMS && out != NULL; i++) {
+                out = summary_json(out, &histogram[i], histogram_units[i], i == 0);
+            }
+            if (out != NULL) am_asprintf(&out, "%s],\"stages\":[", out);
+            for (i = 0; i < AM_STATS_STAGES && out != NULL; i++) {
+                out = summary_json(out, &stage[i], AM_STATS_STAGE_UNIT, i == 0);
+            }
+            if (out != NULL) am_asprintf(&out, "%s]}", out);
+            break;
+
+        case AM_STATS_FORMAT_PROMETHEUS:
+            am_asprintf(&out, "# OpenAM web agent statistics\n");
+            for (i = 0; i < AM_STATS_COUNTERS && out != NULL; i++) {
+                am_asprintf(&out, "%s# TYPE am_%s_total counter\nam_%s_total{agent_id=\"%d\"} %lu\n", out,
+                        counter_names[i], counter_names[i], stats_id, (unsigned long) counter[i]);
+            }
+            for (i = 0; i < AM_STATS_HISTOGRAMS && out != NULL; i++) {
+                char metric[64];
+                snprintf(metric, sizeof (metric), "am_%s", histogram_names[i]);
+                am_asprintf(&out, "%s# TYPE %s summary\n", out, metric);
+                if (out != NULL) out = summary_prometheus(out, metric, "", &histogram[i], histogram_sum[i]);
+            }
+            if (out != NULL) am_asprintf(&out, "%s# TYPE am_request_stage_usec summary\n", out);
+            for (i = 0; i < AM_STATS_STAGES && out != NULL; i++) {
+                snprintf(label, sizeof (label), ",stage=\"%s\"", stage_names[i]);
+                out = summary_prometheus(out, "am_request_stage_usec", label, &stage[i], stage_sum[i]);
+            }
+            break;
+
+        default:
+            am_asprintf(&out, "%-22s %12s\n", "counter", "value");
+            for (i = 0; i < AM_STATS_COUNTERS && out != NULL; i++) {
+                am_asprintf(&out, "%s%-22s %12lu\n", out, counter_names[i], (unsigned long) counter[i]);
+            }
+            if (out != NULL) {
+                am_asprintf(&out, "%s\ncache hit rate %lu%%, shared memory lock contention %lu%%, "
+                        "OpenAM call errors %lu%%\n\n%-22s %12s %10s %10s %10s %10s %10s\n", out,
+                        ratio(counter[AM_STATS_CACHE_HITS], counter[AM_STATS_CACHE_HITS] + counter[AM_STATS_CACHE_MISSES]),
+                        ratio(counter[AM_STATS_SHM_LOCKS_CONTENDED], counter[AM_STATS_SHM_LOCKS]),
+                        ratio(counter[AM_STATS_OPENAM_ERRORS], counter[AM_STATS_OPENAM_REQUESTS]),
+                        "histogram", "count", "mean", "p50", "p99", "p999", "max");
+            }
+            for (i = 0; i < AM_STATS_HISTOGRAMS && out != NULL; i++) {
+                out = summary_text(out, &histogram[i]);
+            }
+            if (out != NULL) {
+                am_asprintf(&out, "%s\n%-22s %12s %10s %10s %10s %10s %10s\n", out, "stage ("AM_STATS_STAGE_UNIT")",
+                        "count", "mean", "p50", "p99", "p999", "max");
+            }
+            for (i = 0; i < AM_STATS_STAGES && out != NULL; i++) {
+                out = summary_text(out, &stage[i]);
+            }
+            break;
+    }
+    return out;
+}
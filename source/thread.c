@@ -34,16 +34,176 @@
 struct am_callback_args {
     void *args;
     void (*callback)(void *);
+#ifdef _WIN32
+    int cls;
+    uint64_t queued;
+#endif
 };
 
+/*
+ * Background worker pool.
+ *
+ * Work is dispatched in one of AM_WORKER_CLASSES priority classes - a worker always picks
+ * the oldest task of the highest class available, so that a burst of low priority jobs
+ * (remote audit shipping) never delays cache invalidations.
+ *
+ * On Unix each worker thread is attached to one of AM_WORKER_QUEUES task queues; a task
+ * dispatched from a worker thread goes to its own queue, all others are spread round-robin.
+ * A worker serves its own queue first and steals from the other queues when it is empty.
+ * Task nodes are preallocated with the pool and recycled through per-queue free lists,
+ * the heap is used only when a queue runs out of them.
+ */
+
+static struct am_worker_stats {
+    volatile uint64_t dispatched;
+    volatile uint64_t completed;
+    volatile uint64_t stolen;
+    volatile uint64_t depth;
+    volatile uint64_t max_depth;
+    volatile uint64_t wait;
+    volatile uint64_t max_wait;
+} worker_stats[AM_WORKER_CLASSES];
+
+static void worker_stats_max(volatile uint64_t *max, uint64_t value) {
+    uint64_t cur;
+    for (cur = *max; value > cur; cur = *max) {
+        if (AM_ATOMIC_CAS_64(max, cur, value)) break;
+    }
+}
+
+static void worker_stats_queued(int cls) {
+    struct am_worker_stats *st = &worker_stats[cls];
+    AM_ATOMIC_ADD_64(&st->dispatched, 1);
+    worker_stats_max(&st->max_depth, AM_ATOMIC_ADD_64(&st->depth, 1) + 1);
+}
+
+static void worker_stats_started(int cls, uint64_t queued, int stolen) {
+    struct am_worker_stats *st = &worker_stats[cls];
+    uint64_t now, wait;
+    am_timer(&now);
+    wait = am_timer_usec(queued, now);
+    AM_ATOMIC_ADD_64(&st->depth, (uint64_t) -1);
+    AM_ATOMIC_ADD_64(&st->wait, wait);
+    worker_stats_max(&st->max_wait, wait);
+    if (stolen) {
+        AM_ATOMIC_ADD_64(&st->stolen, 1);
+    }
+}
+
+static void worker_stats_done(int cls) {
+    AM_ATOMIC_ADD_64(&worker_stats[cls].completed, 1);
+}
+
+/**
+ * Worker pool queue depth and wait time (time between dispatch and the start of work,
+ * in microseconds) for each priority class. 'stats' must have room for AM_WORKER_CLASSES entries.
+ */
+void am_worker_pool_stats(am_worker_stats_t *stats) {
+    int i;
+    if (stats == NULL) return;
+    for (i = 0; i < AM_WORKER_CLASSES; i++) {
+        struct am_worker_stats *st = &worker_stats[i];
+        stats[i].dispatched = st->dispatched;
+        stats[i].completed = st->completed;
+        stats[i].stolen = st->stolen;
+        stats[i].depth = st->depth;
+        stats[i].max_depth = st->max_depth;
+        stats[i].wait = st->wait;
+        stats[i].max_wait = st->max_wait;
+    }
+}
+
+/*
+ * Thread exit cleanup of the thread-local state (request arena, pre-filter, session decode cache).
+ * A module registers its cleanup function when the calling thread allocates its state; all
+ * registered functions run (in the exiting thread) from the destructor of one thread key.
+ */
+
+#define AM_THREAD_CLEANUPS 8
+
+static AM_THREAD_LOCAL void (*thread_cleanup[AM_THREAD_CLEANUPS])(void);
+
+#ifdef _WIN32
+static INIT_ONCE thread_cleanup_initialized = INIT_ONCE_STATIC_INIT;
+static DWORD thread_cleanup_key = FLS_OUT_OF_INDEXES;
+#else
+static pthread_once_t thread_cleanup_initialized = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_cleanup_key;
+static int thread_cleanup_key_created = AM_FALSE;
+#endif
+
+static
+#ifdef _WIN32
+VOID WINAPI
+#else
+void
+#endif
+run_thread_cleanup(void *arg) {
+    int i;
+    for (i = 0; i < AM_THREAD_CLEANUPS; i++) {
+        void (*cleanup)(void) = thread_cleanup[i];
+        thread_cleanup[i] = NULL;
+        if (cleanup != NULL) {
+            cleanup();
+        }
+    }
+}
+
+static
+#ifdef _WIN32
+BOOL CALLBACK
+#else
+void
+#endif
+create_thread_cleanup_key(
+#ifdef _WIN32
+        PINIT_ONCE io, PVOID p, PVOID *c
+#endif
+        ) {
+#ifdef _WIN32
+    thread_cleanup_key = FlsAlloc(run_thread_cleanup);
+    return TRUE;
+#else
+    thread_cleanup_key_created = pthread_key_create(&thread_cleanup_key, run_thread_cleanup) == 0;
+#endif
+}
+
+/**
+ * Run 'cleanup' when the calling thread exits. Registering the same function again is a no-op.
+ */
+void am_thread_cleanup_register(void (*cleanup)(void)) {
+    int i;
+
+    for (i = 0; i < AM_THREAD_CLEANUPS; i++) {
+        if (thread_cleanup[i] == cleanup) return;
+        if (thread_cleanup[i] == NULL) break;
+    }
+    if (i == AM_THREAD_CLEANUPS) return;
+    thread_cleanup[i] = cleanup;
+
+#ifdef _WIN32
+    InitOnceExecuteOnce(&thread_cleanup_initialized, create_thread_cleanup_key, NULL, NULL);
+    if (thread_cleanup_key != FLS_OUT_OF_INDEXES) {
+        FlsSetValue(thread_cleanup_key, (PVOID) thread_cleanup);
+    }
+#else
+    pthread_once(&thread_cleanup_initialized, create_thread_cleanup_key);
+    if (thread_cleanup_key_created) {
+        /* the destructor is called only for a non-NULL value */
+        pthread_setspecific(thread_cleanup_key, (void *) thread_cleanup);
+    }
+#endif
+}
+
 #ifdef _WIN32
 static INIT_ONCE worker_pool_initialized = INIT_ONCE_STATIC_INIT;
-static TP_CALLBACK_ENVIRON worker_env;
+static TP_CALLBACK_ENVIRON worker_env[AM_WORKER_CLASSES];
 static PTP_POOL worker_pool = NULL;
 static PTP_CLEANUP_GROUP worker_pool_cleanup = NULL;
 #else
 static int worker_pool_atfork = 0;
 static sigset_t fillset;
+static AM_THREAD_LOCAL int worker_queue = 0; /* worker thread queue index + 1 */
 
 enum {
     AM_THREADPOOL_WAIT = 0x01,
@@ -53,16 +213,30 @@ enum {
 struct am_threadpool_work {
     void (*func) (void *);
     void *arg;
+    uint64_t queued;
+    char cls;
+    char heap;
     struct am_threadpool_work *next;
 };
 
+struct am_threadpool_queue {
+    pthread_mutex_t lock;
+    struct am_threadpool_work *head[AM_WORKER_CLASSES];
+    struct am_threadpool_work *tail[AM_WORKER_CLASSES];
+    volatile uint64_t count[AM_WORKER_CLASSES]; /* number of queued tasks, changed with the lock held */
+    struct am_threadpool_work *free; /* recycled task nodes */
+};
+
 struct am_threadpool {
     pthread_mutex_t lock;
     pthread_cond_t busy;
     pthread_cond_t work;
     pthread_cond_t wait;
-    struct am_threadpool_work *head;
-    struct am_threadpool_work *tail;
+    struct am_threadpool_queue queue[AM_WORKER_QUEUES];
+    struct am_threadpool_work *tasks; /* preallocated task nodes */
+    uint64_t next_queue; /* round-robin queue index for tasks dispatched outside of the pool */
+    int pending; /* number of queued tasks not yet claimed by a worker */
+    int next_worker; /* queue index for the next worker thread */
     pthread_attr_t attr;
     int flag;
     int linger; /* number of seconds excess idle worker threads (greater than min_threads) linger before exiting */
@@ -80,19 +254,49 @@ struct am_threadpool {
 static struct am_threadpool *worker_pool = NULL;
 
 static void worker_pool_unlock_all() {
+    int i;
+    for (i = AM_WORKER_QUEUES - 1; i >= 0; i--) {
+        pthread_mutex_unlock(&worker_pool->queue[i].lock);
+    }
     pthread_mutex_unlock(&worker_pool->lock);
 }
 
 static void worker_pool_lock_all() {
+    int i;
     pthread_mutex_lock(&worker_pool->lock);
+    for (i = 0; i < AM_WORKER_QUEUES; i++) {
+        pthread_mutex_lock(&worker_pool->queue[i].lock);
+    }
 }
 
-static void worker_pool_fork_handler() {
+static void worker_pool_free_tasks(struct am_threadpool *pool) {
     struct am_threadpool_work *work;
+    int i, c;
+
+    for (i = 0; i < AM_WORKER_QUEUES; i++) {
+        struct am_threadpool_queue *q = &pool->queue[i];
+        for (c = 0; c < AM_WORKER_CLASSES; c++) {
+            for (work = q->head[c]; work != NULL; work = q->head[c]) {
+                q->head[c] = work->next;
+                if (work->heap) {
+                    free(work);
+                }
+            }
+            q->tail[c] = NULL;
+            q->count[c] = 0;
+        }
+        q->free = NULL;
+    }
+    free(pool->tasks);
+    pool->tasks = NULL;
+}
 
-    for (work = worker_pool->head; work != NULL; work = worker_pool->head) {
-        worker_pool->head = work->next;
-        free(work);
+static void worker_pool_fork_handler() {
+    int i;
+
+    worker_pool_free_tasks(worker_pool);
+    for (i = 0; i < AM_WORKER_QUEUES; i++) {
+        pthread_mutex_init(&worker_pool->queue[i].lock, NULL);
     }
 
     pthread_attr_destroy(&worker_pool->attr);
@@ -123,7 +327,7 @@ static void worker_cleanup(void *arg) {
         if (pool->num_threads == 0) {
             pthread_cond_broadcast(&pool->busy);
         }
-    } else if (pool->head != NULL && pool->num_threads < pool->max_threads &&
+    } else if (pool->pending > 0 && pool->num_threads < pool->max_threads &&
             create_worker(pool) == 0) {
         pool->num_threads++;
     }
@@ -131,7 +335,7 @@ static void worker_cleanup(void *arg) {
 }
 
 static void worker_notify(struct am_threadpool *pool) {
-    if (pool->head == NULL && pool->active == NULL) {
+    if (pool->pending == 0 && pool->active == NULL) {
         pool->flag &= ~AM_THREADPOOL_WAIT;
         pthread_cond_broadcast(&pool->wait);
     }
@@ -155,7 +359,7 @@ static void work_cleanup(void *arg) {
 }
 
 static void am_clock_gettime(struct timespec *ts) {
-#ifdef __APPLE__ 
+#ifdef __APPLE__
     clock_serv_t cclock;
     mach_timespec_t mts;
     host_get_clock_service(mach_host_self(), CALENDAR_CLOCK, &cclock);
@@ -172,11 +376,59 @@ static void cleanup_unlock_mutex(void *arg) {
     pthread_mutex_unlock(arg);
 }
 
+/**
+ * Take a task of the highest priority class queued, looking into the worker's own queue first
+ * and stealing from the other queues after that. Tasks are taken in FIFO order within a queue
+ * (and class) only - a task stolen from another queue might not be the oldest one of its class.
+ *
+ * The caller has claimed one of the pool->pending tasks, so there is always one to take. A pass
+ * over the queues can still come up empty when the claimed task is taken by another worker
+ * (which then leaves a task queued later in a queue already passed) - the next pass finds it.
+ */
+static void take_work(struct am_threadpool *pool, int own, void (**func) (void *), void **func_arg, int *cls) {
+    struct am_threadpool_work *cur;
+    int i, c;
+
+    for (;;) {
+        for (c = 0; c < AM_WORKER_CLASSES; c++) {
+            for (i = 0; i < AM_WORKER_QUEUES; i++) {
+                struct am_threadpool_queue *q = &pool->queue[(own + i) % AM_WORKER_QUEUES];
+                if (AM_ATOMIC_ADD_64(&q->count[c], 0) == 0) continue;
+
+                pthread_mutex_lock(&q->lock);
+                cur = q->head[c];
+                if (cur == NULL) {
+                    pthread_mutex_unlock(&q->lock);
+                    continue;
+                }
+                q->head[c] = cur->next;
+                if (cur == q->tail[c]) {
+                    q->tail[c] = NULL;
+                }
+                AM_ATOMIC_ADD_64(&q->count[c], (uint64_t) -1);
+                *func = cur->func;
+                *func_arg = cur->arg;
+                *cls = c;
+                worker_stats_started(c, cur->queued, i != 0);
+                if (cur->heap) {
+                    pthread_mutex_unlock(&q->lock);
+                    free(cur);
+                } else {
+                    cur->next = q->free;
+                    q->free = cur;
+                    pthread_mutex_unlock(&q->lock);
+                }
+                return;
+            }
+        }
+        sched_yield();
+    }
+}
+
 static void *do_work(void *arg) {
     struct am_threadpool *pool = (struct am_threadpool *) arg;
-    struct am_threadpool_work *cur;
     struct am_threadpool_active active;
-    int timed_out;
+    int timed_out, own, cls;
     struct timespec ts;
     void (*func) (void *arg);
     void *func_arg;
@@ -186,9 +438,11 @@ static void *do_work(void *arg) {
     /* maintain pool integrity in case work function calls pthread_exit() */
     pthread_cleanup_push(worker_cleanup, pool);
     active.thread = pthread_self();
+    own = pool->next_worker++ % AM_WORKER_QUEUES;
+    worker_queue = own + 1;
 
     while (1) {
-        /* reset (this) thread signal mask and cancellation state back to the initial values 
+        /* reset (this) thread signal mask and cancellation state back to the initial values
          * (since the last work performed) */
         pthread_sigmask(SIG_SETMASK, &fillset, NULL);
         pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, NULL);
@@ -200,7 +454,7 @@ static void *do_work(void *arg) {
         if (pool->flag & AM_THREADPOOL_WAIT) {
             worker_notify(pool);
         }
-        while (pool->head == NULL && !(pool->flag & AM_THREADPOOL_DESTROY)) {
+        while (pool->pending == 0 && !(pool->flag & AM_THREADPOOL_DESTROY)) {
             if (pool->num_threads <= pool->min_threads) {
                 pthread_cond_wait(&pool->work, &pool->lock);
             } else {
@@ -219,32 +473,29 @@ static void *do_work(void *arg) {
             break;
         }
 
-        if ((cur = pool->head) != NULL) {
+        if (pool->pending > 0) {
             timed_out = 0;
-            /* take out am_threadpool_work from the list and execute it */
-            func = cur->func;
-            func_arg = cur->arg;
-
-            pool->head = cur->next;
-            if (cur == pool->tail) {
-                pool->tail = NULL;
-            }
+            /* claim a task, take it out of the queues and execute it */
+            pool->pending--;
             active.next = pool->active;
             pool->active = &active;
             pthread_mutex_unlock(&pool->lock);
 
+            take_work(pool, own, &func, &func_arg, &cls);
+
             /* do the actual work */
             pthread_cleanup_push(work_cleanup, pool);
-            free(cur);
             func(func_arg);
+            worker_stats_done(cls);
             pthread_cleanup_pop(1);
         }
         if (timed_out && pool->num_threads > pool->min_threads) {
-            /* thread timed out (waiting for work) and 
+            /* thread timed out (waiting for work) and
              * the number of workers exceeds the minimum - exit now */
             break;
         }
     }
+    worker_queue = 0;
     pthread_cleanup_pop(1);
     return NULL;
 }
@@ -265,6 +516,10 @@ create_threadpool(
 #endif
         ) {
 #ifdef _WIN32
+    static const TP_CALLBACK_PRIORITY priority[AM_WORKER_CLASSES] = {
+        TP_CALLBACK_PRIORITY_HIGH, TP_CALLBACK_PRIORITY_NORMAL, TP_CALLBACK_PRIORITY_LOW
+    };
+    int i;
 
     worker_pool = CreateThreadpool(NULL);
     if (worker_pool == NULL) {
@@ -274,20 +529,24 @@ create_threadpool(
     SetThreadpoolThreadMaximum(worker_pool, AM_MAX_THREADS_POOL);
     SetThreadpoolThreadMinimum(worker_pool, AM_MIN_THREADS_POOL);
 
-    InitializeThreadpoolEnvironment(&worker_env);
-    SetThreadpoolCallbackPool(&worker_env, worker_pool);
     worker_pool_cleanup = CreateThreadpoolCleanupGroup();
     if (worker_pool_cleanup == NULL) {
-        DestroyThreadpoolEnvironment(&worker_env);
         CloseThreadpool(worker_pool);
         worker_pool = NULL;
         return FALSE;
-    } else {
-        SetThreadpoolCallbackCleanupGroup(&worker_env, worker_pool_cleanup, NULL);
     }
+    for (i = 0; i < AM_WORKER_CLASSES; i++) {
+        InitializeThreadpoolEnvironment(&worker_env[i]);
+        SetThreadpoolCallbackPool(&worker_env[i], worker_pool);
+        SetThreadpoolCallbackPriority(&worker_env[i], priority[i]);
+        SetThreadpoolCallbackCleanupGroup(&worker_env[i], worker_pool_cleanup, NULL);
+    }
+    memset(worker_stats, 0, sizeof (worker_stats));
     return TRUE;
 
 #else
+    int i, c;
+
     if (worker_pool != NULL) return;
 
     sigfillset(&fillset);
@@ -307,15 +566,39 @@ create_threadpool(
     if (worker_pool == NULL) {
         return;
     }
+    worker_pool->tasks = (struct am_threadpool_work *) calloc(AM_WORKER_TASKS, sizeof (struct am_threadpool_work));
+    if (worker_pool->tasks == NULL) {
+        free(worker_pool);
+        worker_pool = NULL;
+        return;
+    }
+
+    for (i = 0; i < AM_WORKER_QUEUES; i++) {
+        struct am_threadpool_queue *q = &worker_pool->queue[i];
+        pthread_mutex_init(&q->lock, NULL);
+        for (c = 0; c < AM_WORKER_CLASSES; c++) {
+            q->head[c] = q->tail[c] = NULL;
+            q->count[c] = 0;
+        }
+        q->free = NULL;
+    }
+    for (i = 0; i < AM_WORKER_TASKS; i++) {
+        struct am_threadpool_queue *q = &worker_pool->queue[i % AM_WORKER_QUEUES];
+        worker_pool->tasks[i].next = q->free;
+        q->free = &worker_pool->tasks[i];
+    }
 
     worker_pool->active = NULL;
-    worker_pool->head = worker_pool->tail = NULL;
+    worker_pool->next_queue = 0;
+    worker_pool->pending = 0;
+    worker_pool->next_worker = 0;
     worker_pool->flag = 0;
     worker_pool->linger = AM_THREADS_POOL_LINGER;
     worker_pool->min_threads = AM_MIN_THREADS_POOL;
     worker_pool->max_threads = AM_MAX_THREADS_POOL;
     worker_pool->num_threads = 0;
     worker_pool->idle = 0;
+    memset(worker_stats, 0, sizeof (worker_stats));
 
     pthread_attr_init(&worker_pool->attr);
     pthread_attr_setdetachstate(&worker_pool->attr, PTHREAD_CREATE_DETACHED);
@@ -350,47 +633,87 @@ void am_worker_pool_init_reset() {
 static void CALLBACK worker_dispatch_callback(PTP_CALLBACK_INSTANCE instance, void *arg) {
     struct am_callback_args *cba = (struct am_callback_args *) arg;
     if (cba != NULL && cba->callback != NULL) {
+        worker_stats_started(cba->cls, cba->queued, 0);
         cba->callback(cba->args);
+        worker_stats_done(cba->cls);
     }
     am_free(cba);
 }
 
 #endif
 
-int am_worker_dispatch(void (*worker_f)(void *), void *arg) {
+/**
+ * Run worker_f(arg) in the background, in the priority class 'cls' (AM_WORKER_HIGH, AM_WORKER_NORMAL
+ * or AM_WORKER_LOW).
+ */
+int am_worker_dispatch_class(int cls, void (*worker_f)(void *), void *arg) {
 #ifdef _WIN32
     BOOL status = FALSE;
-    struct am_callback_args *cb_arg =
-            (struct am_callback_args *) malloc(sizeof (struct am_callback_args));
+    struct am_callback_args *cb_arg;
+
+    if (cls < 0 || cls >= AM_WORKER_CLASSES) {
+        cls = AM_WORKER_NORMAL;
+    }
+    cb_arg = (struct am_callback_args *) malloc(sizeof (struct am_callback_args));
     if (cb_arg != NULL) {
         cb_arg->args = arg;
         cb_arg->callback = worker_f;
-        status = TrySubmitThreadpoolCallback(worker_dispatch_callback, cb_arg, &worker_env);
+        cb_arg->cls = cls;
+        am_timer(&cb_arg->queued);
+        worker_stats_queued(cls);
+        status = TrySubmitThreadpoolCallback(worker_dispatch_callback, cb_arg, &worker_env[cls]);
+        if (status == FALSE) {
+            AM_ATOMIC_ADD_64(&worker_stats[cls].depth, (uint64_t) -1);
+            free(cb_arg);
+        }
     }
     return status == FALSE ? AM_ENOMEM : AM_SUCCESS;
 #else
+    struct am_threadpool_queue *q;
     struct am_threadpool_work *cur;
 
     if (worker_pool == NULL) return AM_EFAULT;
+    if (cls < 0 || cls >= AM_WORKER_CLASSES) {
+        cls = AM_WORKER_NORMAL;
+    }
 
-    cur = (struct am_threadpool_work *) malloc(sizeof (struct am_threadpool_work));
-    if (cur == NULL) {
-        return AM_ENOMEM;
+    q = &worker_pool->queue[worker_queue > 0 ? worker_queue - 1 :
+            (int) (AM_ATOMIC_ADD_64(&worker_pool->next_queue, 1) % AM_WORKER_QUEUES)];
+
+    pthread_mutex_lock(&q->lock);
+    cur = q->free;
+    if (cur != NULL) {
+        q->free = cur->next;
+        cur->heap = 0;
+    } else {
+        /* out of preallocated task nodes */
+        pthread_mutex_unlock(&q->lock);
+        cur = (struct am_threadpool_work *) malloc(sizeof (struct am_threadpool_work));
+        if (cur == NULL) {
+            return AM_ENOMEM;
+        }
+        cur->heap = 1;
+        pthread_mutex_lock(&q->lock);
     }
 
     cur->func = worker_f;
     cur->arg = arg;
+    cur->cls = (char) cls;
     cur->next = NULL;
+    am_timer(&cur->queued);
+    worker_stats_queued(cls);
 
-    pthread_mutex_lock(&worker_pool->lock);
-
-    if (worker_pool->head == NULL) {
-        worker_pool->head = cur;
+    if (q->head[cls] == NULL) {
+        q->head[cls] = cur;
     } else {
-        worker_pool->tail->next = cur;
+        q->tail[cls]->next = cur;
     }
-    worker_pool->tail = cur;
+    q->tail[cls] = cur;
+    AM_ATOMIC_ADD_64(&q->count[cls], 1);
+    pthread_mutex_unlock(&q->lock);
 
+    pthread_mutex_lock(&worker_pool->lock);
+    worker_pool->pending++;
     if (worker_pool->idle > 0) {
         /* if there is an idle worker in the pool - wake it up */
         pthread_cond_signal(&worker_pool->work);
@@ -405,16 +728,23 @@ int am_worker_dispatch(void (*worker_f)(void *), void *arg) {
 #endif
 }
 
+int am_worker_dispatch(void (*worker_f)(void *), void *arg) {
+    return am_worker_dispatch_class(AM_WORKER_NORMAL, worker_f, arg);
+}
+
 void am_worker_pool_shutdown() {
 #ifdef _WIN32
+    int i;
     CloseThreadpoolCleanupGroupMembers(worker_pool_cleanup, TRUE, NULL);
     CloseThreadpoolCleanupGroup(worker_pool_cleanup);
-    DestroyThreadpoolEnvironment(&worker_env);
+    for (i = 0; i < AM_WORKER_CLASSES; i++) {
+        DestroyThreadpoolEnvironment(&worker_env[i]);
+    }
     CloseThreadpool(worker_pool);
     worker_pool_cleanup = NULL;
 #else
     struct am_threadpool_active *active;
-    struct am_threadpool_work *work;
+    int i;
 
     if (worker_pool == NULL) return;
 
@@ -440,9 +770,9 @@ void am_worker_pool_shutdown() {
     }
     pthread_cleanup_pop(1);
 
-    for (work = worker_pool->head; work != NULL; work = worker_pool->head) {
-        worker_pool->head = work->next;
-        free(work);
+    worker_pool_free_tasks(worker_pool);
+    for (i = 0; i < AM_WORKER_QUEUES; i++) {
+        pthread_mutex_destroy(&worker_pool->queue[i].lock);
     }
 
     pthread_attr_destroy(&worker_pool->attr);
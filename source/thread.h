@@ -39,6 +39,24 @@ typedef pthread_t am_thread_t;
 #define AM_THREAD_LOCAL         __thread
 #endif
 
+/* atomic operations on (possibly process-shared) memory; all of them imply a full barrier */
+#ifdef _WIN32
+#define AM_ATOMIC_ADD_64(p,v)     InterlockedExchangeAdd64((volatile LONGLONG *) (p), (LONGLONG) (v))
+#define AM_ATOMIC_CAS_64(p,o,n)   (InterlockedCompareExchange64((volatile LONGLONG *) (p), (LONGLONG) (n), (LONGLONG) (o)) == (LONGLONG) (o))
+#define AM_ATOMIC_CAS_32(p,o,n)   (InterlockedCompareExchange((volatile LONG *) (p), (LONG) (n), (LONG) (o)) == (LONG) (o))
+#define AM_MEMORY_BARRIER()       MemoryBarrier()
+#elif defined(__sun) && !defined(__GNUC__)
+#define AM_ATOMIC_ADD_64(p,v)     (atomic_add_64_nv((volatile uint64_t *) (p), (int64_t) (v)) - (v))
+#define AM_ATOMIC_CAS_64(p,o,n)   (atomic_cas_64((volatile uint64_t *) (p), (o), (n)) == (o))
+#define AM_ATOMIC_CAS_32(p,o,n)   (atomic_cas_32((volatile uint32_t *) (p), (uint32_t) (o), (uint32_t) (n)) == (uint32_t) (o))
+#define AM_MEMORY_BARRIER()       do { membar_enter(); membar_exit(); } while (0)
+#else
+#define AM_ATOMIC_ADD_64(p,v)     __sync_fetch_and_add((p), (v))
+#define AM_ATOMIC_CAS_64(p,o,n)   __sync_bool_compare_and_swap((p), (o), (n))
+#define AM_ATOMIC_CAS_32(p,o,n)   __sync_bool_compare_and_swap((p), (o), (n))
+#define AM_MEMORY_BARRIER()       __sync_synchronize()
+#endif
+
 typedef struct {
 #ifdef _WIN32
     HANDLE e;
@@ -87,9 +105,29 @@ void am_close_timer_event(am_timer_event_t *e);
 void am_worker_pool_shutdown();
 void am_worker_pool_init(int (*init_status_cb)(int));
 
+enum {
+    AM_WORKER_HIGH = 0, /* cache invalidations */
+    AM_WORKER_NORMAL,
+    AM_WORKER_LOW, /* bulk background jobs */
+    AM_WORKER_CLASSES
+};
+
+typedef struct {
+    uint64_t dispatched;
+    uint64_t completed;
+    uint64_t stolen; /* tasks taken from another worker's queue */
+    uint64_t depth; /* tasks waiting for a worker */
+    uint64_t max_depth;
+    uint64_t wait; /* usec, total */
+    uint64_t max_wait; /* usec */
+} am_worker_stats_t;
+
 int am_worker_dispatch(void (*worker_f)(void *), void *arg);
+int am_worker_dispatch_class(int cls, void (*worker_f)(void *), void *arg);
+void am_worker_pool_stats(am_worker_stats_t *stats);
+
+void am_thread_cleanup_register(void (*cleanup)(void));
 
-void notification_worker(void *arg);
 void session_logout_worker(void *arg);
 void remote_audit_worker(void *arg);
 
@@ -80,23 +80,6 @@ const char *request_method_str[] = {
     "PING-RSP"
 };
 
-#define AM_XSTR(s) AM_STR(s)
-#define AM_STR(s) #s
-
-#define URI_HTTP "%"AM_XSTR(AM_PROTO_SIZE)"[HTPShtps]"
-#define URI_HOST "%"AM_XSTR(AM_HOST_SIZE)"[-_.abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789]"
-#define URI_PORT "%6d"
-#define URI_PATH "%"AM_XSTR(AM_URI_SIZE)"[-_.!~*'();/?:@&=+$,%#abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789]"
-#define HD1 URI_HTTP "://" URI_HOST ":" URI_PORT "/" URI_PATH
-#define HD2 URI_HTTP "://" URI_HOST "/" URI_PATH
-#define HD3 URI_HTTP "://" URI_HOST ":" URI_PORT
-#define HD4 URI_HTTP "://" URI_HOST
-
-struct query_attribute {
-    char *key;
-    char *key_value;
-};
-
 enum {
     AM_TIMER_INACTIVE = 0,
     AM_TIMER_ACTIVE = 1 << 0,
@@ -130,6 +113,8 @@ static am_timer_t am_timer_s = {0, 0, 0, 0};
 
 static const char *hex_chars = "0123456789ABCDEF";
 
+#define BASE16_TO_BASE10(x) (isdigit(x) ? ((x) - '0') : (toupper((x)) - 'A' + 10))
+
 static const unsigned char base64_table[64] =
         "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
@@ -268,248 +253,324 @@ char *match_group(pcre *x, int capture_groups, const char *subject, size_t *len)
     return result;
 }
 
-static void uri_normalize(struct url *url, char *path) {
+/**
+ * Normalize an (absolute) URL path in a single pass: percent-decode it, collapse
+ * consecutive '/' and resolve "." and ".." segments (RFC-2396, section-5.2).
+ * A leading '/' is assumed when src does not start with one. The result is never
+ * longer than src, so dst may be the same buffer as src (as long as src starts with '/').
+ *
+ * @param dst The buffer the normalized path is written into (at least src_sz + 1 bytes)
+ * @param src The path to normalize
+ * @param src_sz The number of characters in src to process
+ * @return The length of the normalized path, which is nul terminated
+ */
+size_t uri_normalize(char *dst, const char *src, size_t src_sz) {
+    size_t i = 0, w = 1, seg_start = 1, seg_sz;
+    unsigned int segments = 1; /* root segment */
+    char c, last = '/';
 
-    char *s, *o, *p = path != NULL ? strdup(path) : NULL;
-    int i, m = 0, list_sz = 0;
-    char **segment_list = NULL, **segment_list_norm = NULL, **tmp;
-    char u[AM_URI_SIZE + 1];
+    if (dst == NULL || src == NULL) {
+        return 0;
+    }
 
-    if (p == NULL) {
-        if (url != NULL) {
-            url->error = path != NULL ? AM_ENOMEM : AM_EINVAL;
-        }
-        return;
+    if (src_sz > 0 && src[0] == '/') {
+        i++; /* root segment separator */
     }
-    o = p; /* preserve original pointer */
+    dst[0] = '/';
 
-    /* split path into segments */
-    while ((s = am_strsep(&p, "/")) != NULL) {
-        if (strcmp(s, ".") == 0) {
-            continue; /* remove (ignore) single dot segments */
+    for (;; i++) {
+        if (i < src_sz && src[i] != '\0') {
+            c = src[i];
+            if (c == '%' && (i + 2) < src_sz && isxdigit((unsigned char) src[i + 1]) && isxdigit((unsigned char) src[i + 2])) {
+                c = (char) ((BASE16_TO_BASE10(src[i + 1]) * 16) + BASE16_TO_BASE10(src[i + 2]));
+                i += 2;
+            } else if (c == '+') {
+                c = ' ';
+            }
+            if (c != '/' && c != '\0') {
+                dst[w++] = c;
+                last = c;
+                continue;
+            }
+            if (c == '/' && last == '/') {
+                continue; /* replace all consecutive '/' with a single '/' */
+            }
+        } else {
+            c = '\0';
+        }
+
+        /* end of a segment */
+        seg_sz = w - seg_start;
+        if (seg_sz == 1 && dst[seg_start] == '.') {
+            w = seg_start - 1; /* remove (ignore) single dot segments */
+        } else if (seg_sz == 2 && dst[seg_start] == '.' && dst[seg_start + 1] == '.') {
+            /* remove double dot segments together with the preceding one */
+            w = seg_start - 1;
+            if (segments > 1) {
+                do {
+                    w--;
+                } while (w > 0 && dst[w] != '/');
+                segments--;
+            }
+        } else {
+            segments++;
         }
-        tmp = (char **) realloc(segment_list, sizeof (char *) * (++list_sz));
-        if (tmp == NULL) {
-            AM_FREE(o, segment_list);
-            url->error = AM_ENOMEM;
-            return;
+        if (c == '\0') {
+            break;
         }
-        segment_list = tmp;
-        segment_list[list_sz - 1] = s;
+        dst[w++] = '/';
+        seg_start = w;
+        last = '/';
     }
-    if (list_sz == 0) {
-        /* nothing to do here */
-        AM_FREE(o, segment_list);
-        if (url != NULL) {
-            url->error = AM_SUCCESS;
-        }
-        return;
+
+    if (segments == 1) {
+        w = 0; /* only the root segment is left */
     }
+    dst[w] = '\0';
+    return w;
+}
 
-    /* create a list for normalized segment storage */
-    segment_list_norm = (char **) calloc(list_sz, sizeof (char *));
-    if (segment_list_norm == NULL) {
-        AM_FREE(o, segment_list);
-        if (url != NULL) {
-            url->error = AM_ENOMEM;
+struct query_attribute {
+    const char *key_value;
+    size_t key_sz;
+    size_t key_value_sz;
+};
+
+static int query_attribute_compare(const void *a, const void *b) {
+    int status;
+    const struct query_attribute *ia = (const struct query_attribute *) a;
+    const struct query_attribute *ib = (const struct query_attribute *) b;
+    status = memcmp(ia->key_value, ib->key_value, MIN(ia->key_sz, ib->key_sz));
+    if (status == 0) {
+        status = CMP(ia->key_sz, ib->key_sz);
+    }
+    if (status == 0) {
+        /* variable names (keys) are the same, we need to further compare the values */
+        status = memcmp(ia->key_value, ib->key_value, MIN(ia->key_value_sz, ib->key_value_sz));
+        if (status == 0) {
+            status = CMP(ia->key_value_sz, ib->key_value_sz);
         }
-        return;
     }
+    return status;
+}
 
-    for (i = 0; i < list_sz; i++) {
-        if (strcmp(segment_list[i], "..") == 0) {
-            /* remove double dot segments */
-            if (m-- <= 1) {
-                m = 1;
-                continue;
-            }
-            segment_list_norm[m] = NULL;
-        } else {
-            segment_list_norm[m++] = segment_list[i];
+/**
+ * Write the query string (starting with '?') into dst, sorting query parameters
+ * if there are more than one of them. Empty parameters are dropped in that case.
+ */
+static size_t query_normalize(char *dst, const char *src, size_t src_sz) {
+    struct query_attribute list_s[AM_URL_QUERY_PARAMS], *list = list_s;
+    const char *p, *e, *end = src + src_sz;
+    size_t w, j, count = 0, sep_count = 0;
+
+    for (p = src + 1; p < end; p++) {
+        sep_count += (*p == '&');
+    }
+    if (sep_count == 0) {
+        memcpy(dst, src, src_sz);
+        dst[src_sz] = '\0';
+        return src_sz;
+    }
+
+    if (++sep_count > AM_URL_QUERY_PARAMS) {
+        list = (struct query_attribute *) malloc(sep_count * sizeof (struct query_attribute));
+        if (list == NULL) {
+            return (size_t) - 1;
         }
     }
 
-    memset(&u[0], 0, sizeof (u));
-    /* join normalized segments */
-    for (i = 0; i < list_sz; i++) {
-        if (segment_list_norm[i] == NULL) {
-            break;
+    for (p = src + 1; p < end; p = e + 1) {
+        const char *sep;
+        e = memchr(p, '&', end - p);
+        if (e == NULL) {
+            e = end;
         }
-        if (i == 0) {
-            strncpy(u, segment_list_norm[i], sizeof (u) - 1);
-            if ((i + 1) < list_sz && segment_list_norm[i + 1] != NULL) {
-                strncat(u, "/", sizeof (u) - 1);
-            }
-        } else {
-            strncat(u, segment_list_norm[i], sizeof (u) - 1);
-            if ((i + 1) < list_sz && segment_list_norm[i + 1] != NULL) {
-                strncat(u, "/", sizeof (u) - 1);
-            }
+        if (e == p) {
+            continue;
         }
+        sep = memchr(p, '=', e - p);
+        list[count].key_value = p;
+        list[count].key_value_sz = e - p;
+        list[count].key_sz = sep != NULL ? (size_t) (sep - p) : (size_t) (e - p);
+        count++;
     }
-    memcpy(path, u, sizeof (u));
 
-    AM_FREE(segment_list_norm, segment_list, o);
+    qsort(list, count, sizeof (struct query_attribute), query_attribute_compare);
 
-    if (url != NULL) {
-        url->error = AM_SUCCESS;
+    dst[0] = '?';
+    for (j = 0, w = 1; j < count; j++) {
+        if (j > 0) {
+            dst[w++] = '&';
+        }
+        memcpy(dst + w, list[j].key_value, list[j].key_value_sz);
+        w += list[j].key_value_sz;
     }
-}
+    dst[w] = '\0';
 
-static int query_attribute_compare(const void *a, const void *b) {
-    int status;
-    struct query_attribute *ia = (struct query_attribute *) a;
-    struct query_attribute *ib = (struct query_attribute *) b;
-    status = strcmp(ia->key, ib->key);
-    if (status == 0) {
-        /* variable names (keys) are the same, we need to further compare the values */
-        status = strcmp(ia->key_value, ib->key_value);
+    if (list != list_s) {
+        free(list);
     }
-    return status;
+    return w;
 }
 
+#define URL_ALNUM(c) (((c) >= 'a' && (c) <= 'z') || ((c) >= 'A' && (c) <= 'Z') || ((c) >= '0' && (c) <= '9'))
+#define URL_PROTO_CHAR(c) ((c) != '\0' && strchr("HTPShtps", (c)) != NULL)
+#define URL_HOST_CHAR(c) (URL_ALNUM(c) || (c) == '-' || (c) == '_' || (c) == '.')
+#define URL_PATH_CHAR(c) (URL_ALNUM(c) || ((c) != '\0' && strchr("-_.!~*'();/?:@&=+$,%#", (c)) != NULL))
+
 /**
- * Parse a URL into a struct url which contains members broken out into protocol,
- * host, path, etc. etc.
+ * Parse a URL into a struct url_view. Protocol, host, path and query values are stored
+ * as nul terminated strings in the buffer supplied by the caller (see AM_URL_VIEW_SIZE)
+ * and referenced by their offsets. The path is normalized and query parameters are sorted
+ * exactly the same way parse_url does, without allocating any memory.
  *
  * @param u The url to break out
- * @param url The broken out url structure to break out into
+ * @param url The url view structure to fill
+ * @param buf The storage for the url parts
+ * @param buf_sz The size of buf
  * @return AM_SUCCESS if all goes well, AM_ERROR if it does not.
  */
-int parse_url(const char *u, struct url *url) {
-    int i = 0, port = 0;
-    char last = 0;
-    char *d, *p, uri[AM_URI_SIZE + 1];
+int parse_url_view(const char *u, struct url_view *url, char *buf, size_t buf_sz) {
+    const char *p, *path = NULL, *query;
+    size_t proto_sz = 0, host_sz = 0, path_sz = 0, query_sz = 0, w;
+    int port = 0;
 
     if (url == NULL) {
         return AM_ERROR;
     }
-    if (u == NULL) {
+    memset(url, 0, sizeof (struct url_view));
+    url->buf = buf;
+    if (u == NULL || buf == NULL) {
         url->error = AM_EINVAL;
         return AM_ERROR;
     }
-    if (strlen(u) > (AM_PROTO_SIZE + AM_HOST_SIZE + 6 + AM_URI_SIZE /* max size of all sscanf format limits */)) {
+    if (strlen(u) > (AM_PROTO_SIZE + AM_HOST_SIZE + 6 + AM_URI_SIZE)) {
         url->error = AM_E2BIG;
         return AM_ERROR;
     }
 
-    url->error = url->ssl = url->port = 0;
-    memset(&uri[0], 0, sizeof (uri));
-    memset(&url->proto[0], 0, sizeof (url->proto));
-    memset(&url->host[0], 0, sizeof (url->host));
-    memset(&url->path[0], 0, sizeof (url->path));
-    memset(&url->query[0], 0, sizeof (url->query));
-
-    if (sscanf(u, HD1, url->proto, url->host, &port, url->path) == 4) {
-        ;
-    } else if (sscanf(u, HD2, url->proto, url->host, url->path) == 3) {
-        ;
-    } else if (sscanf(u, HD3, url->proto, url->host, &port) == 3) {
-        ;
-    } else if (sscanf(u, HD4, url->proto, url->host) == 2) {
-        ;
-    } else {
+    /* proto://host[:port][/path] with the same character sets and length limits 
+     * the sscanf based parser used to apply */
+    for (p = u; proto_sz < AM_PROTO_SIZE && URL_PROTO_CHAR(*p); p++) {
+        proto_sz++;
+    }
+    if (proto_sz == 0 || strncmp(p, "://", 3) != 0) {
+        url->error = AM_EOF;
+        return AM_ERROR;
+    }
+    for (p += 3; host_sz < AM_HOST_SIZE && URL_HOST_CHAR(*p); p++) {
+        host_sz++;
+    }
+    if (host_sz == 0) {
         url->error = AM_EOF;
         return AM_ERROR;
     }
 
-    url->port = port < 0 ? -(port) : port;
-    if (strcasecmp(url->proto, "https") == 0) {
-        url->ssl = 1;
-    } else {
-        url->ssl = 0;
+    if (*p == ':') {
+        const char *d = p + 1;
+        int width = 6, sign = 1, digits = 0;
+        while (isspace((unsigned char) *d)) d++;
+        if (*d == '-' || *d == '+') {
+            sign = *d++ == '-' ? -1 : 1;
+            width--;
+        }
+        for (; width > 0 && isdigit((unsigned char) *d); d++, width--, digits++) {
+            port = port * 10 + (*d - '0');
+        }
+        if (digits > 0) {
+            port *= sign;
+            p = d;
+        } else {
+            port = 0;
+            p = NULL; /* invalid port value - ignore the rest of the url */
+        }
     }
-    if (strcasecmp(url->proto, "https") == 0 && url->port == 0) {
+    if (p != NULL && *p == '/') {
+        path = ++p;
+        for (; path_sz < AM_URI_SIZE && URL_PATH_CHAR(*p); p++) {
+            path_sz++;
+        }
+    }
+
+    if (buf_sz < proto_sz + host_sz + path_sz + 5) {
+        url->error = AM_E2BIG;
+        return AM_ERROR;
+    }
+
+    url->port = port < 0 ? -(port) : port;
+    url->ssl = strncasecmp(u, "https", proto_sz) == 0 && proto_sz == 5 ? 1 : 0;
+    if (url->port == 0 && proto_sz == 5 && url->ssl) {
         url->port = 443;
-    } else if (strcasecmp(url->proto, "http") == 0 && url->port == 0) {
+    } else if (url->port == 0 && proto_sz == 4 && strncasecmp(u, "http", 4) == 0) {
         url->port = 80;
     }
-    if (!ISVALID(url->path)) {
-        strcpy(url->path, "/");
-    } else if (url->path[0] != '/') {
-        size_t ul = strlen(url->path);
-        if (ul < sizeof (url->path)) {
-            memmove(url->path + 1, url->path, ul);
-        }
-        url->path[0] = '/';
-    }
 
-    /* split out a query string, if any and sort query parameters */
-    p = strchr(url->path, '?');
-    if (p != NULL) {
-        char *token, *temp, query[AM_URI_SIZE + 1], *sep;
-        struct query_attribute *list;
-        int sep_count, sep_count_init, j;
-        strncpy(url->query, p, sizeof (url->query) - 1);
-        *p = 0;
-
-        strncpy(query, url->query + 1 /* skip '?' */, sizeof (url->query) - 1);
-        sep_count = char_count(query, '&', NULL);
-        if (sep_count > 0) {
-            list = (struct query_attribute *) calloc(++sep_count, sizeof (struct query_attribute));
-            if (list == NULL) {
-                url->error = AM_ENOMEM;
-                return AM_ERROR;
-            }
-            sep_count_init = sep_count;
-            sep_count = 0;
-
-            for ((token = strtok_r(query, "&", &temp)); token; (token = strtok_r(NULL, "&", &temp))) {
-                struct query_attribute *elm = &list[sep_count++];
-                elm->key_value = token;
-                elm->key = strdup(token);
-                if (elm->key == NULL) {
-                    for (j = 0; j < sep_count_init; j++) {
-                        struct query_attribute *elm = &list[j];
-                        am_free(elm->key);
-                    }
-                    free(list);
-                    url->error = AM_ENOMEM;
-                    return AM_ERROR;
-                }
-                sep = strchr(elm->key, '=');
-                if (sep != NULL) {
-                    *sep = '\0';
-                }
-            }
+    url->proto.off = 0;
+    url->proto.len = (unsigned int) proto_sz;
+    memcpy(buf, u, proto_sz);
+    buf[proto_sz] = '\0';
+    w = proto_sz + 1;
 
-            qsort(list, sep_count, sizeof (struct query_attribute), query_attribute_compare);
+    url->host.off = (unsigned int) w;
+    url->host.len = (unsigned int) host_sz;
+    memcpy(buf + w, u + proto_sz + 3, host_sz);
+    buf[w + host_sz] = '\0';
+    w += host_sz + 1;
 
-            strncpy(url->query, "?", sizeof (url->query) - 1);
-            for (j = 0; j < sep_count; j++) {
-                struct query_attribute *elm = &list[j];
-                if (j > 0) {
-                    strcat(url->query, "&");
-                }
-                strcat(url->query, elm->key_value);
-                free(elm->key);
-            }
-            free(list);
-        }
+    /* split out a query string, if any */
+    query = path != NULL ? memchr(path, '?', path_sz) : NULL;
+    if (query != NULL) {
+        query_sz = path_sz - (query - path);
+        path_sz = query - path;
     }
 
-    /* decode path */
-    d = url_decode(url->path);
-    if (d == NULL) {
-        url->error = AM_ENOMEM;
-        return AM_ERROR;
-    }
+    url->path.off = (unsigned int) w;
+    url->path.len = (unsigned int) uri_normalize(buf + w, path != NULL ? path : "", path_sz);
+    w += url->path.len + 1;
 
-    p = d;
-    /* replace all consecutive '/' with a single '/' */
-    while (*p != '\0') {
-        if (*p != '/' || (*p == '/' && last != '/')) {
-            uri[i++] = *p;
+    url->query.off = (unsigned int) w;
+    if (query != NULL) {
+        size_t sz = query_normalize(buf + w, query, query_sz);
+        if (sz == (size_t) - 1) {
+            url->error = AM_ENOMEM;
+            return AM_ERROR;
         }
-        last = *p;
-        p++;
+        url->query.len = (unsigned int) sz;
+    } else {
+        buf[w] = '\0';
     }
-    free(d);
+    return AM_SUCCESS;
+}
 
-    /* normalize path segments, RFC-2396, section-5.2 */
-    uri_normalize(url, uri);
+/**
+ * Parse a URL into a struct url which contains members broken out into protocol,
+ * host, path, etc. etc.
+ *
+ * @param u The url to break out
+ * @param url The broken out url structure to break out into
+ * @return AM_SUCCESS if all goes well, AM_ERROR if it does not.
+ */
+int parse_url(const char *u, struct url *url) {
+    struct url_view v;
+    char buf[AM_URL_VIEW_SIZE];
 
-    strncpy(url->path, uri, sizeof (url->path) - 1);
+    if (url == NULL) {
+        return AM_ERROR;
+    }
+    if (parse_url_view(u, &v, buf, sizeof (buf)) != AM_SUCCESS) {
+        url->error = v.error;
+        return AM_ERROR;
+    }
+
+    url->error = AM_SUCCESS;
+    url->port = v.port;
+    url->ssl = v.ssl;
+    memcpy(url->proto, URL_VIEW_PART(&v, proto), v.proto.len + 1);
+    memcpy(url->host, URL_VIEW_PART(&v, host), v.host.len + 1);
+    strncpy(url->path, URL_VIEW_PART(&v, path), sizeof (url->path) - 1);
+    url->path[sizeof (url->path) - 1] = '\0';
+    strncpy(url->query, URL_VIEW_PART(&v, query), sizeof (url->query) - 1);
+    url->query[sizeof (url->query) - 1] = '\0';
     return AM_SUCCESS;
 }
 
@@ -575,8 +636,6 @@ char *url_decode(const char *str) {
         return NULL;
     }
 
-#define BASE16_TO_BASE10(x) (isdigit(x) ? ((x) - '0') : (toupper((x)) - 'A' + 10))
-
     for (c = str; *c; c++) {
         if (*c != '%' || !isxdigit(c[1]) || !isxdigit(c[2])) {
             *ptr++ = *c == '+' ? ' ' : *c;
@@ -934,59 +993,150 @@ int am_method_str_to_num(const char *method_str) {
     return AM_REQUEST_UNKNOWN;
 }
 
-am_status_t get_cookie_value(am_request_t *rq, const char *separator, const char *cookie_name,
-        const char *cookie_header_val, char **value) {
-    size_t value_len = 0, ec = 0;
-    am_status_t found = AM_NOT_FOUND;
-    char *a, *b, *header_val = NULL, *c = NULL;
+/**
+ * Split the request Cookie header into a table of name/value spans (offsets into rq->cookies).
+ * The header is tokenized once per request - the table is rebuilt only if rq->cookies
+ * points to a different header value. Delimiter scans are done with memchr, which
+ * is vectorized by the C runtime on most platforms.
+ *
+ * @param rq The request
+ * @return AM_SUCCESS, AM_EINVAL or AM_ENOMEM
+ */
+int am_parse_cookie_header(am_request_t *rq) {
+    am_cookie_table_t *t;
+    const char *h, *p, *e, *end;
 
-    if (ISINVALID(cookie_name)) {
+    if (rq == NULL) {
         return AM_EINVAL;
     }
-    if (ISINVALID(cookie_header_val)) {
-        return AM_NOT_FOUND;
+    t = &rq->cookie_table;
+    if (t->list != NULL && t->header == rq->cookies) {
+        return AM_SUCCESS;
     }
-
-    *value = NULL;
-    header_val = strdup(cookie_header_val);
-    if (header_val == NULL) {
-        return AM_ENOMEM;
+    if (t->list == NULL) {
+        t->list = t->entries;
+        t->size = AM_COOKIE_TABLE_SIZE;
+    }
+    t->header = rq->cookies;
+    t->count = 0;
+    if (ISINVALID(rq->cookies)) {
+        return AM_SUCCESS;
     }
 
-    AM_LOG_DEBUG(rq->instance_id, "get_cookie_value(%s): parsing cookie header: %s",
-            separator, cookie_header_val);
+    AM_LOG_DEBUG(rq->instance_id, "am_parse_cookie_header(): parsing cookie header: %s", rq->cookies);
 
-    for ((a = strtok_r(header_val, separator, &b)); a; (a = strtok_r(NULL, separator, &b))) {
-        if (strcmp(separator, "=") == 0 || strcmp(separator, "~") == 0) {
-            /* trim any leading/trailing whitespace */
-            trim(a, ' ');
-            if (found != AM_SUCCESS && strcmp(a, cookie_name) == 0) found = AM_SUCCESS;
-            else if (found == AM_SUCCESS && a[0] != '\0') {
-                value_len = strlen(a);
-                if ((*value = strdup(a)) == NULL) {
-                    found = AM_NOT_FOUND;
-                } else {
-                    (*value)[value_len] = '\0';
-                    /* trim any leading/trailing double-quotes */
-                    trim(*value, '"');
-                }
-            }
-        } else {
-            if (strstr(a, cookie_name) == NULL) continue;
-            for (ec = 0, c = a; *c != '\0'; ++c) {
-                if (*c == '=') ++ec;
+    h = rq->cookies;
+    end = h + strlen(h);
+    for (p = h; p < end; p = e + 1) {
+        const char *n, *ne, *eq;
+        am_cookie_span_t *c;
+
+        e = memchr(p, ';', end - p);
+        if (e == NULL) {
+            e = end;
+        }
+        for (n = p; n < e && isspace((unsigned char) *n); n++)
+            ;
+        if (n == e) {
+            continue;
+        }
+
+        if (t->count == t->size) {
+            size_t size = t->size * 2;
+            am_cookie_span_t *list = t->list == t->entries ?
+                    (am_cookie_span_t *) malloc(size * sizeof (am_cookie_span_t)) :
+                    (am_cookie_span_t *) realloc(t->list, size * sizeof (am_cookie_span_t));
+            if (list == NULL) {
+                return AM_ENOMEM;
             }
-            if (ec > 1) {
-                c = strchr(a, '=');
-                *c = '~';
-                if ((found = get_cookie_value(rq, "~", cookie_name, a, value)) == AM_SUCCESS) break;
-            } else {
-                if ((found = get_cookie_value(rq, "=", cookie_name, a, value)) == AM_SUCCESS) break;
+            if (t->list == t->entries) {
+                memcpy(list, t->entries, sizeof (t->entries));
             }
+            t->list = list;
+            t->size = (unsigned int) size;
+        }
+
+        c = &t->list[t->count++];
+        c->pair.off = (unsigned int) (n - h);
+        c->pair.len = (unsigned int) (e - n);
+
+        eq = memchr(n, '=', e - n);
+        for (ne = eq != NULL ? eq : e; ne > n && isspace((unsigned char) ne[-1]); ne--)
+            ;
+        c->name.off = c->pair.off;
+        c->name.len = (unsigned int) (ne - n);
+
+        if (eq != NULL) {
+            const char *v = eq + 1, *ve = e;
+            /* trim any leading/trailing whitespace and double-quotes */
+            while (v < ve && isspace((unsigned char) *v)) v++;
+            while (ve > v && isspace((unsigned char) ve[-1])) ve--;
+            while (v < ve && *v == '"') v++;
+            while (ve > v && ve[-1] == '"') ve--;
+            c->value.off = (unsigned int) (v - h);
+            c->value.len = (unsigned int) (ve - v);
+        } else {
+            c->value.off = (unsigned int) (e - h);
+            c->value.len = 0;
+        }
+    }
+    return AM_SUCCESS;
+}
+
+/**
+ * Find a cookie in the request Cookie header.
+ *
+ * @param rq The request
+ * @param cookie_name The cookie name
+ * @return The first cookie table entry with a matching name or NULL if there is none
+ */
+const am_cookie_span_t *am_find_cookie(am_request_t *rq, const char *cookie_name) {
+    unsigned int i;
+    size_t cookie_name_len;
+
+    if (ISINVALID(cookie_name) || am_parse_cookie_header(rq) != AM_SUCCESS) {
+        return NULL;
+    }
+    cookie_name_len = strlen(cookie_name);
+    for (i = 0; i < rq->cookie_table.count; i++) {
+        const am_cookie_span_t *c = &rq->cookie_table.list[i];
+        if (c->name.len == cookie_name_len &&
+                memcmp(rq->cookies + c->name.off, cookie_name, cookie_name_len) == 0) {
+            return c;
         }
     }
-    free(header_val);
-    return found;
+    return NULL;
+}
+
+/**
+ * Get a cookie value from the request Cookie header.
+ *
+ * @param rq The request
+ * @param cookie_name The cookie name
+ * @param value Set to the (allocated) cookie value if found
+ * @return AM_SUCCESS if a non-empty value is found, AM_NOT_FOUND, AM_EINVAL or AM_ENOMEM
+ */
+am_status_t get_cookie_value(am_request_t *rq, const char *cookie_name, char **value) {
+    const am_cookie_span_t *c;
+    int status;
+
+    if (rq == NULL || value == NULL || ISINVALID(cookie_name)) {
+        return AM_EINVAL;
+    }
+    *value = NULL;
+    if (ISINVALID(rq->cookies)) {
+        return AM_NOT_FOUND;
+    }
+    status = am_parse_cookie_header(rq);
+    if (status != AM_SUCCESS) {
+        return status;
+    }
+    c = am_find_cookie(rq, cookie_name);
+    if (c == NULL || c->value.len == 0) {
+        return AM_NOT_FOUND;
+    }
+    *value = strndup(rq->cookies + c->value.off, c->value.len);
+    return *value != NULL ? AM_SUCCESS : AM_ENOMEM;
 }
 
 am_status_t get_token_from_url(am_request_t *rq) {
@@ -1052,11 +1202,22 @@ am_status_t get_token_from_url(am_request_t *rq) {
     return ISVALID(rq->token) ? AM_SUCCESS : AM_NOT_FOUND;
 }
 
+/**
+ * Rebuild the request Cookie header without the cookie(s) named cookie_name.
+ *
+ * @param rq The request
+ * @param cookie_name The cookie name
+ * @param cookie_hdr Set to the new header value (allocated from the request arena), NULL if no cookies are left
+ * @return AM_SUCCESS if the cookie was removed, AM_NOT_FOUND if it was not there
+ * (cookie_hdr is set in both cases), AM_EINVAL or AM_ENOMEM
+ */
 int remove_cookie(am_request_t *rq, const char *cookie_name, char **cookie_hdr) {
-    char *tmp, *tok, *last = NULL;
-    size_t cookie_name_len;
+    unsigned int i;
+    size_t cookie_name_len, w = 0;
+    char *hdr;
+    int status = AM_NOT_FOUND;
 
-    if (rq == NULL || rq->ctx == NULL || !ISVALID(cookie_name)) {
+    if (rq == NULL || rq->ctx == NULL || !ISVALID(cookie_name) || cookie_hdr == NULL) {
         return AM_EINVAL;
     }
 
@@ -1064,44 +1225,34 @@ int remove_cookie(am_request_t *rq, const char *cookie_name, char **cookie_hdr)
         return AM_SUCCESS;
     }
 
-    if (strstr(rq->cookies, cookie_name) == NULL) {
-        return AM_NOT_FOUND;
+    if (am_parse_cookie_header(rq) != AM_SUCCESS) {
+        return AM_ENOMEM;
     }
 
-    tmp = strdup(rq->cookies);
-    if (tmp == NULL) return AM_ENOMEM;
+    hdr = (char *) am_arena_alloc(am_request_arena(rq), strlen(rq->cookies) + 1);
+    if (hdr == NULL) {
+        return AM_ENOMEM;
+    }
 
     cookie_name_len = strlen(cookie_name);
-
-    tok = strtok_r(tmp, ";", &last);
-    while (tok != NULL) {
-        char match = AM_FALSE;
-        char *equal_sign = strchr(tok, '=');
-        /* trim space before the cookie name in the cookie header */
-        while (isspace(*tok)) tok++;
-        if (equal_sign != NULL && equal_sign != tok) {
-            /* trim white space after the cookie name in the cookie header */
-            while ((--equal_sign) >= tok && isspace(*equal_sign))
-                ;
-            equal_sign++;
-            /* now compare the cookie names */
-            if (equal_sign != tok && (equal_sign - tok) == cookie_name_len &&
-                    !strncmp(tok, cookie_name, cookie_name_len)) {
-                match = AM_TRUE;
-            }
+    for (i = 0; i < rq->cookie_table.count; i++) {
+        const am_cookie_span_t *c = &rq->cookie_table.list[i];
+        /* put cookie in a header only if it doesn't match cookie name */
+        if (c->name.len == cookie_name_len &&
+                memcmp(rq->cookies + c->name.off, cookie_name, cookie_name_len) == 0) {
+            status = AM_SUCCESS;
+            continue;
         }
-        /* put cookie in a header only if it didn't match cookie name */
-        if (!match) {
-            am_asprintf(cookie_hdr, "%s%s%s",
-                    *cookie_hdr == NULL ? "" : *cookie_hdr,
-                    *cookie_hdr != NULL ? ";" : "",
-                    tok);
+        if (w > 0) {
+            hdr[w++] = ';';
         }
-        tok = strtok_r(NULL, ";", &last);
+        memcpy(hdr + w, rq->cookies + c->pair.off, c->pair.len);
+        w += c->pair.len;
     }
+    hdr[w] = '\0';
 
-    free(tmp);
-    return AM_SUCCESS;
+    *cookie_hdr = w > 0 ? hdr : NULL;
+    return status;
 }
 
 char *load_file(const char *filepath, size_t *data_sz) {
@@ -1135,6 +1286,51 @@ char *load_file(const char *filepath, size_t *data_sz) {
     return text;
 }
 
+/**
+ * Load 'size' bytes at 'offset' of a file (NUL terminated).
+ */
+char *load_file_range(const char *filepath, uint64_t offset, size_t size) {
+    char *text, *p;
+    size_t left = size;
+    int fd;
+#ifdef _WIN32
+    fd = _open(filepath, _O_BINARY | _O_RDONLY);
+#else
+    fd = open(filepath, O_RDONLY);
+#endif
+    if (fd == -1) {
+        return NULL;
+    }
+#ifdef _WIN32
+    if (_lseeki64(fd, (__int64) offset, SEEK_SET) != (__int64) offset) {
+#else
+    if (lseek(fd, (off_t) offset, SEEK_SET) != (off_t) offset) {
+#endif
+        close(fd);
+        return NULL;
+    }
+    text = malloc(size + 1);
+    for (p = text; text != NULL && left > 0;) {
+        ssize_t rd = read(fd, p,
+#ifdef _WIN32
+                (unsigned int)
+#endif
+                left);
+        if (rd <= 0) {
+            free(text);
+            text = NULL;
+            break;
+        }
+        p += rd;
+        left -= (size_t) rd;
+    }
+    if (text != NULL) {
+        text[size] = '\0';
+    }
+    close(fd);
+    return text;
+}
+
 ssize_t write_file(const char *filepath, const void *data, size_t data_sz) {
     int fd;
     ssize_t wr = 0;
@@ -1165,6 +1361,70 @@ ssize_t write_file(const char *filepath, const void *data, size_t data_sz) {
     return wr;
 }
 
+/**
+ * Write data, read in chunks with 'read_f' (returns the number of bytes read, 0 at the end
+ * of data or a negative value on error), into a file. Fails with AM_E2BIG as soon as more than
+ * 'max_size' bytes (0 - no limit) are read. The file is removed on any error.
+ */
+int write_file_stream(const char *filepath, ssize_t(*read_f)(void *, char *, size_t), void *arg,
+        size_t max_size, size_t *data_sz) {
+    int fd, status = AM_SUCCESS;
+    size_t total = 0;
+    char *buf;
+
+    if (filepath == NULL || read_f == NULL) return AM_EINVAL;
+    buf = malloc(AM_POST_DATA_CHUNK_SIZE);
+    if (buf == NULL) return AM_ENOMEM;
+#ifdef _WIN32
+    fd = _open(filepath, _O_CREAT | _O_WRONLY | _O_TRUNC | _O_BINARY, _S_IWRITE);
+#else
+    fd = open(filepath, O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+#endif
+    if (fd == -1) {
+        free(buf);
+        return AM_EPERM;
+    }
+
+    for (;;) {
+        ssize_t rd = read_f(arg, buf, AM_POST_DATA_CHUNK_SIZE), off = 0;
+        if (rd == 0) break;
+        if (rd < 0) {
+            status = AM_ERROR;
+            break;
+        }
+        if (max_size > 0 && total + rd > max_size) {
+            status = AM_E2BIG;
+            break;
+        }
+        while (off < rd) {
+            ssize_t wr = write(fd, buf + off,
+#ifdef _WIN32
+                    (unsigned int)
+#endif
+                    (rd - off));
+            if (wr <= 0) {
+                status = AM_EOF;
+                break;
+            }
+            off += wr;
+        }
+        if (status != AM_SUCCESS) break;
+        total += rd;
+    }
+
+    /* no fsync: the file is only needed as long as its (shared memory) cache entry is */
+    close(fd);
+    free(buf);
+    if (status != AM_SUCCESS) {
+        unlink(filepath);
+        total = 0;
+    }
+    if (data_sz) {
+        *data_sz = total;
+    }
+    return status;
+}
+
 char file_exists(const char *fn) {
 #ifdef _WIN32
     if (_access(fn, 6) == 0) {
@@ -1526,21 +1786,112 @@ void uuid(char *buf, size_t buflen) {
             uuid_data.u.node[3], uuid_data.u.node[4], uuid_data.u.node[5]);
 }
 
+/*
+ * Per-thread LRU of decoded session tokens (am_session_decode results), keyed by the token hash.
+ * Entry data format: token\0si\0sk\0s1\0 - a missing value has its offset set to -1.
+ */
+struct session_decode_entry {
+    uint32_t hash;
+    unsigned long tick;
+    int si, sk, s1;
+    char *data;
+};
+
+static AM_THREAD_LOCAL struct session_decode_entry session_decode_cache[AM_SESSION_DECODE_CACHE_SIZE];
+static AM_THREAD_LOCAL unsigned long session_decode_tick = 0;
+
+static void session_decode_thread_cleanup() {
+    int i;
+    for (i = 0; i < AM_SESSION_DECODE_CACHE_SIZE; i++) {
+        am_free(session_decode_cache[i].data);
+        session_decode_cache[i].data = NULL;
+    }
+}
+
+static char *session_decode_value(am_request_t *r, const struct session_decode_entry *e, int off) {
+    return off < 0 ? NULL : am_arena_strdup(am_request_arena(r), e->data + off);
+}
+
+static am_bool_t session_decode_cache_get(am_request_t *r, uint32_t hash) {
+    int i;
+    for (i = 0; i < AM_SESSION_DECODE_CACHE_SIZE; i++) {
+        struct session_decode_entry *e = &session_decode_cache[i];
+        if (e->data == NULL || e->hash != hash || strcmp(e->data, r->token) != 0) continue;
+        r->session_info.si = session_decode_value(r, e, e->si);
+        r->session_info.sk = session_decode_value(r, e, e->sk);
+        r->session_info.s1 = session_decode_value(r, e, e->s1);
+        if ((e->si >= 0 && r->session_info.si == NULL) || (e->sk >= 0 && r->session_info.sk == NULL) ||
+                (e->s1 >= 0 && r->session_info.s1 == NULL)) {
+            r->session_info.error = AM_ENOMEM;
+        }
+        e->tick = ++session_decode_tick;
+        return AM_TRUE;
+    }
+    return AM_FALSE;
+}
+
+static void session_decode_cache_set(am_request_t *r, uint32_t hash) {
+    struct session_decode_entry *e = &session_decode_cache[0];
+    size_t token_sz = strlen(r->token) + 1,
+            si_sz = r->session_info.si != NULL ? strlen(r->session_info.si) + 1 : 0,
+            sk_sz = r->session_info.sk != NULL ? strlen(r->session_info.sk) + 1 : 0,
+            s1_sz = r->session_info.s1 != NULL ? strlen(r->session_info.s1) + 1 : 0;
+    char *data;
+    int i;
+
+    /* replace an empty or the least recently used entry */
+    for (i = 1; i < AM_SESSION_DECODE_CACHE_SIZE && e->data != NULL; i++) {
+        if (session_decode_cache[i].data == NULL || session_decode_cache[i].tick < e->tick) {
+            e = &session_decode_cache[i];
+        }
+    }
+
+    data = realloc(e->data, token_sz + si_sz + sk_sz + s1_sz);
+    if (data == NULL) {
+        am_free(e->data);
+        e->data = NULL;
+        return;
+    }
+    memcpy(data, r->token, token_sz);
+    e->si = si_sz > 0 ? (int) token_sz : -1;
+    e->sk = sk_sz > 0 ? (int) (token_sz + si_sz) : -1;
+    e->s1 = s1_sz > 0 ? (int) (token_sz + si_sz + sk_sz) : -1;
+    if (si_sz > 0) memcpy(data + e->si, r->session_info.si, si_sz);
+    if (sk_sz > 0) memcpy(data + e->sk, r->session_info.sk, sk_sz);
+    if (s1_sz > 0) memcpy(data + e->s1, r->session_info.s1, s1_sz);
+    e->data = data;
+    e->hash = hash;
+    e->tick = ++session_decode_tick;
+    am_thread_cleanup_register(session_decode_thread_cleanup);
+}
+
+/**
+ * Parse the SI/SK/S1 values out of the session token (r->token) into r->session_info.
+ * Decoded values are cached per thread, so that a repeat request with the same token
+ * does not need to c66/base64-decode it again.
+ */
 int am_session_decode(am_request_t *r) {
     size_t tl, i;
     int nv = 0;
-    char *begin, *end;
+    char *begin, *end, *token;
+    uint32_t hash;
 
     enum {
         AM_NA, AM_SI, AM_SK, AM_S1
     } ty = AM_NA;
 
-    char *token = (r != NULL && ISVALID(r->token)) ?
-            strdup(r->token) : NULL;
+    if (r == NULL || ISINVALID(r->token)) return AM_EINVAL;
+
+    memset(&r->session_info, 0, sizeof (struct am_session_info));
+
+    hash = am_hash(r->token);
+    if (session_decode_cache_get(r, hash)) {
+        return AM_SUCCESS;
+    }
 
+    token = am_arena_strdup(am_request_arena(r), r->token);
     if (token == NULL) return AM_EINVAL;
 
-    memset(&r->session_info, 0, sizeof (struct am_session_info));
     tl = strlen(token);
 
     if (strchr(token, '*') != NULL) {
@@ -1601,7 +1952,7 @@ int am_session_decode(am_request_t *r) {
                         }
                     } else {
                         if (ty == AM_SI) {
-                            r->session_info.si = malloc(sz + 1);
+                            r->session_info.si = am_arena_alloc(r->arena, sz + 1);
                             if (r->session_info.si == NULL) {
                                 r->session_info.error = AM_ENOMEM;
                                 break;
@@ -1609,7 +1960,7 @@ int am_session_decode(am_request_t *r) {
                             memcpy(r->session_info.si, raw, sz);
                             r->session_info.si[sz] = 0;
                         } else if (ty == AM_SK) {
-                            r->session_info.sk = malloc(sz + 1);
+                            r->session_info.sk = am_arena_alloc(r->arena, sz + 1);
                             if (r->session_info.sk == NULL) {
                                 r->session_info.error = AM_ENOMEM;
                                 break;
@@ -1617,7 +1968,7 @@ int am_session_decode(am_request_t *r) {
                             memcpy(r->session_info.sk, raw, sz);
                             r->session_info.sk[sz] = 0;
                         } else if (ty == AM_S1) {
-                            r->session_info.s1 = malloc(sz + 1);
+                            r->session_info.s1 = am_arena_alloc(r->arena, sz + 1);
                             if (r->session_info.s1 == NULL) {
                                 r->session_info.error = AM_ENOMEM;
                                 break;
@@ -1635,7 +1986,9 @@ int am_session_decode(am_request_t *r) {
         }
     }
 
-    free(token);
+    if (r->session_info.error == AM_SUCCESS) {
+        session_decode_cache_set(r, hash);
+    }
     return AM_SUCCESS;
 }
 
@@ -1694,11 +2047,33 @@ void am_timer(uint64_t *t) {
     QueryPerformanceCounter((LARGE_INTEGER *) t);
 #else
     struct timeval tv;
-    gettimeofday(&tv, NULL); //TODO: gethrtime
+#if defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
+        *t = ((uint64_t) ts.tv_sec * AM_TIMER_USEC_PER_SEC) + (uint64_t) ts.tv_nsec / 1000;
+        return;
+    }
+#endif
+    gettimeofday(&tv, NULL);
     *t = ((uint64_t) tv.tv_sec * AM_TIMER_USEC_PER_SEC) + tv.tv_usec;
 #endif
 }
 
+/**
+ * Number of microseconds between two am_timer readings.
+ */
+uint64_t am_timer_usec(uint64_t start, uint64_t stop) {
+#ifdef _WIN32
+    static LONGLONG freq = 0;
+    if (freq == 0) {
+        QueryPerformanceFrequency((LARGE_INTEGER *) & freq);
+    }
+    return stop > start && freq > 0 ? ((stop - start) * AM_TIMER_USEC_PER_SEC) / (uint64_t) freq : 0;
+#else
+    return stop > start ? stop - start : 0;
+#endif
+}
+
 void am_timer_start(am_timer_t *t) {
     t = t ? t : &am_timer_s;
     t->state = AM_TIMER_ACTIVE;
@@ -1912,12 +2287,14 @@ void decrypt_agent_passwords(am_config_t *r) {
 
 void am_request_free(am_request_t *r) {
     if (r != NULL) {
-        AM_FREE(r->normalized_url, r->overridden_url, r->normalized_url_pathinfo,
-                r->overridden_url_pathinfo, r->token,
-                r->client_ip, r->client_host, r->post_data,
-                r->session_info.s1, r->session_info.si, r->session_info.sk);
+        AM_FREE(r->token, r->post_data);
         delete_am_policy_result_list(&r->pattr);
         delete_am_namevalue_list(&r->sattr);
+        if (r->cookie_table.list != r->cookie_table.entries) {
+            am_free(r->cookie_table.list);
+        }
+        am_arena_release(r->arena);
+        r->arena = NULL;
     }
 }
 
@@ -2593,6 +2970,143 @@ void read_directory(const char *path, struct am_namevalue **list) {
     }
 }
 
+/**
+ * Compress file 'from' into a gzip file 'to' (streaming, the file is never read into memory at once).
+ * Returns AM_SUCCESS or an error code; 'to' is removed on failure.
+ */
+int gzip_file(const char *from, const char *to) {
+    char buffer[AM_PATH_SIZE * 8];
+    FILE *in;
+    gzFile out;
+    size_t rd;
+    int status = AM_SUCCESS;
+
+    if (ISINVALID(from) || ISINVALID(to)) {
+        return AM_EINVAL;
+    }
+    if ((in = fopen(from, "rb")) == NULL) {
+        return AM_FILE_ERROR;
+    }
+    if ((out = gzopen(to, "wb")) == NULL) {
+        fclose(in);
+        return AM_FILE_ERROR;
+    }
+    while ((rd = fread(buffer, 1, sizeof (buffer), in)) > 0) {
+        if (gzwrite(out, buffer, (unsigned int) rd) != (int) rd) {
+            status = AM_FILE_ERROR;
+            break;
+        }
+    }
+    if (ferror(in)) {
+        status = AM_FILE_ERROR;
+    }
+    fclose(in);
+    if (gzclose(out) != Z_OK) {
+        status = AM_FILE_ERROR;
+    }
+    if (status != AM_SUCCESS) {
+        unlink(to);
+    }
+    return status;
+}
+
+struct retained_file {
+    char *name;
+    time_t modified;
+    uint64_t size;
+};
+
+static int retained_file_compare(const void *a, const void *b) {
+    const struct retained_file *x = (const struct retained_file *) a;
+    const struct retained_file *y = (const struct retained_file *) b;
+    /* newest first */
+    return x->modified < y->modified ? 1 : (x->modified > y->modified ? -1 : strcmp(y->name, x->name));
+}
+
+/**
+ * Delete the oldest rotated copies of a file (all files named <file_name>.<suffix>) so that
+ * at most 'max_count' of them, taking at most 'max_size' bytes in total, are kept (0 - no limit).
+ * Returns the number of files deleted.
+ */
+int delete_rotated_files(const char *file_name, unsigned int max_count, uint64_t max_size) {
+    char dir[AM_PATH_SIZE];
+    const char *base;
+    size_t base_sz, i, count = 0, capacity = 0;
+    struct retained_file *files = NULL;
+    uint64_t total = 0;
+    int deleted = 0;
+    DIR *d;
+
+    if (ISINVALID(file_name) || (max_count == 0 && max_size == 0)) {
+        return 0;
+    }
+    base = strrchr(file_name, '/');
+#ifdef _WIN32
+    if (base == NULL || strrchr(file_name, '\\') > base) {
+        base = strrchr(file_name, '\\');
+    }
+#endif
+    if (base != NULL) {
+        snprintf(dir, sizeof (dir), "%.*s", (int) (base - file_name), file_name);
+        base++;
+    } else {
+        strcpy(dir, ".");
+        base = file_name;
+    }
+    base_sz = strlen(base);
+
+    if ((d = opendir(ISVALID(dir) ? dir : "/")) == NULL) {
+        return 0;
+    }
+    for (;;) {
+        struct dirent *e = readdir(d);
+        struct stat st;
+        char *path = NULL;
+        if (e == NULL) {
+            break;
+        }
+        if (strncmp(e->d_name, base, base_sz) != 0 || e->d_name[base_sz] != '.' ||
+                e->d_name[base_sz + 1] == '\0') {
+            continue;
+        }
+        if (am_asprintf(&path, "%s/%s", ISVALID(dir) ? dir : "", e->d_name) == -1) {
+            break;
+        }
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+            free(path);
+            continue;
+        }
+        if (count == capacity) {
+            struct retained_file *tmp = (struct retained_file *) realloc(files,
+                    (capacity + 32) * sizeof (struct retained_file));
+            if (tmp == NULL) {
+                free(path);
+                break;
+            }
+            files = tmp;
+            capacity += 32;
+        }
+        files[count].name = path;
+        files[count].modified = st.st_mtime;
+        files[count].size = st.st_size;
+        count++;
+    }
+    closedir(d);
+
+    qsort(files, count, sizeof (struct retained_file), retained_file_compare);
+    for (i = 0; i < count; i++) {
+        total += files[i].size;
+        if ((max_count > 0 && i >= max_count) || (max_size > 0 && total > max_size)) {
+            if (unlink(files[i].name) == 0) {
+                deleted++;
+            }
+        }
+        free(files[i].name);
+    }
+    free(files);
+    return deleted;
+}
+
 int get_ttl_value(struct am_namevalue *session, const char *name, int def, int value_in_minutes) {
     struct am_namevalue *element, *tmp;
     int result;
@@ -2665,46 +3179,27 @@ void* mem3cpy(void* dest, const void* source1, size_t size1,
     return dest;
 }
 
-char *am_json_escape(const char *str, size_t *escaped_sz) {
-    char *data = NULL;
-    const char *end;
-    size_t len = 0;
-    int err = 0;
-
-    if (str == NULL) {
-        return NULL;
-    }
+/**
+ * Write 'len' bytes of 'str' into 'buf' as a quoted JSON string, escaping \, /, " and control
+ * characters on the way. The output is truncated (closing quote kept) to fit into 'size' bytes,
+ * nul terminator included.
+ *
+ * @return number of bytes written (without the nul terminator)
+ */
+size_t am_json_escape_to(char *buf, size_t size, const char *str, size_t len) {
+    size_t pos = 0, i, length;
+    const char *text;
+    char seq[7];
 
-    err = concat(&data, &len, "\"", 1);
-    if (err) {
-        am_free(data);
-        return NULL;
+    if (buf == NULL || size < 3) {
+        return 0;
     }
 
-    end = str;
-    while (1) {
-        const char *text;
-        char seq[7];
-        int length;
-
-        while (*end && *end != '\\' && *end != '"' && *end != '/' &&
-                (unsigned char) *end > 0x1F) {
-            end++;
-        }
-        if (end != str) {
-            err = concat(&data, &len, str, end - str);
-            if (err) {
-                am_free(data);
-                return NULL;
-            }
-        }
-        if (!*end) {
-            break;
-        }
-
-        /* handle \, /, ", and control codes */
+    buf[pos++] = '"';
+    for (i = 0; str != NULL && i < len; i++) {
+        unsigned char c = (unsigned char) str[i];
         length = 2;
-        switch (*end) {
+        switch (c) {
             case '/': text = "\\/";
                 break;
             case '\\': text = "\\\\";
@@ -2722,29 +3217,46 @@ char *am_json_escape(const char *str, size_t *escaped_sz) {
             case '\t': text = "\\t";
                 break;
             default:
-            {
-                snprintf(seq, sizeof (seq), "\\u%04X", *end);
-                text = seq;
-                length = 6;
+                if (c > 0x1F) {
+                    text = NULL;
+                    length = 1;
+                } else {
+                    snprintf(seq, sizeof (seq), "\\u%04X", c);
+                    text = seq;
+                    length = 6;
+                }
                 break;
-            }
         }
-
-        err = concat(&data, &len, text, length);
-        if (err) {
-            am_free(data);
-            return NULL;
+        if (pos + length + 2 > size) {
+            break; /* keep room for the closing quote */
         }
-        end++;
-        str = end;
+        if (text != NULL) {
+            memcpy(buf + pos, text, length);
+        } else {
+            buf[pos] = (char) c;
+        }
+        pos += length;
     }
+    buf[pos++] = '"';
+    buf[pos] = '\0';
+    return pos;
+}
 
-    err = concat(&data, &len, "\"", 1);
-    if (err) {
-        am_free(data);
+char *am_json_escape(const char *str, size_t *escaped_sz) {
+    size_t len, size;
+    char *data;
+
+    if (str == NULL) {
         return NULL;
     }
 
+    len = strlen(str);
+    size = len * 6 + 3;
+    data = malloc(size);
+    if (data == NULL) {
+        return NULL;
+    }
+    len = am_json_escape_to(data, size, str, len);
     if (escaped_sz) {
         *escaped_sz = len;
     }
@@ -28,6 +28,9 @@
 #define AM_COMMA_CHAR           ","
 #define AM_PIPE_CHAR            "|"
 #define AM_BITMASK_CHECK(v,m)   (((v) & (m)) == (m))             
+#define AM_URL_QUERY_PARAMS     64 /* number of query parameters sorted w/o a heap allocation */
+#define AM_URL_VIEW_SIZE        (AM_PROTO_SIZE + AM_HOST_SIZE + AM_URI_SIZE + 8)
+#define URL_VIEW_PART(v, p)     ((v)->buf + (v)->p.off)
 
 #define AM_NULL_CHECK(...) \
   do { \
@@ -125,6 +128,7 @@ struct notification_worker_data {
     unsigned long instance_id;
     char *post_data;
     size_t post_data_sz;
+    struct notification_worker_data *next;
 };
 
 struct logout_worker_data {
@@ -149,6 +153,19 @@ struct url_validator_worker_data {
     char *config_path;
 };
 
+/* compact url representation - all parts are nul terminated strings 
+ * stored in a single buffer (AM_URL_VIEW_SIZE bytes for any valid url) */
+struct url_view {
+    unsigned int port;
+    int error;
+    char ssl;
+    char *buf;
+    am_span_t proto;
+    am_span_t host;
+    am_span_t path;
+    am_span_t query;
+};
+
 typedef struct {
     uint64_t start;
     uint64_t stop;
@@ -160,6 +177,7 @@ void delete_am_cookie_list(struct am_cookie **list);
 void delete_am_policy_result_list(struct am_policy_result **list);
 
 void am_timer(uint64_t *t);
+uint64_t am_timer_usec(uint64_t start, uint64_t stop);
 void am_timer_start(am_timer_t *t);
 void am_timer_stop(am_timer_t *t);
 void am_timer_pause(am_timer_t *t);
@@ -170,11 +188,15 @@ void am_timer_report(unsigned long instance_id, am_timer_t *t, const char *op);
 const char *get_valid_openam_url(am_request_t *r);
 
 am_status_t ip_address_match(const char *ip, const char **list, unsigned int listsize, unsigned long instance_id);
+am_bool_t ip_address_loopback(const char *ip);
 
 am_status_t get_token_from_url(am_request_t *rq);
-am_status_t get_cookie_value(am_request_t *rq, const char *separator, const char *cookie_name,
-        const char *cookie_header_val, char **value);
+int am_parse_cookie_header(am_request_t *rq);
+const am_cookie_span_t *am_find_cookie(am_request_t *rq, const char *cookie_name);
+am_status_t get_cookie_value(am_request_t *rq, const char *cookie_name, char **value);
 int parse_url(const char *u, struct url *url);
+int parse_url_view(const char *u, struct url_view *url, char *buf, size_t buf_sz);
+size_t uri_normalize(char *dst, const char *src, size_t src_sz);
 char *url_encode(const char *str);
 char *url_decode(const char *str);
 
@@ -190,11 +212,19 @@ void am_shm_shutdown(am_shm_t *);
 void *am_shm_alloc(am_shm_t *am, size_t usize);
 void *am_shm_alloc_with_gc(am_shm_t *am, size_t usize, int (*gc)(unsigned long), unsigned long instance_id);
 void am_shm_free(am_shm_t *am, void *ptr);
+size_t am_shm_size(void *ptr);
 void *am_shm_realloc(am_shm_t *am, void *ptr, size_t size);
 void am_shm_set_user_offset(am_shm_t *r, size_t s);
 void *am_shm_get_user_pointer(am_shm_t *am);
 void am_shm_info(am_shm_t *);
 void am_shm_destroy(am_shm_t* am);
+size_t am_shm_page_size(size_t size);
+#ifndef _WIN32
+int am_shm_open(const char *name, int flags);
+int am_shm_unlink(const char *name);
+void *am_shm_map(int fd, size_t size, int create);
+void *am_shm_map_new(const char *name, int *fd, size_t request, size_t max_size, size_t *size);
+#endif
 
 int am_create_agent_dir(const char *sep, const char *path, char **created_name,
         char **created_name_simple, uid_t* uid, gid_t* gid, void (*log)(const char *, ...));
@@ -209,10 +239,22 @@ am_return_t match(unsigned long instance_id, const char *subject, const char *pa
 char *match_group(pcre *x, int capture_groups, const char *subject, size_t *len);
 int gzip_deflate(const char *uncompressed, size_t *uncompressed_sz, char **compressed);
 int gzip_inflate(const char *compressed, size_t *compressed_sz, char **uncompressed);
+int gzip_file(const char *from, const char *to);
 void trim(char *a, char w);
 
 int am_vasprintf(char **buffer, const char *fmt, va_list arg);
 
+am_arena_t *am_arena_create();
+void am_arena_reset(am_arena_t *a);
+void am_arena_destroy(am_arena_t *a);
+void *am_arena_alloc(am_arena_t *a, size_t size);
+char *am_arena_strdup(am_arena_t *a, const char *s);
+char *am_arena_strndup(am_arena_t *a, const char *s, size_t n);
+int am_arena_asprintf(am_arena_t *a, char **buffer, const char *fmt, ...);
+am_arena_t *am_arena_get();
+void am_arena_release(am_arena_t *a);
+am_arena_t *am_request_arena(am_request_t *r);
+
 void am_secure_zero_memory(void *v, size_t sz);
 
 void read_directory(const char *path, struct am_namevalue **list);
@@ -228,6 +270,7 @@ char *stristr(char *str1, char *str2);
 am_status_t concat(char **str, size_t *str_sz, const char *s2, size_t s2sz);
 
 int copy_file(const char *from, const char *to);
+int delete_rotated_files(const char *file_name, unsigned int max_count, uint64_t max_size);
 
 void xml_entity_escape(char *temp_str, size_t str_len);
 
@@ -235,8 +278,9 @@ int char_count(const char *string, int c, int *last);
 void uuid(char *buf, size_t buflen);
 
 char file_exists(const char *fn);
-char *load_file(const char *filepath, size_t *data_sz);
 ssize_t write_file(const char *filepath, const void *data, size_t data_sz);
+int write_file_stream(const char *filepath, ssize_t(*read_f)(void *, char *, size_t), void *arg,
+        size_t max_size, size_t *data_sz);
 
 int get_line(char **line, size_t *size, FILE *file);
 
@@ -267,11 +311,31 @@ void *am_parse_session_xml(unsigned long instance_id, const char *xml, size_t xm
 void *am_parse_session_saml(unsigned long instance_id, const char *xml, size_t xml_sz);
 void *am_parse_policy_xml(unsigned long instance_id, const char *xml, size_t xml_sz, int scope);
 
+typedef struct am_spool am_spool_t;
+
+am_spool_t *am_spool_open(const char *base, size_t segment_size, int max_segments);
+void am_spool_close(am_spool_t *s);
+int am_spool_append(am_spool_t *s, const void *data, size_t size);
+int am_spool_has_room(am_spool_t *s, size_t size);
+int am_spool_read(am_spool_t *s, int max, void (*cb)(void *arg, const char *data, size_t size), void *arg);
+int am_spool_ack(am_spool_t *s, int count);
+unsigned int am_spool_pending(am_spool_t *s);
+
+int am_pdp_init(int id);
+int am_pdp_shutdown();
+int am_pdp_store(const char *dir, const char *key, const char *url, const char *content_type, int ttl,
+        ssize_t(*read_f)(void *, char *, size_t), void *arg, size_t max_size, size_t *data_sz);
+int am_pdp_get(const char *dir, const char *key, char **url, char **content_type,
+        char **file, uint64_t *offset, size_t *size);
+int am_pdp_remove(const char *dir, const char *key);
+int am_pdp_compact(time_t now);
+
 int am_audit_init(int id);
 int am_audit_shutdown();
 int am_audit_processor_init();
 void am_audit_processor_shutdown();
 int am_audit_register_instance(am_config_t *conf);
+int am_audit_spool_upload(unsigned long instance_id, const char *openam, am_net_options_t *options, am_spool_t *spool);
 int am_add_remote_audit_entry(unsigned long instance_id, const char *agent_token,
         const char *agent_token_server_id, const char *file_name,
         const char *user_token, const char *format, ...);
@@ -279,6 +343,68 @@ int am_add_remote_audit_entry(unsigned long instance_id, const char *agent_token
 int am_url_validator_init();
 void am_url_validator_shutdown();
 
+int am_notification_init();
+void am_notification_shutdown();
+int am_notification_dispatch(struct notification_worker_data *r);
+
+#define AM_STATS_STAGES 8 /* number of am_process_request states */
+
+typedef struct {
+    const char *name;
+    uint64_t count;
+    uint64_t mean;
+    uint64_t p50;
+    uint64_t p99;
+    uint64_t p999;
+    uint64_t max;
+} am_latency_stage_t;
+
+typedef enum {
+    AM_STATS_CACHE_HITS = 0,
+    AM_STATS_CACHE_MISSES,
+    AM_STATS_CACHE_ADMITTED,
+    AM_STATS_CACHE_REJECTED,
+    AM_STATS_CACHE_EVICTED,
+    AM_STATS_SHM_LOCKS,
+    AM_STATS_SHM_LOCKS_CONTENDED,
+    AM_STATS_SHM_ALLOCS,
+    AM_STATS_SHM_ALLOC_FAILURES,
+    AM_STATS_SHM_ALLOC_FRAGMENTED, /* no free chunk large enough although the pool had enough free space */
+    AM_STATS_SHM_FREES,
+    AM_STATS_SHM_EXTENDS,
+    AM_STATS_LOG_MESSAGES,
+    AM_STATS_LOG_DROPPED,
+    AM_STATS_LOG_WAITS,
+    AM_STATS_OPENAM_REQUESTS,
+    AM_STATS_OPENAM_ERRORS,
+    AM_STATS_REQUESTS,
+    AM_STATS_REQUESTS_REDIRECTED,
+    AM_STATS_REQUESTS_FORBIDDEN,
+    AM_STATS_COUNTERS
+} am_stats_counter_t;
+
+typedef enum {
+    AM_STATS_SHM_LOCK_WAIT = 0, /* usec, contended locks only */
+    AM_STATS_LOG_QUEUE_DEPTH, /* bytes */
+    AM_STATS_OPENAM_LATENCY, /* usec */
+    AM_STATS_HISTOGRAMS
+} am_stats_histogram_t;
+
+#define AM_STATS_FORMAT_TEXT 0
+#define AM_STATS_FORMAT_JSON 1
+#define AM_STATS_FORMAT_PROMETHEUS 2
+
+int am_stats_init(int id);
+int am_stats_shutdown();
+void am_latency_record(const uint64_t *usec, unsigned int stages);
+int am_latency_get(am_latency_stage_t *out, int size);
+char *am_latency_report(int json);
+void am_stats_add(am_stats_counter_t counter, uint64_t value);
+void am_stats_record(am_stats_histogram_t histogram, uint64_t value);
+uint64_t am_stats_get(am_stats_counter_t counter);
+int am_stats_histogram_get(am_stats_histogram_t histogram, am_latency_stage_t *out);
+char *am_stats_report(int format);
+
 int am_scope_to_num(const char *scope);
 const char *am_scope_to_str(int scope);
 
@@ -301,6 +427,12 @@ void am_agent_instance_init_release(int id, char unlink);
 void am_agent_init_set_value(unsigned long instance_id, char lock, int val);
 
 am_config_t *am_parse_config_xml(unsigned long instance_id, const char *xml, size_t xml_sz, char log_enable);
+void *am_config_image_create(const am_config_t *boot, const am_config_t *remote, size_t *size);
+am_config_t *am_config_image_load(const void *data, size_t size);
+uint64_t am_config_image_hash(const void *data);
+int am_config_image_diff(const void *a, const void *b, size_t *changed, int size);
+int am_config_refresh(unsigned long instance_id, const char *token);
+void am_config_refresh_byname(const char *name);
 
 int am_get_pdp_cache_entry(am_request_t *r, const char *key, char **data, size_t *data_sz, char **content_type);
 int am_add_pdp_cache_entry(am_request_t *r, const char *key, const char *url, const char *file, const char *content_type);
@@ -313,6 +445,21 @@ int am_get_cache_entry(unsigned long instance_id, int valid, const char *key);
 int am_add_cache_entry(unsigned long instance_id, const char *key);
 
 int am_remove_cache_entry(unsigned long instance_id, const char *key);
+int am_remove_cache_entries(unsigned long instance_id, const char **keys, int count);
+int am_remove_instance_cache_entries(unsigned long instance_id);
+
+typedef struct {
+    unsigned long instance_id;
+    uint64_t size; /* bytes of cache memory in use */
+    uint64_t quota; /* bytes, 0 - no limit */
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t admitted;
+    uint64_t rejected; /* session entries not cached (over quota) */
+    uint64_t evicted;
+} am_cache_stats_t;
+
+int am_cache_stats(am_cache_stats_t *out, int size);
 
 void* mem2cpy(void* dest, const void* source1, size_t size1, const void* source2, size_t size2);
 void* mem3cpy(void* dest, const void* source1, size_t size1, const void* source2, size_t size2, const void* source3, size_t size3);
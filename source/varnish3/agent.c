@@ -78,6 +78,7 @@ char *url_decode(const char *str);
 
 void vmod_init(struct sess *ctx, struct vmod_priv *priv, const char *conf) {
     am_config_t *boot;
+    am_log_options_t log_options;
     struct agent_instance *settings = (struct agent_instance *) priv->priv;
     pthread_mutex_lock(&init_mutex);
     do {
@@ -123,8 +124,9 @@ void vmod_init(struct sess *ctx, struct vmod_priv *priv, const char *conf) {
             break;
         }
 
+        am_config_log_options(boot, &log_options);
         am_log_register_instance(settings->instance_id, boot->debug_file, boot->debug_level, boot->debug,
-                boot->audit_file, boot->audit_level, boot->audit, conf);
+                boot->audit_file, boot->audit_level, boot->audit, &log_options, conf);
 
         am_config_free(&boot);
 
@@ -597,6 +599,12 @@ unsigned int vmod_authenticate(struct sess *ctx, struct vmod_priv *priv) {
         return result;
     }
 
+    /* static asset pre-filter: not enforced requests skip the rest of the processing */
+    if (am_prefilter_request(settings->instance_id, am_method_str_to_num(http_GetReq(ctx->http)), VRT_r_req_url(ctx))) {
+        req->status = am_status_value(AM_SUCCESS);
+        return 1;
+    }
+
     status = am_get_agent_config(settings->instance_id, settings->conf_file, &boot);
     if (boot == NULL || status != AM_SUCCESS) {
         WSP(ctx, SLT_VCL_Log, "am_vmod failed to get agent configuration instance, configuration: %s, error: %s",
@@ -615,11 +623,14 @@ unsigned int vmod_authenticate(struct sess *ctx, struct vmod_priv *priv) {
     am_request.content_type = get_request_header(ctx, HTTP_HDR_CONTENT_TYPE);
     am_request.cookies = get_request_header(ctx, HTTP_HDR_COOKIE);
 
+    if (client_addr != NULL) {
+        am_request.peer_ip = VRT_IP_string(ctx, client_addr);
+    }
     if (ISVALID(am_request.conf->client_ip_header)) {
         am_request.client_ip = (char *) get_request_header(ctx, am_request.conf->client_ip_header);
     }
-    if (!ISVALID(am_request.client_ip) && client_addr != NULL) {
-        am_request.client_ip = (char *) VRT_IP_string(ctx, client_addr);
+    if (!ISVALID(am_request.client_ip)) {
+        am_request.client_ip = (char *) am_request.peer_ip;
     }
     if (ISVALID(am_request.conf->client_hostname_header)) {
         am_request.client_host = (char *) get_request_header(ctx, am_request.conf->client_hostname_header);
@@ -18,20 +18,55 @@
 #include "am.h"
 #include "utility.h"
 #include "list.h"
+#include "thread.h"
 
-void notification_worker(void *arg) {
+/*
+ * Notification messages are queued and processed in batches, by one worker at a time.
+ * Session tokens of all destroyed sessions in a batch are de-duplicated and removed from
+ * the cache together (am_remove_cache_entries) and the policy change cache update is done
+ * once per agent instance and batch.
+ */
+
+struct notification_batch {
+    const char **tokens;
+    int tokens_sz;
+    unsigned long policy_change[AM_MAX_INSTANCES];
+    int policy_change_sz;
+};
+
+static am_mutex_t notification_lock;
+static int notification_init = AM_FALSE;
+static int notification_running = AM_FALSE;
+static struct notification_worker_data *notification_head = NULL;
+static struct notification_worker_data *notification_tail = NULL;
+
+static void notification_policy_change(unsigned long instance_id, struct notification_batch *b) {
+    static const char *thisfunc = "notification_worker():";
+    am_request_t req;
+    int i, rv;
+
+    for (i = 0; i < b->policy_change_sz; i++) {
+        if (b->policy_change[i] == instance_id) return;
+    }
+    if (b->policy_change_sz < AM_MAX_INSTANCES) {
+        b->policy_change[b->policy_change_sz++] = instance_id;
+    }
+    memset(&req, 0, sizeof (am_request_t));
+    req.instance_id = instance_id;
+    rv = am_add_policy_cache_entry(&req, AM_POLICY_CHANGE_KEY, 0);
+    AM_LOG_DEBUG(instance_id, "%s policy change cache update status: %s",
+            thisfunc, am_strerror(rv));
+}
+
+static void notification_parse(struct notification_worker_data *r, struct notification_batch *b) {
     static const char *thisfunc = "notification_worker():";
-    struct notification_worker_data *r = (struct notification_worker_data *) arg;
     struct am_namevalue *e, *t, *session_list;
     char *token = NULL, destroyed = 0;
     am_bool_t policy_change_run = AM_FALSE;
     char *agentid = NULL;
 
-    if (r == NULL) return;
     if (r->post_data == NULL || r->post_data_sz == 0) {
         AM_LOG_WARNING(r->instance_id, "%s post data is not available", thisfunc);
-        am_free(r->post_data);
-        free(r);
         return;
     }
 
@@ -50,31 +85,148 @@ void notification_worker(void *arg) {
         }
         /* PolicyChangeNotification - ResourceName */
         if (!policy_change_run && strcmp(e->n, "ResourceName") == 0) {
-            am_request_t req;
-            int rv;
-            memset(&req, 0, sizeof (am_request_t));
-            req.instance_id = r->instance_id;
-            rv = am_add_policy_cache_entry(&req, AM_POLICY_CHANGE_KEY, 0);
-            AM_LOG_DEBUG(r->instance_id, "%s policy change cache update status: %s",
-                    thisfunc, am_strerror(rv));
+            notification_policy_change(r->instance_id, b);
             policy_change_run = AM_TRUE; /* one AM_POLICY_CHANGE_KEY update per PolicyChangeNotification is enough */
         }
     }
 
     if (ISVALID(token) && destroyed) {
-        am_remove_cache_entry(r->instance_id, token);
+        b->tokens[b->tokens_sz] = strdup(token);
+        if (b->tokens[b->tokens_sz] != NULL) {
+            b->tokens_sz++;
+        }
     }
 
     if (ISVALID(agentid)) {
-        AM_LOG_DEBUG(r->instance_id, "%s agent configuration entry removed (%s)",
+        AM_LOG_DEBUG(r->instance_id, "%s agent configuration refresh requested (%s)",
                 thisfunc, agentid);
-        remove_agent_instance_byname(agentid);
+        am_config_refresh_byname(agentid);
     }
 
     delete_am_namevalue_list(&session_list);
+}
+
+/**
+ * Process (and release) a list of notification messages.
+ */
+static void notification_process(struct notification_worker_data *list) {
+    static const char *thisfunc = "notification_worker():";
+    struct notification_batch b;
+    struct notification_worker_data *r;
+    unsigned long instance_id = list != NULL ? list->instance_id : 0;
+    int i, n = 0, removed, batch = AM_NOTIFICATION_BATCH;
+    const char *token[1];
+
+    memset(&b, 0, sizeof (struct notification_batch));
+    b.tokens = (const char **) malloc(AM_NOTIFICATION_BATCH * sizeof (char *));
+    if (b.tokens == NULL) {
+        /* no memory for a batch - process the messages one at a time */
+        AM_LOG_WARNING(instance_id, "%s memory allocation error, notifications are not batched", thisfunc);
+        b.tokens = token;
+        batch = 1;
+    }
 
-    am_free(r->post_data);
-    free(r);
+    while (list != NULL) {
+        r = list;
+        list = r->next;
+        notification_parse(r, &b);
+        am_free(r->post_data);
+        free(r);
+
+        if (++n == batch || list == NULL) {
+            removed = am_remove_cache_entries(instance_id, b.tokens, b.tokens_sz);
+            AM_LOG_DEBUG(instance_id, "%s %d notifications processed, %d sessions removed from the cache",
+                    thisfunc, n, removed);
+            for (i = 0; i < b.tokens_sz; i++) {
+                am_free((void *) b.tokens[i]);
+            }
+            b.tokens_sz = 0;
+            b.policy_change_sz = 0;
+            n = 0;
+        }
+    }
+    if (b.tokens != token) {
+        free((void *) b.tokens);
+    }
+}
+
+static void notification_worker(void *arg) {
+    struct notification_worker_data *list;
+
+    for (;;) {
+        AM_MUTEX_LOCK(&notification_lock);
+        list = notification_head;
+        notification_head = notification_tail = NULL;
+        if (list == NULL) {
+            notification_running = AM_FALSE;
+        }
+        AM_MUTEX_UNLOCK(&notification_lock);
+        if (list == NULL) break;
+        notification_process(list);
+    }
+}
+
+int am_notification_init() {
+    if (notification_init) return AM_SUCCESS;
+    AM_MUTEX_INIT(&notification_lock);
+    notification_head = notification_tail = NULL;
+    notification_running = AM_FALSE;
+    notification_init = AM_TRUE;
+    return AM_SUCCESS;
+}
+
+/**
+ * Release notification messages still waiting in the queue. Must be called after
+ * the worker pool shutdown.
+ */
+void am_notification_shutdown() {
+    struct notification_worker_data *r;
+    if (!notification_init) return;
+    AM_MUTEX_LOCK(&notification_lock);
+    while ((r = notification_head) != NULL) {
+        notification_head = r->next;
+        am_free(r->post_data);
+        free(r);
+    }
+    notification_tail = NULL;
+    notification_running = AM_FALSE;
+    AM_MUTEX_UNLOCK(&notification_lock);
+    AM_MUTEX_DESTROY(&notification_lock);
+    notification_init = AM_FALSE;
+}
+
+/**
+ * Queue a notification message for processing; the notification worker takes over the
+ * ownership of 'r'.
+ */
+int am_notification_dispatch(struct notification_worker_data *r) {
+    int schedule;
+
+    if (r == NULL) return AM_EINVAL;
+    r->next = NULL;
+
+    if (!notification_init) {
+        /* no queue - process it right away */
+        notification_process(r);
+        return AM_SUCCESS;
+    }
+
+    AM_MUTEX_LOCK(&notification_lock);
+    if (notification_tail == NULL) {
+        notification_head = r;
+    } else {
+        notification_tail->next = r;
+    }
+    notification_tail = r;
+    schedule = !notification_running;
+    notification_running = AM_TRUE;
+    AM_MUTEX_UNLOCK(&notification_lock);
+
+    if (schedule && am_worker_dispatch_class(AM_WORKER_HIGH, notification_worker, NULL) != AM_SUCCESS) {
+        /* worker pool is not available - process the queue in this thread */
+        notification_worker(NULL);
+    }
+    return AM_SUCCESS;
 }
 
 void session_logout_worker(void *arg) {
@@ -0,0 +1,280 @@
+/**
+ * The contents of this file are subject to the terms of the Common Development and
+ * Distribution License (the License). You may not use this file except in compliance with the
+ * License.
+ *
+ * You can obtain a copy of the License at legal/CDDLv1.0.txt. See the License for the
+ * specific language governing permission and limitations under the License.
+ *
+ * When distributing Covered Software, include this CDDL Header Notice in each file and include
+ * the License file at legal/CDDLv1.0.txt. If applicable, add the following below the CDDL
+ * Header, with the fields enclosed by brackets [] replaced by your own identifying
+ * information: "Portions copyright [year] [name of copyright owner]".
+ *
+ * Copyright 2015 ForgeRock AS.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <setjmp.h>
+
+#include "platform.h"
+#include "am.h"
+#include "utility.h"
+#include "net_client.h"
+#include "thread.h"
+#include "cmocka.h"
+
+#ifdef _WIN32
+#define AUDIT_TEST_SPOOL "c:\\windows\\temp\\test_audit_spool"
+#define close_socket closesocket
+#else
+#define AUDIT_TEST_SPOOL "/tmp/test_audit_spool"
+#define close_socket close
+#endif
+
+#define AUDIT_TEST_SEGMENT_SIZE 4096
+#define AUDIT_TEST_SEGMENTS 4
+#define AUDIT_TEST_INSTANCE 7
+
+void am_net_init_ssl_reset();
+unsigned int am_test_get_audit_generation(unsigned long instance_id);
+
+/**
+ * Local stand-in for the remote logging service: answers the first 'fail' requests with
+ * an error and counts the records in all accepted requests.
+ */
+struct stub_logging_service {
+    int sock;
+    int port;
+    volatile int fail;
+    volatile int stop;
+    volatile int requests;
+    volatile int records;
+};
+
+static int stub_listen(struct stub_logging_service *svc) {
+    struct sockaddr_in sa;
+    socklen_t sa_len = sizeof (sa);
+
+    svc->sock = (int) socket(AF_INET, SOCK_STREAM, 0);
+    if (svc->sock == -1) return -1;
+    memset(&sa, 0, sizeof (sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sa.sin_port = 0;
+    if (bind(svc->sock, (struct sockaddr *) &sa, sizeof (sa)) != 0 ||
+            getsockname(svc->sock, (struct sockaddr *) &sa, &sa_len) != 0 ||
+            listen(svc->sock, 8) != 0) {
+        close_socket(svc->sock);
+        return -1;
+    }
+    svc->port = ntohs(sa.sin_port);
+    return 0;
+}
+
+static void stub_serve(struct stub_logging_service *svc, int client) {
+    static const char *ok = "HTTP/1.1 200 OK\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    static const char *error = "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    char *request = NULL, *body, *p;
+    size_t size = 0, content_length = 0;
+    int rd, records = 0;
+
+    for (;;) {
+        char *tmp = realloc(request, size + 4097);
+        if (tmp == NULL) break;
+        request = tmp;
+        rd = recv(client, request + size, 4096, 0);
+        if (rd <= 0) break;
+        size += rd;
+        request[size] = '\0';
+        body = strstr(request, "\r\n\r\n");
+        if (body != NULL) {
+            p = stristr(request, "Content-Length:");
+            content_length = p != NULL ? strtoul(p + 15, NULL, 10) : 0;
+            if (size - (body + 4 - request) >= content_length) break;
+        }
+    }
+
+    if (request != NULL) {
+        for (p = request; (p = strstr(p, "<logRecWrite ")) != NULL; p++) {
+            records++;
+        }
+    }
+    svc->requests++;
+    if (svc->fail > 0) {
+        svc->fail--;
+        send(client, error, (int) strlen(error), 0);
+    } else {
+        svc->records += records;
+        send(client, ok, (int) strlen(ok), 0);
+    }
+    am_free(request);
+}
+
+static void *stub_logging_service_run(void *arg) {
+    struct stub_logging_service *svc = (struct stub_logging_service *) arg;
+    while (!svc->stop) {
+        fd_set rfds;
+        struct timeval tv;
+        int client;
+
+        FD_ZERO(&rfds);
+        FD_SET(svc->sock, &rfds);
+        tv.tv_sec = 0;
+        tv.tv_usec = 100000;
+        if (select(svc->sock + 1, &rfds, NULL, NULL, &tv) <= 0) continue;
+        client = (int) accept(svc->sock, NULL, NULL);
+        if (client == -1) continue;
+        stub_serve(svc, client);
+        close_socket(client);
+    }
+    return NULL;
+}
+
+static void delete_spool_files() {
+    char name[AM_PATH_SIZE];
+    int i;
+    unlink(AUDIT_TEST_SPOOL ".idx");
+    for (i = 0; i < 64; i++) {
+        snprintf(name, sizeof (name), AUDIT_TEST_SPOOL ".%d", i);
+        unlink(name);
+    }
+}
+
+static int spool_test_records(am_spool_t *spool, int first, int count) {
+    char record[256];
+    int i, size;
+    for (i = first; i < first + count; i++) {
+        /* spooled record: server-id, then logRecWrite request without its prefix */
+        size = snprintf(record, sizeof (record), "01%c\"><log logName=\"test\" sid=\"x\"></log>"
+                "<logRecord><recMsg>%d</recMsg></logRecord></logRecWrite>]]></Request>", '\0', i);
+        if (am_spool_append(spool, record, size + 1) != AM_SUCCESS) {
+            return -(i - first);
+        }
+    }
+    return count;
+}
+
+void test_audit_spool_outage(void **state) {
+    struct stub_logging_service svc;
+    am_thread_t thread;
+    am_spool_t *spool;
+    char openam[64];
+    int n, count;
+
+    delete_spool_files();
+    am_net_init();
+
+    memset(&svc, 0, sizeof (svc));
+    assert_int_equal(stub_listen(&svc), 0);
+    snprintf(openam, sizeof (openam), "http://127.0.0.1:%d/am", svc.port);
+
+    spool = am_spool_open(AUDIT_TEST_SPOOL, AUDIT_TEST_SEGMENT_SIZE, AUDIT_TEST_SEGMENTS);
+    assert_non_null(spool);
+    assert_int_equal(spool_test_records(spool, 0, 60), 60);
+    assert_int_equal(am_spool_pending(spool), 60);
+
+    /* outage: nothing is accepting connections */
+    close_socket(svc.sock);
+    assert_int_not_equal(am_audit_spool_upload(0, openam, NULL, spool), AM_SUCCESS);
+    assert_int_equal(am_spool_pending(spool), 60);
+
+    /* restart: records are replayed from the segment files */
+    am_spool_close(spool);
+    spool = am_spool_open(AUDIT_TEST_SPOOL, AUDIT_TEST_SEGMENT_SIZE, AUDIT_TEST_SEGMENTS);
+    assert_non_null(spool);
+    assert_int_equal(am_spool_pending(spool), 60);
+
+    /* service is back, but fails the first request - nothing must be acknowledged */
+    assert_int_equal(stub_listen(&svc), 0);
+    snprintf(openam, sizeof (openam), "http://127.0.0.1:%d/am", svc.port);
+    svc.fail = 1;
+    AM_THREAD_CREATE(thread, stub_logging_service_run, &svc);
+
+    assert_int_not_equal(am_audit_spool_upload(0, openam, NULL, spool), AM_SUCCESS);
+    assert_int_equal(am_spool_pending(spool), 60);
+    assert_int_equal(svc.records, 0);
+
+    /* all records are uploaded in batches and the spool is truncated */
+    assert_int_equal(am_audit_spool_upload(0, openam, NULL, spool), AM_SUCCESS);
+    assert_int_equal(am_spool_pending(spool), 0);
+    assert_int_equal(svc.records, 60);
+    assert_true(svc.requests >= 4);
+    assert_int_equal(file_exists(AUDIT_TEST_SPOOL ".0"), AM_FALSE);
+
+    /* backpressure: a full spool refuses new records instead of growing */
+    count = spool_test_records(spool, 0, 1000);
+    assert_true(count < 0);
+    count = -count;
+    assert_int_equal(am_spool_pending(spool), count);
+    assert_int_equal(am_audit_spool_upload(0, openam, NULL, spool), AM_SUCCESS);
+    assert_int_equal(am_spool_pending(spool), 0);
+    assert_int_equal(svc.records, 60 + count);
+    n = spool_test_records(spool, 0, 10);
+    assert_int_equal(n, 10);
+
+    am_spool_close(spool);
+    spool = am_spool_open(AUDIT_TEST_SPOOL, AUDIT_TEST_SEGMENT_SIZE, AUDIT_TEST_SEGMENTS);
+    assert_non_null(spool);
+    assert_int_equal(am_spool_pending(spool), 10);
+    am_spool_close(spool);
+
+    svc.stop = 1;
+    AM_THREAD_JOIN(thread);
+    close_socket(svc.sock);
+
+    am_net_shutdown();
+    am_net_init_ssl_reset();
+    delete_spool_files();
+}
+
+static void audit_log_callback(void *arg, char *name, int error) {
+}
+
+void test_audit_register_instance(void **state) {
+    char *naming_url[] = {"http://openam.example.com:8080/openam", "http://openam2.example.com:8080/openam"};
+    am_config_t config;
+    unsigned int generation;
+
+    am_audit_shutdown();
+    am_remove_shm_and_locks(AUDIT_TEST_INSTANCE, audit_log_callback, NULL);
+    assert_int_equal(am_audit_init(AUDIT_TEST_INSTANCE), AM_SUCCESS);
+
+    memset(&config, 0, sizeof (config));
+    config.instance_id = 1;
+    config.config = "/opt/agent/config/agent.conf";
+    config.naming_url = naming_url;
+    config.naming_url_sz = 1;
+    config.audit_file = "/opt/agent/log/audit.log";
+    config.audit_remote_interval = 5;
+
+    assert_int_equal(am_audit_register_instance(&config), AM_SUCCESS);
+    generation = am_test_get_audit_generation(config.instance_id);
+    assert_int_not_equal(generation, 0);
+
+    /* every configuration fetch registers the instance again - nothing is reloaded unless a value changes */
+    assert_int_equal(am_audit_register_instance(&config), AM_SUCCESS);
+    assert_int_equal(am_audit_register_instance(&config), AM_SUCCESS);
+    assert_int_equal(am_test_get_audit_generation(config.instance_id), generation);
+
+    config.audit_remote_interval = 10;
+    assert_int_equal(am_audit_register_instance(&config), AM_SUCCESS);
+    assert_int_equal(am_test_get_audit_generation(config.instance_id), ++generation);
+
+    config.audit_file = "/var/log/agent/audit.log";
+    assert_int_equal(am_audit_register_instance(&config), AM_SUCCESS);
+    assert_int_equal(am_test_get_audit_generation(config.instance_id), ++generation);
+
+    config.naming_url = naming_url + 1;
+    assert_int_equal(am_audit_register_instance(&config), AM_SUCCESS);
+    assert_int_equal(am_test_get_audit_generation(config.instance_id), ++generation);
+
+    config.config = "/opt/agent/config/agent2.conf";
+    assert_int_equal(am_audit_register_instance(&config), AM_SUCCESS);
+    assert_int_equal(am_audit_register_instance(&config), AM_SUCCESS);
+    assert_int_equal(am_test_get_audit_generation(config.instance_id), ++generation);
+
+    am_audit_shutdown();
+    am_remove_shm_and_locks(AUDIT_TEST_INSTANCE, audit_log_callback, NULL);
+}
@@ -26,6 +26,8 @@
 #include "log.h"
 #include "cmocka.h"
 
+const char *am_test_get_config_property(int index);
+
 void test_config_url_maps(void **state) {
     int i;
     am_config_t * conf;
@@ -78,6 +80,50 @@ void test_config_url_maps(void **state) {
     unlink(path);
 }
 
+/**
+ * Ensure that the org.forgerock.agents.config.log.* bootstrap properties end up in the
+ * instance log settings.
+ */
+void test_config_log_options(void **state) {
+    am_config_t *conf;
+    am_log_options_t options;
+    char buffer[] = "config-tests-XXXXXXX";
+    char *path = mktemp(buffer);
+    char *configs =
+    "com.sun.identity.agents.config.repository.location = local\n"
+    "org.forgerock.agents.config.log.sync = 5\n"
+    "org.forgerock.agents.config.log.rate = 100\n"
+    "org.forgerock.agents.config.log.overflow.drop = true\n"
+    "org.forgerock.agents.config.log.format = json\n"
+    "org.forgerock.agents.config.log.segment.size = 1048576\n"
+    "org.forgerock.agents.config.log.compress.disable = on\n"
+    "org.forgerock.agents.config.log.retain.files = 7\n"
+    "org.forgerock.agents.config.log.retain.size = 8388608\n"
+    "";
+
+    write_file(path, configs, strlen(configs));
+    conf = am_get_config_file(1, path);
+    assert_non_null(conf);
+    am_config_log_options(conf, &options);
+    assert_int_equal(options.sync, 5);
+    assert_int_equal(options.rate, 100);
+    assert_int_equal(options.overflow_drop, AM_TRUE);
+    assert_int_equal(options.json, AM_TRUE);
+    assert_int_equal(options.deferred, AM_TRUE); /* implied by json */
+    assert_int_equal(options.segment_size, 1048576);
+    assert_int_equal(options.compress_disable, AM_TRUE);
+    assert_int_equal(options.retain_files, 7);
+    assert_int_equal(options.retain_size, 8388608);
+    am_config_free(&conf);
+
+    /* defaults */
+    am_config_log_options(NULL, &options);
+    assert_int_equal(options.json, AM_FALSE);
+    assert_int_equal(options.deferred, AM_FALSE);
+    assert_int_equal(options.compress_disable, AM_FALSE);
+    unlink(path);
+}
+
 void test_config_map_value_reorder(void **state) {
     am_config_t conf;
 #define MAP_SIZE 3
@@ -109,3 +155,355 @@ void test_config_map_value_reorder(void **state) {
     free(map[2].value);
     free(map);
 }
+
+#define CONFIG_BENCH_LINES 5000
+#define CONFIG_BENCH_RUNS 10
+
+void test_config_startup_benchmark(void **state) {
+    char buffer[] = "config-bench-XXXXXXX";
+    char *path = mktemp(buffer);
+    size_t size = CONFIG_BENCH_LINES * 128, len = 0;
+    char *configs = malloc(size);
+    am_config_t *conf;
+    am_timer_t tm = {0, 0, 0, 0};
+    int i, urls = 0, attrs = 0;
+
+    assert_non_null(configs);
+
+    /* local-only options are not read until the configuration is known to be local */
+    len += snprintf(configs + len, size - len,
+            "com.sun.identity.agents.config.cookie.name = ignored\n"
+            "com.sun.identity.agents.config.repository.location = local\n"
+            "com.sun.identity.agents.config.naming.url = http://a.b.c:8080/am http://d.e.f:8080/am\n"
+            "com.sun.identity.agents.config.cookie.name = iPlanetDirectoryPro\n"
+            "com.sun.identity.agents.config.notenforced.url[] = http://a.b.c/no-key\n"
+            "com.sun.identity.agents.config.notenforced.url.unknown = http://a.b.c/unknown\n"
+            "org.forgerock.agents.config.notenforced.ext.regex.enable = true\n");
+    for (i = 7; i < CONFIG_BENCH_LINES; i++) {
+        if (i % 10 == 0) {
+            len += snprintf(configs + len, size - len, "# comment line %d\n", i);
+        } else if (i % 2 == 0) {
+            len += snprintf(configs + len, size - len,
+                    "com.sun.identity.agents.config.notenforced.url[%d] = http://a.b.c/path/%d/*\n", urls, i);
+            urls++;
+        } else {
+            len += snprintf(configs + len, size - len,
+                    "com.sun.identity.agents.config.profile.attribute.mapping[attr%d] = HTTP_ATTR_%d\n", attrs, i);
+            attrs++;
+        }
+    }
+    write_file(path, configs, len);
+
+    am_timer_start(&tm);
+    for (i = 0; i < CONFIG_BENCH_RUNS; i++) {
+        conf = am_get_config_file(1, path);
+        assert_non_null(conf);
+        if (i < CONFIG_BENCH_RUNS - 1) {
+            am_config_free(&conf);
+        }
+    }
+    am_timer_stop(&tm);
+    printf("am_get_config_file: %d lines, %.3f ms per file\n", CONFIG_BENCH_LINES,
+            am_timer_elapsed(&tm) * 1000.0 / CONFIG_BENCH_RUNS);
+
+    assert_int_equal(conf->local, AM_TRUE);
+    assert_string_equal(conf->cookie_name, "iPlanetDirectoryPro");
+    assert_int_equal(conf->naming_url_sz, 2);
+    assert_string_equal(conf->naming_url[1], "http://d.e.f:8080/am");
+    assert_int_equal(conf->not_enforced_ext_regex_enable, AM_TRUE);
+    assert_int_equal(conf->not_enforced_map_sz, urls);
+    assert_int_equal(conf->profile_attr_map_sz, attrs);
+    for (i = 0; i < attrs; i++) {
+        if (strcmp(conf->profile_attr_map[i].name, "attr7") == 0) {
+            assert_string_equal(conf->profile_attr_map[i].value, "HTTP_ATTR_21");
+            break;
+        }
+    }
+    assert_int_not_equal(i, attrs);
+
+    am_config_free(&conf);
+    free(configs);
+    unlink(path);
+}
+
+void test_config_image_roundtrip(void **state) {
+    char buffer[] = "config-image-XXXXXXX";
+    char *path = mktemp(buffer);
+    am_config_t *conf, *loaded;
+    void *image, *other;
+    size_t size, other_size;
+    char *corrupt;
+
+    char *configs =
+            "com.sun.identity.agents.config.repository.location = local\n"
+            "com.sun.identity.agents.config.naming.url = http://a.b.c:8080/am http://d.e.f:8080/am\n"
+            "com.sun.identity.agents.config.cookie.name = iPlanetDirectoryPro\n"
+            "com.sun.identity.agents.config.postcache.entry.lifetime = 5\n"
+            "com.forgerock.agents.ext.url.validation.default.url.set = 1,0\n"
+            "com.sun.identity.agents.config.notenforced.url[0] = http://a.b.c/path\n"
+            "com.sun.identity.agents.config.notenforced.url[1] = http://a.b.c/other\n"
+            "com.sun.identity.agents.config.profile.attribute.mapping[cn] = CUSTOM-Common-Name\n"
+            "com.sun.identity.agents.config.local.log.rotate = true\n";
+
+    write_file(path, configs, strlen(configs));
+    conf = am_get_config_file(1, path);
+    assert_non_null(conf);
+
+    image = am_config_image_create(conf, conf, &size);
+    assert_non_null(image);
+    assert_true(size > 0);
+    assert_int_not_equal(am_config_image_hash(image), 0);
+
+    loaded = am_config_image_load(image, size);
+    assert_non_null(loaded);
+    assert_non_null(loaded->image);
+    assert_int_equal(loaded->local, AM_TRUE);
+    assert_int_equal(loaded->pdp_cache_valid, conf->pdp_cache_valid);
+    assert_string_equal(loaded->cookie_name, "iPlanetDirectoryPro");
+    assert_int_equal(loaded->naming_url_sz, 2);
+    assert_string_equal(loaded->naming_url[0], "http://a.b.c:8080/am");
+    assert_string_equal(loaded->naming_url[1], "http://d.e.f:8080/am");
+    assert_int_equal(loaded->valid_default_url_sz, 2);
+    assert_int_equal(loaded->valid_default_url[0], 1);
+    assert_int_equal(loaded->valid_default_url[1], 0);
+    assert_int_equal(loaded->not_enforced_map_sz, 2);
+    assert_string_equal(loaded->not_enforced_map[1].value, conf->not_enforced_map[1].value);
+    assert_int_equal(loaded->profile_attr_map_sz, 1);
+    assert_string_equal(loaded->profile_attr_map[0].name, "cn");
+    assert_string_equal(loaded->profile_attr_map[0].value, "CUSTOM-Common-Name");
+    assert_null(loaded->realm);
+
+    /* an image of the loaded configuration is the same */
+    other = am_config_image_create(loaded, loaded, &other_size);
+    assert_non_null(other);
+    assert_int_equal(other_size, size);
+    assert_true(am_config_image_hash(other) == am_config_image_hash(image));
+    assert_memory_equal(other, image, size);
+    free(other);
+
+    /* any change results in a different hash */
+    am_free(conf->cookie_name);
+    conf->cookie_name = strdup("iPlanetDirectoryPro2");
+    other = am_config_image_create(conf, conf, &other_size);
+    assert_non_null(other);
+    assert_true(am_config_image_hash(other) != am_config_image_hash(image));
+    free(other);
+
+    /* truncated or damaged images are refused */
+    assert_null(am_config_image_load(image, 16));
+    corrupt = malloc(size);
+    assert_non_null(corrupt);
+    memcpy(corrupt, image, size);
+    corrupt[0] = 'X';
+    assert_null(am_config_image_load(corrupt, size));
+    assert_int_equal(am_config_image_hash(corrupt), 0);
+    free(corrupt);
+
+    am_config_free(&loaded);
+    am_config_free(&conf);
+    free(image);
+    unlink(path);
+}
+
+void test_config_image_diff(void **state) {
+    char buffer[] = "config-image-XXXXXXX";
+    char *path = mktemp(buffer);
+    am_config_t *conf;
+    void *image, *other;
+    size_t size, other_size, changed[8];
+    int i, count, scope_changed = 0, cookie_changed = 0;
+
+    char *configs =
+            "com.sun.identity.agents.config.repository.location = local\n"
+            "com.sun.identity.agents.config.naming.url = http://a.b.c:8080/am\n"
+            "com.sun.identity.agents.config.cookie.name = iPlanetDirectoryPro\n"
+            "com.sun.identity.agents.config.notenforced.url[0] = http://a.b.c/path\n";
+
+    write_file(path, configs, strlen(configs));
+    conf = am_get_config_file(1, path);
+    assert_non_null(conf);
+
+    image = am_config_image_create(conf, conf, &size);
+    assert_non_null(image);
+
+    /* same configuration - no changes */
+    other = am_config_image_create(conf, conf, &other_size);
+    assert_non_null(other);
+    assert_int_equal(am_config_image_diff(image, other, changed, 8), 0);
+    free(other);
+
+    /* string and number value changes are reported with their field offsets */
+    am_free(conf->cookie_name);
+    conf->cookie_name = strdup("iPlanetDirectoryPro2");
+    conf->policy_scope_subtree = !conf->policy_scope_subtree;
+    other = am_config_image_create(conf, conf, &other_size);
+    assert_non_null(other);
+    count = am_config_image_diff(image, other, changed, 8);
+    assert_int_equal(count, 2);
+    for (i = 0; i < count; i++) {
+        if (changed[i] == offsetof(am_config_t, cookie_name)) cookie_changed++;
+        if (changed[i] == offsetof(am_config_t, policy_scope_subtree)) scope_changed++;
+    }
+    assert_int_equal(cookie_changed, 1);
+    assert_int_equal(scope_changed, 1);
+
+    /* map value change, with the same number of items */
+    am_free(conf->not_enforced_map[0].name);
+    conf->not_enforced_map[0].name = malloc(32);
+    assert_non_null(conf->not_enforced_map[0].name);
+    strcpy(conf->not_enforced_map[0].name, "1");
+    conf->not_enforced_map[0].value = conf->not_enforced_map[0].name + 2;
+    strcpy(conf->not_enforced_map[0].value, "http://a.b.c/");
+    free(image);
+    image = am_config_image_create(conf, conf, &size);
+    assert_non_null(image);
+    count = am_config_image_diff(other, image, changed, 8);
+    assert_int_equal(count, 1);
+    assert_true(changed[0] == offsetof(am_config_t, not_enforced_map));
+
+    /* invalid image */
+    assert_int_equal(am_config_image_diff(image, "invalid", changed, 8), -1);
+
+    am_config_free(&conf);
+    free(other);
+    free(image);
+    unlink(path);
+}
+
+/**
+ * Rewrite a configuration line the way the earlier (prefix matching) parser read it: every
+ * property name is tested against the start of the line and the list key, if any, runs from
+ * the first '[' up to the last character. Matches are written out as "name[key] = value".
+ */
+static size_t legacy_config_line(const char *line, char *out, size_t size) {
+    size_t len = 0;
+    const char *name;
+    int i;
+
+    for (i = 0; (name = am_test_get_config_property(i)) != NULL; i++) {
+        char *tmp, *tn, *token, *key, *key_val = NULL;
+        size_t name_sz = strlen(name), token_sz;
+
+        if (compare_property(line, name) != AM_SUCCESS) continue;
+
+        tmp = strdup(line);
+        assert_non_null(tmp);
+        tn = strchr(tmp, '=');
+        if (tn == NULL) {
+            free(tmp);
+            continue;
+        }
+        token = tn + 1;
+        *tn = '\0';
+        tn = tmp;
+        trim(tn, ' ');
+        trim(token, ' ');
+        if ((token_sz = strlen(tn)) != name_sz) {
+            key = strstr(tn, "[");
+            if (key != NULL && *(++key) != ']') {
+                tn[token_sz - 1] = '\0';
+                key_val = key;
+            }
+        }
+        if (key_val != NULL) {
+            len += snprintf(out + len, size - len, "%s[%s] = %s\n", name, key_val, token);
+        } else {
+            len += snprintf(out + len, size - len, "%s = %s\n", name, token);
+        }
+        free(tmp);
+    }
+    return len;
+}
+
+static void config_template_compare(const char *template_file, const char *location) {
+    char buffer[] = "config-template-XXXXXXX", legacy_buffer[] = "config-legacy-XXXXXXX";
+    char *path = mktemp(buffer), *legacy_path = mktemp(legacy_buffer);
+    size_t size = 64 * 1024, len = 0, legacy_len = 0, image_size, legacy_image_size;
+    char *configs = malloc(size), *legacy = malloc(size);
+    char *line = NULL;
+    size_t line_len = 0;
+    am_config_t *conf, *legacy_conf;
+    void *image, *legacy_image;
+    FILE *file;
+
+    assert_non_null(configs);
+    assert_non_null(legacy);
+    file = fopen(template_file, "r");
+    assert_non_null(file);
+
+    while (get_line(&line, &line_len, file) != -1) {
+        trim(line, '\n');
+        trim(line, '\r');
+        trim(line, ' ');
+        if (strcmp(line, "com.sun.identity.agents.config.repository.location = centralized") == 0) {
+            len += snprintf(configs + len, size - len, "com.sun.identity.agents.config.repository.location = %s\n",
+                    location);
+            legacy_len += snprintf(legacy + legacy_len, size - legacy_len,
+                    "com.sun.identity.agents.config.repository.location = %s\n", location);
+            continue;
+        }
+        len += snprintf(configs + len, size - len, "%s\n", line);
+        if (line[0] == '\0' || line[0] == '#') continue;
+        legacy_len += legacy_config_line(line, legacy + legacy_len, size - legacy_len);
+    }
+    fclose(file);
+    am_free(line);
+    assert_true(len < size && legacy_len < size);
+
+    write_file(path, configs, len);
+    write_file(legacy_path, legacy, legacy_len);
+    conf = am_get_config_file(1, path);
+    assert_non_null(conf);
+    legacy_conf = am_get_config_file(1, legacy_path);
+    assert_non_null(legacy_conf);
+    assert_int_equal(conf->local, strcmp(location, "local") == 0);
+    assert_true(conf->naming_url_sz > 0);
+
+    image = am_config_image_create(conf, conf, &image_size);
+    assert_non_null(image);
+    legacy_image = am_config_image_create(legacy_conf, legacy_conf, &legacy_image_size);
+    assert_non_null(legacy_image);
+    assert_int_equal(am_config_image_diff(image, legacy_image, NULL, 0), 0);
+
+    free(image);
+    free(legacy_image);
+    am_config_free(&conf);
+    am_config_free(&legacy_conf);
+    free(configs);
+    free(legacy);
+    unlink(path);
+    unlink(legacy_path);
+}
+
+/**
+ * Properties are looked up by their exact name now - reading the agent.conf template must
+ * give the same configuration as matching each line by property name prefix did.
+ */
+void test_config_template_legacy_match(void **state) {
+    const char *template_file = "../config/agent.conf.template";
+    char buffer[] = "config-key-XXXXXXX";
+    char *path = mktemp(buffer);
+    am_config_t *conf;
+
+    char *configs =
+            "com.sun.identity.agents.config.repository.location = local\n"
+            "com.sun.identity.agents.config.profile.attribute.mapping[cn = CUSTOM-Common-Name\n"
+            "com.sun.identity.agents.config.profile.attribute.mapping[mail] = CUSTOM-Email\n"
+            "com.sun.identity.agents.config.notenforced.url [0] = http://a.b.c/path\n";
+
+    if (access(template_file, R_OK) != 0) {
+        template_file = "config/agent.conf.template";
+    }
+    config_template_compare(template_file, "centralized");
+    config_template_compare(template_file, "local");
+
+    /* list key without the closing ']' is refused */
+    write_file(path, configs, strlen(configs));
+    conf = am_get_config_file(1, path);
+    assert_non_null(conf);
+    assert_int_equal(conf->profile_attr_map_sz, 1);
+    assert_string_equal(conf->profile_attr_map[0].name, "mail");
+    assert_int_equal(conf->not_enforced_map_sz, 1);
+    am_config_free(&conf);
+    unlink(path);
+}
@@ -502,3 +502,117 @@ void test_handle_exits_with_access_denied(void **state) {
     cookie_table_dump("headers out", &ctx.out);
     cookie_table_dump("error headers out", &ctx.err_out);
 }
+
+#define EXITS_PDP_INSTANCE 6
+
+static char * replayed_post_data = NULL;
+static size_t replayed_post_data_sz = 0;
+
+static am_status_t set_post_data(am_request_t * rq)
+{
+    am_free(replayed_post_data);
+    replayed_post_data = malloc(rq->post_data_sz + 1);
+    if (replayed_post_data == NULL)
+        return AM_ENOMEM;
+    memcpy(replayed_post_data, rq->post_data, rq->post_data_sz);
+    replayed_post_data [rq->post_data_sz] = 0;
+    replayed_post_data_sz = rq->post_data_sz;
+    return AM_SUCCESS;
+}
+
+static void pdp_log_callback(void * arg, char * name, int error)
+{
+}
+
+static void replay_post_data(am_request_t * request, const char * key, const char * expected)
+{
+    am_state_func_t const * func_array = NULL;
+    int array_len = 0;
+    am_state_func_t exit_f;
+    
+    am_test_get_state_funcs(&func_array, &array_len);
+    exit_f = func_array [7];
+    
+    snprintf(request->url.query, sizeof(request->url.query), "?%s", key);
+    request->status = AM_SUCCESS;
+    request->method = AM_REQUEST_GET;
+    replayed_post_data_sz = 0;
+    
+    assert_int_equal(exit_f(request), AM_OK);
+    assert_int_equal(request->method, AM_REQUEST_POST);
+    assert_int_equal(replayed_post_data_sz, strlen(expected));
+    assert_string_equal(replayed_post_data, expected);
+    
+    am_free(request->post_data);
+    request->post_data = NULL;
+}
+
+/**
+ * Post data files stored by an earlier agent version are base64 encoded, files without
+ * the ".raw" suffix are decoded when replayed.
+ */
+void test_handle_exits_pdp_legacy_file(void **state) {
+    const char * post = "a=b&c=d%20e";
+    char dir_template [] = "/tmp/am_pdp_exits_XXXXXX";
+    char * dir, * file = NULL, * post_enc;
+    size_t post_enc_sz = strlen(post);
+    
+    struct cookie_ctx ctx =
+    {
+        .in = { .c = 0 }, .out = { .c = 0 }
+    };
+    
+    am_config_t config =
+    {
+        .instance_id                    = EXITS_PDP_INSTANCE,
+        .pdp_cache_valid                = 60,
+    };
+    
+    am_request_t request =
+    {
+        .instance_id                    = EXITS_PDP_INSTANCE,
+        .conf                           = &config,
+        .ctx                            = &ctx,
+        .is_dummypost_url               = AM_TRUE,
+        .content_type                   = "application/x-www-form-urlencoded",
+        .am_set_post_data_f             = set_post_data,
+        .am_set_custom_response_f       = set_custom_response,
+    };
+    
+    am_pdp_shutdown();
+    am_cache_destroy();
+    am_remove_shm_and_locks(EXITS_PDP_INSTANCE, pdp_log_callback, NULL);
+    assert_int_equal(am_cache_init(EXITS_PDP_INSTANCE), AM_SUCCESS);
+    assert_int_equal(am_pdp_init(EXITS_PDP_INSTANCE), AM_SUCCESS);
+    dir = mkdtemp(dir_template);
+    assert_non_null(dir);
+    config.pdp_dir = dir;
+    
+    /* earlier agent version: base64 encoded, no suffix */
+    post_enc = base64_encode(post, &post_enc_sz);
+    assert_non_null(post_enc);
+    am_asprintf(&file, "%s/legacy-key", dir);
+    assert_int_equal(write_file(file, post_enc, post_enc_sz), post_enc_sz);
+    assert_int_equal(am_add_pdp_cache_entry(&request, "legacy-key", "/post/url", file, request.content_type), AM_SUCCESS);
+    replay_post_data(&request, "legacy-key", post);
+    assert_int_equal(file_exists(file), AM_FALSE);
+    AM_FREE(file, post_enc);
+    
+    /* raw bytes */
+    file = NULL;
+    am_asprintf(&file, "%s/raw-key.raw", dir);
+    assert_int_equal(write_file(file, post, strlen(post)), strlen(post));
+    assert_int_equal(am_add_pdp_cache_entry(&request, "raw-key", "/post/url", file, request.content_type), AM_SUCCESS);
+    replay_post_data(&request, "raw-key", post);
+    assert_int_equal(file_exists(file), AM_FALSE);
+    free(file);
+    
+    am_free(replayed_post_data);
+    replayed_post_data = NULL;
+    rmdir(dir);
+    am_pdp_shutdown();
+    am_cache_destroy();
+    cookie_table_clear(&ctx.in);
+    cookie_table_clear(&ctx.out);
+    cookie_table_clear(&ctx.err_out);
+}
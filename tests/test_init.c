@@ -45,7 +45,7 @@ void test_init_cleanup(void **state) {
 #ifdef _WIN32
     assert_int_equal(clearup_count, 0);
 #else
-    assert_int_equal(clearup_count, 5);
+    assert_int_equal(clearup_count, 7);
 #endif
 
     clearup_count = 0;
@@ -18,14 +18,19 @@
 #include <string.h>
 #include <stdlib.h>
 #include <setjmp.h>
+#ifndef _WIN32
+#include <glob.h>
+#endif
 
 #include "platform.h"
 #include "am.h"
 #include "log.h"
+#include "zlib.h"
 #include "cmocka.h"
 
 void am_worker_pool_init_reset();
 void am_net_init_ssl_reset();
+uint32_t am_test_get_log_level_generation();
 
 /**
  * This is the simplest of tests to check we can log things without crashing.
@@ -84,6 +89,7 @@ void test_logging_in_unit_test_mode(void** state) {
 
 char log_file_name[20];
 char audit_file_name[20];
+static am_log_options_t log_options; /* instance log settings used by logging_setup */
 
 #define ONE_K   1024
 #define ONE_MB  1024 * 1024
@@ -109,7 +115,7 @@ void logging_setup(int logging_level) {
     
     am_log_register_instance(getpid(),
                              log_file_name, logging_level, TEN_MB,
-                             audit_file_name, AM_LOG_LEVEL_AUDIT, ONE_MB, NULL);
+                             audit_file_name, AM_LOG_LEVEL_AUDIT, ONE_MB, &log_options, NULL);
     am_init_worker(AM_DEFAULT_AGENT_ID);
 }
 
@@ -199,3 +205,303 @@ void test_log_warning_at_warning_level(void** state) {
     assert_int_equal(result, 1);
 }
 
+
+/**
+ * Ensure that a burst of messages (written by the log worker in batches) ends up in the
+ * log file complete and in order.
+ */
+void test_log_batch_all_messages_written(void** state) {
+    int i, count = 0, in_order = 1;
+    char line[10 * ONE_K];
+    FILE* fp;
+    
+    logging_setup(AM_LOG_LEVEL_DEBUG);
+    for (i = 0; i < 1000; i++) {
+        AM_LOG_DEBUG(getpid(), "batch message %d", i);
+    }
+    sleep(5);
+    if ((fp = fopen(log_file_name, "r")) != NULL) {
+        while (fgets(line, sizeof(line), fp) != NULL) {
+            char* p = strstr(line, "batch message ");
+            if (p != NULL) {
+                if (atoi(p + strlen("batch message ")) != count) {
+                    in_order = 0;
+                }
+                count++;
+            }
+        }
+        fclose(fp);
+    }
+    logging_teardown();
+    assert_int_equal(count, 1000);
+    assert_int_equal(in_order, 1);
+}
+
+/**
+ * Ensure that messages are neither lost nor reordered when writers wrap around (and block on)
+ * a small log ring.
+ */
+void test_log_ring_wrap_block(void** state) {
+    int i, count = 0, in_order = 1;
+    char line[10 * ONE_K];
+    FILE* fp;
+    
+    setenv(AM_LOG_RING_SIZE_VAR, "1", 1); /* minimal capacity, writers block when it is full */
+    logging_setup(AM_LOG_LEVEL_DEBUG);
+    for (i = 0; i < 10000; i++) {
+        AM_LOG_DEBUG(getpid(), "ring message %d %0*d", i, i % 500, 0);
+    }
+    sleep(5);
+    if ((fp = fopen(log_file_name, "r")) != NULL) {
+        while (fgets(line, sizeof(line), fp) != NULL) {
+            char* p = strstr(line, "ring message ");
+            if (p != NULL) {
+                if (atoi(p + strlen("ring message ")) != count) {
+                    in_order = 0;
+                }
+                count++;
+            }
+        }
+        fclose(fp);
+    }
+    logging_teardown();
+    unsetenv(AM_LOG_RING_SIZE_VAR);
+    assert_int_equal(count, 10000);
+    assert_int_equal(in_order, 1);
+}
+
+/**
+ * Ensure that a log level change (instance re-registration) is seen by perform_logging
+ * which otherwise uses the levels cached in the calling thread.
+ */
+void test_log_level_change(void** state) {
+    logging_setup(AM_LOG_LEVEL_WARNING);
+    assert_int_equal(perform_logging(getpid(), AM_LOG_LEVEL_DEBUG), AM_FALSE);
+    assert_int_equal(perform_logging(getpid(), AM_LOG_LEVEL_WARNING), AM_TRUE);
+    assert_int_equal(perform_logging(getpid() + 1, AM_LOG_LEVEL_WARNING), AM_FALSE);
+
+    am_log_register_instance(getpid(), log_file_name, AM_LOG_LEVEL_DEBUG, TEN_MB,
+                             audit_file_name, AM_LOG_LEVEL_AUDIT, ONE_MB, NULL, NULL);
+    assert_int_equal(perform_logging(getpid(), AM_LOG_LEVEL_DEBUG), AM_TRUE);
+
+    am_log_register_instance(getpid(), log_file_name, AM_LOG_LEVEL_ERROR, TEN_MB,
+                             audit_file_name, AM_LOG_LEVEL_AUDIT, ONE_MB, NULL, NULL);
+    assert_int_equal(perform_logging(getpid(), AM_LOG_LEVEL_WARNING), AM_FALSE);
+    assert_int_equal(perform_logging(getpid(), AM_LOG_LEVEL_AUDIT), AM_TRUE);
+    logging_teardown();
+}
+
+/**
+ * Ensure that re-registering an instance with unchanged settings (which happens with every request)
+ * leaves the level table version, and with it the levels cached in every thread, alone.
+ */
+void test_log_register_unchanged(void** state) {
+    uint32_t generation;
+
+    logging_setup(AM_LOG_LEVEL_WARNING);
+    generation = am_test_get_log_level_generation();
+    assert_int_equal(generation & 1, 0);
+
+    am_log_register_instance(getpid(), log_file_name, AM_LOG_LEVEL_WARNING, TEN_MB,
+                             audit_file_name, AM_LOG_LEVEL_AUDIT, ONE_MB, &log_options, NULL);
+    am_log_register_instance(getpid(), log_file_name, AM_LOG_LEVEL_WARNING, TEN_MB,
+                             audit_file_name, AM_LOG_LEVEL_AUDIT, ONE_MB, &log_options, NULL);
+    assert_int_equal(am_test_get_log_level_generation(), generation);
+
+    am_log_register_instance(getpid(), log_file_name, AM_LOG_LEVEL_WARNING, TEN_MB,
+                             audit_file_name, AM_LOG_LEVEL_AUDIT, TEN_MB, &log_options, NULL);
+    assert_int_equal(am_test_get_log_level_generation(), generation + 2);
+    am_log_register_instance(getpid(), log_file_name, AM_LOG_LEVEL_DEBUG, TEN_MB,
+                             audit_file_name, AM_LOG_LEVEL_AUDIT, TEN_MB, &log_options, NULL);
+    assert_int_equal(am_test_get_log_level_generation(), generation + 4);
+    assert_int_equal(perform_logging(getpid(), AM_LOG_LEVEL_DEBUG), AM_TRUE);
+    logging_teardown();
+}
+
+/**
+ * Ensure that messages logged in deferred mode (formatted by the log worker) come out the same
+ * as if they were formatted by the caller.
+ */
+void test_log_deferred_format(void** state) {
+    char expected[4][256];
+    const char* value = "value";
+    const char* text = "not terminated";
+    
+    snprintf(expected[0], sizeof(expected[0]), "deferred %d %u %ld %lu %x %5.2f %c %% %s %.*s %-6s| %zu",
+            -42, 42u, -1234567L, 1234567UL, 255, 3.14159, 'z', value, 3, text, "ab", (size_t) 77);
+    snprintf(expected[1], sizeof(expected[1]), "deferred null (null)");
+    snprintf(expected[2], sizeof(expected[2]), "deferred %*d|%-*.*s|", 6, 12, 5, 2, "xyz");
+    snprintf(expected[3], sizeof(expected[3]), "deferred long double %.20Lf", 1.0L / 3.0L);
+    
+    log_options.deferred = AM_TRUE;
+    logging_setup(AM_LOG_LEVEL_DEBUG);
+    assert_int_equal(perform_logging(getpid(), AM_LOG_LEVEL_DEBUG), AM_LOG_DEFERRED);
+    AM_LOG_DEBUG(getpid(), "deferred %d %u %ld %lu %x %5.2f %c %% %s %.*s %-6s| %zu",
+            -42, 42u, -1234567L, 1234567UL, 255, 3.14159, 'z', value, 3, text, "ab", (size_t) 77);
+    AM_LOG_WARNING(getpid(), "deferred null %s", (char*) NULL);
+    AM_LOG_INFO(getpid(), "deferred %*d|%-*.*s|", 6, 12, 5, 2, "xyz");
+    AM_LOG_INFO(getpid(), "deferred long double %.20Lf", 1.0L / 3.0L);
+    sleep(5);
+    assert_int_equal(validate_contains(log_file_name, expected[0]), 1);
+    assert_int_equal(validate_contains(log_file_name, expected[1]), 1);
+    assert_int_equal(validate_contains(log_file_name, expected[2]), 1);
+    assert_int_equal(validate_contains(log_file_name, expected[3]), 1);
+    assert_int_equal(validate_contains(log_file_name, " WARNING ["), 1);
+    assert_int_equal(validate_contains(log_file_name, "test_log.c:"), 1);
+    logging_teardown();
+    memset(&log_options, 0, sizeof (log_options));
+}
+
+/**
+ * Ensure that messages from a single call site are rate limited and that the number of
+ * suppressed messages is reported with the next message logged.
+ */
+void test_log_rate_limit(void** state) {
+    int i, count = 0, summary = 0;
+    char line[10 * ONE_K];
+    FILE* fp;
+    
+    log_options.rate = 10;
+    logging_setup(AM_LOG_LEVEL_DEBUG);
+    memset(&log_options, 0, sizeof (log_options));
+    for (i = 0; i <= 1000; i++) {
+        if (i == 1000) {
+            sleep(2); /* let the bucket refill */
+        }
+        AM_LOG_WARNING(getpid(), "flood message %d", i);
+    }
+    sleep(5);
+    if ((fp = fopen(log_file_name, "r")) != NULL) {
+        while (fgets(line, sizeof(line), fp) != NULL) {
+            if (strstr(line, "flood message ") != NULL) {
+                count++;
+            }
+            if (strstr(line, "message(s) suppressed") != NULL) {
+                summary++;
+            }
+        }
+        fclose(fp);
+    }
+    logging_teardown();
+    assert_true(count >= 11 && count <= 30);
+    assert_int_equal(summary, 1);
+}
+
+#ifndef _WIN32
+
+/**
+ * Count the segment files (file_name.<timestamp>.<sequence>) rolled over from the specified
+ * log file which contain the specified string. Segment files are removed if 'remove' is set.
+ */
+static int segments_containing(const char* file_name, const char* text, int remove) {
+    char pattern[64];
+    glob_t files;
+    size_t i;
+    int result = 0;
+    
+    snprintf(pattern, sizeof(pattern), "%s.*Z.[0-9][0-9][0-9]", file_name);
+    if (glob(pattern, 0, NULL, &files) == 0) {
+        for (i = 0; i < files.gl_pathc; i++) {
+            result += text == NULL || validate_contains(files.gl_pathv[i], text);
+            if (remove) {
+                unlink(files.gl_pathv[i]);
+            }
+        }
+        globfree(&files);
+    }
+    return result;
+}
+
+/**
+ * Ensure that in JSON mode debug and audit records are written as JSON objects (audit
+ * records with their decision, user, client ip and url fields) and that the log files
+ * are rolled over into segment files.
+ */
+void test_log_json_format(void** state) {
+    int debug, audit, segments;
+    
+    log_options.json = AM_TRUE;
+    log_options.segment_size = 64;
+    log_options.compress_disable = AM_TRUE;
+    logging_setup(AM_LOG_LEVEL_DEBUG);
+    AM_LOG_DEBUG(getpid(), "json \"quoted\" %d", 42);
+    AM_LOG_AUDIT(getpid(), AUDIT_DENY_USER_MESSAGE, "user", "127.0.0.1", "http://a.b/c?d=e");
+    sleep(5);
+    logging_teardown();
+    memset(&log_options, 0, sizeof (log_options));
+    
+    debug = segments_containing(log_file_name, "\"level\":\"DEBUG\"", AM_FALSE);
+    debug += segments_containing(log_file_name, "\"message\":\"json \\\"quoted\\\" 42\"", AM_FALSE);
+    audit = segments_containing(audit_file_name, "\"level\":\"AUDIT\"", AM_FALSE);
+    audit += segments_containing(audit_file_name,
+            "\"decision\":\"deny\",\"user\":\"user\",\"client_ip\":\"127.0.0.1\",\"url\":\"http:\\/\\/a.b\\/c?d=e\"}", AM_FALSE);
+    segments = segments_containing(log_file_name, NULL, AM_TRUE);
+    segments += segments_containing(audit_file_name, NULL, AM_TRUE);
+    assert_int_equal(debug, 2);
+    assert_int_equal(audit, 2);
+    assert_true(segments >= 2);
+}
+
+/**
+ * Ensure that log files are rotated by the maintenance task while messages are being logged,
+ * that rotated files are compressed and that only the configured number of them is kept.
+ */
+void test_log_rotation_compress(void** state) {
+    char pattern[64], line[256];
+    glob_t files;
+    gzFile gz;
+    int i, found = 0;
+    
+    log_options.segment_size = 128;
+    log_options.retain_files = 2;
+    logging_setup(AM_LOG_LEVEL_DEBUG);
+    for (i = 0; i < 6; i++) {
+        AM_LOG_DEBUG(getpid(), "rotated message %d with some padding to fill up the segment quickly "
+                "................................................................................", i);
+        usleep(1500000);
+    }
+    logging_teardown();
+    memset(&log_options, 0, sizeof (log_options));
+    
+    snprintf(pattern, sizeof(pattern), "%s.*", log_file_name);
+    assert_int_equal(glob(pattern, 0, NULL, &files), 0);
+    assert_int_equal(files.gl_pathc, 2);
+    for (i = 0; i < (int) files.gl_pathc; i++) {
+        assert_non_null(strstr(files.gl_pathv[i], ".gz"));
+        gz = gzopen(files.gl_pathv[i], "rb");
+        assert_non_null(gz);
+        while (gzgets(gz, line, sizeof(line)) != NULL) {
+            found += strstr(line, "rotated message 5") != NULL;
+        }
+        gzclose(gz);
+        unlink(files.gl_pathv[i]);
+    }
+    globfree(&files);
+    assert_int_equal(found, 1);
+    segments_containing(audit_file_name, NULL, AM_TRUE);
+}
+
+/**
+ * Ensure that a log file renamed externally (by logrotate, for example) is noticed by the log
+ * worker and re-opened, so that the following messages go into a new file.
+ */
+void test_log_reopen_renamed(void** state) {
+    char renamed[64];
+
+    logging_setup(AM_LOG_LEVEL_DEBUG);
+    AM_LOG_DEBUG(getpid(), "before rename");
+    sleep(2);
+    snprintf(renamed, sizeof(renamed), "%s.moved", log_file_name);
+    assert_int_equal(rename(log_file_name, renamed), 0);
+    AM_LOG_DEBUG(getpid(), "noticed rename");
+    sleep(3);
+    AM_LOG_DEBUG(getpid(), "after rename");
+    sleep(3);
+    assert_int_equal(validate_contains(renamed, "before rename"), 1);
+    assert_int_equal(validate_contains(log_file_name, "after rename"), 1);
+    assert_int_equal(validate_contains(log_file_name, "before rename"), 0);
+    logging_teardown();
+    unlink(renamed);
+}
+
+#endif
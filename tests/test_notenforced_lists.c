@@ -145,6 +145,21 @@ void test_ip6_addresses(void ** state) {
     test_ip6();
 }
 
+void test_ip_loopback(void ** state) {
+    (void)state;
+
+    assert_int_equal(ip_address_loopback("127.0.0.1"), AM_TRUE);
+    assert_int_equal(ip_address_loopback("127.10.20.30"), AM_TRUE);
+    assert_int_equal(ip_address_loopback("::1"), AM_TRUE);
+    assert_int_equal(ip_address_loopback("::ffff:127.0.0.1"), AM_TRUE);
+    assert_int_equal(ip_address_loopback("128.0.0.1"), AM_FALSE);
+    assert_int_equal(ip_address_loopback("192.168.1.1"), AM_FALSE);
+    assert_int_equal(ip_address_loopback("::2"), AM_FALSE);
+    assert_int_equal(ip_address_loopback("::ffff:10.0.0.1"), AM_FALSE);
+    assert_int_equal(ip_address_loopback(""), AM_FALSE);
+    assert_int_equal(ip_address_loopback(NULL), AM_FALSE);
+}
+
 void test_ip_ranges(void ** state) {
     (void)state;
     
@@ -498,3 +513,135 @@ void test_deny_url_notenforced_get(void **state) {
     assert_int_equal(notenforced_handler(&request), AM_OK);
     assert_int_equal(request.not_enforced, AM_TRUE);
 }
+
+void test_notenforced_prefilter(void **state) {
+
+    am_state_func_t const * func_array = NULL;
+    int array_len = 0;
+    am_state_func_t notenforced_handler;
+    int i;
+    
+    struct ctx {
+        void *dummy;
+    } ctx;
+    
+    struct am_config_map not_enforced_map[] = {
+        { "0",       "http*://*:*/*.css" },
+        { "1",       "*://*/*.js" },
+        { "2",       "http*://*/static/*" },
+        { "GET,3",   "*://*/img/*" },
+        { "POST,4",  "*://*/*.png" },
+        { "5",       "http://www.url.com:80/*.gif" },   /* host specific - not used by the pre-filter */
+        { "6",       "*://*/*.sh*" },                   /* not a plain extension */
+    };
+    
+    struct {
+        const char *uri;
+        int method;
+        int expect;
+    } tests[] = {
+        { "/a.css",                 AM_REQUEST_GET,     AM_TRUE },
+        { "/x/y/a.b.css",           AM_REQUEST_HEAD,    AM_TRUE },
+        { "/main.js",               AM_REQUEST_GET,     AM_TRUE },
+        { "/static/a",              AM_REQUEST_GET,     AM_TRUE },
+        { "/static/a?b=c",          AM_REQUEST_GET,     AM_TRUE },
+        { "/img/logo",              AM_REQUEST_GET,     AM_TRUE },
+        { "/img/logo",              AM_REQUEST_HEAD,    AM_FALSE },
+        { "/a.css",                 AM_REQUEST_POST,    AM_FALSE },
+        { "/a.CSS",                 AM_REQUEST_GET,     AM_FALSE },
+        { "/a.css?v=1",             AM_REQUEST_GET,     AM_FALSE },
+        { "/a.cssx",                AM_REQUEST_GET,     AM_FALSE },
+        { "/css",                   AM_REQUEST_GET,     AM_FALSE },
+        { "/.css",                  AM_REQUEST_GET,     AM_FALSE },
+        { "/static",                AM_REQUEST_GET,     AM_FALSE },
+        { "/static/",               AM_REQUEST_GET,     AM_FALSE },
+        { "/a.png",                 AM_REQUEST_GET,     AM_FALSE },
+        { "/a.gif",                 AM_REQUEST_GET,     AM_FALSE },
+        { "/a.sh",                  AM_REQUEST_GET,     AM_FALSE },
+        { "/static/../secret",      AM_REQUEST_GET,     AM_FALSE },
+        { "/static/./a",            AM_REQUEST_GET,     AM_FALSE },
+        { "//static/a",             AM_REQUEST_GET,     AM_FALSE },
+        { "/static/%2e%2e/a",       AM_REQUEST_GET,     AM_FALSE },
+        { "/private/a.css/..",      AM_REQUEST_GET,     AM_FALSE },
+        { "http://a/static/a",      AM_REQUEST_GET,     AM_FALSE },
+        { NULL,                     AM_REQUEST_GET,     AM_FALSE },
+    };
+    
+    am_config_t config = {
+        .instance_id                = 29,
+        .ts                         = 1,
+        .url_eval_case_ignore       = AM_FALSE,
+        
+        .not_enforced_fetch_attr    = AM_FALSE,
+        .not_enforced_regex_enable  = AM_FALSE,
+        
+        .not_enforced_map_sz        = array_len(not_enforced_map),
+        .not_enforced_map           = not_enforced_map,
+        
+        .not_enforced_invert        = 0,
+        
+        .not_enforced_ext_map_sz    = 0,
+        .logout_map_sz              = 0,
+    };
+    
+    am_request_t request = {
+        .instance_id                = 29,
+        .conf                       = &config,
+        .ctx                        = &ctx,
+        .method                     = AM_REQUEST_GET,
+    };
+    
+    am_test_get_state_funcs(&func_array, &array_len);
+    notenforced_handler = func_array [5];
+    
+    /* no filter for this instance yet */
+    assert_int_equal(am_prefilter_request(29, AM_REQUEST_GET, "/a.css"), AM_FALSE);
+    
+    am_prefilter_update(&config);
+    
+    for (i = 0; i < array_len(tests); i++) {
+        assert_int_equal(am_prefilter_request(29, tests[i].method, tests[i].uri), tests[i].expect);
+        
+        if (tests[i].expect) {
+            /* the regular not-enforced list processing must come to the same conclusion */
+            char url[AM_URI_SIZE];
+            snprintf(url, sizeof (url), "http://www.url.com:80%s", tests[i].uri);
+            
+            request.method = tests[i].method;
+            request.normalized_url = url;
+            request.not_enforced = AM_FALSE;
+            parse_url(url, &request.url);
+            
+            assert_int_equal(notenforced_handler(&request), AM_QUIT);
+            assert_int_equal(request.not_enforced, AM_TRUE);
+        }
+    }
+    
+    /* other instances are not affected */
+    assert_int_equal(am_prefilter_request(30, AM_REQUEST_GET, "/a.css"), AM_FALSE);
+    
+    /* case insensitive url evaluation */
+    config.url_eval_case_ignore = AM_TRUE;
+    config.ts++;
+    am_prefilter_update(&config);
+    assert_int_equal(am_prefilter_request(29, AM_REQUEST_GET, "/a.CSS"), AM_TRUE);
+    assert_int_equal(am_prefilter_request(29, AM_REQUEST_GET, "/STATIC/a"), AM_TRUE);
+    
+    /* options requiring the full request processing disable the filter */
+    config.not_enforced_fetch_attr = AM_TRUE;
+    config.ts++;
+    am_prefilter_update(&config);
+    assert_int_equal(am_prefilter_request(29, AM_REQUEST_GET, "/a.css"), AM_FALSE);
+    
+    config.not_enforced_fetch_attr = AM_FALSE;
+    config.not_enforced_invert = AM_TRUE;
+    config.ts++;
+    am_prefilter_update(&config);
+    assert_int_equal(am_prefilter_request(29, AM_REQUEST_GET, "/a.css"), AM_FALSE);
+    
+    config.not_enforced_invert = AM_FALSE;
+    config.fqdn_check_enable = AM_TRUE;
+    config.ts++;
+    am_prefilter_update(&config);
+    assert_int_equal(am_prefilter_request(29, AM_REQUEST_GET, "/a.css"), AM_FALSE);
+}
@@ -21,6 +21,7 @@
 #include "platform.h"
 #include "am.h"
 #include "utility.h"
+#include "list.h"
 #include "thread.h"
 #include "cmocka.h"
 
@@ -485,3 +486,137 @@ void test_resource_notification_on_policy_cache(void **state) {
     am_worker_pool_init_reset();
     am_net_init_ssl_reset();
 }
+
+#define NOTIFICATION_BENCH_SESSIONS 2000
+
+static void add_bench_sessions(am_request_t *request, const char *prefix, struct am_policy_result *result) {
+    char key[64];
+    int i;
+    for (i = 0; i < NOTIFICATION_BENCH_SESSIONS; i++) {
+        snprintf(key, sizeof (key), "%s-%d", prefix, i);
+        assert_int_equal(am_add_session_policy_cache_entry(request, key, result, NULL), AM_SUCCESS);
+    }
+}
+
+static int bench_session_cached(am_request_t *request, const char *key) {
+    time_t ets;
+    struct am_policy_result *r = NULL;
+    struct am_namevalue *session = NULL;
+    int status = am_get_session_policy_cache_entry(request, key, &r, &session, &ets);
+    delete_am_policy_result_list(&r);
+    delete_am_namevalue_list(&session);
+    return status == AM_SUCCESS;
+}
+
+void test_notification_batch_throughput(void **state) {
+
+    am_state_func_t const * func_array = NULL;
+    int array_len = 0;
+    am_state_func_t notification_handler;
+
+    struct ctx {
+        void *dummy;
+    } ctx;
+
+    char post_data[256];
+    char key[64];
+    am_timer_t tm;
+    double elapsed;
+    int i, j;
+
+    am_config_t config = {
+        .instance_id                = 0,
+        .token_cache_valid          = 0,
+
+        .notif_enable               = AM_TRUE,
+        .notif_url                  = "https://www.notify.com:1234/am",
+        .override_notif_url         = AM_FALSE,
+
+        .url_eval_case_ignore       = AM_FALSE,
+    };
+
+    am_request_t request = {
+        .instance_id                = 0,
+        .conf                       = &config,
+        .ctx                        = &ctx,
+
+        .method                     = AM_REQUEST_POST,
+        .token                      = NULL,
+
+        .overridden_url             = "https://www.override.com:90/am",
+        .normalized_url             = "https://www.notify.com:1234/am",
+
+        .am_get_post_data_f         = get_post_data,
+
+        .am_set_custom_response_f   = set_custom_response,
+    };
+
+    char * xml =
+        "<PolicyService version='1.0' revisionNumber='60'>"
+        "  <PolicyResponse requestId='4' issueInstant='1424783306343' >"
+        "    <ResourceResult name='http://vb2.local.com:80/testwebsite'>"
+        "      <PolicyDecision>"
+        "        <ActionDecision timeToLive='1234'>"
+        "          <AttributeValuePair>"
+        "            <Attribute name='GET'/> <Value>allow</Value>"
+        "          </AttributeValuePair>"
+        "        </ActionDecision>"
+        "      </PolicyDecision>"
+        "    </ResourceResult>"
+        "  </PolicyResponse>"
+        "</PolicyService>";
+
+    char * pll = "<?xml version='1.0' encoding='UTF-8' standalone='yes'?>"
+        "<ResponseSet vers='1.0' svcid='poicy' reqid='48'>"
+        "  <Response><![CDATA[%s]]></Response>"
+        "</ResponseSet>";
+
+    char * buffer = NULL;
+    struct am_policy_result * result;
+
+    am_asprintf(&buffer, pll, xml);
+    result = am_parse_policy_xml(0l, buffer, strlen(buffer), 0);
+    free(buffer);
+    assert_non_null(result);
+
+    am_test_get_state_funcs(&func_array, &array_len);
+    notification_handler = func_array [2];
+
+    assert_int_equal(am_init(AM_DEFAULT_AGENT_ID, NULL), AM_SUCCESS);
+    am_init_worker(AM_DEFAULT_AGENT_ID);
+
+    /* mass logout: every session destroyed notification is delivered twice */
+    add_bench_sessions(&request, "batch", result);
+    am_timer_start(&tm);
+    for (i = 0; i < NOTIFICATION_BENCH_SESSIONS; i++) {
+        snprintf(post_data, sizeof (post_data),
+                "<NotificationSet version='1.0'><Notification><SessionNotification>"
+                "<Session sid='batch-%d' state='destroyed' /></SessionNotification></Notification></NotificationSet>", i);
+        request.post_data = post_data;
+        request.post_data_sz = strlen(post_data);
+        for (j = 0; j < 2; j++) {
+            assert_int_equal(notification_handler(&request), AM_OK);
+        }
+    }
+    snprintf(key, sizeof (key), "batch-%d", NOTIFICATION_BENCH_SESSIONS - 1);
+    for (i = 0; i < 3000 && bench_session_cached(&request, key); i++) {
+        usleep(10000);
+    }
+    am_timer_stop(&tm);
+    elapsed = am_timer_elapsed(&tm);
+
+    for (i = 0; i < NOTIFICATION_BENCH_SESSIONS; i++) {
+        snprintf(key, sizeof (key), "batch-%d", i);
+        assert_false(bench_session_cached(&request, key));
+    }
+
+    printf("session notifications: %d sessions removed by %d notifications in %.3f sec (%.0f notifications/sec)\n",
+            NOTIFICATION_BENCH_SESSIONS, NOTIFICATION_BENCH_SESSIONS * 2, elapsed,
+            elapsed > 0 ? NOTIFICATION_BENCH_SESSIONS * 2 / elapsed : 0.0);
+
+    delete_am_policy_result_list(&result);
+    am_shutdown_worker();
+    am_shutdown(AM_DEFAULT_AGENT_ID);
+    am_worker_pool_init_reset();
+    am_net_init_ssl_reset();
+}
@@ -0,0 +1,247 @@
+/**
+ * The contents of this file are subject to the terms of the Common Development and
+ * Distribution License (the License). You may not use this file except in compliance with the
+ * License.
+ *
+ * You can obtain a copy of the License at legal/CDDLv1.0.txt. See the License for the
+ * specific language governing permission and limitations under the License.
+ *
+ * When distributing Covered Software, include this CDDL Header Notice in each file and include
+ * the License file at legal/CDDLv1.0.txt. If applicable, add the following below the CDDL
+ * Header, with the fields enclosed by brackets [] replaced by your own identifying
+ * information: "Portions copyright [year] [name of copyright owner]".
+ *
+ * Copyright 2015 ForgeRock AS.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <setjmp.h>
+
+#include "platform.h"
+#include "am.h"
+#include "utility.h"
+#include "cmocka.h"
+
+#define PDP_TEST_INSTANCE 4
+#define PDP_BENCH_POSTS 2000
+#define PDP_BENCH_SIZE 2048
+
+struct pdp_source {
+    const char *data;
+    size_t size;
+};
+
+static ssize_t pdp_read(void *arg, char *buf, size_t size) {
+    struct pdp_source *src = (struct pdp_source *) arg;
+    size_t n = src->size < size ? src->size : size;
+    memcpy(buf, src->data, n);
+    src->data += n;
+    src->size -= n;
+    return (ssize_t) n;
+}
+
+static void pdp_log_callback(void *arg, char *name, int error) {
+}
+
+static char *pdp_setup(char *dir) {
+    am_pdp_shutdown();
+    am_remove_shm_and_locks(PDP_TEST_INSTANCE, pdp_log_callback, NULL);
+    assert_int_equal(am_pdp_init(PDP_TEST_INSTANCE), AM_SUCCESS);
+    return mkdtemp(dir);
+}
+
+static int pdp_put(const char *dir, const char *key, const char *data, size_t size, int ttl) {
+    struct pdp_source src;
+    size_t stored = 0;
+    int status;
+    src.data = data;
+    src.size = size;
+    status = am_pdp_store(dir, key, "/post/url?a=b", "text/plain", ttl, pdp_read, &src, 0, &stored);
+    if (status == AM_SUCCESS) {
+        assert_int_equal(stored, size);
+    }
+    return status;
+}
+
+static void pdp_check(const char *dir, const char *key, const char *data, size_t size) {
+    char *url = NULL, *content_type = NULL, *file = NULL, *post;
+    uint64_t offset = 0;
+    size_t post_sz = 0;
+
+    assert_int_equal(am_pdp_get(dir, key, &url, &content_type, &file, &offset, &post_sz), AM_SUCCESS);
+    assert_string_equal(url, "/post/url?a=b");
+    assert_string_equal(content_type, "text/plain");
+    assert_int_equal(post_sz, size);
+    post = load_file_range(file, offset, post_sz);
+    assert_non_null(post);
+    assert_memory_equal(post, data, size);
+    AM_FREE(url, content_type, file, post);
+}
+
+void test_pdp_store(void **state) {
+    char buffer[] = "test_pdp_store-XXXXXX";
+    char *dir = pdp_setup(buffer), *url = NULL, *content_type = NULL, *file = NULL, *data;
+    char name[AM_PATH_SIZE];
+    struct pdp_source src;
+    struct stat st;
+    off_t end;
+    uint64_t offset;
+    size_t i, size = 3 * AM_POST_DATA_CHUNK_SIZE + 11, post_sz = 0, stored = 1;
+
+    assert_non_null(dir);
+    data = malloc(size);
+    assert_non_null(data);
+    for (i = 0; i < size; i++) {
+        data[i] = (char) (i % 251);
+    }
+
+    assert_int_equal(pdp_put(dir, "key-1", data, size, 0), AM_SUCCESS);
+    assert_int_equal(pdp_put(dir, "key-2", "a=b&c=d", 7, 0), AM_SUCCESS);
+    assert_int_equal(pdp_put(dir, "key-3", "", 0, 0), AM_SUCCESS);
+    /* duplicate key is refused before the body is read */
+    src.data = "x";
+    src.size = 1;
+    assert_int_equal(am_pdp_store(dir, "key-2", "/post/url", "text/plain", 0, pdp_read, &src, 0, &stored), AM_EEXIST);
+    assert_int_equal(src.size, 1);
+    assert_int_equal(stored, 0);
+
+    pdp_check(dir, "key-1", data, size);
+    pdp_check(dir, "key-2", "a=b&c=d", 7);
+    pdp_check(dir, "key-3", "", 0);
+
+    /* removed and unknown entries */
+    assert_int_equal(am_pdp_remove(dir, "key-2"), AM_SUCCESS);
+    assert_int_equal(am_pdp_remove(dir, "key-2"), AM_NOT_FOUND);
+    assert_int_equal(am_pdp_get(dir, "key-2", &url, &content_type, &file, &offset, &post_sz), AM_NOT_FOUND);
+    pdp_check(dir, "key-1", data, size);
+
+    /* size limit - the part of the body written before the limit was hit is not left in the segment */
+    snprintf(name, sizeof (name), "%s/am_pdp.0", dir);
+    assert_int_equal(stat(name, &st), 0);
+    end = (st.st_size + 7) & ~((off_t) 7);
+    src.data = data;
+    src.size = size;
+    assert_int_equal(am_pdp_store(dir, "key-4", "/", "text/plain", 0, pdp_read, &src, size - 1, NULL), AM_E2BIG);
+    assert_int_equal(am_pdp_get(dir, "key-4", &url, &content_type, &file, &offset, &post_sz), AM_NOT_FOUND);
+    assert_int_equal(stat(name, &st), 0);
+    assert_true(st.st_size <= end);
+
+    /* expired entry */
+    assert_int_equal(pdp_put(dir, "key-5", "x", 1, 1), AM_SUCCESS);
+    sleep(2);
+    assert_int_equal(am_pdp_get(dir, "key-5", &url, &content_type, &file, &offset, &post_sz), AM_ETIMEDOUT);
+    assert_int_equal(am_pdp_get(dir, "key-5", &url, &content_type, &file, &offset, &post_sz), AM_NOT_FOUND);
+
+    free(data);
+    am_pdp_shutdown();
+    am_delete_directory(dir);
+}
+
+void test_pdp_compact_and_recover(void **state) {
+    char buffer[] = "test_pdp_compact-XXXXXX", name[AM_PATH_SIZE], key[32];
+    char *dir = pdp_setup(buffer);
+    time_t now = time(NULL);
+    FILE *f;
+    int i;
+
+    assert_non_null(dir);
+
+    /* all expired - segment dies and is deleted one compaction interval later */
+    for (i = 0; i < 10; i++) {
+        snprintf(key, sizeof (key), "expired-%d", i);
+        assert_int_equal(pdp_put(dir, key, "a=b", 3, 10), AM_SUCCESS);
+    }
+    snprintf(name, sizeof (name), "%s/am_pdp.0", dir);
+    assert_int_equal(file_exists(name), AM_TRUE);
+    assert_int_equal(am_pdp_compact(now + 20), 0);
+    assert_int_equal(file_exists(name), AM_TRUE);
+    assert_int_equal(am_pdp_compact(now + 20 + AM_PDP_COMPACT_INTERVAL), 1);
+    assert_int_equal(file_exists(name), AM_FALSE);
+
+    /* live entries survive a restart, a removed one and a torn tail do not */
+    for (i = 0; i < 10; i++) {
+        snprintf(key, sizeof (key), "live-%d", i);
+        assert_int_equal(pdp_put(dir, key, key, strlen(key), 0), AM_SUCCESS);
+    }
+    assert_int_equal(am_pdp_remove(dir, "live-3"), AM_SUCCESS);
+    snprintf(name, sizeof (name), "%s/am_pdp.1", dir);
+    f = fopen(name, "ab");
+    assert_non_null(f);
+    fwrite("torn record", 1, 11, f);
+    fclose(f);
+
+    am_pdp_shutdown();
+    am_remove_shm_and_locks(PDP_TEST_INSTANCE, pdp_log_callback, NULL);
+    assert_int_equal(am_pdp_init(PDP_TEST_INSTANCE), AM_SUCCESS);
+
+    for (i = 0; i < 10; i++) {
+        snprintf(key, sizeof (key), "live-%d", i);
+        if (i == 3) {
+            assert_int_equal(am_pdp_remove(dir, key), AM_NOT_FOUND);
+        } else {
+            pdp_check(dir, key, key, strlen(key));
+        }
+    }
+    /* new records go to a new segment */
+    assert_int_equal(pdp_put(dir, "after", "x", 1, 0), AM_SUCCESS);
+    snprintf(name, sizeof (name), "%s/am_pdp.2", dir);
+    assert_int_equal(file_exists(name), AM_TRUE);
+    pdp_check(dir, "live-0", "live-0", 6);
+
+    am_pdp_shutdown();
+    am_delete_directory(dir);
+}
+
+void test_pdp_benchmark(void **state) {
+    char buffer[] = "test_pdp_bench-XXXXXX", file[AM_PATH_SIZE], key[32], *data, *post;
+    char *dir = pdp_setup(buffer), *url, *content_type, *fn;
+    am_timer_t tm = {0, 0, 0, 0};
+    uint64_t offset;
+    size_t post_sz;
+    int i;
+
+    assert_non_null(dir);
+    data = malloc(PDP_BENCH_SIZE);
+    assert_non_null(data);
+    memset(data, 'x', PDP_BENCH_SIZE);
+
+    /* file per post: write, load and delete */
+    am_timer_start(&tm);
+    for (i = 0; i < PDP_BENCH_POSTS; i++) {
+        snprintf(file, sizeof (file), "%s/post-%d", dir, i);
+        assert_int_equal(write_file(file, data, PDP_BENCH_SIZE), PDP_BENCH_SIZE);
+    }
+    for (i = 0; i < PDP_BENCH_POSTS; i++) {
+        snprintf(file, sizeof (file), "%s/post-%d", dir, i);
+        post = load_file(file, &post_sz);
+        assert_non_null(post);
+        free(post);
+        unlink(file);
+    }
+    am_timer_stop(&tm);
+    printf("file per post: %d posts of %d bytes, %.3f ms\n", PDP_BENCH_POSTS, PDP_BENCH_SIZE,
+            am_timer_elapsed(&tm) * 1000.0);
+
+    /* segment store: store, get and remove */
+    am_timer_start(&tm);
+    for (i = 0; i < PDP_BENCH_POSTS; i++) {
+        snprintf(key, sizeof (key), "post-%d", i);
+        assert_int_equal(pdp_put(dir, key, data, PDP_BENCH_SIZE, 0), AM_SUCCESS);
+    }
+    for (i = 0; i < PDP_BENCH_POSTS; i++) {
+        snprintf(key, sizeof (key), "post-%d", i);
+        assert_int_equal(am_pdp_get(dir, key, &url, &content_type, &fn, &offset, &post_sz), AM_SUCCESS);
+        post = load_file_range(fn, offset, post_sz);
+        assert_non_null(post);
+        AM_FREE(url, content_type, fn, post);
+        assert_int_equal(am_pdp_remove(dir, key), AM_SUCCESS);
+    }
+    am_timer_stop(&tm);
+    printf("segment store: %d posts of %d bytes, %.3f ms\n", PDP_BENCH_POSTS, PDP_BENCH_SIZE,
+            am_timer_elapsed(&tm) * 1000.0);
+
+    free(data);
+    am_pdp_shutdown();
+    am_delete_directory(dir);
+}
@@ -743,3 +743,115 @@ void test_key_creation(void **state) {
         assert_string_equal(key, keys[i]);
     }
 }
+
+static am_cache_stats_t *find_cache_stats(am_cache_stats_t *stats, int count, unsigned long instance_id) {
+    int i;
+    for (i = 0; i < count; i++) {
+        if (stats[i].instance_id == instance_id) {
+            return &stats[i];
+        }
+    }
+    return NULL;
+}
+
+static int lookup_cache_key(am_request_t *request, const char *key) {
+    struct am_policy_result *policy = NULL;
+    struct am_namevalue *session = NULL;
+    time_t ets = 0;
+    int status = am_get_session_policy_cache_entry(request, key, &policy, &session, &ets);
+    delete_am_policy_result_list(&policy);
+    delete_am_namevalue_list(&session);
+    return status;
+}
+
+void test_policy_cache_instance_quota(void **state) {
+    am_cache_stats_t stats[AM_MAX_INSTANCES], *a, *b;
+    am_config_t config_a, config_b;
+    am_request_t request_a, request_b;
+    struct am_policy_result *result;
+    char *buffer = NULL, key[32];
+    uint64_t entry_size, b_size;
+    int i, j, n;
+
+    memset(&config_a, 0, sizeof(am_config_t));
+    memset(&config_b, 0, sizeof(am_config_t));
+    memset(&request_a, 0, sizeof(am_request_t));
+    memset(&request_b, 0, sizeof(am_request_t));
+    config_a.token_cache_valid = config_b.token_cache_valid = 600;
+    request_a.conf = &config_a;
+    request_a.instance_id = 1;
+    request_b.conf = &config_b;
+    request_b.instance_id = 2;
+
+    am_asprintf(&buffer, pll, policy_xml);
+    result = am_parse_policy_xml(0l, buffer, strlen(buffer), 0);
+    free(buffer);
+
+    cleardown();
+    assert_int_equal(am_cache_init(AM_DEFAULT_AGENT_ID), AM_SUCCESS);
+
+    /* instance without a quota */
+    for (i = 0; i < 50; i++) {
+        snprintf(key, sizeof (key), "b-%d", i);
+        assert_int_equal(am_add_session_policy_cache_entry(&request_b, key, result, NULL), AM_SUCCESS);
+    }
+    n = am_cache_stats(stats, AM_MAX_INSTANCES);
+    b = find_cache_stats(stats, n, 2);
+    assert_non_null(b);
+    b_size = b->size;
+    entry_size = b_size / 50;
+    assert_true(entry_size > 0);
+
+    /* room for 12 entries; hot keys are looked up a few times each */
+    config_a.cache_quota = (int) (entry_size * 12 / 1024 + 1);
+    config_a.cache_admission = AM_TRUE;
+    for (i = 0; i < 10; i++) {
+        snprintf(key, sizeof (key), "hot-%d", i);
+        for (j = 0; j < 4; j++) {
+            lookup_cache_key(&request_a, key);
+        }
+        assert_int_equal(am_add_session_policy_cache_entry(&request_a, key, result, NULL), AM_SUCCESS);
+    }
+
+    /* keys seen once do not push the hot ones out */
+    for (i = 0; i < 100; i++) {
+        snprintf(key, sizeof (key), "cold-%d", i);
+        assert_int_equal(lookup_cache_key(&request_a, key), AM_NOT_FOUND);
+        am_add_session_policy_cache_entry(&request_a, key, result, NULL);
+    }
+    for (i = 0; i < 10; i++) {
+        snprintf(key, sizeof (key), "hot-%d", i);
+        assert_int_equal(lookup_cache_key(&request_a, key), AM_SUCCESS);
+    }
+    n = am_cache_stats(stats, AM_MAX_INSTANCES);
+    a = find_cache_stats(stats, n, 1);
+    b = find_cache_stats(stats, n, 2);
+    assert_non_null(a);
+    assert_non_null(b);
+    assert_true(a->size <= a->quota + entry_size);
+    assert_true(a->rejected >= 90);
+    assert_int_equal(a->evicted, 0);
+    assert_int_equal(a->hits, 10);
+    assert_int_equal(b->size, b_size);
+
+    /* without admission new entries evict the least used ones */
+    config_a.cache_admission = AM_FALSE;
+    for (i = 0; i < 20; i++) {
+        snprintf(key, sizeof (key), "new-%d", i);
+        assert_int_equal(am_add_session_policy_cache_entry(&request_a, key, result, NULL), AM_SUCCESS);
+    }
+    n = am_cache_stats(stats, AM_MAX_INSTANCES);
+    a = find_cache_stats(stats, n, 1);
+    assert_non_null(a);
+    assert_true(a->evicted >= 20);
+    assert_true(a->size <= a->quota + entry_size);
+
+    /* other instance entries are untouched */
+    for (i = 0; i < 50; i++) {
+        snprintf(key, sizeof (key), "b-%d", i);
+        assert_int_equal(lookup_cache_key(&request_b, key), AM_SUCCESS);
+    }
+
+    delete_am_policy_result_list(&result);
+    am_cache_shutdown();
+}
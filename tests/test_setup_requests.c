@@ -372,3 +372,63 @@ void test_setup_with_resolve_host(void **state) {
     am_net_shutdown();
     am_net_init_ssl_reset();
 }
+
+static int status_responses;
+
+static am_status_t set_status_response(am_request_t *r, const char *text, const char *cont_type) {
+    status_responses++;
+    return AM_SUCCESS;
+}
+
+/**
+ * The status url is answered for loopback connections only; the client ip header value can be
+ * set by any client, so it must not be enough to get the report.
+ */
+void test_status_url_loopback_only(void **state) {
+
+    am_state_func_t const* func_array = NULL;
+    int array_len = 0;
+    am_state_func_t handle_notification;
+
+    am_config_t config = {
+        .instance_id            = 0,
+        .status_url             = "http://a.b.c:80/agent/status",
+    };
+
+    am_request_t request = {
+        .instance_id            = 0,
+        .conf                   = &config,
+        .normalized_url         = "http://a.b.c:80/agent/status",
+        .method                 = AM_REQUEST_GET,
+        .am_set_custom_response_f = set_status_response,
+    };
+
+    am_test_get_state_funcs(&func_array, &array_len);
+    handle_notification = func_array [2];
+    status_responses = 0;
+
+    /* no client ip header: the client ip is the connection address */
+    request.client_ip = "127.0.0.1";
+    assert_int_equal(handle_notification(&request), AM_OK);
+    assert_int_equal(request.status, AM_NOTIFICATION_DONE);
+    assert_int_equal(status_responses, 1);
+
+    request.client_ip = "10.1.2.3";
+    assert_int_equal(handle_notification(&request), AM_FAIL);
+
+    /* spoofed client ip header, remote connection */
+    config.client_ip_header = "X-Forwarded-For";
+    request.client_ip = "127.0.0.1";
+    request.peer_ip = "10.1.2.3";
+    assert_int_equal(handle_notification(&request), AM_FAIL);
+
+    /* client ip header and no connection address from the container */
+    request.peer_ip = NULL;
+    assert_int_equal(handle_notification(&request), AM_FAIL);
+
+    /* loopback connection (a local proxy) */
+    request.client_ip = "10.1.2.3";
+    request.peer_ip = "::1";
+    assert_int_equal(handle_notification(&request), AM_OK);
+    assert_int_equal(status_responses, 2);
+}
@@ -0,0 +1,361 @@
+/**
+ * The contents of this file are subject to the terms of the Common Development and
+ * Distribution License (the License). You may not use this file except in compliance with the
+ * License.
+ *
+ * You can obtain a copy of the License at legal/CDDLv1.0.txt. See the License for the
+ * specific language governing permission and limitations under the License.
+ *
+ * When distributing Covered Software, include this CDDL Header Notice in each file and include
+ * the License file at legal/CDDLv1.0.txt. If applicable, add the following below the CDDL
+ * Header, with the fields enclosed by brackets [] replaced by your own identifying
+ * information: "Portions copyright [year] [name of copyright owner]".
+ *
+ * Copyright 2015 ForgeRock AS.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <setjmp.h>
+
+#include "platform.h"
+#include "am.h"
+#include "utility.h"
+#include "cmocka.h"
+
+#define SHM_TEST_INSTANCE 5
+#define SHM_MAP_SIZE (8 * 1024 * 1024)
+#define SHM_BENCH_POOL_SIZE (128 * 1024 * 1024)
+#define SHM_BENCH_STEPS 4000000
+#define SHM_BENCH_VAR "AM_TEST_SHM_BENCHMARK" /* set to "1" to run the chain walk benchmark */
+#define SHM_HUGETLBFS_VAR "AM_TEST_SHM_HUGETLBFS" /* hugetlbfs mount directory, /dev/hugepages by default */
+
+struct shm_node {
+    size_t next;
+    char pad[56]; /* one node per cache line, like a cache entry header */
+};
+
+static void shm_clear_options() {
+    unsetenv(AM_SHARED_HUGEPAGES_VAR);
+    unsetenv(AM_SHARED_PREFAULT_VAR);
+    unsetenv(AM_SHARED_NUMA_VAR);
+}
+
+static void shm_fill_and_check(const char *name) {
+    am_shm_t *pool = am_shm_create(get_global_name(name, SHM_TEST_INSTANCE), 8192);
+    char *small, *large;
+    size_t i;
+
+    assert_non_null(pool);
+    assert_int_equal(pool->error, AM_SUCCESS);
+    small = am_shm_alloc(pool, 100);
+    assert_non_null(small);
+    memset(small, 'a', 100);
+    am_shm_set_user_offset(pool, (size_t) (small - (char *) pool->pool));
+
+    /* forces the pool to be extended (and remapped) */
+    large = am_shm_alloc(pool, 1024 * 1024);
+    assert_non_null(large);
+    memset(large, 'b', 1024 * 1024);
+    small = am_shm_get_user_pointer(pool);
+    for (i = 0; i < 100; i++) {
+        assert_int_equal(small[i], 'a');
+    }
+    am_shm_free(pool, large);
+    am_shm_destroy(pool);
+}
+
+/**
+ * Create an empty (no pages allocated) segment file and map it as its creator would.
+ */
+static char *shm_map_fresh(const char *name, int *fd) {
+    char *area;
+    am_shm_unlink(name);
+    *fd = am_shm_open(name, O_CREAT | O_RDWR);
+    assert_int_not_equal(*fd, -1);
+    assert_int_equal(ftruncate(*fd, SHM_MAP_SIZE), 0);
+    area = am_shm_map(*fd, SHM_MAP_SIZE, AM_TRUE);
+    assert_true(area != MAP_FAILED);
+    return area;
+}
+
+static void shm_unmap(const char *name, char *area, int fd) {
+    munmap(area, SHM_MAP_SIZE);
+    close(fd);
+    am_shm_unlink(name);
+}
+
+/**
+ * Number of pages of the mapping which are in memory.
+ */
+static size_t shm_resident_pages(char *area) {
+    size_t i, pages = SHM_MAP_SIZE / page_size(1), resident = 0;
+    unsigned char *vec = malloc(pages);
+    assert_non_null(vec);
+    assert_int_equal(mincore(area, SHM_MAP_SIZE, vec), 0);
+    for (i = 0; i < pages; i++) {
+        if (vec[i] & 1) resident++;
+    }
+    free(vec);
+    return resident;
+}
+
+/**
+ * Find the /proc/self/smaps (or numa_maps) entry of the mapping at 'area' and copy the rest of
+ * the line starting with 'field' (or the mapping line itself if 'field' is NULL) into 'value'.
+ */
+static int shm_proc_maps_value(const char *file, char *area, const char *field, char *value, size_t size) {
+    unsigned long start, end;
+    char line[1024];
+    int found = AM_FALSE, in_area = AM_FALSE;
+    FILE *f = fopen(file, "r");
+
+    if (f == NULL) return AM_FALSE;
+    while (!found && fgets(line, sizeof (line), f) != NULL) {
+        /* mapping lines start with the (lower case hex) address, field names with a capital */
+        int n = (line[0] >= '0' && line[0] <= '9') || (line[0] >= 'a' && line[0] <= 'f') ?
+                sscanf(line, "%lx-%lx", &start, &end) : 0;
+        if (n == 2) {
+            in_area = (unsigned long) area >= start && (unsigned long) area < end;
+        } else if (n == 1 && field == NULL) {
+            found = (unsigned long) area == start;
+        } else if (in_area && field != NULL && strncmp(line, field, strlen(field)) == 0) {
+            found = AM_TRUE;
+        }
+        if (found) {
+            snprintf(value, size, "%s", line);
+        }
+    }
+    fclose(f);
+    return found;
+}
+
+/**
+ * First line of a (sysfs) file, empty if it can't be read.
+ */
+static char *shm_read_line(const char *file, char *value, size_t size) {
+    FILE *f = fopen(file, "r");
+    value[0] = '\0';
+    if (f != NULL) {
+        if (fgets(value, (int) size, f) == NULL) value[0] = '\0';
+        fclose(f);
+    }
+    return value;
+}
+
+static int shm_numa_nodes() {
+    char online[256], *p;
+    int nodes = 0;
+    for (p = shm_read_line("/sys/devices/system/node/online", online, sizeof (online)); *p >= '0' && *p <= '9';) {
+        unsigned long first = strtoul(p, &p, 10), last = first;
+        if (*p == '-') last = strtoul(p + 1, &p, 10);
+        nodes += (int) (last - first + 1);
+        if (*p == ',') p++;
+    }
+    return nodes;
+}
+
+void test_shm_prefault(void **state) {
+    const char *name = get_global_name("am_test_shm_map_prefault", SHM_TEST_INSTANCE);
+    size_t pages = SHM_MAP_SIZE / page_size(1);
+    char *area;
+    int fd;
+
+    /* pages are faulted in on first use */
+    shm_clear_options();
+    area = shm_map_fresh(name, &fd);
+    assert_int_equal(shm_resident_pages(area), 0);
+    shm_unmap(name, area, fd);
+
+    /* MAP_POPULATE */
+    setenv(AM_SHARED_PREFAULT_VAR, "1", 1);
+    area = shm_map_fresh(name, &fd);
+    assert_int_equal(shm_resident_pages(area), pages);
+    shm_unmap(name, area, fd);
+
+    /* touched page by page once the huge page advice is set */
+    setenv(AM_SHARED_HUGEPAGES_VAR, "thp", 1);
+    area = shm_map_fresh(name, &fd);
+    assert_int_equal(shm_resident_pages(area), pages);
+    shm_unmap(name, area, fd);
+
+    shm_clear_options();
+}
+
+void test_shm_transparent_huge_pages(void **state) {
+    const char *name = get_global_name("am_test_shm_map_thp", SHM_TEST_INSTANCE);
+    char value[1024], mode[256];
+    char *area;
+    int fd;
+
+#ifndef MADV_HUGEPAGE
+    skip();
+#endif
+    if (shm_read_line("/sys/kernel/mm/transparent_hugepage/shmem_enabled", mode, sizeof (mode))[0] == '\0') {
+        skip(); /* kernel without transparent huge page support */
+    }
+
+    shm_clear_options();
+    setenv(AM_SHARED_HUGEPAGES_VAR, "thp", 1);
+    setenv(AM_SHARED_PREFAULT_VAR, "1", 1);
+    area = shm_map_fresh(name, &fd);
+    shm_clear_options();
+
+    /* the advice is set on the mapping ("hg" flag) */
+    if (shm_proc_maps_value("/proc/self/smaps", area, "VmFlags:", value, sizeof (value))) {
+        assert_non_null(strstr(value, " hg"));
+    }
+    /* and huge pages are used when shmem_enabled lets madvise'd mappings have them */
+    if (strstr(mode, "[always]") != NULL || strstr(mode, "[advise]") != NULL ||
+            strstr(mode, "[within_size]") != NULL) {
+        assert_true(shm_proc_maps_value("/proc/self/smaps", area, "ShmemPmdMapped:", value, sizeof (value)));
+        assert_true(strtoul(value + strlen("ShmemPmdMapped:"), NULL, 10) > 0);
+    }
+    shm_unmap(name, area, fd);
+}
+
+void test_shm_numa_interleave(void **state) {
+    const char *name = get_global_name("am_test_shm_map_numa", SHM_TEST_INSTANCE);
+    char value[1024];
+    char *area;
+    int fd;
+
+    if (shm_numa_nodes() < 2 || access("/proc/self/numa_maps", R_OK) != 0) {
+        skip(); /* interleaving is not set up on a single node */
+    }
+
+    shm_clear_options();
+    setenv(AM_SHARED_NUMA_VAR, "interleave", 1);
+    area = shm_map_fresh(name, &fd);
+    shm_clear_options();
+
+    assert_true(shm_proc_maps_value("/proc/self/numa_maps", area, NULL, value, sizeof (value)));
+    assert_non_null(strstr(value, " interleave:"));
+    shm_unmap(name, area, fd);
+}
+
+void test_shm_mapping_options(void **state) {
+    shm_clear_options();
+    shm_fill_and_check("am_test_shm_plain");
+
+    setenv(AM_SHARED_PREFAULT_VAR, "1", 1);
+    shm_fill_and_check("am_test_shm_prefault");
+
+    setenv(AM_SHARED_HUGEPAGES_VAR, "thp", 1);
+    setenv(AM_SHARED_NUMA_VAR, "interleave", 1);
+    shm_fill_and_check("am_test_shm_thp");
+
+    /* not a hugetlbfs mount - regular pages, shm_open segments */
+    setenv(AM_SHARED_HUGEPAGES_VAR, "/tmp", 1);
+    assert_int_equal(am_shm_page_size(1), page_size(1));
+    shm_fill_and_check("am_test_shm_nohugetlbfs");
+
+    shm_clear_options();
+}
+
+/**
+ * A hugetlbfs mount without huge pages to back the segments (vm.nr_hugepages is 0 by default)
+ * gets the pools created with shm_open, in regular pages. Once that happens, hugetlbfs is off
+ * for the process - keep this test after the others which map segments.
+ */
+void test_shm_hugetlbfs_fallback(void **state) {
+    char *dir = getenv(SHM_HUGETLBFS_VAR);
+    char file[AM_PATH_SIZE], value[64];
+    size_t huge;
+
+    shm_clear_options();
+    setenv(AM_SHARED_HUGEPAGES_VAR, ISVALID(dir) ? dir : "/dev/hugepages", 1);
+    huge = am_shm_page_size(1);
+    if (huge == page_size(1)) {
+        shm_clear_options();
+        skip(); /* not a hugetlbfs mount */
+    }
+    snprintf(file, sizeof (file), "/sys/kernel/mm/hugepages/hugepages-%lukB/free_hugepages",
+            (unsigned long) (huge / 1024));
+    if (strtoul(shm_read_line(file, value, sizeof (value)), NULL, 10) > 0) {
+        shm_clear_options();
+        skip(); /* huge pages are there, nothing to fall back from */
+    }
+
+    /* a pool segment file left by an earlier (failed) run would be opened rather than created */
+    snprintf(file, sizeof (file), "%s_s", get_global_name("am_test_shm_hugetlbfs", SHM_TEST_INSTANCE));
+    am_shm_unlink(file);
+    snprintf(file, sizeof (file), "%s_s", get_global_name("am_test_shm_hugetlbfs_next", SHM_TEST_INSTANCE));
+    am_shm_unlink(file);
+
+    shm_fill_and_check("am_test_shm_hugetlbfs");
+    assert_int_equal(am_shm_page_size(1), page_size(1));
+    shm_fill_and_check("am_test_shm_hugetlbfs_next");
+    shm_clear_options();
+}
+
+/**
+ * Random pointer chase over the pool (the access pattern of a long cache bucket chain walk),
+ * returns the average latency of one step in nanoseconds.
+ */
+static double shm_chain_walk(const char *name) {
+    am_shm_t *pool = am_shm_create(get_global_name(name, SHM_TEST_INSTANCE), SHM_BENCH_POOL_SIZE);
+    am_timer_t tm = {0, 0, 0, 0};
+    struct shm_node *nodes;
+    size_t count, i, *order, pos;
+    double elapsed;
+
+    assert_non_null(pool);
+    assert_int_equal(pool->error, AM_SUCCESS);
+    nodes = am_shm_alloc(pool, SHM_BENCH_POOL_SIZE / 2);
+    assert_non_null(nodes);
+    count = (SHM_BENCH_POOL_SIZE / 2) / sizeof (struct shm_node);
+
+    /* single cycle through all nodes in a random order */
+    order = malloc(count * sizeof (size_t));
+    assert_non_null(order);
+    for (i = 0; i < count; i++) {
+        order[i] = i;
+    }
+    srand(42);
+    for (i = count - 1; i > 0; i--) {
+        size_t j = ((size_t) rand() * RAND_MAX + rand()) % (i + 1), t = order[i];
+        order[i] = order[j];
+        order[j] = t;
+    }
+    for (i = 0; i < count; i++) {
+        nodes[order[i]].next = order[(i + 1) % count];
+    }
+    free(order);
+
+    am_timer_start(&tm);
+    for (i = 0, pos = 0; i < SHM_BENCH_STEPS; i++) {
+        pos = nodes[pos].next;
+    }
+    am_timer_stop(&tm);
+    elapsed = am_timer_elapsed(&tm);
+    assert_true(pos < count);
+
+    am_shm_free(pool, nodes);
+    am_shm_destroy(pool);
+    return elapsed * 1000000000.0 / SHM_BENCH_STEPS;
+}
+
+void test_shm_chain_walk_benchmark(void **state) {
+    char *run = getenv(SHM_BENCH_VAR);
+    if (!ISVALID(run) || strcmp(run, "1") != 0) {
+        skip(); /* 128 MB pools, run on demand only */
+    }
+
+    shm_clear_options();
+    setenv(AM_SHARED_PREFAULT_VAR, "1", 1);
+    printf("chain walk, %d MB pool, regular pages: %.1f ns/step\n", SHM_BENCH_POOL_SIZE / (1024 * 1024),
+            shm_chain_walk("am_test_shm_walk"));
+
+    /* effective only with shmem_enabled set to "advise" (or "always") */
+    setenv(AM_SHARED_HUGEPAGES_VAR, "thp", 1);
+    printf("chain walk, %d MB pool, transparent huge pages: %.1f ns/step\n", SHM_BENCH_POOL_SIZE / (1024 * 1024),
+            shm_chain_walk("am_test_shm_walk_thp"));
+
+    /* needs huge pages reserved (vm.nr_hugepages), otherwise same as regular pages */
+    setenv(AM_SHARED_HUGEPAGES_VAR, "/dev/hugepages", 1);
+    printf("chain walk, %d MB pool, hugetlbfs%s: %.1f ns/step\n", SHM_BENCH_POOL_SIZE / (1024 * 1024),
+            am_shm_page_size(1) > page_size(1) ? "" : " (not mounted)", shm_chain_walk("am_test_shm_walk_huge"));
+
+    shm_clear_options();
+}
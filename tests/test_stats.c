@@ -0,0 +1,194 @@
+/**
+ * The contents of this file are subject to the terms of the Common Development and
+ * Distribution License (the License). You may not use this file except in compliance with the
+ * License.
+ *
+ * You can obtain a copy of the License at legal/CDDLv1.0.txt. See the License for the
+ * specific language governing permission and limitations under the License.
+ *
+ * When distributing Covered Software, include this CDDL Header Notice in each file and include
+ * the License file at legal/CDDLv1.0.txt. If applicable, add the following below the CDDL
+ * Header, with the fields enclosed by brackets [] replaced by your own identifying
+ * information: "Portions copyright [year] [name of copyright owner]".
+ *
+ * Copyright 2015 ForgeRock AS.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <setjmp.h>
+
+#include "platform.h"
+#include "am.h"
+#include "utility.h"
+#include "thread.h"
+#include "cmocka.h"
+
+#define STATS_TEST_INSTANCE 3
+#define STATS_TEST_THREADS 4
+#define STATS_TEST_RECORDS 10000
+
+static void stats_log_callback(void *arg, char *name, int error) {
+}
+
+static void *stats_record_procedure(void *arg) {
+    uint64_t usec[AM_STATS_STAGES];
+    int i;
+    memset(usec, 0, sizeof (usec));
+    for (i = 0; i < STATS_TEST_RECORDS; i++) {
+        usec[1] = (uint64_t) (i % 100);
+        am_latency_record(usec, 1U << 1);
+    }
+    return NULL;
+}
+
+static void assert_within(uint64_t value, uint64_t expected) {
+    /* log-linear buckets: at most 1/16 relative error */
+    assert_true(value >= expected);
+    assert_true(value <= expected + expected / 16);
+}
+
+void test_stats_latency_percentiles(void **state) {
+    am_latency_stage_t stages[AM_STATS_STAGES];
+    am_thread_t threads[STATS_TEST_THREADS];
+    uint64_t usec[AM_STATS_STAGES];
+    char *report;
+    int i;
+
+    am_stats_shutdown();
+    am_remove_shm_and_locks(STATS_TEST_INSTANCE, stats_log_callback, NULL);
+    assert_int_equal(am_stats_init(STATS_TEST_INSTANCE), AM_SUCCESS);
+
+    /* 1..1000 usec in the first stage, one 5 second sample in the last one */
+    memset(usec, 0, sizeof (usec));
+    for (i = 1; i <= 1000; i++) {
+        usec[0] = (uint64_t) i;
+        am_latency_record(usec, 1U);
+    }
+    usec[AM_STATS_STAGES - 1] = 5000000;
+    am_latency_record(usec, 1U << (AM_STATS_STAGES - 1));
+
+    /* concurrent updates are not lost */
+    for (i = 0; i < STATS_TEST_THREADS; i++) {
+        AM_THREAD_CREATE(threads[i], stats_record_procedure, NULL);
+    }
+    for (i = 0; i < STATS_TEST_THREADS; i++) {
+        AM_THREAD_JOIN(threads[i]);
+    }
+
+    assert_int_equal(am_latency_get(stages, AM_STATS_STAGES), AM_STATS_STAGES);
+    assert_string_equal(stages[0].name, "setup_request_data");
+    assert_int_equal(stages[0].count, 1000);
+    assert_int_equal(stages[0].mean, 500);
+    assert_int_equal(stages[0].max, 1000);
+    assert_within(stages[0].p50, 500);
+    assert_within(stages[0].p99, 990);
+    assert_within(stages[0].p999, 999);
+
+    assert_int_equal(stages[1].count, STATS_TEST_THREADS * STATS_TEST_RECORDS);
+    assert_int_equal(stages[1].max, 99);
+    assert_within(stages[1].p50, 49);
+
+    assert_int_equal(stages[2].count, 0);
+    assert_int_equal(stages[2].p99, 0);
+
+    assert_string_equal(stages[AM_STATS_STAGES - 1].name, "handle_exit");
+    assert_int_equal(stages[AM_STATS_STAGES - 1].count, 1);
+    assert_int_equal(stages[AM_STATS_STAGES - 1].p50, 5000000);
+    assert_int_equal(stages[AM_STATS_STAGES - 1].p999, 5000000);
+
+    report = am_latency_report(AM_TRUE);
+    assert_non_null(report);
+    assert_non_null(strstr(report, "{\"name\":\"handle_exit\",\"count\":1,\"mean\":5000000,"));
+    am_free(report);
+
+    report = am_latency_report(AM_FALSE);
+    assert_non_null(report);
+    assert_non_null(strstr(report, "validate_policy"));
+    am_free(report);
+
+    am_stats_shutdown();
+    am_remove_shm_and_locks(STATS_TEST_INSTANCE, stats_log_callback, NULL);
+}
+
+static void *stats_counter_procedure(void *arg) {
+    int i;
+    for (i = 0; i < STATS_TEST_RECORDS; i++) {
+        am_stats_add(AM_STATS_CACHE_HITS, 1);
+        am_stats_record(AM_STATS_OPENAM_LATENCY, (uint64_t) (i % 100));
+    }
+    return NULL;
+}
+
+void test_stats_counters(void **state) {
+    am_latency_stage_t h;
+    am_thread_t threads[STATS_TEST_THREADS];
+    am_shm_t *pool;
+    uint64_t locks;
+    char *report, *unit;
+    void *ptr;
+    int i;
+
+    am_stats_shutdown();
+    am_remove_shm_and_locks(STATS_TEST_INSTANCE, stats_log_callback, NULL);
+    assert_int_equal(am_stats_init(STATS_TEST_INSTANCE), AM_SUCCESS);
+
+    for (i = 0; i < STATS_TEST_THREADS; i++) {
+        AM_THREAD_CREATE(threads[i], stats_counter_procedure, NULL);
+    }
+    for (i = 0; i < STATS_TEST_THREADS; i++) {
+        AM_THREAD_JOIN(threads[i]);
+    }
+    am_stats_add(AM_STATS_CACHE_MISSES, STATS_TEST_THREADS * STATS_TEST_RECORDS);
+    assert_int_equal(am_stats_get(AM_STATS_CACHE_HITS), STATS_TEST_THREADS * STATS_TEST_RECORDS);
+
+    assert_int_equal(am_stats_histogram_get(AM_STATS_OPENAM_LATENCY, &h), AM_SUCCESS);
+    assert_string_equal(h.name, "openam_latency_usec");
+    assert_int_equal(h.count, STATS_TEST_THREADS * STATS_TEST_RECORDS);
+    assert_int_equal(h.max, 99);
+    assert_within(h.p50, 49);
+    assert_int_equal(am_stats_histogram_get(AM_STATS_HISTOGRAMS, &h), AM_EINVAL);
+
+    /* shared memory pool operations are counted */
+    locks = am_stats_get(AM_STATS_SHM_LOCKS);
+    pool = am_shm_create(get_global_name("am_stats_test_pool", STATS_TEST_INSTANCE), 4096);
+    assert_non_null(pool);
+    assert_int_equal(pool->error, AM_SUCCESS);
+    ptr = am_shm_alloc(pool, 128);
+    assert_non_null(ptr);
+    am_shm_free(pool, ptr);
+    assert_true(am_stats_get(AM_STATS_SHM_LOCKS) >= locks + 2);
+    assert_true(am_stats_get(AM_STATS_SHM_ALLOCS) >= 1);
+    assert_true(am_stats_get(AM_STATS_SHM_FREES) >= 1);
+    am_shm_destroy(pool);
+
+    report = am_stats_report(AM_STATS_FORMAT_TEXT);
+    assert_non_null(report);
+    assert_non_null(strstr(report, "cache hit rate 50%"));
+    assert_non_null(strstr(report, "openam_latency_usec"));
+    am_free(report);
+
+    report = am_stats_report(AM_STATS_FORMAT_JSON);
+    assert_non_null(report);
+    assert_non_null(strstr(report, "\"cache_misses\":40000,"));
+    assert_non_null(strstr(report, "{\"name\":\"handle_exit\",\"count\":0,"));
+    /* each histogram carries its own unit */
+    unit = strstr(report, "{\"name\":\"log_queue_depth_bytes\",");
+    assert_non_null(unit);
+    unit = strchr(unit, '}');
+    assert_non_null(unit);
+    assert_memory_equal(unit - 15, ",\"unit\":\"bytes\"}", 16);
+    assert_non_null(strstr(report, "\"max\":99,\"unit\":\"usec\"}"));
+    assert_null(strstr(report, "],\"unit\""));
+    am_free(report);
+
+    report = am_stats_report(AM_STATS_FORMAT_PROMETHEUS);
+    assert_non_null(report);
+    assert_non_null(strstr(report, "# TYPE am_cache_hits_total counter\nam_cache_hits_total{agent_id=\"3\"} 40000\n"));
+    assert_non_null(strstr(report, "am_openam_latency_usec_count{agent_id=\"3\"} 40000\n"));
+    assert_non_null(strstr(report, "am_request_stage_usec{agent_id=\"3\",stage=\"validate_url\",quantile=\"0.99\"} 0\n"));
+    am_free(report);
+
+    am_stats_shutdown();
+    am_remove_shm_and_locks(STATS_TEST_INSTANCE, stats_log_callback, NULL);
+}
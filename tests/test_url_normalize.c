@@ -0,0 +1,447 @@
+/**
+ * The contents of this file are subject to the terms of the Common Development and
+ * Distribution License (the License). You may not use this file except in compliance with the
+ * License.
+ *
+ * You can obtain a copy of the License at legal/CDDLv1.0.txt. See the License for the
+ * specific language governing permission and limitations under the License.
+ *
+ * When distributing Covered Software, include this CDDL Header Notice in each file and include
+ * the License file at legal/CDDLv1.0.txt. If applicable, add the following below the CDDL
+ * Header, with the fields enclosed by brackets [] replaced by your own identifying
+ * information: "Portions copyright [year] [name of copyright owner]".
+ *
+ * Copyright 2015 ForgeRock AS.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <setjmp.h>
+
+#include "am.h"
+#include "platform.h"
+#include "utility.h"
+#include "log.h"
+#include "cmocka.h"
+
+/*
+ * The sscanf/strsep based parse_url implementation, kept here as a reference for the
+ * differential tests of the single pass parser and normalizer.
+ */
+
+#define AM_XSTR(s) AM_STR(s)
+#define AM_STR(s) #s
+
+#define URI_HTTP "%"AM_XSTR(AM_PROTO_SIZE)"[HTPShtps]"
+#define URI_HOST "%"AM_XSTR(AM_HOST_SIZE)"[-_.abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789]"
+#define URI_PORT "%6d"
+#define URI_PATH "%"AM_XSTR(AM_URI_SIZE)"[-_.!~*'();/?:@&=+$,%#abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789]"
+#define HD1 URI_HTTP "://" URI_HOST ":" URI_PORT "/" URI_PATH
+#define HD2 URI_HTTP "://" URI_HOST "/" URI_PATH
+#define HD3 URI_HTTP "://" URI_HOST ":" URI_PORT
+#define HD4 URI_HTTP "://" URI_HOST
+
+struct legacy_query_attribute {
+    char *key;
+    char *key_value;
+};
+
+static void legacy_uri_normalize(struct url *url, char *path) {
+
+    char *s, *o, *p = path != NULL ? strdup(path) : NULL;
+    int i, m = 0, list_sz = 0;
+    char **segment_list = NULL, **segment_list_norm = NULL, **tmp;
+    char u[AM_URI_SIZE + 1];
+
+    if (p == NULL) {
+        if (url != NULL) {
+            url->error = path != NULL ? AM_ENOMEM : AM_EINVAL;
+        }
+        return;
+    }
+    o = p; /* preserve original pointer */
+
+    /* split path into segments */
+    while ((s = am_strsep(&p, "/")) != NULL) {
+        if (strcmp(s, ".") == 0) {
+            continue; /* remove (ignore) single dot segments */
+        }
+        tmp = (char **) realloc(segment_list, sizeof (char *) * (++list_sz));
+        if (tmp == NULL) {
+            AM_FREE(o, segment_list);
+            url->error = AM_ENOMEM;
+            return;
+        }
+        segment_list = tmp;
+        segment_list[list_sz - 1] = s;
+    }
+    if (list_sz == 0) {
+        /* nothing to do here */
+        AM_FREE(o, segment_list);
+        if (url != NULL) {
+            url->error = AM_SUCCESS;
+        }
+        return;
+    }
+
+    /* create a list for normalized segment storage */
+    segment_list_norm = (char **) calloc(list_sz, sizeof (char *));
+    if (segment_list_norm == NULL) {
+        AM_FREE(o, segment_list);
+        if (url != NULL) {
+            url->error = AM_ENOMEM;
+        }
+        return;
+    }
+
+    for (i = 0; i < list_sz; i++) {
+        if (strcmp(segment_list[i], "..") == 0) {
+            /* remove double dot segments */
+            if (m-- <= 1) {
+                m = 1;
+                continue;
+            }
+            segment_list_norm[m] = NULL;
+        } else {
+            segment_list_norm[m++] = segment_list[i];
+        }
+    }
+
+    memset(&u[0], 0, sizeof (u));
+    /* join normalized segments */
+    for (i = 0; i < list_sz; i++) {
+        if (segment_list_norm[i] == NULL) {
+            break;
+        }
+        if (i == 0) {
+            strncpy(u, segment_list_norm[i], sizeof (u) - 1);
+            if ((i + 1) < list_sz && segment_list_norm[i + 1] != NULL) {
+                strncat(u, "/", sizeof (u) - 1);
+            }
+        } else {
+            strncat(u, segment_list_norm[i], sizeof (u) - 1);
+            if ((i + 1) < list_sz && segment_list_norm[i + 1] != NULL) {
+                strncat(u, "/", sizeof (u) - 1);
+            }
+        }
+    }
+    memcpy(path, u, sizeof (u));
+
+    AM_FREE(segment_list_norm, segment_list, o);
+
+    if (url != NULL) {
+        url->error = AM_SUCCESS;
+    }
+}
+
+static int legacy_query_attribute_compare(const void *a, const void *b) {
+    int status;
+    struct legacy_query_attribute *ia = (struct legacy_query_attribute *) a;
+    struct legacy_query_attribute *ib = (struct legacy_query_attribute *) b;
+    status = strcmp(ia->key, ib->key);
+    if (status == 0) {
+        /* variable names (keys) are the same, we need to further compare the values */
+        status = strcmp(ia->key_value, ib->key_value);
+    }
+    return status;
+}
+
+static int legacy_parse_url(const char *u, struct url *url) {
+    int i = 0, port = 0;
+    char last = 0;
+    char *d, *p, uri[AM_URI_SIZE + 1];
+
+    if (url == NULL) {
+        return AM_ERROR;
+    }
+    if (u == NULL) {
+        url->error = AM_EINVAL;
+        return AM_ERROR;
+    }
+    if (strlen(u) > (AM_PROTO_SIZE + AM_HOST_SIZE + 6 + AM_URI_SIZE /* max size of all sscanf format limits */)) {
+        url->error = AM_E2BIG;
+        return AM_ERROR;
+    }
+
+    url->error = url->ssl = url->port = 0;
+    memset(&uri[0], 0, sizeof (uri));
+    memset(&url->proto[0], 0, sizeof (url->proto));
+    memset(&url->host[0], 0, sizeof (url->host));
+    memset(&url->path[0], 0, sizeof (url->path));
+    memset(&url->query[0], 0, sizeof (url->query));
+
+    if (sscanf(u, HD1, url->proto, url->host, &port, url->path) == 4) {
+        ;
+    } else if (sscanf(u, HD2, url->proto, url->host, url->path) == 3) {
+        ;
+    } else if (sscanf(u, HD3, url->proto, url->host, &port) == 3) {
+        ;
+    } else if (sscanf(u, HD4, url->proto, url->host) == 2) {
+        ;
+    } else {
+        url->error = AM_EOF;
+        return AM_ERROR;
+    }
+
+    url->port = port < 0 ? -(port) : port;
+    if (strcasecmp(url->proto, "https") == 0) {
+        url->ssl = 1;
+    } else {
+        url->ssl = 0;
+    }
+    if (strcasecmp(url->proto, "https") == 0 && url->port == 0) {
+        url->port = 443;
+    } else if (strcasecmp(url->proto, "http") == 0 && url->port == 0) {
+        url->port = 80;
+    }
+    if (!ISVALID(url->path)) {
+        strcpy(url->path, "/");
+    } else if (url->path[0] != '/') {
+        size_t ul = strlen(url->path);
+        if (ul < sizeof (url->path)) {
+            memmove(url->path + 1, url->path, ul);
+        }
+        url->path[0] = '/';
+    }
+
+    /* split out a query string, if any and sort query parameters */
+    p = strchr(url->path, '?');
+    if (p != NULL) {
+        char *token, *temp, query[AM_URI_SIZE + 1], *sep;
+        struct legacy_query_attribute *list;
+        int sep_count, sep_count_init, j;
+        strncpy(url->query, p, sizeof (url->query) - 1);
+        *p = 0;
+
+        strncpy(query, url->query + 1 /* skip '?' */, sizeof (url->query) - 1);
+        sep_count = char_count(query, '&', NULL);
+        if (sep_count > 0) {
+            list = (struct legacy_query_attribute *) calloc(++sep_count, sizeof (struct legacy_query_attribute));
+            if (list == NULL) {
+                url->error = AM_ENOMEM;
+                return AM_ERROR;
+            }
+            sep_count_init = sep_count;
+            sep_count = 0;
+
+            for ((token = strtok_r(query, "&", &temp)); token; (token = strtok_r(NULL, "&", &temp))) {
+                struct legacy_query_attribute *elm = &list[sep_count++];
+                elm->key_value = token;
+                elm->key = strdup(token);
+                if (elm->key == NULL) {
+                    for (j = 0; j < sep_count_init; j++) {
+                        struct legacy_query_attribute *elm = &list[j];
+                        am_free(elm->key);
+                    }
+                    free(list);
+                    url->error = AM_ENOMEM;
+                    return AM_ERROR;
+                }
+                sep = strchr(elm->key, '=');
+                if (sep != NULL) {
+                    *sep = '\0';
+                }
+            }
+
+            qsort(list, sep_count, sizeof (struct legacy_query_attribute), legacy_query_attribute_compare);
+
+            strncpy(url->query, "?", sizeof (url->query) - 1);
+            for (j = 0; j < sep_count; j++) {
+                struct legacy_query_attribute *elm = &list[j];
+                if (j > 0) {
+                    strcat(url->query, "&");
+                }
+                strcat(url->query, elm->key_value);
+                free(elm->key);
+            }
+            free(list);
+        }
+    }
+
+    /* decode path */
+    d = url_decode(url->path);
+    if (d == NULL) {
+        url->error = AM_ENOMEM;
+        return AM_ERROR;
+    }
+
+    p = d;
+    /* replace all consecutive '/' with a single '/' */
+    while (*p != '\0') {
+        if (*p != '/' || (*p == '/' && last != '/')) {
+            uri[i++] = *p;
+        }
+        last = *p;
+        p++;
+    }
+    free(d);
+
+    /* normalize path segments, RFC-2396, section-5.2 */
+    legacy_uri_normalize(url, uri);
+
+    strncpy(url->path, uri, sizeof (url->path) - 1);
+    return AM_SUCCESS;
+}
+
+/**
+ * Compare the results of both parsers, returning 0 if they are the same.
+ */
+static int compare_parsers(const char *u) {
+    struct url expected, actual;
+    int expected_status, actual_status;
+
+    memset(&expected, 0, sizeof (struct url));
+    memset(&actual, 0, sizeof (struct url));
+    expected_status = legacy_parse_url(u, &expected);
+    actual_status = parse_url(u, &actual);
+
+    if (expected_status != actual_status || expected.error != actual.error) {
+        printf("status mismatch for %s: %d (%d) != %d (%d)\n", u,
+                expected_status, expected.error, actual_status, actual.error);
+        return 1;
+    }
+    if (expected_status != AM_SUCCESS) {
+        return 0;
+    }
+    if (expected.port != actual.port || expected.ssl != actual.ssl ||
+            strcmp(expected.proto, actual.proto) != 0 || strcmp(expected.host, actual.host) != 0 ||
+            strcmp(expected.path, actual.path) != 0 || strcmp(expected.query, actual.query) != 0) {
+        printf("value mismatch for %s:\n %s %s %d %s %s\n %s %s %d %s %s\n", u,
+                expected.proto, expected.host, expected.port, expected.path, expected.query,
+                actual.proto, actual.host, actual.port, actual.path, actual.query);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Build a random url out of fragments which are likely to hit the interesting cases:
+ * dot segments, encoded characters, repeated separators and unsorted query parameters.
+ */
+static void random_url(char *buf, size_t buf_sz) {
+    static const char *protos[] = {"http", "https", "HTTP", "ftp", "httpsss", ""};
+    static const char *hosts[] = {"a.b.com", "host_1", "h-2.example.org", "", "x y"};
+    static const char *ports[] = {"", ":80", ":8080", ":-443", ": 90", ":", ":abc", ":1234567", ":+1"};
+    static const char *fragments[] = {"/", "//", ".", "..", "/./", "/../", "%2e", "%2E%2e", "%2F",
+        "%", "%4", "%41", "%zz", "%00", "+", "a", "bc", "index.html", "?", "&", "=", "k=v", "a=1",
+        "b=2", "&&", "#", "~", " ", "<", ":", ";", "@", "$", "'"};
+    size_t len;
+    int i, n = rand() % 16;
+
+    snprintf(buf, buf_sz, "%s://%s%s", protos[rand() % ARRAY_SIZE(protos)],
+            hosts[rand() % ARRAY_SIZE(hosts)], ports[rand() % ARRAY_SIZE(ports)]);
+    len = strlen(buf);
+    for (i = 0; i < n; i++) {
+        const char *f = fragments[rand() % ARRAY_SIZE(fragments)];
+        size_t f_sz = strlen(f);
+        if (len + f_sz >= buf_sz) break;
+        memcpy(buf + len, f, f_sz + 1);
+        len += f_sz;
+    }
+}
+
+/**
+ * Run the single pass parser against the reference implementation.
+ */
+void test_parse_url_differential(void **state) {
+    static const char *urls[] = {
+        "http://a.b.com",
+        "http://a.b.com/",
+        "http://a.b.com:8080",
+        "http://a.b.com:8080/",
+        "https://a.b.com/a/b/c/./../../g",
+        "http://a.b.com/a/..",
+        "http://a.b.com/..",
+        "http://a.b.com/.",
+        "http://a.b.com/a/./",
+        "http://a.b.com/a/b/../",
+        "http://a.b.com//a///b////",
+        "http://a.b.com/%2e%2E/a/%2e/b%2Fc",
+        "http://a.b.com/a+b%20c",
+        "http://a.b.com/a%00b/c",
+        "http://a.b.com/path?z=1&a=2&&m=3&",
+        "http://a.b.com/path?a=2&a=1&a&b",
+        "http://a.b.com/path?only=one",
+        "http://a.b.com/path?&",
+        "http://a.b.com?a=b",
+        "http://a.b.com:abc/path",
+        "http://a.b.com: 81/path",
+        "http://a.b.com:-82/path",
+        "http://a.b.com/a b/c",
+        "htp://a.b.com/",
+        "http:/a.b.com/",
+        "http://",
+        ""
+    };
+    char buf[1024];
+    int i;
+
+    (void) state;
+
+    for (i = 0; i < ARRAY_SIZE(urls); i++) {
+        assert_int_equal(compare_parsers(urls[i]), 0);
+    }
+
+    srand(26);
+    for (i = 0; i < 100000; i++) {
+        random_url(buf, sizeof (buf));
+        assert_int_equal(compare_parsers(buf), 0);
+    }
+}
+
+/**
+ * Test the in-place path normalizer.
+ */
+void test_uri_normalize(void **state) {
+    char path[64];
+    size_t len;
+
+    (void) state;
+
+    strcpy(path, "/a/b/c/./../../g");
+    len = uri_normalize(path, path, strlen(path));
+    assert_string_equal(path, "/a/g");
+    assert_int_equal(len, 4);
+
+    strcpy(path, "//%2e%2e/x%2Fy/../z/");
+    len = uri_normalize(path, path, strlen(path));
+    assert_string_equal(path, "/x/z/");
+    assert_int_equal(len, 5);
+
+    strcpy(path, "/a/b?c");
+    len = uri_normalize(path, path, 2);
+    assert_string_equal(path, "/a");
+    assert_int_equal(len, 2);
+
+    len = uri_normalize(path, "", 0);
+    assert_string_equal(path, "/");
+    assert_int_equal(len, 1);
+}
+
+/**
+ * Test the url view accessors and buffer size checks.
+ */
+void test_parse_url_view(void **state) {
+    struct url_view v;
+    char buf[AM_URL_VIEW_SIZE];
+
+    (void) state;
+
+    assert_int_equal(parse_url_view("https://www.example.com/a/../b?y=2&x=1", &v, buf, sizeof (buf)), AM_SUCCESS);
+    assert_int_equal(v.port, 443);
+    assert_int_equal(v.ssl, 1);
+    assert_string_equal(URL_VIEW_PART(&v, proto), "https");
+    assert_string_equal(URL_VIEW_PART(&v, host), "www.example.com");
+    assert_string_equal(URL_VIEW_PART(&v, path), "/b");
+    assert_int_equal(v.path.len, 2);
+    assert_string_equal(URL_VIEW_PART(&v, query), "?x=1&y=2");
+    assert_int_equal(v.query.len, 8);
+
+    assert_int_equal(parse_url_view("https://www.example.com/a", &v, buf, 16), AM_ERROR);
+    assert_int_equal(v.error, AM_E2BIG);
+
+    assert_int_equal(parse_url_view(NULL, &v, buf, sizeof (buf)), AM_ERROR);
+    assert_int_equal(v.error, AM_EINVAL);
+}
@@ -851,6 +851,69 @@ void test_copy_empty_file(void **state) {
     assert_int_equal(loaded_sz, 0);
 }
 
+struct stream_source {
+    const char *data;
+    size_t size;
+    size_t offset;
+    size_t chunk;
+};
+
+static ssize_t stream_read(void *arg, char *buf, size_t size) {
+    struct stream_source *src = (struct stream_source *) arg;
+    size_t n = src->size - src->offset;
+    if (n > src->chunk) n = src->chunk;
+    if (n > size) n = size;
+    memcpy(buf, src->data + src->offset, n);
+    src->offset += n;
+    return (ssize_t) n;
+}
+
+void test_write_file_stream(void **state) {
+    char buffer [] = "test_stream_file-XXXXXXX";
+    char *path = mktemp(buffer);
+    struct stream_source src;
+    char *content, *loaded;
+    size_t i, size = 3 * AM_POST_DATA_CHUNK_SIZE + 123, written = 0, loaded_sz = 0;
+
+    content = malloc(size);
+    assert_non_null(content);
+    for (i = 0; i < size; i++) {
+        content[i] = (char) (i % 251); /* binary data, with zero bytes */
+    }
+
+    /* raw bytes are stored, whatever the chunk sizes are */
+    src.data = content;
+    src.size = size;
+    src.offset = 0;
+    src.chunk = 1000;
+    assert_int_equal(write_file_stream(path, stream_read, &src, 0, &written), AM_SUCCESS);
+    assert_int_equal(written, size);
+    loaded = load_file(path, &loaded_sz);
+    assert_non_null(loaded);
+    assert_int_equal(loaded_sz, size);
+    assert_memory_equal(loaded, content, size);
+    free(loaded);
+
+    /* size limit */
+    src.offset = 0;
+    src.chunk = size;
+    assert_int_equal(write_file_stream(path, stream_read, &src, size - 1, &written), AM_E2BIG);
+    assert_int_equal(written, 0);
+    assert_int_equal(file_exists(path), AM_FALSE);
+
+    src.offset = 0;
+    assert_int_equal(write_file_stream(path, stream_read, &src, size, &written), AM_SUCCESS);
+    assert_int_equal(written, size);
+
+    /* no data */
+    src.size = src.offset = 0;
+    assert_int_equal(write_file_stream(path, stream_read, &src, 0, &written), AM_SUCCESS);
+    assert_int_equal(written, 0);
+
+    unlink(path);
+    free(content);
+}
+
 void test_url_encoding(void **state) {
     char agent3_input1[] = "~a!a@a#a$a%a^a&";
     char agent3_output1[] = "%7Ea%21a%40a%23a%24a%25a%5Ea%26";
@@ -878,3 +941,218 @@ void test_url_encoding(void **state) {
     assert_string_equal(agent3_output2, agent4_encoded);
     free(agent4_encoded);
 }
+
+/**
+ * Test the cookie header tokenizer and the lookups/removals done on the parsed cookie table.
+ */
+void test_cookie_table(void **state) {
+    char *value = NULL, *hdr = NULL;
+    am_request_t request;
+    const am_cookie_span_t *c;
+    char big[4096];
+    int i;
+
+    (void) state;
+
+    memset(&request, 0, sizeof (am_request_t));
+    request.ctx = &request;
+    request.cookies = " a=1; iPlanetDirectoryPro = \"AQIC5wM2LY4Sfcz=@AAJTSQACMDE.*\" ;;b = x=y ; empty=; flag";
+
+    assert_int_equal(am_parse_cookie_header(&request), AM_SUCCESS);
+    assert_int_equal(request.cookie_table.count, 5);
+    assert_ptr_equal(request.cookie_table.list, request.cookie_table.entries);
+
+    assert_int_equal(get_cookie_value(&request, "iPlanetDirectoryPro", &value), AM_SUCCESS);
+    assert_string_equal(value, "AQIC5wM2LY4Sfcz=@AAJTSQACMDE.*");
+    free(value);
+
+    assert_int_equal(get_cookie_value(&request, "b", &value), AM_SUCCESS);
+    assert_string_equal(value, "x=y");
+    free(value);
+
+    assert_int_equal(get_cookie_value(&request, "empty", &value), AM_NOT_FOUND);
+    assert_null(value);
+    assert_int_equal(get_cookie_value(&request, "flag", &value), AM_NOT_FOUND);
+    assert_int_equal(get_cookie_value(&request, "x", &value), AM_NOT_FOUND);
+    assert_int_equal(get_cookie_value(&request, "iPlanet", &value), AM_NOT_FOUND);
+
+    c = am_find_cookie(&request, "flag");
+    assert_non_null(c);
+    assert_int_equal(c->value.len, 0);
+
+    assert_int_equal(remove_cookie(&request, "iPlanetDirectoryPro", &hdr), AM_SUCCESS);
+    assert_string_equal(hdr, "a=1;b = x=y ;empty=;flag");
+    hdr = NULL;
+
+    assert_int_equal(remove_cookie(&request, "missing", &hdr), AM_NOT_FOUND);
+    assert_string_equal(hdr, "a=1;iPlanetDirectoryPro = \"AQIC5wM2LY4Sfcz=@AAJTSQACMDE.*\" ;b = x=y ;empty=;flag");
+    hdr = NULL;
+
+    /* the table is rebuilt when the header changes */
+    request.cookies = "a=2";
+    assert_int_equal(get_cookie_value(&request, "a", &value), AM_SUCCESS);
+    assert_string_equal(value, "2");
+    free(value);
+    assert_int_equal(remove_cookie(&request, "a", &hdr), AM_SUCCESS);
+    assert_null(hdr);
+
+    /* large headers spill over to heap */
+    for (i = 0, big[0] = '\0'; i < 200; i++) {
+        sprintf(big + strlen(big), "c%d=%d; ", i, i);
+    }
+    request.cookies = big;
+    assert_int_equal(get_cookie_value(&request, "c199", &value), AM_SUCCESS);
+    assert_string_equal(value, "199");
+    free(value);
+    assert_int_equal(request.cookie_table.count, 200);
+    assert_ptr_not_equal(request.cookie_table.list, request.cookie_table.entries);
+
+    am_request_free(&request);
+}
+
+/**
+ * Test the request arena allocator.
+ */
+void test_arena(void **state) {
+    am_arena_t *a, *b;
+    char *s = NULL, *big;
+    void *p1, *p2;
+    int i, size;
+
+    (void) state;
+
+    a = am_arena_create();
+    assert_non_null(a);
+
+    p1 = am_arena_alloc(a, 3);
+    p2 = am_arena_alloc(a, 5);
+    assert_non_null(p1);
+    assert_int_equal(((uintptr_t) p2) % 16, 0);
+    assert_true((char *) p2 - (char *) p1 >= 3);
+
+    assert_string_equal(am_arena_strdup(a, "abc"), "abc");
+    assert_string_equal(am_arena_strndup(a, "abcdef", 3), "abc");
+    assert_null(am_arena_strdup(a, NULL));
+
+    /* concatenation - previous value is an argument */
+    for (i = 0; i < 1000; i++) {
+        size = am_arena_asprintf(a, &s, "%s%d;", s == NULL ? "" : s, i % 10);
+    }
+    assert_int_equal(size, 2000);
+    assert_int_equal(strlen(s), 2000);
+    assert_int_equal(memcmp(s, "0;1;2;", 6), 0);
+
+    /* large allocation */
+    big = am_arena_alloc(a, AM_ARENA_BLOCK_SIZE * 2);
+    assert_non_null(big);
+    memset(big, 'x', AM_ARENA_BLOCK_SIZE * 2);
+    assert_string_equal(am_arena_strdup(a, "after"), "after");
+
+    am_arena_reset(a);
+    assert_ptr_equal(am_arena_alloc(a, 3), p1);
+    am_arena_destroy(a);
+
+    /* arenas are recycled per thread */
+    a = am_arena_get();
+    p1 = am_arena_alloc(a, 10);
+    am_arena_release(a);
+    b = am_arena_get();
+    assert_ptr_equal(a, b);
+    assert_ptr_equal(am_arena_alloc(b, 10), p1);
+    am_arena_release(b);
+}
+
+/*
+ * Create a c66 encoded session token with SI, SK and S1 values (and a distinct prefix).
+ */
+static char *make_session_token(int n) {
+    unsigned char raw[256];
+    const char *kv[] = {"SI", "01", "SK", NULL, "S1", "03"};
+    char sk[32], *b64, *token = NULL;
+    size_t sz = 0, i, j;
+
+    snprintf(sk, sizeof (sk), "key%d", n);
+    kv[3] = sk;
+    for (i = 0; i < sizeof (kv) / sizeof (kv[0]); i++) {
+        size_t l = strlen(kv[i]);
+        raw[sz++] = (unsigned char) (l >> 8);
+        raw[sz++] = (unsigned char) (l & 0xff);
+        memcpy(raw + sz, kv[i], l);
+        sz += l;
+    }
+    b64 = base64_encode(raw, &sz);
+    assert_non_null(b64);
+    am_asprintf(&token, "AQIC5wM2LY4Sfcx%04dKxYnz7JGxm1ekUBpfPFlIgvPWbQrc.*%s*", n, b64);
+    assert_non_null(token);
+    for (j = 0; token[j] != '\0'; j++) {
+        if (token[j] == '+') token[j] = '-';
+        else if (token[j] == '/') token[j] = '_';
+        else if (token[j] == '=') token[j] = '.';
+    }
+    free(b64);
+    return token;
+}
+
+void test_session_decode_cache(void **state) {
+    am_request_t r;
+    char *tokens[AM_SESSION_DECODE_CACHE_SIZE * 2];
+    am_timer_t tm = {0, 0, 0, 0};
+    int i, n;
+    double cold, warm;
+
+    (void) state;
+    for (i = 0; i < AM_SESSION_DECODE_CACHE_SIZE * 2; i++) {
+        tokens[i] = make_session_token(i);
+    }
+
+    /* decoded and cached values are the same */
+    for (n = 0; n < 2; n++) {
+        memset(&r, 0, sizeof (am_request_t));
+        r.token = strdup(tokens[1]);
+        assert_int_equal(am_session_decode(&r), AM_SUCCESS);
+        assert_int_equal(r.session_info.error, AM_SUCCESS);
+        assert_string_equal(r.session_info.si, "01");
+        assert_string_equal(r.session_info.sk, "key1");
+        assert_string_equal(r.session_info.s1, "03");
+        am_request_free(&r);
+    }
+
+    memset(&r, 0, sizeof (am_request_t));
+    r.token = strdup("AQIC5wM2LY4Sfcx");
+    assert_int_equal(am_session_decode(&r), AM_SUCCESS);
+    assert_null(r.session_info.si);
+    assert_null(r.session_info.sk);
+    am_request_free(&r);
+
+    /* microbenchmark: cycling through more tokens than the cache holds (every decode is a miss)
+     * vs a single token (cache hit) */
+    am_timer_start(&tm);
+    for (i = 0; i < 100000; i++) {
+        memset(&r, 0, sizeof (am_request_t));
+        r.token = tokens[i % (AM_SESSION_DECODE_CACHE_SIZE * 2)];
+        am_session_decode(&r);
+        assert_non_null(r.session_info.sk);
+        r.token = NULL;
+        am_request_free(&r);
+    }
+    am_timer_stop(&tm);
+    cold = am_timer_elapsed(&tm);
+
+    am_timer_start(&tm);
+    for (i = 0; i < 100000; i++) {
+        memset(&r, 0, sizeof (am_request_t));
+        r.token = tokens[7];
+        am_session_decode(&r);
+        assert_string_equal(r.session_info.sk, "key7");
+        r.token = NULL;
+        am_request_free(&r);
+    }
+    am_timer_stop(&tm);
+    warm = am_timer_elapsed(&tm);
+
+    printf("session token decode: %.3f sec uncached, %.3f sec cached (100000 decodes)\n", cold, warm);
+
+    for (i = 0; i < AM_SESSION_DECODE_CACHE_SIZE * 2; i++) {
+        free(tokens[i]);
+    }
+}
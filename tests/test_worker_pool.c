@@ -0,0 +1,181 @@
+/**
+ * The contents of this file are subject to the terms of the Common Development and
+ * Distribution License (the License). You may not use this file except in compliance with the
+ * License.
+ *
+ * You can obtain a copy of the License at legal/CDDLv1.0.txt. See the License for the
+ * specific language governing permission and limitations under the License.
+ *
+ * When distributing Covered Software, include this CDDL Header Notice in each file and include
+ * the License file at legal/CDDLv1.0.txt. If applicable, add the following below the CDDL
+ * Header, with the fields enclosed by brackets [] replaced by your own identifying
+ * information: "Portions copyright [year] [name of copyright owner]".
+ *
+ * Copyright 2015 ForgeRock AS.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <setjmp.h>
+
+#include "platform.h"
+#include "am.h"
+#include "utility.h"
+#include "thread.h"
+#include "cmocka.h"
+
+#define POOL_TEST_PRODUCERS 8
+#define POOL_TEST_TASKS 5000 /* per producer */
+#define POOL_TEST_PRIORITY_TASKS 200
+
+void am_worker_pool_init_reset();
+
+static volatile uint64_t tasks_done;
+static volatile uint64_t tasks_started;
+
+static void counting_task(void *arg) {
+    AM_ATOMIC_ADD_64(&tasks_done, 1);
+}
+
+/* a task which dispatches another one (from inside of the pool) */
+static void spawning_task(void *arg) {
+    if (am_worker_dispatch_class(AM_WORKER_NORMAL, counting_task, NULL) != AM_SUCCESS) {
+        AM_ATOMIC_ADD_64(&tasks_done, 1);
+    }
+    AM_ATOMIC_ADD_64(&tasks_done, 1);
+}
+
+static void *producer_procedure(void *arg) {
+    int i;
+    for (i = 0; i < POOL_TEST_TASKS; i++) {
+        int cls = i % AM_WORKER_CLASSES;
+        while (am_worker_dispatch_class(cls, i % 10 == 0 ? spawning_task : counting_task, NULL) != AM_SUCCESS) {
+            usleep(1000);
+        }
+    }
+    return NULL;
+}
+
+static int wait_for_tasks(uint64_t count, int seconds) {
+    int i;
+    for (i = 0; i < seconds * 100 && tasks_done < count; i++) {
+        usleep(10000);
+    }
+    return tasks_done == count;
+}
+
+void test_worker_pool_stress(void **state) {
+    am_thread_t producers[POOL_TEST_PRODUCERS];
+    am_worker_stats_t stats[AM_WORKER_CLASSES];
+    uint64_t expected = POOL_TEST_PRODUCERS * (POOL_TEST_TASKS + POOL_TEST_TASKS / 10);
+    uint64_t dispatched = 0, completed = 0;
+    int i;
+
+    tasks_done = 0;
+    am_worker_pool_init_reset();
+    am_worker_pool_init(NULL);
+
+    for (i = 0; i < POOL_TEST_PRODUCERS; i++) {
+        AM_THREAD_CREATE(producers[i], producer_procedure, NULL);
+    }
+    for (i = 0; i < POOL_TEST_PRODUCERS; i++) {
+        AM_THREAD_JOIN(producers[i]);
+    }
+    assert_true(wait_for_tasks(expected, 60));
+
+    am_worker_pool_stats(stats);
+    for (i = 0; i < AM_WORKER_CLASSES; i++) {
+        dispatched += stats[i].dispatched;
+        completed += stats[i].completed;
+        assert_int_equal(stats[i].depth, 0);
+        assert_true(stats[i].max_depth > 0);
+        assert_true(stats[i].max_wait * stats[i].dispatched >= stats[i].wait);
+    }
+    /* completed counters are updated after the task function returns */
+    for (i = 0; i < 500 && completed < expected; i++) {
+        usleep(10000);
+        am_worker_pool_stats(stats);
+        completed = stats[0].completed + stats[1].completed + stats[2].completed;
+    }
+    assert_int_equal(dispatched, expected);
+    assert_int_equal(completed, expected);
+
+    am_worker_pool_shutdown();
+}
+
+static volatile int gate_open;
+static volatile uint64_t high_started;
+
+static void gate_task(void *arg) {
+    while (!gate_open) {
+        usleep(1000);
+    }
+    AM_ATOMIC_ADD_64(&tasks_done, 1);
+}
+
+static void priority_task(void *arg) {
+    uint64_t seq = AM_ATOMIC_ADD_64(&tasks_started, 1);
+    if (arg != NULL && seq < POOL_TEST_PRIORITY_TASKS) {
+        AM_ATOMIC_ADD_64(&high_started, 1);
+    }
+    AM_ATOMIC_ADD_64(&tasks_done, 1);
+}
+
+void test_worker_pool_priority(void **state) {
+    int i;
+
+    tasks_done = tasks_started = high_started = 0;
+    gate_open = 0;
+    am_worker_pool_init_reset();
+    am_worker_pool_init(NULL);
+
+    /* keep all workers busy, queue a low priority burst followed by high priority tasks */
+    for (i = 0; i < AM_MAX_THREADS_POOL; i++) {
+        assert_int_equal(am_worker_dispatch_class(AM_WORKER_NORMAL, gate_task, NULL), AM_SUCCESS);
+    }
+    for (i = 0; i < POOL_TEST_PRIORITY_TASKS; i++) {
+        assert_int_equal(am_worker_dispatch_class(AM_WORKER_LOW, priority_task, NULL), AM_SUCCESS);
+    }
+    for (i = 0; i < POOL_TEST_PRIORITY_TASKS; i++) {
+        assert_int_equal(am_worker_dispatch_class(AM_WORKER_HIGH, priority_task, (void *) &high_started), AM_SUCCESS);
+    }
+    gate_open = 1;
+
+    assert_true(wait_for_tasks(AM_MAX_THREADS_POOL + 2 * POOL_TEST_PRIORITY_TASKS, 30));
+    /* high priority tasks go first - only the workers which were just finishing
+     * the last ones of them might have started a low priority task in between */
+    assert_true(high_started >= POOL_TEST_PRIORITY_TASKS - AM_MAX_THREADS_POOL);
+
+    am_worker_pool_shutdown();
+}
+
+static volatile uint64_t cleanups_done;
+
+static void counting_cleanup() {
+    AM_ATOMIC_ADD_64(&cleanups_done, 1);
+}
+
+static void *cleanup_thread(void *arg) {
+    am_arena_t *a;
+    am_thread_cleanup_register(counting_cleanup);
+    am_thread_cleanup_register(counting_cleanup); /* registered once */
+    /* thread-local arena is released on thread exit too */
+    a = am_arena_get();
+    assert_non_null(am_arena_alloc(a, 100));
+    am_arena_release(a);
+    return NULL;
+}
+
+void test_thread_cleanup(void **state) {
+    am_thread_t threads[4];
+    int i;
+
+    cleanups_done = 0;
+    for (i = 0; i < 4; i++) {
+        AM_THREAD_CREATE(threads[i], cleanup_thread, NULL);
+    }
+    for (i = 0; i < 4; i++) {
+        AM_THREAD_JOIN(threads[i]);
+    }
+    assert_int_equal(cleanups_done, 4);
+}